@@ -15,6 +15,8 @@
 #include <fuse.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdarg.h>
@@ -26,18 +28,29 @@
 #include <time.h>
 #include <unistd.h>
 #include <wait.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
 #include <linux/magic.h>
+#include <linux/netlink.h>
 #include <linux/sched.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/param.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/sysinfo.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/vfs.h>
 
 #include "bindings.h"
+#include "buf_pool.h"
+#include "cpu_usage.h"
+#include "cpuset.h"
 #include "config.h" // for VERSION
 
 /* Define pivot_root() if missing from the C library */
@@ -55,16 +68,50 @@ return -1;
 extern int pivot_root(const char * new_root, const char * put_old);
 #endif
 
-struct cpuacct_usage {
-	uint64_t user;
-	uint64_t system;
-	uint64_t idle;
-	bool online;
-};
+/* Define pidfd_open() if missing from the C library */
+static int pidfd_open(pid_t pid, unsigned int flags)
+{
+#ifdef __NR_pidfd_open
+	return syscall(__NR_pidfd_open, pid, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * RLIMIT_NOFILE is shared between the fds lxcfs caches and those it needs
+ * for everything else: FUSE, the files read to answer requests, and the
+ * pidfds and helper sockets it keeps per container.  FD_RESERVE of them are
+ * always left alone, and each cache gets a fixed number of quarters of the
+ * rest, so that the caches cannot run everything else into EMFILE.  The
+ * quarter no cache gets goes to the per-container fds.
+ */
+#define FD_RESERVE 256
+#define FD_SHARE_CGROUP_DIRFDS 1
+#define FD_SHARE_LOAD_STAT 2
+
+static int fd_cache_max(int quarters)
+{
+	struct rlimit rlim;
+	rlim_t avail;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0 || rlim.rlim_cur <= FD_RESERVE)
+		return 0;
+
+	avail = MIN(rlim.rlim_cur - FD_RESERVE, INT_MAX);
+	return avail / 4 * quarters;
+}
 
 /* The function of hash table.*/
-#define LOAD_SIZE 100 /*the size of hash_table */
+#define LOAD_MIN_SIZE 64 /* initial number of buckets, a power of two */
+#define LOAD_MAX_LOAD 2  /* nodes per bucket the table grows beyond */
+#define LOAD_MAX_THREADS 100 /* most threads refreshing the loadavgs */
 #define FLUSH_TIME 5  /*the flush rate */
+#define LOAD_IDLE_TICKS 6 /* FLUSH_TIMEs between refreshes of idle nodes */
+#define LOAD_EVICT_FACTOR 10 /* idle periods after which a node is dropped */
+#define LOAD_RESYNC_PASSES 12 /* passes between tasks file reads with LOAD_ENGINE_CONN */
+#define LOAD_CONN_MAX_FORKS 65536 /* forks queued between two passes */
 #define DEPTH_DIR 3   /*the depth of per cgroup */
 /* The function of calculate loadavg .*/
 #define FSHIFT		11		/* nr of bits of precision */
@@ -76,7 +123,7 @@ struct cpuacct_usage {
 #define LOAD_FRAC(x) LOAD_INT(((x) & (FIXED_1-1)) * 100)
 /*
  * This parameter is used for proc_loadavg_read().
- * 1 means use loadavg, 0 means not use.
+ * 0 means not use loadavg, otherwise it is the LOAD_ENGINE_* computing it.
  */
 static int loadavg = 0;
 static volatile sig_atomic_t loadavg_stop = 0;
@@ -95,180 +142,305 @@ static int calc_hash(const char *name)
 	return (hash & 0x7fffffff);
 }
 
-struct load_node {
-	char *cg;  /*cg */
+/* FNV-1a, with the murmur3 finalizer so that the low bits mix well too. */
+static uint64_t load_hash_cg(const char *cg)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (*cg) {
+		hash ^= (unsigned char)*cg++;
+		hash *= 1099511628211ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/* A thread of a sampled cgroup and the fd for its /proc/<tid>/stat, or -1. */
+struct load_tid {
+	pid_t tid;
+	int fd;
+};
+
+/* What /proc/loadavg shows for a container. */
+struct load_avg {
 	unsigned long avenrun[3];		/* Load averages */
 	unsigned int run_pid;
 	unsigned int total_pid;
 	unsigned int last_pid;
+};
+
+struct load_node {
+	char *cg;  /*cg */
+	uint64_t hash;
+	/*
+	 * Only the thread refreshing the node writes avg, through
+	 * load_avg_publish(), bumping seq to odd while it does.  Readers copy
+	 * it with load_avg_read() without taking any lock.
+	 */
+	unsigned int seq;
+	struct load_avg avg;
 	int cfd; /* The file descriptor of the mounted cgroup */
+	struct load_tid *tids; /* The threads seen last time, sorted by tid */
+	int nr_tids;
+	int size_tids;
+	/* Counters of the last PSI sample, in usecs, see refresh_load_psi(). */
+	uint64_t psi_stamp;
+	uint64_t psi_usage;
+	uint64_t psi_cpu_some;
+	uint64_t psi_io_some;
+	uint64_t last_read;	/* atomic, monotonic_ms() of the last read */
+	bool idle;		/* unread for load_idle_ms */
+	unsigned int pending_ticks; /* periods an idle node has skipped */
+	unsigned int synced_pass; /* load_conn.pass tids were last read at */
 	struct  load_node *next;
 	struct  load_node **pre;
 };
 
-struct load_head {
+struct load_bucket {
 	/*
-	 * The lock is about insert load_node and refresh load_node.To the first
-	 * load_node of each hash bucket, insert and refresh in this hash bucket is
-	 * mutually exclusive.
+	 * Held to insert or delete a node and by readers walking the chain.
+	 * Nodes are only deleted by the thread refreshing the bucket, which
+	 * can thus walk the chain without it.
 	 */
 	pthread_mutex_t lock;
-	/*
-	 * The rdlock is about read loadavg and delete load_node.To each hash
-	 * bucket, read and delete is mutually exclusive. But at the same time, we
-	 * allow paratactic read operation. This rdlock is at list level.
-	 */
-	pthread_rwlock_t rdlock;
-	/*
-	 * The rilock is about read loadavg and insert load_node.To the first
-	 * load_node of each hash bucket, read and insert is mutually exclusive.
-	 * But at the same time, we allow paratactic read operation.
-	 */
-	pthread_rwlock_t rilock;
 	struct load_node *next;
 };
 
-static struct load_head load_hash[LOAD_SIZE]; /* hash table */
 /*
- * init_load initialize the hash table.
- * Return 0 on success, return -1 on failure.
+ * The hash table of load_nodes, doubling in size as containers come.  Only
+ * load_begin() resizes it, between two passes, so refreshing threads see
+ * the same buckets throughout a pass and need not take the lock.  Readers
+ * hold it shared while they use a bucket.
  */
-static int init_load(void)
+static struct load_table {
+	pthread_rwlock_t lock;
+	struct load_bucket *buckets;
+	size_t size;		/* a power of two, 0 when not set up */
+	size_t nr_nodes;	/* atomic */
+} load_table = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+static int load_fds_open;	/* atomic, stat fds cached by the load_nodes */
+static int load_fds_max;
+/* Nodes unread for so long are refreshed less often, 0 to never. */
+static uint64_t load_idle_ms;
+
+static void free_load_tids(struct load_tid *tids, int nr);
+
+static void free_load_node(struct load_node *n)
 {
-	int i;
-	int ret;
+	free_load_tids(n->tids, n->nr_tids);
+	free(n->tids);
+	free(n->cg);
+	free(n);
+}
+
+static void load_avg_publish(struct load_node *n, const struct load_avg *avg)
+{
+	unsigned int seq = n->seq;
+
+	__atomic_store_n(&n->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&n->avg.avenrun[0], avg->avenrun[0], __ATOMIC_RELAXED);
+	__atomic_store_n(&n->avg.avenrun[1], avg->avenrun[1], __ATOMIC_RELAXED);
+	__atomic_store_n(&n->avg.avenrun[2], avg->avenrun[2], __ATOMIC_RELAXED);
+	__atomic_store_n(&n->avg.run_pid, avg->run_pid, __ATOMIC_RELAXED);
+	__atomic_store_n(&n->avg.total_pid, avg->total_pid, __ATOMIC_RELAXED);
+	__atomic_store_n(&n->avg.last_pid, avg->last_pid, __ATOMIC_RELAXED);
+	__atomic_store_n(&n->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void load_avg_read(struct load_node *n, struct load_avg *avg)
+{
+	unsigned int seq;
+
+	do {
+		while ((seq = __atomic_load_n(&n->seq, __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+		avg->avenrun[0] = __atomic_load_n(&n->avg.avenrun[0], __ATOMIC_RELAXED);
+		avg->avenrun[1] = __atomic_load_n(&n->avg.avenrun[1], __ATOMIC_RELAXED);
+		avg->avenrun[2] = __atomic_load_n(&n->avg.avenrun[2], __ATOMIC_RELAXED);
+		avg->run_pid = __atomic_load_n(&n->avg.run_pid, __ATOMIC_RELAXED);
+		avg->total_pid = __atomic_load_n(&n->avg.total_pid, __ATOMIC_RELAXED);
+		avg->last_pid = __atomic_load_n(&n->avg.last_pid, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&n->seq, __ATOMIC_RELAXED) != seq);
+}
 
-	for (i = 0; i < LOAD_SIZE; i++) {
-		load_hash[i].next = NULL;
-		ret = pthread_mutex_init(&load_hash[i].lock, NULL);
-		if (ret != 0) {
+static struct load_bucket *alloc_load_buckets(size_t size)
+{
+	struct load_bucket *buckets;
+	size_t i;
+
+	buckets = calloc(size, sizeof(*buckets));
+	if (!buckets)
+		return NULL;
+	for (i = 0; i < size; i++) {
+		if (pthread_mutex_init(&buckets[i].lock, NULL) != 0) {
 			lxcfs_error("%s\n", "Failed to initialize lock");
-			goto out3;
-		}
-		ret = pthread_rwlock_init(&load_hash[i].rdlock, NULL);
-		if (ret != 0) {
-			lxcfs_error("%s\n", "Failed to initialize rdlock");
-			goto out2;
-		}
-		ret = pthread_rwlock_init(&load_hash[i].rilock, NULL);
-		if (ret != 0) {
-			lxcfs_error("%s\n", "Failed to initialize rilock");
-			goto out1;
+			while (i > 0)
+				pthread_mutex_destroy(&buckets[--i].lock);
+			free(buckets);
+			return NULL;
 		}
 	}
-	return 0;
-out1:
-	pthread_rwlock_destroy(&load_hash[i].rdlock);
-out2:
-	pthread_mutex_destroy(&load_hash[i].lock);
-out3:
-	while (i > 0) {
-		i--;
-		pthread_mutex_destroy(&load_hash[i].lock);
-		pthread_rwlock_destroy(&load_hash[i].rdlock);
-		pthread_rwlock_destroy(&load_hash[i].rilock);
-	}
-	return -1;
+	return buckets;
 }
 
-static void insert_node(struct load_node **n, int locate)
+static void free_load_buckets(struct load_bucket *buckets, size_t size)
 {
-	struct load_node *f;
+	size_t i;
 
-	pthread_mutex_lock(&load_hash[locate].lock);
-	pthread_rwlock_wrlock(&load_hash[locate].rilock);
-	f = load_hash[locate].next;
-	load_hash[locate].next = *n;
-
-	(*n)->pre = &(load_hash[locate].next);
-	if (f)
-		f->pre = &((*n)->next);
-	(*n)->next = f;
-	pthread_mutex_unlock(&load_hash[locate].lock);
-	pthread_rwlock_unlock(&load_hash[locate].rilock);
+	for (i = 0; i < size; i++)
+		pthread_mutex_destroy(&buckets[i].lock);
+	free(buckets);
 }
+
 /*
- * locate_node() finds special node. Not return NULL means success.
- * It should be noted that rdlock isn't unlocked at the end of code
- * because this function is used to read special node. Delete is not
- * allowed before read has ended.
- * unlock rdlock only in proc_loadavg_read().
+ * init_load initialize the hash table.
+ * Return 0 on success, return -1 on failure.
  */
-static struct load_node *locate_node(char *cg, int locate)
+static int init_load(void)
 {
-	struct load_node *f = NULL;
-	int i = 0;
+	struct load_bucket *buckets;
+
+	load_fds_max = fd_cache_max(FD_SHARE_LOAD_STAT);
+
+	buckets = alloc_load_buckets(LOAD_MIN_SIZE);
+	if (!buckets)
+		return -1;
+
+	pthread_rwlock_wrlock(&load_table.lock);
+	load_table.buckets = buckets;
+	load_table.size = LOAD_MIN_SIZE;
+	load_table.nr_nodes = 0;
+	pthread_rwlock_unlock(&load_table.lock);
+	return 0;
+}
+
+/*
+ * Grow the table once it averages more than LOAD_MAX_LOAD nodes a bucket,
+ * and shrink it back when most containers are gone.  Must not run during
+ * a pass.
+ */
+static void load_table_resize(void)
+{
+	struct load_bucket *buckets, *old;
+	struct load_node *f, *next;
+	size_t i, size, nr;
+
+	nr = __atomic_load_n(&load_table.nr_nodes, __ATOMIC_RELAXED);
+	size = load_table.size;
+	while (nr > size * LOAD_MAX_LOAD)
+		size *= 2;
+	while (size > LOAD_MIN_SIZE && nr < size / 8)
+		size /= 2;
+	if (size == load_table.size)
+		return;
+
+	buckets = alloc_load_buckets(size);
+	if (!buckets)
+		return;
 
-	pthread_rwlock_rdlock(&load_hash[locate].rilock);
-	pthread_rwlock_rdlock(&load_hash[locate].rdlock);
-	if (load_hash[locate].next == NULL) {
-		pthread_rwlock_unlock(&load_hash[locate].rilock);
-		return f;
+	pthread_rwlock_wrlock(&load_table.lock);
+	old = load_table.buckets;
+	for (i = 0; i < load_table.size; i++) {
+		for (f = old[i].next; f; f = next) {
+			struct load_bucket *b = &buckets[f->hash & (size - 1)];
+
+			next = f->next;
+			f->next = b->next;
+			if (f->next)
+				f->next->pre = &f->next;
+			f->pre = &b->next;
+			b->next = f;
+		}
 	}
-	f = load_hash[locate].next;
-	pthread_rwlock_unlock(&load_hash[locate].rilock);
-	while (f && ((i = strcmp(f->cg, cg)) != 0))
-		f = f->next;
-	return f;
+	free_load_buckets(old, load_table.size);
+	load_table.buckets = buckets;
+	load_table.size = size;
+	pthread_rwlock_unlock(&load_table.lock);
+
+	lxcfs_debug("loadavg table resized to %zu buckets for %zu nodes.\n", size, nr);
+}
+
+/* Must be called with @b->lock held. */
+static struct load_node *locate_node(struct load_bucket *b, const char *cg,
+				     uint64_t hash)
+{
+	struct load_node *f;
+
+	for (f = b->next; f; f = f->next)
+		if (f->hash == hash && strcmp(f->cg, cg) == 0)
+			return f;
+	return NULL;
+}
+
+/* Must be called with @b->lock held. */
+static void insert_node(struct load_bucket *b, struct load_node *n)
+{
+	n->next = b->next;
+	if (n->next)
+		n->next->pre = &n->next;
+	n->pre = &b->next;
+	b->next = n;
+	__atomic_add_fetch(&load_table.nr_nodes, 1, __ATOMIC_RELAXED);
 }
+
 /* Delete the load_node n and return the next node of it. */
-static struct load_node *del_node(struct load_node *n, int locate)
+static struct load_node *del_node(struct load_bucket *b, struct load_node *n)
 {
 	struct load_node *g;
 
-	pthread_rwlock_wrlock(&load_hash[locate].rdlock);
-	if (n->next == NULL) {
-		*(n->pre) = NULL;
-	} else {
-		*(n->pre) = n->next;
-		n->next->pre = n->pre;
-	}
+	pthread_mutex_lock(&b->lock);
 	g = n->next;
-	free(n->cg);
-	free(n);
-	pthread_rwlock_unlock(&load_hash[locate].rdlock);
+	*(n->pre) = g;
+	if (g)
+		g->pre = n->pre;
+	pthread_mutex_unlock(&b->lock);
+
+	__atomic_sub_fetch(&load_table.nr_nodes, 1, __ATOMIC_RELAXED);
+	free_load_node(n);
 	return g;
 }
 
 static void load_free(void)
 {
-	int i;
 	struct load_node *f, *p;
+	size_t i;
 
-	for (i = 0; i < LOAD_SIZE; i++) {
-		pthread_mutex_lock(&load_hash[i].lock);
-		pthread_rwlock_wrlock(&load_hash[i].rilock);
-		pthread_rwlock_wrlock(&load_hash[i].rdlock);
-		if (load_hash[i].next == NULL) {
-			pthread_mutex_unlock(&load_hash[i].lock);
-			pthread_mutex_destroy(&load_hash[i].lock);
-			pthread_rwlock_unlock(&load_hash[i].rilock);
-			pthread_rwlock_destroy(&load_hash[i].rilock);
-			pthread_rwlock_unlock(&load_hash[i].rdlock);
-			pthread_rwlock_destroy(&load_hash[i].rdlock);
-			continue;
-		}
-		for (f = load_hash[i].next; f; ) {
-			free(f->cg);
+	pthread_rwlock_wrlock(&load_table.lock);
+	for (i = 0; i < load_table.size; i++) {
+		for (f = load_table.buckets[i].next; f; ) {
 			p = f->next;
-			free(f);
+			free_load_node(f);
 			f = p;
 		}
-		pthread_mutex_unlock(&load_hash[i].lock);
-		pthread_mutex_destroy(&load_hash[i].lock);
-		pthread_rwlock_unlock(&load_hash[i].rilock);
-		pthread_rwlock_destroy(&load_hash[i].rilock);
-		pthread_rwlock_unlock(&load_hash[i].rdlock);
-		pthread_rwlock_destroy(&load_hash[i].rdlock);
 	}
+	free_load_buckets(load_table.buckets, load_table.size);
+	load_table.buckets = NULL;
+	load_table.size = 0;
+	load_table.nr_nodes = 0;
+	pthread_rwlock_unlock(&load_table.lock);
 }
 
 /* Data for CPU view */
 struct cg_proc_stat {
 	char *cg;
-	struct cpuacct_usage *usage; // Real usage as read from the host's /proc/stat
-	struct cpuacct_usage *view; // Usage stats reported to the container
+	struct cpu_usage usage; // Real usage as read from the host's /proc/stat
+	struct cpu_usage view; // Usage stats reported to the container, its
+			       // online CPUs are those shown
 	int cpu_count;
+	/* The view as last computed, see cpuview_update() */
+	int nprocs;
+	int max_cpus;
+	unsigned long user_sum, system_sum, idle_sum;
+	uint64_t updated; // monotonic_ms() of the last update
+	uint64_t last_read; // monotonic_ms() of the last read
 	pthread_mutex_t lock; // For node manipulation
 	struct cg_proc_stat *next;
 };
@@ -335,8 +507,8 @@ static void free_proc_stat_node(struct cg_proc_stat *node)
 {
 	pthread_mutex_destroy(&node->lock);
 	free(node->cg);
-	free(node->usage);
-	free(node->view);
+	cpu_usage_free(&node->usage);
+	cpu_usage_free(&node->view);
 	free(node);
 }
 
@@ -376,29 +548,57 @@ static void free_cpuview()
  * When looking up which pid is init for $qpid, we first
  * 1. Stat /proc/$qpid/ns/pid.
  * 2. Check whether the ino_t is in our store.
- *   a. if not, fork a child in qpid's ns to send us
- *	 ucred.pid = 1, and read the initpid.  Cache
- *	 initpid and creation time for /proc/initpid
- *	 in a new store entry.
+ *   a. if not, ask the helper living in qpid's ns (see
+ *	 pidns_helper_get()) to send us ucred.pid = 1,
+ *	 and read the initpid.  Cache initpid and creation
+ *	 time for /proc/initpid in a new store entry.
  *   b. if so, verify that /proc/initpid still matches
  *	 what we have saved.  If not, clear the store
  *	 entry and go back to a.  If so, return the
  *	 cached initpid.
+ * Where the kernel has pidfds, step 2b is replaced by a thread
+ * watching a pidfd for every cached initpid (see
+ * initpid_watch()) which drops the entry as soon as the
+ * initpid exits, so that hits need no validation.
+ *
+ * Each entry also doubles as the context of the container: the first handler
+ * asking for the cgroup of $initpid reads /proc/$initpid/cgroup once for all
+ * hierarchies (see get_container_cgroup()), and everybody else gets the
+ * cached paths until they are CGROUP_CACHE_SECS old.  The cpuset of the
+ * container is kept the same way, compiled into a cpumask (see
+ * get_container_cpumask()).
+ *
+ * The buckets are striped over PIDNS_STORE_SHARDS read-write locks so that
+ * hits from all FUSE threads proceed in parallel.  The locks only cover
+ * walking and editing the chains: stat()ing /proc, asking the helper and
+ * freeing pruned entries all happen outside of them.
  */
 struct pidns_init_store {
 	ino_t ino;          // inode number for /proc/$pid/ns/pid
 	pid_t initpid;      // the pid of nit in that ns
 	long int ctime;     // the time at which /proc/$initpid was created
 	struct pidns_init_store *next;
-	long int lastcheck;
+	long int lastcheck; // atomic, bumped under the shard's read lock
+	int pidfd;          // watched pidfd for $initpid, or -1
+	char **cgroups;     // cgroup of $initpid in each hierarchy, or NULL
+	long int cgtime;    // the time at which @cgroups was read
+	char *cpuset_cg;    // cpuset cgroup @cpumask was read from, or NULL
+	struct cpumask *cpumask;
+	long int cpustime;  // the time at which @cpumask was read
 };
 
 /* lol - look at how they are allocated in the kernel */
 #define PIDNS_HASH_SIZE 4096
 #define HASH(x) ((x) % PIDNS_HASH_SIZE)
 
+#define PIDNS_STORE_SHARDS 64
+#define SHARD(h) ((h) % PIDNS_STORE_SHARDS)
+
 static struct pidns_init_store *pidns_hash_table[PIDNS_HASH_SIZE];
-static pthread_mutex_t pidns_store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t pidns_store_locks[PIDNS_STORE_SHARDS] = {
+	[0 ... PIDNS_STORE_SHARDS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
 static void lock_mutex(pthread_mutex_t *l)
 {
 	int ret;
@@ -430,6 +630,29 @@ static char **hierarchies;
 static int *fd_hierarchies;
 static int cgroup_mount_ns_fd = -1;
 
+/* READ-ONLY after __constructor__ collect_and_mount_subsystems() has run.
+ * The hierarchy each of the controllers lxcfs reads for itself is mounted
+ * on, so that looking one up is a plain array access:
+ * Initialized via __constructor__ collect_and_mount_subsystems(). */
+struct lxcfs_ctrl {
+	int hier;     // index into hierarchies, or -1 if not mounted
+	int fd;       // fd_hierarchies[hier], or -1
+	bool unified; // cgroup2 hierarchy, its files follow the v2 names
+};
+
+static const char *ctrl_names[LXC_CTRL_MAX] = {
+	[LXC_CTRL_BLKIO]   = "blkio",
+	[LXC_CTRL_CPU]     = "cpu",
+	[LXC_CTRL_CPUACCT] = "cpuacct",
+	[LXC_CTRL_CPUSET]  = "cpuset",
+	[LXC_CTRL_MEMORY]  = "memory",
+	[LXC_CTRL_UNIFIED] = "unified",
+};
+
+static struct lxcfs_ctrl ctrl_table[LXC_CTRL_MAX] = {
+	[0 ... LXC_CTRL_MAX - 1] = { -1, -1, false }
+};
+
 static void unlock_mutex(pthread_mutex_t *l)
 {
 	int ret;
@@ -440,229 +663,579 @@ static void unlock_mutex(pthread_mutex_t *l)
 	}
 }
 
-static void store_lock(void)
+static void store_lock(int h, bool write)
 {
-	lock_mutex(&pidns_store_mutex);
+	pthread_rwlock_t *l = &pidns_store_locks[SHARD(h)];
+	int ret;
+
+	ret = write ? pthread_rwlock_wrlock(l) : pthread_rwlock_rdlock(l);
+	if (ret != 0) {
+		lxcfs_error("returned:%d %s\n", ret, strerror(ret));
+		exit(1);
+	}
 }
 
-static void store_unlock(void)
+static void store_unlock(int h)
 {
-	unlock_mutex(&pidns_store_mutex);
+	int ret;
+
+	if ((ret = pthread_rwlock_unlock(&pidns_store_locks[SHARD(h)])) != 0) {
+		lxcfs_error("returned:%d %s\n", ret, strerror(ret));
+		exit(1);
+	}
 }
 
-/* Must be called under store_lock */
-static bool initpid_still_valid(struct pidns_init_store *e, struct stat *nsfdsb)
+static bool initpid_still_valid(pid_t initpid, long int ctime)
 {
 	struct stat initsb;
 	char fnam[100];
 
-	snprintf(fnam, 100, "/proc/%d", e->initpid);
+	snprintf(fnam, 100, "/proc/%d", initpid);
 	if (stat(fnam, &initsb) < 0)
 		return false;
 
-	lxcfs_debug("Comparing ctime %ld == %ld for pid %d.\n", e->ctime,
-		    initsb.st_ctime, e->initpid);
+	lxcfs_debug("Comparing ctime %ld == %ld for pid %d.\n", ctime,
+		    initsb.st_ctime, initpid);
 
-	if (e->ctime != initsb.st_ctime)
+	if (ctime != initsb.st_ctime)
 		return false;
 	return true;
 }
 
-/* Must be called under store_lock */
-static void remove_initpid(struct pidns_init_store *e)
+static void free_pid_cgroups(char **cgroups)
 {
-	struct pidns_init_store *tmp;
-	int h;
-
-	lxcfs_debug("Remove_initpid: removing entry for %d.\n", e->initpid);
+	int i;
 
-	h = HASH(e->ino);
-	if (pidns_hash_table[h] == e) {
-		pidns_hash_table[h] = e->next;
-		free(e);
+	if (!cgroups)
 		return;
-	}
+	for (i = 0; i < num_hierarchies; i++)
+		free(cgroups[i]);
+	free(cgroups);
+}
 
-	tmp = pidns_hash_table[h];
-	while (tmp) {
-		if (tmp->next == e) {
-			tmp->next = e->next;
-			free(e);
-			return;
+static void free_initpid(struct pidns_init_store *e)
+{
+	if (e->pidfd >= 0)
+		close(e->pidfd);
+	free_pid_cgroups(e->cgroups);
+	free(e->cpuset_cg);
+	cpumask_free(e->cpumask);
+	free(e);
+}
+
+/* Remove the entry for @ino unless someone already replaced it. */
+static void remove_initpid(ino_t ino, pid_t initpid, long int ctime)
+{
+	struct pidns_init_store **p, *e = NULL;
+	int h = HASH(ino);
+
+	lxcfs_debug("Remove_initpid: removing entry for %d.\n", initpid);
+
+	store_lock(h, true);
+	for (p = &pidns_hash_table[h]; *p; p = &(*p)->next) {
+		if ((*p)->ino == ino && (*p)->initpid == initpid &&
+		    (*p)->ctime == ctime) {
+			e = *p;
+			*p = e->next;
+			break;
 		}
-		tmp = tmp->next;
 	}
+	store_unlock(h);
+
+	if (e)
+		free_initpid(e);
 }
 
 #define PURGE_SECS 5
-/* Must be called under store_lock */
+static void prune_pidns_helpers(void);
+
+/*
+ * Only one thread at a time gets to prune; everybody else goes on without
+ * waiting for it.
+ */
 static void prune_initpid_store(void)
 {
 	static long int last_prune = 0;
-	struct pidns_init_store *e, *prev, *delme;
-	long int now, threshold;
-	int i;
+	struct pidns_init_store *e, **p, *delme = NULL;
+	long int now, threshold, prev;
+	int i, s;
 
-	if (!last_prune) {
-		last_prune = time(NULL);
+	now = time(NULL);
+	prev = __atomic_load_n(&last_prune, __ATOMIC_RELAXED);
+	if (!prev) {
+		__atomic_compare_exchange_n(&last_prune, &prev, now, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 		return;
 	}
-	now = time(NULL);
-	if (now < last_prune + PURGE_SECS)
+	if (now < prev + PURGE_SECS)
+		return;
+	if (!__atomic_compare_exchange_n(&last_prune, &prev, now, false,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
 		return;
 
 	lxcfs_debug("%s\n", "Pruning.");
 
-	last_prune = now;
 	threshold = now - 2 * PURGE_SECS;
 
-	for (i = 0; i < PIDNS_HASH_SIZE; i++) {
-		for (prev = NULL, e = pidns_hash_table[i]; e; ) {
-			if (e->lastcheck < threshold) {
+	prune_pidns_helpers();
+
+	for (s = 0; s < PIDNS_STORE_SHARDS; s++) {
+		store_lock(s, true);
+		for (i = s; i < PIDNS_HASH_SIZE; i += PIDNS_STORE_SHARDS) {
+			for (p = &pidns_hash_table[i]; *p; ) {
+				e = *p;
+				/* Watched entries go away when their init does. */
+				if (e->pidfd >= 0 ||
+				    __atomic_load_n(&e->lastcheck, __ATOMIC_RELAXED) >= threshold) {
+					p = &e->next;
+					continue;
+				}
 
 				lxcfs_debug("Removing cached entry for %d.\n", e->initpid);
 
+				*p = e->next;
+				e->next = delme;
 				delme = e;
-				if (prev)
-					prev->next = e->next;
-				else
-					pidns_hash_table[i] = e->next;
-				e = e->next;
-				free(delme);
-			} else {
-				prev = e;
-				e = e->next;
 			}
 		}
+		store_unlock(s);
 	}
-}
-
-/* Must be called under store_lock */
-static void save_initpid(struct stat *sb, pid_t pid)
-{
-	struct pidns_init_store *e;
-	char fpath[100];
-	struct stat procsb;
-	int h;
-
-	lxcfs_debug("Save_initpid: adding entry for %d.\n", pid);
 
-	snprintf(fpath, 100, "/proc/%d", pid);
-	if (stat(fpath, &procsb) < 0)
-		return;
-	do {
-		e = malloc(sizeof(*e));
-	} while (!e);
-	e->ino = sb->st_ino;
-	e->initpid = pid;
-	e->ctime = procsb.st_ctime;
-	h = HASH(e->ino);
-	e->next = pidns_hash_table[h];
-	e->lastcheck = time(NULL);
-	pidns_hash_table[h] = e;
+	while (delme) {
+		e = delme;
+		delme = e->next;
+		free_initpid(e);
+	}
 }
 
 /*
- * Given the stat(2) info for a nsfd pid inode, lookup the init_pid_store
- * entry for the inode number and creation time.  Verify that the init pid
- * is still valid.  If not, remove it.  Return the entry if valid, NULL
- * otherwise.
- * Must be called under store_lock
+ * One thread watches everything that dies together with a pid namespace:
+ * the pidfds of cached initpids and the sockets of pid namespace helpers.
+ * A helper must be reaped as soon as it is gone, the namespace's init
+ * cannot finish exiting while it lingers as our zombie.
  */
-static struct pidns_init_store *lookup_verify_initpid(struct stat *sb)
+static int pidns_watch_epfd = -1;
+static int pidns_watch_stopfd = -1;
+static pthread_t pidns_watch_thread;
+static pthread_once_t pidns_watch_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The epoll data of a watched pidfd carries both the fd and the (32 bit)
+ * namespace inode number, so that the watcher never has to dereference an
+ * entry someone else may be freeing.  Helpers are pinned by their
+ * registration and are tagged with the top bit.  0 is the stop request.
+ */
+#define PIDNS_WATCH_INITPID(fd, ino) (((uint64_t)(fd) << 32) | (uint32_t)(ino))
+#define PIDNS_WATCH_HELPER(h) ((uint64_t)(uintptr_t)(h) | (1ULL << 63))
+#define PIDNS_WATCH_STOP 0
+
+struct pidns_helper;
+static void pidns_helper_died(struct pidns_helper *h);
+
+/* Drop the entry for @ino if it is still watched through @pidfd. */
+static void evict_initpid(ino_t ino, int pidfd)
 {
-	int h = HASH(sb->st_ino);
-	struct pidns_init_store *e = pidns_hash_table[h];
+	struct pidns_init_store **p, *e = NULL;
+	int h = HASH(ino);
 
-	while (e) {
-		if (e->ino == sb->st_ino) {
-			if (initpid_still_valid(e, sb)) {
-				e->lastcheck = time(NULL);
-				return e;
-			}
-			remove_initpid(e);
-			return NULL;
+	store_lock(h, true);
+	for (p = &pidns_hash_table[h]; *p; p = &(*p)->next) {
+		if ((*p)->ino == ino && (*p)->pidfd == pidfd) {
+			e = *p;
+			*p = e->next;
+			break;
 		}
-		e = e->next;
 	}
+	store_unlock(h);
 
-	return NULL;
+	if (e) {
+		lxcfs_debug("Init %d exited, evicting its entry.\n", e->initpid);
+		free_initpid(e);
+	}
 }
 
-static int is_dir(const char *path, int fd)
+static void *pidns_watch(void *arg)
 {
-	struct stat statbuf;
-	int ret = fstatat(fd, path, &statbuf, fd);
-	if (ret == 0 && S_ISDIR(statbuf.st_mode))
-		return 1;
-	return 0;
+	struct epoll_event ev[16];
+	uint64_t data;
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait(pidns_watch_epfd, ev, 16, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			lxcfs_error("Failed to wait for pid namespaces: %s.\n", strerror(errno));
+			return NULL;
+		}
+		for (i = 0; i < n; i++) {
+			data = ev[i].data.u64;
+			if (data == PIDNS_WATCH_STOP)
+				return NULL;
+			if (data & (1ULL << 63))
+				pidns_helper_died((struct pidns_helper *)(uintptr_t)(data & ~(1ULL << 63)));
+			else
+				evict_initpid((uint32_t)data, data >> 32);
+		}
+	}
 }
 
-static char *must_copy_string(const char *str)
+static void pidns_watch_start(void)
 {
-	char *dup = NULL;
-	if (!str)
-		return NULL;
-	do {
-		dup = strdup(str);
-	} while (!dup);
+	struct epoll_event ev;
 
-	return dup;
-}
+	pidns_watch_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (pidns_watch_epfd < 0)
+		goto err;
+	pidns_watch_stopfd = eventfd(0, EFD_CLOEXEC);
+	if (pidns_watch_stopfd < 0)
+		goto err;
 
-static inline void drop_trailing_newlines(char *s)
-{
-	int l;
+	ev.events = EPOLLIN;
+	ev.data.u64 = PIDNS_WATCH_STOP;
+	if (epoll_ctl(pidns_watch_epfd, EPOLL_CTL_ADD, pidns_watch_stopfd, &ev) < 0)
+		goto err;
 
-	for (l=strlen(s); l>0 && s[l-1] == '\n'; l--)
-		s[l-1] = '\0';
+	if (pthread_create(&pidns_watch_thread, NULL, pidns_watch, NULL) != 0)
+		goto err;
+	return;
+
+err:
+	lxcfs_error("%s\n", "Failed to start pid namespace watcher, falling back to polling.");
+	if (pidns_watch_stopfd >= 0)
+		close(pidns_watch_stopfd);
+	if (pidns_watch_epfd >= 0)
+		close(pidns_watch_epfd);
+	pidns_watch_stopfd = -1;
+	pidns_watch_epfd = -1;
 }
 
-#define BATCH_SIZE 50
-static void dorealloc(char **mem, size_t oldlen, size_t newlen)
+/* Returns false if there is no watcher. */
+static bool pidns_watch_add(int fd, uint32_t events, uint64_t data)
 {
-	int newbatches = (newlen / BATCH_SIZE) + 1;
-	int oldbatches = (oldlen / BATCH_SIZE) + 1;
+	struct epoll_event ev;
 
-	if (!*mem || newbatches > oldbatches) {
-		char *tmp;
-		do {
-			tmp = realloc(*mem, newbatches * BATCH_SIZE);
-		} while (!tmp);
-		*mem = tmp;
-	}
+	pthread_once(&pidns_watch_once, pidns_watch_start);
+	if (pidns_watch_epfd < 0)
+		return false;
+
+	ev.events = events | EPOLLONESHOT;
+	ev.data.u64 = data;
+	return epoll_ctl(pidns_watch_epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
 }
-static void append_line(char **contents, size_t *len, char *line, ssize_t linelen)
+
+static void pidns_watch_stop(void)
 {
-	size_t newlen = *len + linelen;
-	dorealloc(contents, *len, newlen + 1);
-	memcpy(*contents + *len, line, linelen+1);
-	*len = newlen;
+	uint64_t one = 1;
+
+	if (pidns_watch_epfd < 0)
+		return;
+
+	if (write(pidns_watch_stopfd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(pidns_watch_thread, NULL);
+	close(pidns_watch_stopfd);
+	close(pidns_watch_epfd);
+	pidns_watch_stopfd = -1;
+	pidns_watch_epfd = -1;
 }
 
-static char *slurp_file(const char *from, int fd)
+/*
+ * Open a pidfd for @pid, which must still be the init of the namespace
+ * described by @sb.  Returns -1 if pidfds are not available.
+ */
+static int initpid_pidfd(pid_t pid, struct stat *sb)
 {
-	char *line = NULL;
-	char *contents = NULL;
-	FILE *f = fdopen(fd, "r");
-	size_t len = 0, fulllen = 0;
-	ssize_t linelen;
+	struct stat nssb;
+	char fnam[100];
+	int fd;
 
-	if (!f)
-		return NULL;
+	pthread_once(&pidns_watch_once, pidns_watch_start);
+	if (pidns_watch_epfd < 0)
+		return -1;
 
-	while ((linelen = getline(&line, &len, f)) != -1) {
-		append_line(&contents, &fulllen, line, linelen);
+	fd = pidfd_open(pid, 0);
+	if (fd < 0)
+		return -1;
+
+	/* @pid might have been recycled since the helper told us about it. */
+	snprintf(fnam, 100, "/proc/%d/ns/pid", pid);
+	if (stat(fnam, &nssb) < 0 || nssb.st_ino != sb->st_ino) {
+		close(fd);
+		return -1;
 	}
-	fclose(f);
 
-	if (contents)
-		drop_trailing_newlines(contents);
-	free(line);
-	return contents;
+	return fd;
 }
 
-static bool write_string(const char *fnam, const char *string, int fd)
+/*
+ * Start watching @e's pidfd.  Must be called under the write lock for
+ * @e's shard, after @e has been hashed.
+ */
+static void initpid_watch(struct pidns_init_store *e)
+{
+	if (!pidns_watch_add(e->pidfd, EPOLLIN, PIDNS_WATCH_INITPID(e->pidfd, e->ino))) {
+		close(e->pidfd);
+		e->pidfd = -1;
+	}
+}
+
+static void free_initpid_store(void)
+{
+	struct pidns_init_store *e, *next;
+	int i;
+
+	for (i = 0; i < PIDNS_HASH_SIZE; i++) {
+		for (e = pidns_hash_table[i]; e; e = next) {
+			next = e->next;
+			free_initpid(e);
+		}
+		pidns_hash_table[i] = NULL;
+	}
+}
+
+/* Returns the creation time of /proc/@pid, or 0 if it is gone. */
+static long int save_initpid(struct stat *sb, pid_t pid)
+{
+	struct pidns_init_store *e, *tmp;
+	char fpath[100];
+	struct stat procsb;
+	int h;
+
+	lxcfs_debug("Save_initpid: adding entry for %d.\n", pid);
+
+	snprintf(fpath, 100, "/proc/%d", pid);
+	if (stat(fpath, &procsb) < 0)
+		return 0;
+	do {
+		e = malloc(sizeof(*e));
+	} while (!e);
+	e->ino = sb->st_ino;
+	e->initpid = pid;
+	e->ctime = procsb.st_ctime;
+	e->lastcheck = time(NULL);
+	e->pidfd = initpid_pidfd(pid, sb);
+	e->cgroups = NULL;
+	e->cgtime = 0;
+	e->cpuset_cg = NULL;
+	e->cpumask = NULL;
+	e->cpustime = 0;
+	h = HASH(e->ino);
+
+	store_lock(h, true);
+	/* Another thread may have resolved the same namespace meanwhile. */
+	for (tmp = pidns_hash_table[h]; tmp; tmp = tmp->next) {
+		if (tmp->ino == e->ino)
+			break;
+	}
+	if (!tmp) {
+		e->next = pidns_hash_table[h];
+		pidns_hash_table[h] = e;
+		if (e->pidfd >= 0)
+			initpid_watch(e);
+		e = NULL;
+	}
+	store_unlock(h);
+
+	if (e)
+		free_initpid(e);
+
+	return procsb.st_ctime;
+}
+
+/*
+ * Given the stat(2) info for a nsfd pid inode, lookup the init_pid_store
+ * entry for the inode number and creation time.  Unless it is watched
+ * through a pidfd, verify that the init pid is still valid.  If not, remove
+ * it.  Return true and set @initpid and @initctime if valid.
+ */
+static bool lookup_verify_initpid(struct stat *sb, pid_t *initpid,
+				  long int *initctime)
+{
+	int h = HASH(sb->st_ino);
+	struct pidns_init_store *e;
+	long int ctime = 0;
+	pid_t pid = 0;
+	bool watched = false;
+
+	store_lock(h, false);
+	for (e = pidns_hash_table[h]; e; e = e->next) {
+		if (e->ino == sb->st_ino) {
+			pid = e->initpid;
+			ctime = e->ctime;
+			watched = e->pidfd >= 0;
+			if (!watched)
+				__atomic_store_n(&e->lastcheck, time(NULL), __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	store_unlock(h);
+
+	if (!pid)
+		return false;
+
+	/* Still hashed means still alive. */
+	if (watched || initpid_still_valid(pid, ctime)) {
+		*initpid = pid;
+		*initctime = ctime;
+		return true;
+	}
+
+	remove_initpid(sb->st_ino, pid, ctime);
+	return false;
+}
+
+#define CGROUP_CACHE_SECS 2
+static char *must_copy_string(const char *str);
+
+/*
+ * Copy the cached cgroup of the init of @ino, started at @ctime, in
+ * hierarchy @idx to @cg.  Returns false if the cache is missing or stale;
+ * @cg may be NULL on success if init is not in that hierarchy.
+ */
+static bool lookup_initpid_cgroup(ino_t ino, long int ctime, int idx, char **cg)
+{
+	int h = HASH(ino);
+	struct pidns_init_store *e;
+	bool found = false;
+
+	store_lock(h, false);
+	for (e = pidns_hash_table[h]; e; e = e->next) {
+		if (e->ino != ino || e->ctime != ctime)
+			continue;
+		if (e->cgroups && e->cgtime + CGROUP_CACHE_SECS > time(NULL)) {
+			*cg = must_copy_string(e->cgroups[idx]);
+			found = true;
+		}
+		break;
+	}
+	store_unlock(h);
+
+	return found;
+}
+
+/*
+ * Hand @cgroups over to the entry for the init of @ino started at @ctime.
+ * Returns false, leaving @cgroups to the caller, if there is no such entry.
+ */
+static bool save_initpid_cgroups(ino_t ino, long int ctime, char **cgroups)
+{
+	int h = HASH(ino);
+	struct pidns_init_store *e;
+	char **old = NULL;
+	bool found = false;
+
+	store_lock(h, true);
+	for (e = pidns_hash_table[h]; e; e = e->next) {
+		if (e->ino != ino || e->ctime != ctime)
+			continue;
+		old = e->cgroups;
+		e->cgroups = cgroups;
+		e->cgtime = time(NULL);
+		found = true;
+		break;
+	}
+	store_unlock(h);
+
+	free_pid_cgroups(old);
+	return found;
+}
+
+/*
+ * Copy the cached cpumask of the cpuset cgroup @cg of the init of @ino,
+ * started at @ctime, to @mask.  Returns false if the cache is missing, stale
+ * or for another cgroup.
+ */
+static bool lookup_initpid_cpumask(ino_t ino, long int ctime, const char *cg,
+				   struct cpumask **mask)
+{
+	int h = HASH(ino);
+	struct pidns_init_store *e;
+	bool found = false;
+
+	store_lock(h, false);
+	for (e = pidns_hash_table[h]; e; e = e->next) {
+		if (e->ino != ino || e->ctime != ctime)
+			continue;
+		if (e->cpumask && e->cpustime + CGROUP_CACHE_SECS > time(NULL) &&
+		    strcmp(e->cpuset_cg, cg) == 0) {
+			*mask = cpumask_dup(e->cpumask);
+			found = *mask != NULL;
+		}
+		break;
+	}
+	store_unlock(h);
+
+	return found;
+}
+
+/* Remember a copy of @mask for the init of @ino started at @ctime. */
+static void save_initpid_cpumask(ino_t ino, long int ctime, const char *cg,
+				 const struct cpumask *mask)
+{
+	int h = HASH(ino);
+	struct pidns_init_store *e;
+	struct cpumask *copy, *old = NULL;
+	char *cg_copy, *old_cg = NULL;
+
+	copy = cpumask_dup(mask);
+	cg_copy = strdup(cg);
+	if (!copy || !cg_copy)
+		goto out;
+
+	store_lock(h, true);
+	for (e = pidns_hash_table[h]; e; e = e->next) {
+		if (e->ino != ino || e->ctime != ctime)
+			continue;
+		old = e->cpumask;
+		old_cg = e->cpuset_cg;
+		e->cpumask = copy;
+		e->cpuset_cg = cg_copy;
+		e->cpustime = time(NULL);
+		copy = NULL;
+		cg_copy = NULL;
+		break;
+	}
+	store_unlock(h);
+
+out:
+	cpumask_free(old);
+	free(old_cg);
+	cpumask_free(copy);
+	free(cg_copy);
+}
+
+static int is_dir(const char *path, int fd)
+{
+	struct stat statbuf;
+	int ret = fstatat(fd, path, &statbuf, fd);
+	if (ret == 0 && S_ISDIR(statbuf.st_mode))
+		return 1;
+	return 0;
+}
+
+static char *must_copy_string(const char *str)
+{
+	char *dup = NULL;
+	if (!str)
+		return NULL;
+	do {
+		dup = strdup(str);
+	} while (!dup);
+
+	return dup;
+}
+
+static inline void drop_trailing_newlines(char *s)
+{
+	int l;
+
+	for (l=strlen(s); l>0 && s[l-1] == '\n'; l--)
+		s[l-1] = '\0';
+}
+
+#define BATCH_SIZE 50
+
+static bool write_string(const char *fnam, const char *string, int fd)
 {
 	FILE *f;
 	size_t len, ret;
@@ -744,29 +1317,50 @@ static bool in_comma_list(const char *needle, const char *haystack)
 	return false;
 }
 
-/* do we need to do any massaging here?  I'm not sure... */
-/* Return the mounted controller and store the corresponding open file descriptor
- * referring to the controller mountpoint in the private lxcfs namespace in
- * @cfd.
- */
-static char *find_mounted_controller(const char *controller, int *cfd)
+static int find_hierarchy(const char *controller)
 {
 	int i;
 
 	for (i = 0; i < num_hierarchies; i++) {
 		if (!hierarchies[i])
 			continue;
-		if (strcmp(hierarchies[i], controller) == 0) {
-			*cfd = fd_hierarchies[i];
-			return hierarchies[i];
-		}
-		if (in_comma_list(controller, hierarchies[i])) {
-			*cfd = fd_hierarchies[i];
-			return hierarchies[i];
-		}
+		if (strcmp(hierarchies[i], controller) == 0)
+			return i;
+		if (in_comma_list(controller, hierarchies[i]))
+			return i;
 	}
 
-	return NULL;
+	return -1;
+}
+
+static void init_ctrl_table(void)
+{
+	int i, hier;
+
+	for (i = 0; i < LXC_CTRL_MAX; i++) {
+		hier = find_hierarchy(ctrl_names[i]);
+		if (hier < 0)
+			continue;
+		ctrl_table[i].hier = hier;
+		ctrl_table[i].fd = fd_hierarchies[hier];
+		ctrl_table[i].unified = strcmp(hierarchies[hier], "unified") == 0;
+	}
+}
+
+/* do we need to do any massaging here?  I'm not sure... */
+/* Return the mounted controller and store the corresponding open file descriptor
+ * referring to the controller mountpoint in the private lxcfs namespace in
+ * @cfd.
+ * Controllers lxcfs reads for itself are looked up in @ctrl_table instead.
+ */
+static char *find_mounted_controller(const char *controller, int *cfd)
+{
+	int i = find_hierarchy(controller);
+
+	if (i < 0)
+		return NULL;
+	*cfd = fd_hierarchies[i];
+	return hierarchies[i];
 }
 
 bool cgfs_set_value(const char *controller, const char *cgroup, const char *file,
@@ -1149,71 +1743,430 @@ void free_keys(struct cgfs_files **keys)
 	free(keys);
 }
 
-bool cgfs_get_value(const char *controller, const char *cgroup, const char *file, char **value)
+/*
+ * A cache of O_PATH fds for the cgroup directories of containers, so that
+ * reading the several files of a cgroup walks its path once rather than
+ * once per file.  Entries unused for CGROUP_DIRFD_IDLE_SECS are closed on
+ * the next insertion, and there are never more than cgroup_dirfds_max of
+ * them.  Hits hold the read lock across the openat() so that the fd cannot
+ * be closed under them.
+ */
+struct cgroup_dirfd {
+	int hier;          // index into hierarchies
+	char *cgroup;      // the cgroup as passed by the caller
+	int fd;            // O_PATH fd for the cgroup directory
+	ino_t ino;         // inode of the directory, to notice it was removed
+	long int lastuse;  // atomic, bumped under the read lock
+	struct cgroup_dirfd *next;
+};
+
+#define CGROUP_DIRFD_HASH_SIZE 256
+#define CGROUP_DIRFD_IDLE_SECS 60
+
+static struct cgroup_dirfd *cgroup_dirfds[CGROUP_DIRFD_HASH_SIZE];
+static int nr_cgroup_dirfds;
+static int cgroup_dirfds_max; // set by the constructor, see fd_cache_max()
+static long int cgroup_dirfds_pruned;
+static pthread_rwlock_t cgroup_dirfd_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void cgroup_dirfd_lock_(bool write)
 {
-	int ret, fd, cfd;
-	size_t len;
-	char *fnam, *tmpc;
+	int ret;
 
-	tmpc = find_mounted_controller(controller, &cfd);
-	if (!tmpc)
-		return false;
+	ret = write ? pthread_rwlock_wrlock(&cgroup_dirfd_lock) :
+		      pthread_rwlock_rdlock(&cgroup_dirfd_lock);
+	if (ret != 0) {
+		lxcfs_error("returned:%d %s\n", ret, strerror(ret));
+		exit(1);
+	}
+}
 
-	/* Make sure we pass a relative path to *at() family of functions.
-	 * . + /cgroup + / + file + \0
-	 */
-	len = strlen(cgroup) + strlen(file) + 3;
-	fnam = alloca(len);
-	ret = snprintf(fnam, len, "%s%s/%s", *cgroup == '/' ? "." : "", cgroup, file);
-	if (ret < 0 || (size_t)ret >= len)
-		return false;
+static void cgroup_dirfd_unlock(void)
+{
+	int ret;
 
-	fd = openat(cfd, fnam, O_RDONLY);
-	if (fd < 0)
-		return false;
+	if ((ret = pthread_rwlock_unlock(&cgroup_dirfd_lock)) != 0) {
+		lxcfs_error("returned:%d %s\n", ret, strerror(ret));
+		exit(1);
+	}
+}
 
-	*value = slurp_file(fnam, fd);
-	return *value != NULL;
+static int cgroup_dirfd_hash(int hier, const char *cgroup)
+{
+	return (calc_hash(cgroup) + hier) % CGROUP_DIRFD_HASH_SIZE;
 }
 
-bool cgfs_param_exist(const char *controller, const char *cgroup, const char *file)
+static struct cgroup_dirfd *find_cgroup_dirfd(int hier, const char *cgroup)
 {
-	int ret, cfd;
-	size_t len;
-	char *fnam, *tmpc;
+	struct cgroup_dirfd *e;
 
-	tmpc = find_mounted_controller(controller, &cfd);
-	if (!tmpc)
-		return false;
+	for (e = cgroup_dirfds[cgroup_dirfd_hash(hier, cgroup)]; e; e = e->next) {
+		if (e->hier == hier && strcmp(e->cgroup, cgroup) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static void free_cgroup_dirfd(struct cgroup_dirfd *e)
+{
+	close(e->fd);
+	free(e->cgroup);
+	free(e);
+}
+
+/* Open @cgroup in hierarchy @hier, returning its inode number in @ino. */
+static int open_cgroup_dirfd(int hier, const char *cgroup, ino_t *ino)
+{
+	struct stat sb;
+	size_t len;
+	char *fnam;
+	int fd, ret;
 
 	/* Make sure we pass a relative path to *at() family of functions.
-	 * . + /cgroup + / + file + \0
+	 * . + /cgroup + \0
 	 */
-	len = strlen(cgroup) + strlen(file) + 3;
+	len = strlen(cgroup) + 2;
 	fnam = alloca(len);
-	ret = snprintf(fnam, len, "%s%s/%s", *cgroup == '/' ? "." : "", cgroup, file);
+	ret = snprintf(fnam, len, "%s%s", *cgroup == '/' ? "." : "", cgroup);
 	if (ret < 0 || (size_t)ret >= len)
-		return false;
+		return -1;
 
-	return (faccessat(cfd, fnam, F_OK, 0) == 0);
+	fd = openat(fd_hierarchies[hier], fnam, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	*ino = sb.st_ino;
+	return fd;
 }
 
-struct cgfs_files *cgfs_get_key(const char *controller, const char *cgroup, const char *file)
+/* Close the entries which have been idle for too long.  Called write locked. */
+static void prune_cgroup_dirfds(long int now)
 {
-	int ret, cfd;
-	size_t len;
-	char *fnam, *tmpc;
-	struct stat sb;
-	struct cgfs_files *newkey;
+	struct cgroup_dirfd *e, **p;
+	int i;
 
-	tmpc = find_mounted_controller(controller, &cfd);
-	if (!tmpc)
-		return false;
+	for (i = 0; i < CGROUP_DIRFD_HASH_SIZE; i++) {
+		for (p = &cgroup_dirfds[i]; *p; ) {
+			e = *p;
+			if (e->lastuse + CGROUP_DIRFD_IDLE_SECS > now) {
+				p = &e->next;
+				continue;
+			}
+			*p = e->next;
+			free_cgroup_dirfd(e);
+			nr_cgroup_dirfds--;
+		}
+	}
+	cgroup_dirfds_pruned = now;
+}
 
-	if (file && *file == '/')
-		file++;
+/* Cache @fd for @cgroup, or close it if there is no room or no need. */
+static void save_cgroup_dirfd(int hier, const char *cgroup, int fd, ino_t ino)
+{
+	struct cgroup_dirfd *e;
+	long int now = time(NULL);
+	int h;
 
-	if (file && strchr(file, '/'))
+	cgroup_dirfd_lock_(true);
+	if (nr_cgroup_dirfds >= cgroup_dirfds_max ||
+	    cgroup_dirfds_pruned + CGROUP_DIRFD_IDLE_SECS <= now)
+		prune_cgroup_dirfds(now);
+	if (nr_cgroup_dirfds >= cgroup_dirfds_max || find_cgroup_dirfd(hier, cgroup)) {
+		cgroup_dirfd_unlock();
+		close(fd);
+		return;
+	}
+
+	do {
+		e = malloc(sizeof(*e));
+	} while (!e);
+	e->hier = hier;
+	e->cgroup = must_copy_string(cgroup);
+	e->fd = fd;
+	e->ino = ino;
+	e->lastuse = now;
+	h = cgroup_dirfd_hash(hier, cgroup);
+	e->next = cgroup_dirfds[h];
+	cgroup_dirfds[h] = e;
+	nr_cgroup_dirfds++;
+	cgroup_dirfd_unlock();
+}
+
+/* Drop the entry for @cgroup if it still refers to directory @ino. */
+static void remove_cgroup_dirfd(int hier, const char *cgroup, ino_t ino)
+{
+	struct cgroup_dirfd *e, **p;
+
+	cgroup_dirfd_lock_(true);
+	p = &cgroup_dirfds[cgroup_dirfd_hash(hier, cgroup)];
+	for (; *p; p = &(*p)->next) {
+		e = *p;
+		if (e->hier == hier && e->ino == ino && strcmp(e->cgroup, cgroup) == 0) {
+			*p = e->next;
+			free_cgroup_dirfd(e);
+			nr_cgroup_dirfds--;
+			break;
+		}
+	}
+	cgroup_dirfd_unlock();
+}
+
+static void free_cgroup_dirfds(void)
+{
+	struct cgroup_dirfd *e, *next;
+	int i;
+
+	for (i = 0; i < CGROUP_DIRFD_HASH_SIZE; i++) {
+		for (e = cgroup_dirfds[i]; e; e = next) {
+			next = e->next;
+			free_cgroup_dirfd(e);
+		}
+		cgroup_dirfds[i] = NULL;
+	}
+	nr_cgroup_dirfds = 0;
+}
+
+/*
+ * Open @file of @cgroup in hierarchy @hier read-only, through the cached
+ * fd for the cgroup.  A cached fd whose directory has been removed, or
+ * removed and created again, is dropped and the cgroup looked up anew.
+ */
+static int cgroup_openat(int hier, const char *cgroup, const char *file)
+{
+	struct cgroup_dirfd *e;
+	struct stat sb;
+	ino_t ino = 0;
+	int dfd, fd, saved_errno;
+	bool hit;
+
+	cgroup_dirfd_lock_(false);
+	e = find_cgroup_dirfd(hier, cgroup);
+	hit = e != NULL;
+	if (hit) {
+		__atomic_store_n(&e->lastuse, time(NULL), __ATOMIC_RELAXED);
+		ino = e->ino;
+		fd = openat(e->fd, file, O_RDONLY | O_CLOEXEC);
+		saved_errno = errno;
+	}
+	cgroup_dirfd_unlock();
+
+	if (hit) {
+		if (fd >= 0 || saved_errno != ENOENT) {
+			errno = saved_errno;
+			return fd;
+		}
+		/* Either @file does not exist or the whole cgroup is gone. */
+		dfd = open_cgroup_dirfd(hier, cgroup, &sb.st_ino);
+		if (dfd >= 0 && sb.st_ino == ino) {
+			close(dfd);
+			errno = ENOENT;
+			return -1;
+		}
+		remove_cgroup_dirfd(hier, cgroup, ino);
+	} else {
+		dfd = open_cgroup_dirfd(hier, cgroup, &sb.st_ino);
+	}
+	if (dfd < 0)
+		return -1;
+
+	fd = openat(dfd, file, O_RDONLY | O_CLOEXEC);
+	saved_errno = errno;
+	save_cgroup_dirfd(hier, cgroup, dfd, sb.st_ino);
+	errno = saved_errno;
+	return fd;
+}
+
+/*
+ * The caller of the request a thread serves.  lxcfs runs on the FUSE
+ * low-level API, which has no fuse_get_context(): it hands us the caller
+ * of each request through lxcfs_set_context() instead.
+ */
+static pthread_key_t context_key;
+static pthread_once_t context_once = PTHREAD_ONCE_INIT;
+static bool context_key_created;
+
+static void context_init(void)
+{
+	context_key_created = pthread_key_create(&context_key, NULL) == 0;
+}
+
+/* @ctx must stay valid until the request is done and this is reset to NULL. */
+void lxcfs_set_context(struct fuse_context *ctx)
+{
+	pthread_once(&context_once, context_init);
+	if (context_key_created)
+		pthread_setspecific(context_key, ctx);
+}
+
+struct fuse_context *lxcfs_get_context(void)
+{
+	struct fuse_context *ctx = NULL;
+
+	if (context_key_created)
+		ctx = pthread_getspecific(context_key);
+	return ctx ? ctx : fuse_get_context();
+}
+
+/*
+ * Per-thread buffer cgroup files are read into before being copied out
+ * at their exact size.
+ */
+struct cgfs_buf {
+	char *buf;
+	size_t size;
+};
+
+static pthread_key_t cgfs_buf_key;
+static pthread_once_t cgfs_buf_once = PTHREAD_ONCE_INIT;
+static bool cgfs_buf_key_created;
+
+static void free_cgfs_buf(void *arg)
+{
+	struct cgfs_buf *b = arg;
+
+	free(b->buf);
+	free(b);
+}
+
+static void cgfs_buf_init(void)
+{
+	cgfs_buf_key_created = pthread_key_create(&cgfs_buf_key, free_cgfs_buf) == 0;
+}
+
+static struct cgfs_buf *get_cgfs_buf(void)
+{
+	struct cgfs_buf *b;
+
+	pthread_once(&cgfs_buf_once, cgfs_buf_init);
+	if (!cgfs_buf_key_created)
+		return NULL;
+
+	b = pthread_getspecific(cgfs_buf_key);
+	if (b)
+		return b;
+
+	b = calloc(1, sizeof(*b));
+	if (b && pthread_setspecific(cgfs_buf_key, b) != 0) {
+		free(b);
+		b = NULL;
+	}
+	return b;
+}
+
+/* Read all of @fd into a newly allocated string without trailing newlines. */
+static char *read_cgroup_file(int fd)
+{
+	struct cgfs_buf local = { NULL, 0 }, *b;
+	char *value = NULL;
+	size_t len = 0;
+	ssize_t ret;
+
+	b = get_cgfs_buf();
+	if (!b)
+		b = &local;
+
+	for (;;) {
+		if (len + 1 >= b->size) {
+			size_t newsize = b->size ? 2 * b->size : BUF_RESERVE_SIZE;
+			char *tmp;
+
+			tmp = realloc(b->buf, newsize);
+			if (!tmp)
+				goto out;
+			b->buf = tmp;
+			b->size = newsize;
+		}
+		ret = pread(fd, b->buf + len, b->size - len - 1, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			goto out;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+	if (!len)
+		goto out;
+
+	b->buf[len] = '\0';
+	drop_trailing_newlines(b->buf);
+	value = must_copy_string(b->buf);
+
+out:
+	if (b == &local)
+		free(local.buf);
+	return value;
+}
+
+static bool hier_get_value(int hier, const char *cgroup, const char *file, char **value)
+{
+	int fd;
+
+	if (hier < 0)
+		return false;
+
+	fd = cgroup_openat(hier, cgroup, file);
+	if (fd < 0)
+		return false;
+
+	*value = read_cgroup_file(fd);
+	close(fd);
+	return *value != NULL;
+}
+
+bool cgfs_get_value(const char *controller, const char *cgroup, const char *file, char **value)
+{
+	return hier_get_value(find_hierarchy(controller), cgroup, file, value);
+}
+
+static bool ctrl_get_value(enum lxcfs_ctrl_t ctrl, const char *cgroup, const char *file, char **value)
+{
+	return hier_get_value(ctrl_table[ctrl].hier, cgroup, file, value);
+}
+
+static bool ctrl_param_exist(enum lxcfs_ctrl_t ctrl, const char *cgroup, const char *file)
+{
+	int ret, cfd = ctrl_table[ctrl].fd;
+	size_t len;
+	char *fnam;
+
+	if (cfd < 0)
+		return false;
+
+	/* Make sure we pass a relative path to *at() family of functions.
+	 * . + /cgroup + / + file + \0
+	 */
+	len = strlen(cgroup) + strlen(file) + 3;
+	fnam = alloca(len);
+	ret = snprintf(fnam, len, "%s%s/%s", *cgroup == '/' ? "." : "", cgroup, file);
+	if (ret < 0 || (size_t)ret >= len)
+		return false;
+
+	return (faccessat(cfd, fnam, F_OK, 0) == 0);
+}
+
+struct cgfs_files *cgfs_get_key(const char *controller, const char *cgroup, const char *file)
+{
+	int ret, cfd;
+	size_t len;
+	char *fnam, *tmpc;
+	struct stat sb;
+	struct cgfs_files *newkey;
+
+	tmpc = find_mounted_controller(controller, &cfd);
+	if (!tmpc)
+		return false;
+
+	if (file && *file == '/')
+		file++;
+
+	if (file && strchr(file, '/'))
 		return NULL;
 
 	/* Make sure we pass a relative path to *at() family of functions.
@@ -1289,170 +2242,1021 @@ bool is_child_cgroup(const char *controller, const char *cgroup, const char *f)
 	return true;
 }
 
-#define SEND_CREDS_OK 0
-#define SEND_CREDS_NOTSK 1
-#define SEND_CREDS_FAIL 2
-static bool recv_creds(int sock, struct ucred *cred, char *v);
 static int wait_for_pid(pid_t pid);
-static int send_creds(int sock, struct ucred *cred, char v, bool pingfirst);
-static int send_creds_clone_wrapper(void *arg);
 
 /*
- * clone a task which switches to @task's namespace and writes '1'.
- * over a unix sock so we can read the task's reaper's pid in our
- * namespace
+ * Persistent pid namespace helpers.
  *
- * Note: glibc's fork() does not respect pidns, which can lead to failed
- * assertions inside glibc (and thus failed forks) if the child's pid in
- * the pidns and the parent pid outside are identical. Using clone prevents
- * this issue.
+ * Converting pids between pid namespaces needs a task living in the target
+ * namespace: the kernel rewrites the pid carried in SCM_CREDENTIALS into the
+ * receiver's view.  Rather than forking and cloning a fresh task for every
+ * query, we keep one long-lived helper per pid namespace and talk to it over
+ * a SOCK_SEQPACKET socketpair.
+ *
+ * The helper is cloned into the namespace with CLONE_PARENT so that it is our
+ * direct child.  It goes away together with the namespace: once the
+ * namespace's init exits the kernel SIGKILLs every other task in it, our end
+ * of the socket sees a hangup and the helper is reaped by
+ * prune_pidns_helpers() or by the next failing request.
  */
-static void write_task_init_pid_exit(int sock, pid_t target)
-{
-	char fnam[100];
-	pid_t pid;
-	int fd, ret;
-	size_t stack_size = sysconf(_SC_PAGESIZE);
-	void *stack = alloca(stack_size);
+#define PIDNS_HELPER_INITPID 1 /* reply with ucred.pid = 1 */
+#define PIDNS_HELPER_TO_NS   2 /* translate the pid in the request's ucred */
+#define PIDNS_HELPER_FROM_NS 3 /* reply with ucred.pid = msg.pid */
+#define PIDNS_HELPER_END     4 /* ends a batch of translations */
 
-	ret = snprintf(fnam, sizeof(fnam), "/proc/%d/ns/pid", (int)target);
-	if (ret < 0 || ret >= sizeof(fnam))
-		_exit(1);
+/*
+ * Translations are batched.  The kernel honours a single SCM_CREDENTIALS per
+ * message, so a batch is a run of up to PIDNS_HELPER_BATCH requests, each
+ * carrying its own ucred, queued with one sendmmsg() and closed by a
+ * PIDNS_HELPER_END message.  The helper drains them with recvmmsg() and
+ * answers a TO_NS batch with a single struct pidns_helper_pids, a FROM_NS
+ * batch with one sendmmsg() of credentials closed by its own
+ * PIDNS_HELPER_END.
+ */
+#define PIDNS_HELPER_BATCH 128
 
-	fd = open(fnam, O_RDONLY);
-	if (fd < 0) {
-		perror("write_task_init_pid_exit open of ns/pid");
-		_exit(1);
-	}
-	if (setns(fd, 0)) {
-		perror("write_task_init_pid_exit setns 1");
-		close(fd);
-		_exit(1);
-	}
-	pid = clone(send_creds_clone_wrapper, stack + stack_size, SIGCHLD, &sock);
-	if (pid < 0)
-		_exit(1);
-	if (pid != 0) {
-		if (!wait_for_pid(pid))
-			_exit(1);
-		_exit(0);
-	}
-}
+struct pidns_helper_msg {
+	int op;     // PIDNS_HELPER_* in requests, 0 or -errno in replies
+	int index;  // position within the batch, batch size for PIDNS_HELPER_END
+	pid_t pid;
+};
 
-static int send_creds_clone_wrapper(void *arg) {
-	struct ucred cred;
-	char v;
-	int sock = *(int *)arg;
+struct pidns_helper_pids {
+	struct pidns_helper_msg hdr;
+	pid_t pids[PIDNS_HELPER_BATCH];
+};
 
-	/* we are the child */
-	cred.uid = 0;
-	cred.gid = 0;
-	cred.pid = 1;
-	v = '1';
-	if (send_creds(sock, &cred, v, true) != SEND_CREDS_OK)
-		return 1;
-	return 0;
-}
+struct pidns_msgvec {
+	struct mmsghdr vec[PIDNS_HELPER_BATCH + 1];
+	struct iovec iov[PIDNS_HELPER_BATCH + 1];
+	struct pidns_helper_msg msgs[PIDNS_HELPER_BATCH + 1];
+	char cmsgs[PIDNS_HELPER_BATCH + 1][CMSG_SPACE(sizeof(struct ucred))];
+};
 
-static pid_t get_init_pid_for_task(pid_t task)
-{
-	int sock[2];
-	pid_t pid;
-	pid_t ret = -1;
-	char v = '0';
-	struct ucred cred;
+struct pidns_helper {
+	ino_t ino;              // inode number for /proc/$pid/ns/pid
+	pid_t pid;              // the helper's pid in our namespace
+	int sock;               // our end of the socketpair
+	int refcount;           // protected by pidns_helpers_mutex
+	bool dead;
+	bool hashed;
+	pthread_mutex_t lock;   // serializes requests on @sock
+	struct pidns_helper *next;
+};
 
-	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sock) < 0) {
-		perror("socketpair");
-		return -1;
-	}
+static struct pidns_helper *pidns_helpers[PIDNS_HASH_SIZE];
+static pthread_mutex_t pidns_helpers_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-	pid = fork();
-	if (pid < 0)
-		goto out;
-	if (!pid) {
-		close(sock[1]);
-		write_task_init_pid_exit(sock[0], task);
-		_exit(0);
-	}
+/* Inode number of our own pid namespace, we never need a helper for it. */
+static ino_t host_pidns_ino;
 
-	if (!recv_creds(sock[1], &cred, &v))
-		goto out;
-	ret = cred.pid;
+static void pidns_set_cred(struct msghdr *msg, void *cmsgbuf, struct ucred *cred)
+{
+	struct cmsghdr *cmsg;
 
-out:
-	close(sock[0]);
-	close(sock[1]);
-	if (pid > 0)
-		wait_for_pid(pid);
-	return ret;
+	msg->msg_control = cmsgbuf;
+	msg->msg_controllen = CMSG_SPACE(sizeof(*cred));
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_CREDENTIALS;
+	memcpy(CMSG_DATA(cmsg), cred, sizeof(*cred));
 }
 
-pid_t lookup_initpid_in_store(pid_t qpid)
+static void pidns_get_cred(struct msghdr *msg, struct ucred *cred)
 {
-	pid_t answer = 0;
-	struct stat sb;
-	struct pidns_init_store *e;
-	char fnam[100];
+	struct cmsghdr *cmsg;
 
-	snprintf(fnam, 100, "/proc/%d/ns/pid", qpid);
-	store_lock();
-	if (stat(fnam, &sb) < 0)
-		goto out;
-	e = lookup_verify_initpid(&sb);
-	if (e) {
-		answer = e->initpid;
-		goto out;
-	}
-	answer = get_init_pid_for_task(qpid);
-	if (answer > 0)
-		save_initpid(&sb, answer);
+	cred->pid = -1;
+	cred->uid = -1;
+	cred->gid = -1;
 
-out:
-	/* we prune at end in case we are returning
-	 * the value we were about to return */
-	prune_initpid_store();
-	store_unlock();
-	return answer;
+	cmsg = CMSG_FIRSTHDR(msg);
+	if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred)) &&
+			cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_CREDENTIALS)
+		memcpy(cred, CMSG_DATA(cmsg), sizeof(*cred));
 }
 
-static int wait_for_pid(pid_t pid)
+static int pidns_sendmsg(int sock, struct pidns_helper_msg *m, struct ucred *cred)
 {
-	int status, ret;
+	struct msghdr msg = { 0 };
+	struct iovec iov;
+	char cmsgbuf[CMSG_SPACE(sizeof(*cred))];
 
-	if (pid <= 0)
-		return -1;
+	iov.iov_base = m;
+	iov.iov_len = sizeof(*m);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (cred)
+		pidns_set_cred(&msg, cmsgbuf, cred);
 
-again:
-	ret = waitpid(pid, &status, 0);
-	if (ret == -1) {
-		if (errno == EINTR)
-			goto again;
-		return -1;
-	}
-	if (ret != pid)
-		goto again;
-	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-		return -1;
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+		return -errno;
 	return 0;
 }
 
-/*
- * append the given formatted string to *src.
- * src: a pointer to a char* in which to append the formatted string.
- * sz: the number of characters printed so far, minus trailing \0.
- * asz: the allocated size so far
- * format: string format. See printf for details.
- * ...: varargs. See printf for details.
- */
-static void must_strcat(char **src, size_t *sz, size_t *asz, const char *format, ...)
+/* Returns the message length, or -EPIPE once the peer is gone. */
+static ssize_t pidns_recvmsg(int sock, void *buf, size_t len, struct ucred *cred)
 {
-	char tmp[BUF_RESERVE_SIZE];
-	va_list		args;
+	struct msghdr msg = { 0 };
+	struct iovec iov;
+	char cmsgbuf[CMSG_SPACE(sizeof(*cred))];
+	ssize_t ret;
 
-	va_start (args, format);
-	int tmplen = vsnprintf(tmp, BUF_RESERVE_SIZE, format, args);
-	va_end(args);
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+
+	ret = recvmsg(sock, &msg, 0);
+	if (ret < 0)
+		return -errno;
+	if (ret == 0)
+		return -EPIPE;
+
+	pidns_get_cred(&msg, cred);
+	return ret;
+}
+
+/* Set up entry @i of @v for sending, with @cred if not NULL. */
+static void pidns_msgvec_init(struct pidns_msgvec *v, int i, struct ucred *cred)
+{
+	struct msghdr *msg = &v->vec[i].msg_hdr;
+
+	memset(msg, 0, sizeof(*msg));
+	v->iov[i].iov_base = &v->msgs[i];
+	v->iov[i].iov_len = sizeof(v->msgs[i]);
+	msg->msg_iov = &v->iov[i];
+	msg->msg_iovlen = 1;
+	if (cred)
+		pidns_set_cred(msg, v->cmsgs[i], cred);
+}
+
+/*
+ * Queue entries [0, @n) of @v with as few syscalls as possible.  An entry
+ * whose ucred names a pid which does not exist is skipped and gets -ESRCH
+ * in its op field.
+ */
+static int pidns_sendmmsg(int sock, struct pidns_msgvec *v, int n)
+{
+	int i = 0, ret;
+
+	while (i < n) {
+		ret = sendmmsg(sock, &v->vec[i], n - i, MSG_NOSIGNAL);
+		if (ret > 0) {
+			i += ret;
+			continue;
+		}
+		if (ret == 0)
+			return -EIO;
+		if (errno == EINTR)
+			continue;
+		if (errno != ESRCH)
+			return -errno;
+		v->msgs[i++].op = -ESRCH;
+	}
+
+	return 0;
+}
+
+/* Receive at least one and at most @n messages into @v. */
+static int pidns_recvmmsg(int sock, struct pidns_msgvec *v, int n)
+{
+	int i, ret;
+
+	for (i = 0; i < n; i++) {
+		pidns_msgvec_init(v, i, NULL);
+		v->vec[i].msg_hdr.msg_control = v->cmsgs[i];
+		v->vec[i].msg_hdr.msg_controllen = sizeof(v->cmsgs[i]);
+	}
+
+	do {
+		ret = recvmmsg(sock, v->vec, n, MSG_WAITFORONE, NULL);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	if (ret == 0 || v->vec[0].msg_len == 0)
+		return -EPIPE;
+
+	return ret;
+}
+
+/*
+ * Only helpers use these, each of them has its own copy.  They would not fit
+ * on the single page of stack a helper runs on.
+ */
+static struct pidns_msgvec helper_in, helper_out;
+static struct pidns_helper_pids helper_pids;
+
+/* Send the replies to a FROM_NS batch queued in helper_out. */
+static int pidns_helper_flush(int sock, int n, int count)
+{
+	int i, ret;
+
+	ret = pidns_sendmmsg(sock, &helper_out, n);
+	if (ret < 0)
+		return ret;
+
+	/* Pids which do not exist in our namespace. */
+	for (i = 0; i < n; i++) {
+		if (helper_out.msgs[i].op != -ESRCH)
+			continue;
+		ret = pidns_sendmsg(sock, &helper_out.msgs[i], NULL);
+		if (ret < 0)
+			return ret;
+	}
+
+	helper_out.msgs[0].op = PIDNS_HELPER_END;
+	helper_out.msgs[0].index = count;
+	helper_out.msgs[0].pid = 0;
+	return pidns_sendmsg(sock, &helper_out.msgs[0], NULL);
+}
+
+/*
+ * The helper is a copy of a multithreaded daemon, so only async-signal-safe
+ * calls from here on.  In particular no lxcfs_error().
+ */
+static int pidns_helper_main(void *arg)
+{
+	int sock = *(int *)arg;
+	struct pidns_helper_msg m, *req;
+	struct ucred cred;
+	sigset_t mask;
+	int fd, maxfd, optval = 1, ret, i, j, n, nout = 0;
+
+	/*
+	 * Don't hold on to the fuse device or the cgroup mounts, and let the
+	 * container's init get rid of us with a plain SIGTERM on shutdown.
+	 */
+#ifdef __NR_close_range
+	if (syscall(__NR_close_range, 0, sock - 1, 0) < 0 ||
+	    syscall(__NR_close_range, sock + 1, ~0U, 0) < 0)
+#endif
+	{
+		maxfd = sysconf(_SC_OPEN_MAX);
+		if (maxfd < 0 || maxfd > 65536)
+			maxfd = 65536;
+		for (fd = 0; fd < maxfd; fd++)
+			if (fd != sock)
+				close(fd);
+	}
+	for (ret = 1; ret < NSIG; ret++)
+		signal(ret, SIG_DFL);
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	prctl(PR_SET_NAME, "lxcfs-pidns", 0, 0, 0);
+
+	if (setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &optval, sizeof(optval)) < 0)
+		_exit(1);
+
+	/* Announce ourselves, the kernel fills in our pid as lxcfs sees it. */
+	memset(&m, 0, sizeof(m));
+	if (pidns_sendmsg(sock, &m, NULL) < 0)
+		_exit(1);
+
+	for (i = 0; i < PIDNS_HELPER_BATCH; i++)
+		helper_pids.pids[i] = -1;
+
+	for (;;) {
+		n = pidns_recvmmsg(sock, &helper_in, PIDNS_HELPER_BATCH + 1);
+		if (n < 0)
+			_exit(n == -EPIPE ? 0 : 1);
+
+		for (i = 0, ret = 0; i < n && ret == 0; i++) {
+			req = &helper_in.msgs[i];
+			pidns_get_cred(&helper_in.vec[i].msg_hdr, &cred);
+
+			if (req->op != PIDNS_HELPER_INITPID &&
+			    req->op != PIDNS_HELPER_END &&
+			    (req->index < 0 || req->index >= PIDNS_HELPER_BATCH))
+				_exit(1);
+
+			switch (req->op) {
+			case PIDNS_HELPER_INITPID:
+				m.op = 0;
+				cred.pid = 1;
+				cred.uid = 0;
+				cred.gid = 0;
+				ret = pidns_sendmsg(sock, &m, &cred);
+				break;
+			case PIDNS_HELPER_TO_NS:
+				/* 0 if the pid is not visible in our namespace */
+				helper_pids.pids[req->index] = cred.pid;
+				break;
+			case PIDNS_HELPER_FROM_NS:
+				if (nout == PIDNS_HELPER_BATCH)
+					_exit(1);
+				cred.pid = req->pid;
+				cred.uid = 0;
+				cred.gid = 0;
+				helper_out.msgs[nout] = *req;
+				helper_out.msgs[nout].op = 0;
+				pidns_msgvec_init(&helper_out, nout, &cred);
+				nout++;
+				break;
+			case PIDNS_HELPER_END:
+				if (nout > 0) {
+					ret = pidns_helper_flush(sock, nout, req->index);
+					nout = 0;
+					break;
+				}
+				helper_pids.hdr.op = PIDNS_HELPER_END;
+				helper_pids.hdr.index = req->index;
+				helper_pids.hdr.pid = 0;
+				if (send(sock, &helper_pids, sizeof(helper_pids), MSG_NOSIGNAL) < 0)
+					ret = -errno;
+				for (j = 0; j < PIDNS_HELPER_BATCH; j++)
+					helper_pids.pids[j] = -1;
+				break;
+			default:
+				m.op = -EINVAL;
+				ret = pidns_sendmsg(sock, &m, NULL);
+				break;
+			}
+		}
+		if (ret < 0)
+			_exit(ret == -EPIPE ? 0 : 1);
+	}
+}
+
+/*
+ * Note: glibc's fork() does not respect pidns, which can lead to failed
+ * assertions inside glibc (and thus failed forks) if the child's pid in
+ * the pidns and the parent pid outside are identical. Using clone prevents
+ * this issue.
+ */
+static void pidns_helper_clone_exit(int nsfd, int sock)
+{
+	size_t stack_size = sysconf(_SC_PAGESIZE);
+	void *stack = alloca(stack_size);
+	pid_t pid;
+
+	if (setns(nsfd, CLONE_NEWPID) < 0)
+		_exit(1);
+
+	pid = clone(pidns_helper_main, stack + stack_size, CLONE_PARENT | SIGCHLD, &sock);
+	_exit(pid < 0 ? 1 : 0);
+}
+
+static struct pidns_helper *pidns_helper_spawn(pid_t task, ino_t ino)
+{
+	struct pidns_helper *h;
+	struct pidns_helper_msg m;
+	struct ucred cred;
+	struct timeval tv = { .tv_sec = 2, .tv_usec = 0 };
+	struct stat sb;
+	char fnam[100];
+	int nsfd, sock[2], optval = 1;
+	pid_t pid;
+
+	snprintf(fnam, 100, "/proc/%d/ns/pid", task);
+	nsfd = open(fnam, O_RDONLY | O_CLOEXEC);
+	if (nsfd < 0)
+		return NULL;
+	/* @task might have been replaced since our caller looked at it. */
+	if (fstat(nsfd, &sb) < 0 || sb.st_ino != ino) {
+		close(nsfd);
+		return NULL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sock) < 0) {
+		lxcfs_error("Failed to create socketpair: %s.\n", strerror(errno));
+		close(nsfd);
+		return NULL;
+	}
+	if (setsockopt(sock[0], SOL_SOCKET, SO_PASSCRED, &optval, sizeof(optval)) < 0 ||
+	    setsockopt(sock[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		lxcfs_error("Failed to set socket options: %s.\n", strerror(errno));
+		goto err;
+	}
+
+	pid = fork();
+	if (pid < 0)
+		goto err;
+	if (!pid) {
+		close(sock[0]);
+		pidns_helper_clone_exit(nsfd, sock[1]);
+	}
+	close(sock[1]);
+	sock[1] = -1;
+	if (wait_for_pid(pid) < 0)
+		goto err;
+
+	if (pidns_recvmsg(sock[0], &m, sizeof(m), &cred) != sizeof(m) || cred.pid <= 0) {
+		lxcfs_error("No hello from pid namespace helper for %d.\n", task);
+		goto err;
+	}
+
+	do {
+		h = malloc(sizeof(*h));
+	} while (!h);
+	h->ino = ino;
+	h->pid = cred.pid;
+	h->sock = sock[0];
+	h->refcount = 1;
+	h->dead = false;
+	h->hashed = false;
+	pthread_mutex_init(&h->lock, NULL);
+	h->next = NULL;
+	close(nsfd);
+
+	lxcfs_debug("Spawned pid namespace helper %d for %d.\n", h->pid, task);
+	return h;
+
+err:
+	close(nsfd);
+	close(sock[0]);
+	if (sock[1] >= 0)
+		close(sock[1]);
+	return NULL;
+}
+
+static void pidns_helper_free(struct pidns_helper *h)
+{
+	lxcfs_debug("Reaping pid namespace helper %d.\n", h->pid);
+
+	/* The helper is our child, so its pid cannot have been reused yet. */
+	close(h->sock);
+	kill(h->pid, SIGKILL);
+	while (waitpid(h->pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+/* Must be called under pidns_helpers_mutex */
+static void pidns_helper_unhash(struct pidns_helper *h)
+{
+	struct pidns_helper **p;
+
+	for (p = &pidns_helpers[HASH(h->ino)]; *p; p = &(*p)->next) {
+		if (*p == h) {
+			*p = h->next;
+			break;
+		}
+	}
+	h->hashed = false;
+	h->refcount--;
+}
+
+static void pidns_helper_put(struct pidns_helper *h)
+{
+	bool last;
+
+	if (!h)
+		return;
+
+	lock_mutex(&pidns_helpers_mutex);
+	if (h->dead && h->hashed)
+		pidns_helper_unhash(h);
+	last = --h->refcount == 0;
+	unlock_mutex(&pidns_helpers_mutex);
+
+	if (last)
+		pidns_helper_free(h);
+}
+
+/*
+ * Return a referenced helper for @task, whose /proc/$task/ns/pid has inode
+ * number @ino, spawning one if needed.  Drop it with pidns_helper_put().
+ */
+static struct pidns_helper *pidns_helper_get(pid_t task, ino_t ino)
+{
+	struct pidns_helper *h, *new;
+
+	lock_mutex(&pidns_helpers_mutex);
+	for (h = pidns_helpers[HASH(ino)]; h; h = h->next) {
+		if (h->ino == ino && !h->dead) {
+			h->refcount++;
+			unlock_mutex(&pidns_helpers_mutex);
+			return h;
+		}
+	}
+	unlock_mutex(&pidns_helpers_mutex);
+
+	new = pidns_helper_spawn(task, ino);
+	if (!new)
+		return NULL;
+
+	/* Someone may have raced us to it. */
+	lock_mutex(&pidns_helpers_mutex);
+	for (h = pidns_helpers[HASH(ino)]; h; h = h->next) {
+		if (h->ino == ino && !h->dead) {
+			h->refcount++;
+			unlock_mutex(&pidns_helpers_mutex);
+			pidns_helper_free(new);
+			return h;
+		}
+	}
+	new->hashed = true;
+	new->refcount++;
+	new->next = pidns_helpers[HASH(ino)];
+	pidns_helpers[HASH(ino)] = new;
+	/* The watcher holds a reference until the helper dies. */
+	new->refcount++;
+	if (!pidns_watch_add(new->sock, EPOLLRDHUP, PIDNS_WATCH_HELPER(new)))
+		new->refcount--;
+	unlock_mutex(&pidns_helpers_mutex);
+
+	return new;
+}
+
+/* Called by the watcher once @h hung up. */
+static void pidns_helper_died(struct pidns_helper *h)
+{
+	lock_mutex(&pidns_helpers_mutex);
+	h->dead = true;
+	unlock_mutex(&pidns_helpers_mutex);
+
+	pidns_helper_put(h);
+}
+
+/*
+ * Mark @h dead after a failed exchange, it is reaped once the last reference
+ * is dropped.  Must be called with @h->lock held.
+ */
+static int pidns_helper_fail(struct pidns_helper *h, int ret)
+{
+	lxcfs_error("Pid namespace helper %d failed: %s.\n", h->pid, strerror(-ret));
+	h->dead = true;
+	return ret;
+}
+
+static int pidns_helper_initpid(struct pidns_helper *h, pid_t *answer)
+{
+	struct pidns_helper_msg m = { .op = PIDNS_HELPER_INITPID };
+	struct ucred cred;
+	ssize_t ret;
+
+	lock_mutex(&h->lock);
+	if (h->dead) {
+		ret = -EPIPE;
+		goto out;
+	}
+
+	ret = pidns_sendmsg(h->sock, &m, NULL);
+	if (ret < 0) {
+		pidns_helper_fail(h, ret);
+		goto out;
+	}
+
+	ret = pidns_recvmsg(h->sock, &m, sizeof(m), &cred);
+	if (ret >= 0 && (ret != sizeof(m) || m.op < 0 || cred.pid <= 0))
+		ret = -EBADMSG;
+	if (ret < 0) {
+		pidns_helper_fail(h, ret);
+		goto out;
+	}
+
+	*answer = cred.pid;
+	ret = 0;
+
+out:
+	unlock_mutex(&h->lock);
+	return ret;
+}
+
+/*
+ * Have @h translate @n <= PIDNS_HELPER_BATCH pids, in place, in direction
+ * @op.  Entries become 0 if the pid is not visible on the other side and -1
+ * if it does not exist on ours.
+ */
+static int pidns_helper_batch(struct pidns_helper *h, int op, pid_t *pids, int n)
+{
+	struct pidns_msgvec *v;
+	struct pidns_helper_pids reply;
+	struct ucred cred = { .uid = 0, .gid = 0 };
+	ssize_t ret;
+	int i, r;
+	bool done = false;
+
+	do {
+		v = malloc(sizeof(*v));
+	} while (!v);
+
+	lock_mutex(&h->lock);
+	if (h->dead) {
+		ret = -EPIPE;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		v->msgs[i].op = op;
+		v->msgs[i].index = i;
+		v->msgs[i].pid = pids[i];
+		cred.pid = pids[i];
+		pidns_msgvec_init(v, i, op == PIDNS_HELPER_TO_NS ? &cred : NULL);
+	}
+	v->msgs[n].op = PIDNS_HELPER_END;
+	v->msgs[n].index = n;
+	v->msgs[n].pid = 0;
+	pidns_msgvec_init(v, n, NULL);
+
+	ret = pidns_sendmmsg(h->sock, v, n + 1);
+	if (ret < 0)
+		goto fail;
+
+	if (op == PIDNS_HELPER_TO_NS) {
+		ret = pidns_recvmsg(h->sock, &reply, sizeof(reply), &cred);
+		if (ret < 0)
+			goto fail;
+		if (ret != sizeof(reply) || reply.hdr.op != PIDNS_HELPER_END ||
+		    reply.hdr.index != n) {
+			ret = -EBADMSG;
+			goto fail;
+		}
+		/* Those we could not send ucreds for are gone. */
+		for (i = 0; i < n; i++)
+			pids[i] = v->msgs[i].op == -ESRCH ? -1 : reply.pids[i];
+		ret = 0;
+		goto out;
+	}
+
+	while (!done) {
+		r = pidns_recvmmsg(h->sock, v, n + 1);
+		if (r < 0) {
+			ret = r;
+			goto fail;
+		}
+		for (i = 0; i < r; i++) {
+			struct pidns_helper_msg *m = &v->msgs[i];
+
+			if (v->vec[i].msg_len != sizeof(*m) ||
+			    (m->op != PIDNS_HELPER_END && (m->index < 0 || m->index >= n))) {
+				ret = -EBADMSG;
+				goto fail;
+			}
+			if (m->op == PIDNS_HELPER_END) {
+				done = true;
+				break;
+			}
+			pidns_get_cred(&v->vec[i].msg_hdr, &cred);
+			pids[m->index] = m->op < 0 ? -1 : cred.pid;
+		}
+	}
+	ret = 0;
+	goto out;
+
+fail:
+	pidns_helper_fail(h, ret);
+out:
+	unlock_mutex(&h->lock);
+	free(v);
+	return ret;
+}
+
+/* Reap helpers whose namespace has gone away. */
+static void prune_pidns_helpers(void)
+{
+	struct pidns_helper *h, *next, *reap = NULL;
+	struct pollfd pfd;
+	int i;
+
+	lock_mutex(&pidns_helpers_mutex);
+	for (i = 0; i < PIDNS_HASH_SIZE; i++) {
+		for (h = pidns_helpers[i]; h; h = next) {
+			next = h->next;
+			pfd.fd = h->sock;
+			pfd.events = POLLIN;
+			if (!h->dead && (poll(&pfd, 1, 0) <= 0 ||
+			    !(pfd.revents & (POLLHUP | POLLERR | POLLNVAL))))
+				continue;
+			h->dead = true;
+			pidns_helper_unhash(h);
+			if (h->refcount == 0) {
+				h->next = reap;
+				reap = h;
+			}
+		}
+	}
+	unlock_mutex(&pidns_helpers_mutex);
+
+	for (h = reap; h; h = next) {
+		next = h->next;
+		pidns_helper_free(h);
+	}
+}
+
+static void free_pidns_helpers(void)
+{
+	struct pidns_helper *h, *next;
+	int i;
+
+	lock_mutex(&pidns_helpers_mutex);
+	for (i = 0; i < PIDNS_HASH_SIZE; i++) {
+		for (h = pidns_helpers[i]; h; h = next) {
+			next = h->next;
+			pidns_helper_free(h);
+		}
+		pidns_helpers[i] = NULL;
+	}
+	unlock_mutex(&pidns_helpers_mutex);
+}
+
+static pid_t get_init_pid_for_task(pid_t task, struct stat *nssb)
+{
+	struct pidns_helper *h;
+	pid_t answer;
+	int tries, ret;
+
+	if (nssb->st_ino == host_pidns_ino)
+		return 1;
+
+	/* A dead helper means a stale namespace inode; retry once. */
+	for (tries = 0; tries < 2; tries++) {
+		h = pidns_helper_get(task, nssb->st_ino);
+		if (!h)
+			return -1;
+		ret = pidns_helper_initpid(h, &answer);
+		pidns_helper_put(h);
+		if (ret == 0)
+			return answer;
+	}
+
+	return -1;
+}
+
+/*
+ * Pid translation.
+ *
+ * Going from our namespace into a container's is done without any help from
+ * inside the container: the NSpid: line of /proc/$pid/status lists the pid
+ * in every namespace from ours down to the task's own.  Only when that is
+ * not conclusive (kernels before 4.1 have no NSpid, and tasks in namespaces
+ * nested below the target's need the kernel to tell whether they are
+ * visible) and for the reverse direction do we fall back to the pid
+ * namespace helper, which is spawned lazily.
+ */
+struct pid_xlate {
+	pid_t task;                     // a task in the target namespace
+	ino_t ino;                      // inode number for /proc/$task/ns/pid
+	int depth;                      // entries in @task's NSpid line, 0 if unknown
+	bool same_ns;                   // @task shares our pid namespace
+	struct pidns_helper *helper;
+};
+
+#define NSPID_MAX 32 /* MAX_PID_NS_LEVEL */
+
+/*
+ * Parse the NSpid: line of /proc/@pid/status into @nspids.  Returns the
+ * number of entries, 0 if there is no such line, or -errno.
+ */
+static int read_nspids(pid_t pid, pid_t *nspids)
+{
+	char fnam[100], buf[4096], *p, *end;
+	ssize_t len;
+	int fd, n = 0;
+
+	snprintf(fnam, 100, "/proc/%d/status", pid);
+	fd = open(fnam, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+
+	p = strstr(buf, "\nNSpid:");
+	if (!p)
+		return 0;
+	p += 7;
+	while (n < NSPID_MAX) {
+		long v = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		nspids[n++] = v;
+		p = end;
+		if (*p == '\n')
+			break;
+	}
+
+	return n;
+}
+
+static int pid_xlate_init(struct pid_xlate *x, pid_t task)
+{
+	pid_t nspids[NSPID_MAX];
+	struct stat sb;
+	char fnam[100];
+
+	memset(x, 0, sizeof(*x));
+	x->task = task;
+
+	snprintf(fnam, 100, "/proc/%d/ns/pid", task);
+	if (stat(fnam, &sb) < 0)
+		return -errno;
+	x->ino = sb.st_ino;
+	x->same_ns = sb.st_ino == host_pidns_ino;
+	if (!x->same_ns)
+		x->depth = MAX(read_nspids(task, nspids), 0);
+
+	return 0;
+}
+
+static void pid_xlate_fini(struct pid_xlate *x)
+{
+	pidns_helper_put(x->helper);
+	x->helper = NULL;
+}
+
+/* Have the helper translate pids[idx[0]] ... pids[idx[n - 1]] in place. */
+static int pid_xlate_helper(struct pid_xlate *x, int op, pid_t *pids, const int *idx, int n)
+{
+	pid_t batch[PIDNS_HELPER_BATCH];
+	int i, ret;
+
+	if (!x->helper) {
+		x->helper = pidns_helper_get(x->task, x->ino);
+		if (!x->helper)
+			return -ECHILD;
+	}
+
+	for (i = 0; i < n; i++)
+		batch[i] = pids[idx[i]];
+	ret = pidns_helper_batch(x->helper, op, batch, n);
+	if (ret < 0)
+		return ret;
+	for (i = 0; i < n; i++)
+		pids[idx[i]] = batch[i];
+
+	return 0;
+}
+
+/*
+ * Translate @pid into @x's namespace from its NSpid line.  Returns false
+ * if that is not conclusive and the helper needs to be asked.
+ */
+static bool pid_to_ns_nspid(struct pid_xlate *x, pid_t *pid)
+{
+	pid_t nspids[NSPID_MAX];
+	struct stat sb;
+	char fnam[100];
+	int n;
+
+	n = read_nspids(*pid, nspids);
+	if (n == -ENOENT) {
+		*pid = -1;
+		return true;
+	}
+	if (n <= 0)
+		return false;
+
+	/* Not nested deep enough to live in @x's namespace. */
+	if (n < x->depth) {
+		*pid = 0;
+		return true;
+	}
+
+	snprintf(fnam, 100, "/proc/%d/ns/pid", *pid);
+	if (stat(fnam, &sb) < 0) {
+		*pid = -1;
+		return true;
+	}
+	if (sb.st_ino == x->ino) {
+		*pid = nspids[x->depth - 1];
+		return true;
+	}
+
+	/* A sibling namespace at the same level. */
+	if (n == x->depth) {
+		*pid = 0;
+		return true;
+	}
+
+	/* Possibly a namespace nested below @x's, let the kernel decide. */
+	return false;
+}
+
+/*
+ * Translate @n pids from our namespace into @x's, in place.  Entries become
+ * 0 if the pid is not visible there and -1 if it does not exist.
+ */
+static int pids_to_ns(struct pid_xlate *x, pid_t *pids, int n)
+{
+	int idx[PIDNS_HELPER_BATCH];
+	int i, ret, pending = 0;
+
+	if (x->same_ns)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (x->depth && pid_to_ns_nspid(x, &pids[i]))
+			continue;
+
+		idx[pending++] = i;
+		if (pending < PIDNS_HELPER_BATCH)
+			continue;
+		ret = pid_xlate_helper(x, PIDNS_HELPER_TO_NS, pids, idx, pending);
+		if (ret < 0)
+			return ret;
+		pending = 0;
+	}
+
+	if (pending)
+		return pid_xlate_helper(x, PIDNS_HELPER_TO_NS, pids, idx, pending);
+	return 0;
+}
+
+/*
+ * Translate @n pids from @x's namespace into ours, in place.  Entries become
+ * -1 if there is no such pid in @x's namespace.
+ */
+static int pids_from_ns(struct pid_xlate *x, pid_t *pids, int n)
+{
+	int idx[PIDNS_HELPER_BATCH];
+	int i, ret, chunk;
+
+	if (x->same_ns)
+		return 0;
+
+	for (i = 0; i < PIDNS_HELPER_BATCH; i++)
+		idx[i] = i;
+
+	for (i = 0; i < n; i += chunk) {
+		chunk = MIN(n - i, PIDNS_HELPER_BATCH);
+		ret = pid_xlate_helper(x, PIDNS_HELPER_FROM_NS, pids + i, idx, chunk);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the init of @qpid's pid namespace.  @sb receives the namespace's
+ * stat(2) info and @ctime the creation time of init, which together
+ * identify the container.
+ */
+static pid_t lookup_initpid(pid_t qpid, struct stat *sb, long int *ctime)
+{
+	pid_t answer = 0;
+	char fnam[100];
+
+	snprintf(fnam, 100, "/proc/%d/ns/pid", qpid);
+	if (stat(fnam, sb) < 0)
+		goto out;
+	if (lookup_verify_initpid(sb, &answer, ctime))
+		goto out;
+	answer = get_init_pid_for_task(qpid, sb);
+	if (answer > 0)
+		*ctime = save_initpid(sb, answer);
+
+out:
+	/* we prune at end in case we are returning
+	 * the value we were about to return */
+	prune_initpid_store();
+	return answer;
+}
+
+pid_t lookup_initpid_in_store(pid_t qpid)
+{
+	struct stat sb;
+	long int ctime;
+
+	return lookup_initpid(qpid, &sb, &ctime);
+}
+
+static int wait_for_pid(pid_t pid)
+{
+	int status, ret;
+
+	if (pid <= 0)
+		return -1;
+
+again:
+	ret = waitpid(pid, &status, 0);
+	if (ret == -1) {
+		if (errno == EINTR)
+			goto again;
+		return -1;
+	}
+	if (ret != pid)
+		goto again;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * append the given formatted string to *src.
+ * src: a pointer to a char* in which to append the formatted string.
+ * sz: the number of characters printed so far, minus trailing \0.
+ * asz: the allocated size so far
+ * format: string format. See printf for details.
+ * ...: varargs. See printf for details.
+ */
+static void must_strcat(char **src, size_t *sz, size_t *asz, const char *format, ...)
+{
+	char tmp[BUF_RESERVE_SIZE];
+	va_list		args;
+
+	va_start (args, format);
+	int tmplen = vsnprintf(tmp, BUF_RESERVE_SIZE, format, args);
+	va_end(args);
 
 	if (!*src || tmplen + *sz + 1 >= *asz) {
 		char *tmp;
@@ -1679,6 +3483,129 @@ out:
 	return answer;
 }
 
+/*
+ * Read the cgroups of @pid in all mounted hierarchies in one go, indexed like
+ * @hierarchies and with the init slice already pruned.
+ */
+static char **get_pid_cgroups(pid_t pid)
+{
+	char fnam[PROCLEN];
+	FILE *f;
+	char **cgroups;
+	char *line = NULL;
+	size_t len = 0;
+	int i, ret;
+
+	ret = snprintf(fnam, PROCLEN, "/proc/%d/cgroup", pid);
+	if (ret < 0 || ret >= PROCLEN)
+		return NULL;
+	if (!(f = fopen(fnam, "r")))
+		return NULL;
+
+	do {
+		cgroups = calloc(num_hierarchies, sizeof(char *));
+	} while (!cgroups);
+
+	while (getline(&line, &len, f) != -1) {
+		char *c1, *c2;
+		if (!line[0])
+			continue;
+		c1 = strchr(line, ':');
+		if (!c1)
+			break;
+		c1++;
+		c2 = strchr(c1, ':');
+		if (!c2)
+			break;
+		*c2 = '\0';
+		c2++;
+		stripnewline(c2);
+		for (i = 0; i < num_hierarchies; i++) {
+			if (!hierarchies[i] || cgroups[i])
+				continue;
+			if (strcmp(c1, hierarchies[i]) != 0)
+				continue;
+			cgroups[i] = must_copy_string(c2);
+			prune_init_slice(cgroups[i]);
+			break;
+		}
+	}
+
+	fclose(f);
+	free(line);
+	return cgroups;
+}
+
+/*
+ * Return the cgroup of the container @qpid lives in for controller @ctrl,
+ * that is the cgroup of its pid namespace's init with the init slice pruned.
+ * @initpid, if not NULL, is set to that init, or to @qpid if it could not be
+ * found.  All hierarchies are read at once and cached with the init-pid
+ * store entry, so that the handlers serving one container share a single
+ * parse of /proc/$initpid/cgroup.
+ */
+char *get_container_cgroup(pid_t qpid, enum lxcfs_ctrl_t ctrl, pid_t *initpid)
+{
+	char **cgroups;
+	char *cg = NULL;
+	struct stat sb;
+	long int ctime = 0;
+	pid_t pid;
+	int idx;
+
+	pid = lookup_initpid(qpid, &sb, &ctime);
+	if (pid <= 0)
+		pid = qpid;
+	if (initpid)
+		*initpid = pid;
+
+	idx = ctrl_table[ctrl].hier;
+	if (idx < 0)
+		return NULL;
+
+	if (ctime && lookup_initpid_cgroup(sb.st_ino, ctime, idx, &cg))
+		return cg;
+
+	cgroups = get_pid_cgroups(pid);
+	if (!cgroups)
+		return NULL;
+	cg = must_copy_string(cgroups[idx]);
+	if (!ctime || !save_initpid_cgroups(sb.st_ino, ctime, cgroups))
+		free_pid_cgroups(cgroups);
+
+	return cg;
+}
+
+/*
+ * Return the cpuset.cpus of the cpuset cgroup @cg of the container @qpid
+ * lives in, compiled into a cpumask which must be freed.  Like the cgroups,
+ * it is cached with the init-pid store entry, so that the handlers serving
+ * one container only read and parse it once every CGROUP_CACHE_SECS.
+ */
+struct cpumask *get_container_cpumask(pid_t qpid, const char *cg)
+{
+	struct cpumask *mask = NULL;
+	struct stat sb;
+	long int ctime = 0;
+	char *cpuset;
+
+	if (lookup_initpid(qpid, &sb, &ctime) <= 0)
+		ctime = 0;
+
+	if (ctime && lookup_initpid_cpumask(sb.st_ino, ctime, cg, &mask))
+		return mask;
+
+	cpuset = get_cpuset(cg);
+	if (!cpuset)
+		return NULL;
+	mask = cpumask_parse(cpuset);
+	free(cpuset);
+	if (mask && ctime)
+		save_initpid_cpumask(sb.st_ino, ctime, cg, mask);
+
+	return mask;
+}
+
 /*
  * check whether a fuse context may access a cgroup dir or file
  *
@@ -1914,7 +3841,7 @@ static void get_cgdir_and_path(const char *cg, char **dir, char **last)
 int cg_getattr(const char *path, struct stat *sb)
 {
 	struct timespec now;
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	char * cgdir = NULL;
 	char *last = NULL, *path1, *path2;
 	struct cgfs_files *k = NULL;
@@ -2023,7 +3950,7 @@ out:
 
 int cg_opendir(const char *path, struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	const char *cgroup;
 	struct file_info *dir_info;
 	char *controller = NULL;
@@ -2058,7 +3985,7 @@ int cg_opendir(const char *path, struct fuse_file_info *fi)
 	}
 
 	/* we'll free this at cg_releasedir */
-	dir_info = malloc(sizeof(*dir_info));
+	dir_info = buf_pool_alloc(sizeof(*dir_info), NULL);
 	if (!dir_info)
 		return -ENOMEM;
 	dir_info->controller = must_copy_string(controller);
@@ -2079,7 +4006,7 @@ int cg_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
 	struct cgfs_files **list = NULL;
 	int i, ret;
 	char *nextcg = NULL;
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	char **clist = NULL;
 
 	if (filler(buf, ".", NULL, 0) != 0 || filler(buf, "..", NULL, 0) != 0)
@@ -2171,9 +4098,9 @@ void do_release_file_info(struct fuse_file_info *fi)
 	f->cgroup = NULL;
 	free(f->file);
 	f->file = NULL;
-	free(f->buf);
+	buf_pool_free(f->buf, f->buflen);
 	f->buf = NULL;
-	free(f);
+	buf_pool_free(f, sizeof(*f));
 	f = NULL;
 }
 
@@ -2189,7 +4116,7 @@ int cg_open(const char *path, struct fuse_file_info *fi)
 	char *last = NULL, *path1, *path2, * cgdir = NULL, *controller;
 	struct cgfs_files *k = NULL;
 	struct file_info *file_info;
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	int ret;
 
 	if (!fc)
@@ -2231,7 +4158,7 @@ int cg_open(const char *path, struct fuse_file_info *fi)
 	}
 
 	/* we'll free this at cg_release */
-	file_info = malloc(sizeof(*file_info));
+	file_info = buf_pool_alloc(sizeof(*file_info), NULL);
 	if (!file_info) {
 		ret = -ENOMEM;
 		goto out;
@@ -2258,7 +4185,7 @@ int cg_access(const char *path, int mode)
 	char *path1, *path2, *controller;
 	char *last = NULL, *cgdir = NULL;
 	struct cgfs_files *k = NULL;
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 
 	if (strcmp(path, "/cgroup") == 0)
 		return 0;
@@ -2312,364 +4239,85 @@ int cg_access(const char *path, int mode)
 
 out:
 	free(cgdir);
-	return ret;
-}
-
-int cg_release(const char *path, struct fuse_file_info *fi)
-{
-	do_release_file_info(fi);
-	return 0;
-}
-
-#define POLLIN_SET ( EPOLLIN | EPOLLHUP | EPOLLRDHUP )
-
-static bool wait_for_sock(int sock, int timeout)
-{
-	struct epoll_event ev;
-	int epfd, ret, now, starttime, deltatime, saved_errno;
-
-	if ((starttime = time(NULL)) < 0)
-		return false;
-
-	if ((epfd = epoll_create(1)) < 0) {
-		lxcfs_error("%s\n", "Failed to create epoll socket: %m.");
-		return false;
-	}
-
-	ev.events = POLLIN_SET;
-	ev.data.fd = sock;
-	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
-		lxcfs_error("%s\n", "Failed adding socket to epoll: %m.");
-		close(epfd);
-		return false;
-	}
-
-again:
-	if ((now = time(NULL)) < 0) {
-		close(epfd);
-		return false;
-	}
-
-	deltatime = (starttime + timeout) - now;
-	if (deltatime < 0) { // timeout
-		errno = 0;
-		close(epfd);
-		return false;
-	}
-	ret = epoll_wait(epfd, &ev, 1, 1000*deltatime + 1);
-	if (ret < 0 && errno == EINTR)
-		goto again;
-	saved_errno = errno;
-	close(epfd);
-
-	if (ret <= 0) {
-		errno = saved_errno;
-		return false;
-	}
-	return true;
-}
-
-static int msgrecv(int sockfd, void *buf, size_t len)
-{
-	if (!wait_for_sock(sockfd, 2))
-		return -1;
-	return recv(sockfd, buf, len, MSG_DONTWAIT);
-}
-
-static int send_creds(int sock, struct ucred *cred, char v, bool pingfirst)
-{
-	struct msghdr msg = { 0 };
-	struct iovec iov;
-	struct cmsghdr *cmsg;
-	char cmsgbuf[CMSG_SPACE(sizeof(*cred))];
-	char buf[1];
-	buf[0] = 'p';
-
-	if (pingfirst) {
-		if (msgrecv(sock, buf, 1) != 1) {
-			lxcfs_error("%s\n", "Error getting reply from server over socketpair.");
-			return SEND_CREDS_FAIL;
-		}
-	}
-
-	msg.msg_control = cmsgbuf;
-	msg.msg_controllen = sizeof(cmsgbuf);
-
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_CREDENTIALS;
-	memcpy(CMSG_DATA(cmsg), cred, sizeof(*cred));
-
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-
-	buf[0] = v;
-	iov.iov_base = buf;
-	iov.iov_len = sizeof(buf);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-
-	if (sendmsg(sock, &msg, 0) < 0) {
-		lxcfs_error("Failed at sendmsg: %s.\n",strerror(errno));
-		if (errno == 3)
-			return SEND_CREDS_NOTSK;
-		return SEND_CREDS_FAIL;
-	}
-
-	return SEND_CREDS_OK;
-}
-
-static bool recv_creds(int sock, struct ucred *cred, char *v)
-{
-	struct msghdr msg = { 0 };
-	struct iovec iov;
-	struct cmsghdr *cmsg;
-	char cmsgbuf[CMSG_SPACE(sizeof(*cred))];
-	char buf[1];
-	int ret;
-	int optval = 1;
-
-	*v = '1';
-
-	cred->pid = -1;
-	cred->uid = -1;
-	cred->gid = -1;
-
-	if (setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &optval, sizeof(optval)) == -1) {
-		lxcfs_error("Failed to set passcred: %s\n", strerror(errno));
-		return false;
-	}
-	buf[0] = '1';
-	if (write(sock, buf, 1) != 1) {
-		lxcfs_error("Failed to start write on scm fd: %s\n", strerror(errno));
-		return false;
-	}
-
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-	msg.msg_control = cmsgbuf;
-	msg.msg_controllen = sizeof(cmsgbuf);
-
-	iov.iov_base = buf;
-	iov.iov_len = sizeof(buf);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-
-	if (!wait_for_sock(sock, 2)) {
-		lxcfs_error("Timed out waiting for scm_cred: %s\n", strerror(errno));
-		return false;
-	}
-	ret = recvmsg(sock, &msg, MSG_DONTWAIT);
-	if (ret < 0) {
-		lxcfs_error("Failed to receive scm_cred: %s\n", strerror(errno));
-		return false;
-	}
-
-	cmsg = CMSG_FIRSTHDR(&msg);
-
-	if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred)) &&
-			cmsg->cmsg_level == SOL_SOCKET &&
-			cmsg->cmsg_type == SCM_CREDENTIALS) {
-		memcpy(cred, CMSG_DATA(cmsg), sizeof(*cred));
-	}
-	*v = buf[0];
-
-	return true;
-}
-
-struct pid_ns_clone_args {
-	int *cpipe;
-	int sock;
-	pid_t tpid;
-	int (*wrapped) (int, pid_t); // pid_from_ns or pid_to_ns
-};
-
-/*
- * pid_ns_clone_wrapper - wraps pid_to_ns or pid_from_ns for usage
- * with clone(). This simply writes '1' as ACK back to the parent
- * before calling the actual wrapped function.
- */
-static int pid_ns_clone_wrapper(void *arg) {
-	struct pid_ns_clone_args* args = (struct pid_ns_clone_args *) arg;
-	char b = '1';
-
-	close(args->cpipe[0]);
-	if (write(args->cpipe[1], &b, sizeof(char)) < 0)
-		lxcfs_error("(child): error on write: %s.\n", strerror(errno));
-	close(args->cpipe[1]);
-	return args->wrapped(args->sock, args->tpid);
+	return ret;
 }
 
-/*
- * pid_to_ns - reads pids from a ucred over a socket, then writes the
- * int value back over the socket.  This shifts the pid from the
- * sender's pidns into tpid's pidns.
- */
-static int pid_to_ns(int sock, pid_t tpid)
+int cg_release(const char *path, struct fuse_file_info *fi)
 {
-	char v = '0';
-	struct ucred cred;
-
-	while (recv_creds(sock, &cred, &v)) {
-		if (v == '1')
-			return 0;
-		if (write(sock, &cred.pid, sizeof(pid_t)) != sizeof(pid_t))
-			return 1;
-	}
+	do_release_file_info(fi);
 	return 0;
 }
 
-
-/*
- * pid_to_ns_wrapper: when you setns into a pidns, you yourself remain
- * in your old pidns.  Only children which you clone will be in the target
- * pidns.  So the pid_to_ns_wrapper does the setns, then clones a child to
- * actually convert pids.
- *
- * Note: glibc's fork() does not respect pidns, which can lead to failed
- * assertions inside glibc (and thus failed forks) if the child's pid in
- * the pidns and the parent pid outside are identical. Using clone prevents
- * this issue.
- */
-static void pid_to_ns_wrapper(int sock, pid_t tpid)
+/* Parse the whitespace separated pids in @buf into a new array in @pids. */
+static int parse_pids(const char *buf, pid_t **pids)
 {
-	int newnsfd = -1, ret, cpipe[2];
-	char fnam[100];
-	pid_t cpid;
-	char v;
-
-	ret = snprintf(fnam, sizeof(fnam), "/proc/%d/ns/pid", tpid);
-	if (ret < 0 || ret >= sizeof(fnam))
-		_exit(1);
-	newnsfd = open(fnam, O_RDONLY);
-	if (newnsfd < 0)
-		_exit(1);
-	if (setns(newnsfd, 0) < 0)
-		_exit(1);
-	close(newnsfd);
-
-	if (pipe(cpipe) < 0)
-		_exit(1);
-
-	struct pid_ns_clone_args args = {
-		.cpipe = cpipe,
-		.sock = sock,
-		.tpid = tpid,
-		.wrapped = &pid_to_ns
-	};
-	size_t stack_size = sysconf(_SC_PAGESIZE);
-	void *stack = alloca(stack_size);
+	const char *ptr = buf;
+	pid_t qpid, *tmp;
+	int n = 0, alloced = 0;
 
-	cpid = clone(pid_ns_clone_wrapper, stack + stack_size, SIGCHLD, &args);
-	if (cpid < 0)
-		_exit(1);
+	*pids = NULL;
+	while (sscanf(ptr, "%d", &qpid) == 1) {
+		if (n == alloced) {
+			alloced += PIDNS_HELPER_BATCH;
+			do {
+				tmp = realloc(*pids, alloced * sizeof(pid_t));
+			} while (!tmp);
+			*pids = tmp;
+		}
+		(*pids)[n++] = qpid;
 
-	// give the child 1 second to be done forking and
-	// write its ack
-	if (!wait_for_sock(cpipe[0], 1))
-		_exit(1);
-	ret = read(cpipe[0], &v, 1);
-	if (ret != sizeof(char) || v != '1')
-		_exit(1);
+		ptr = strchr(ptr, '\n');
+		if (!ptr)
+			break;
+		ptr++;
+	}
 
-	if (!wait_for_pid(cpid))
-		_exit(1);
-	_exit(0);
+	return n;
 }
 
 /*
- * To read cgroup files with a particular pid, we will setns into the child
- * pidns, open a pipe, fork a child - which will be the first to really be in
- * the child ns - which does the cgfs_get_value and writes the data to the pipe.
+ * To read cgroup files with a particular pid, we read the pids as seen from
+ * our namespace and translate them into @tpid's pid namespace.  Pids which
+ * are not visible there are left out.
  */
 bool do_read_pids(pid_t tpid, const char *contrl, const char *cg, const char *file, char **d)
 {
-	int sock[2] = {-1, -1};
+	struct pid_xlate x;
 	char *tmpdata = NULL;
-	int ret;
-	pid_t qpid, cpid = -1;
-	bool answer = false;
-	char v = '0';
-	struct ucred cred;
+	pid_t *pids = NULL;
+	bool ret = false;
 	size_t sz = 0, asz = 0;
+	int i, n;
 
 	if (!cgfs_get_value(contrl, cg, file, &tmpdata))
 		return false;
 
-	/*
-	 * Now we read the pids from returned data one by one, pass
-	 * them into a child in the target namespace, read back the
-	 * translated pids, and put them into our to-return data
-	 */
-
-	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sock) < 0) {
-		perror("socketpair");
+	if (pid_xlate_init(&x, tpid) < 0) {
 		free(tmpdata);
 		return false;
 	}
 
-	cpid = fork();
-	if (cpid == -1)
+	n = parse_pids(tmpdata, &pids);
+	if (pids_to_ns(&x, pids, n) < 0)
 		goto out;
 
-	if (!cpid) // child - exits when done
-		pid_to_ns_wrapper(sock[1], tpid);
-
-	char *ptr = tmpdata;
-	cred.uid = 0;
-	cred.gid = 0;
-	while (sscanf(ptr, "%d\n", &qpid) == 1) {
-		cred.pid = qpid;
-		ret = send_creds(sock[0], &cred, v, true);
-
-		if (ret == SEND_CREDS_NOTSK)
-			goto next;
-		if (ret == SEND_CREDS_FAIL)
-			goto out;
-
-		// read converted results
-		if (!wait_for_sock(sock[0], 2)) {
-			lxcfs_error("Timed out waiting for pid from child: %s.\n", strerror(errno));
-			goto out;
-		}
-		if (read(sock[0], &qpid, sizeof(qpid)) != sizeof(qpid)) {
-			lxcfs_error("Error reading pid from child: %s.\n", strerror(errno));
-			goto out;
-		}
-		must_strcat_pid(d, &sz, &asz, qpid);
-next:
-		ptr = strchr(ptr, '\n');
-		if (!ptr)
-			break;
-		ptr++;
-	}
-
-	cred.pid = getpid();
-	v = '1';
-	if (send_creds(sock[0], &cred, v, true) != SEND_CREDS_OK) {
-		// failed to ask child to exit
-		lxcfs_error("Failed to ask child to exit: %s.\n", strerror(errno));
-		goto out;
-	}
+	for (i = 0; i < n; i++)
+		if (pids[i] > 0)
+			must_strcat_pid(d, &sz, &asz, pids[i]);
 
-	answer = true;
+	ret = true;
 
 out:
+	pid_xlate_fini(&x);
+	free(pids);
 	free(tmpdata);
-	if (cpid != -1)
-		wait_for_pid(cpid);
-	if (sock[0] != -1) {
-		close(sock[0]);
-		close(sock[1]);
-	}
-	return answer;
+	return ret;
 }
 
 int cg_read(const char *path, char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	struct file_info *f = (struct file_info *)fi->fh;
 	struct cgfs_files *k = NULL;
 	char *data = NULL;
@@ -2733,84 +4381,6 @@ out:
 	return ret;
 }
 
-static int pid_from_ns(int sock, pid_t tpid)
-{
-	pid_t vpid;
-	struct ucred cred;
-	char v;
-	int ret;
-
-	cred.uid = 0;
-	cred.gid = 0;
-	while (1) {
-		if (!wait_for_sock(sock, 2)) {
-			lxcfs_error("%s\n", "Timeout reading from parent.");
-			return 1;
-		}
-		if ((ret = read(sock, &vpid, sizeof(pid_t))) != sizeof(pid_t)) {
-			lxcfs_error("Bad read from parent: %s.\n", strerror(errno));
-			return 1;
-		}
-		if (vpid == -1) // done
-			break;
-		v = '0';
-		cred.pid = vpid;
-		if (send_creds(sock, &cred, v, true) != SEND_CREDS_OK) {
-			v = '1';
-			cred.pid = getpid();
-			if (send_creds(sock, &cred, v, false) != SEND_CREDS_OK)
-				return 1;
-		}
-	}
-	return 0;
-}
-
-static void pid_from_ns_wrapper(int sock, pid_t tpid)
-{
-	int newnsfd = -1, ret, cpipe[2];
-	char fnam[100];
-	pid_t cpid;
-	char v;
-
-	ret = snprintf(fnam, sizeof(fnam), "/proc/%d/ns/pid", tpid);
-	if (ret < 0 || ret >= sizeof(fnam))
-		_exit(1);
-	newnsfd = open(fnam, O_RDONLY);
-	if (newnsfd < 0)
-		_exit(1);
-	if (setns(newnsfd, 0) < 0)
-		_exit(1);
-	close(newnsfd);
-
-	if (pipe(cpipe) < 0)
-		_exit(1);
-
-	struct pid_ns_clone_args args = {
-		.cpipe = cpipe,
-		.sock = sock,
-		.tpid = tpid,
-		.wrapped = &pid_from_ns
-	};
-	size_t stack_size = sysconf(_SC_PAGESIZE);
-	void *stack = alloca(stack_size);
-
-	cpid = clone(pid_ns_clone_wrapper, stack + stack_size, SIGCHLD, &args);
-	if (cpid < 0)
-		_exit(1);
-
-	// give the child 1 second to be done forking and
-	// write its ack
-	if (!wait_for_sock(cpipe[0], 1))
-		_exit(1);
-	ret = read(cpipe[0], &v, 1);
-	if (ret != sizeof(char) || v != '1')
-		_exit(1);
-
-	if (!wait_for_pid(cpid))
-		_exit(1);
-	_exit(0);
-}
-
 /*
  * Given host @uid, return the uid to which it maps in
  * @pid's user namespace, or -1 if none.
@@ -2901,75 +4471,40 @@ bool may_move_pid(pid_t r, uid_t r_uid, pid_t v)
 static bool do_write_pids(pid_t tpid, uid_t tuid, const char *contrl, const char *cg,
 		const char *file, const char *buf)
 {
-	int sock[2] = {-1, -1};
-	pid_t qpid, cpid = -1;
+	struct pid_xlate x;
+	pid_t *pids = NULL;
 	FILE *pids_file = NULL;
 	bool answer = false, fail = false;
+	int i, n;
 
-	pids_file = open_pids_file(contrl, cg);
-	if (!pids_file)
+	if (pid_xlate_init(&x, tpid) < 0)
 		return false;
 
-	/*
-	 * write the pids to a socket, have helper in writer's pidns
-	 * call movepid for us
-	 */
-	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sock) < 0) {
-		perror("socketpair");
+	pids_file = open_pids_file(contrl, cg);
+	if (!pids_file)
 		goto out;
-	}
 
-	cpid = fork();
-	if (cpid == -1)
+	n = parse_pids(buf, &pids);
+	if (pids_from_ns(&x, pids, n) < 0)
 		goto out;
 
-	if (!cpid) { // child
-		fclose(pids_file);
-		pid_from_ns_wrapper(sock[1], tpid);
-	}
-
-	const char *ptr = buf;
-	while (sscanf(ptr, "%d", &qpid) == 1) {
-		struct ucred cred;
-		char v;
-
-		if (write(sock[0], &qpid, sizeof(qpid)) != sizeof(qpid)) {
-			lxcfs_error("Error writing pid to child: %s.\n", strerror(errno));
-			goto out;
-		}
-
-		if (recv_creds(sock[0], &cred, &v)) {
-			if (v == '0') {
-				if (!may_move_pid(tpid, tuid, cred.pid)) {
-					fail = true;
-					break;
-				}
-				if (fprintf(pids_file, "%d", (int) cred.pid) < 0)
-					fail = true;
-			}
-		}
-
-		ptr = strchr(ptr, '\n');
-		if (!ptr)
+	for (i = 0; i < n; i++) {
+		if (pids[i] <= 0)
+			continue;
+		if (!may_move_pid(tpid, tuid, pids[i])) {
+			fail = true;
 			break;
-		ptr++;
+		}
+		if (fprintf(pids_file, "%d", (int) pids[i]) < 0)
+			fail = true;
 	}
 
-	/* All good, write the value */
-	qpid = -1;
-	if (write(sock[0], &qpid ,sizeof(qpid)) != sizeof(qpid))
-		lxcfs_error("%s\n", "Warning: failed to ask child to exit.");
-
 	if (!fail)
 		answer = true;
 
 out:
-	if (cpid != -1)
-		wait_for_pid(cpid);
-	if (sock[0] != -1) {
-		close(sock[0]);
-		close(sock[1]);
-	}
+	pid_xlate_fini(&x);
+	free(pids);
 	if (pids_file) {
 		if (fclose(pids_file) != 0)
 			answer = false;
@@ -2980,7 +4515,7 @@ out:
 int cg_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	char *localbuf = NULL;
 	struct cgfs_files *k = NULL;
 	struct file_info *f = (struct file_info *)fi->fh;
@@ -3030,7 +4565,7 @@ out:
 
 int cg_chown(const char *path, uid_t uid, gid_t gid)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	char *cgdir = NULL, *last = NULL, *path1, *path2, *controller;
 	struct cgfs_files *k = NULL;
 	const char *cgroup;
@@ -3096,7 +4631,7 @@ out:
 
 int cg_chmod(const char *path, mode_t mode)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	char * cgdir = NULL, *last = NULL, *path1, *path2, *controller;
 	struct cgfs_files *k = NULL;
 	const char *cgroup;
@@ -3165,7 +4700,7 @@ out:
 
 int cg_mkdir(const char *path, mode_t mode)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	char *last = NULL, *path1, *cgdir = NULL, *controller, *next = NULL;
 	const char *cgroup;
 	int ret;
@@ -3219,7 +4754,7 @@ out:
 
 int cg_rmdir(const char *path)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	char *last = NULL, *cgdir = NULL, *controller, *next = NULL;
 	const char *cgroup;
 	int ret;
@@ -3292,97 +4827,336 @@ static void parse_memstat(char *memstat, unsigned long *cached,
 {
 	char *eol;
 
-	while (*memstat) {
-		if (startswith(memstat, "total_cache")) {
-			sscanf(memstat + 11, "%lu", cached);
-			*cached /= 1024;
-		} else if (startswith(memstat, "total_active_anon")) {
-			sscanf(memstat + 17, "%lu", active_anon);
-			*active_anon /= 1024;
-		} else if (startswith(memstat, "total_inactive_anon")) {
-			sscanf(memstat + 19, "%lu", inactive_anon);
-			*inactive_anon /= 1024;
-		} else if (startswith(memstat, "total_active_file")) {
-			sscanf(memstat + 17, "%lu", active_file);
-			*active_file /= 1024;
-		} else if (startswith(memstat, "total_inactive_file")) {
-			sscanf(memstat + 19, "%lu", inactive_file);
-			*inactive_file /= 1024;
-		} else if (startswith(memstat, "total_unevictable")) {
-			sscanf(memstat + 17, "%lu", unevictable);
-			*unevictable /= 1024;
-		} else if (startswith(memstat, "total_shmem")) {
-			sscanf(memstat + 11, "%lu", shmem);
-			*shmem /= 1024;
+	while (*memstat) {
+		if (startswith(memstat, "total_cache")) {
+			sscanf(memstat + 11, "%lu", cached);
+			*cached /= 1024;
+		} else if (startswith(memstat, "total_active_anon")) {
+			sscanf(memstat + 17, "%lu", active_anon);
+			*active_anon /= 1024;
+		} else if (startswith(memstat, "total_inactive_anon")) {
+			sscanf(memstat + 19, "%lu", inactive_anon);
+			*inactive_anon /= 1024;
+		} else if (startswith(memstat, "total_active_file")) {
+			sscanf(memstat + 17, "%lu", active_file);
+			*active_file /= 1024;
+		} else if (startswith(memstat, "total_inactive_file")) {
+			sscanf(memstat + 19, "%lu", inactive_file);
+			*inactive_file /= 1024;
+		} else if (startswith(memstat, "total_unevictable")) {
+			sscanf(memstat + 17, "%lu", unevictable);
+			*unevictable /= 1024;
+		} else if (startswith(memstat, "total_shmem")) {
+			sscanf(memstat + 11, "%lu", shmem);
+			*shmem /= 1024;
+		}
+		eol = strchr(memstat, '\n');
+		if (!eol)
+			return;
+		memstat = eol+1;
+	}
+}
+
+static void get_blkio_io_value(char *str, unsigned major, unsigned minor, char *iotype, unsigned long *v)
+{
+	char *eol;
+	char key[32];
+
+	memset(key, 0, 32);
+	snprintf(key, 32, "%u:%u %s", major, minor, iotype);
+
+	size_t len = strlen(key);
+	*v = 0;
+
+	while (*str) {
+		if (startswith(str, key)) {
+			sscanf(str + len, "%lu", v);
+			return;
+		}
+		eol = strchr(str, '\n');
+		if (!eol)
+			return;
+		str = eol+1;
+	}
+}
+
+/*
+ * Hand @len bytes rendered at the start of d->buf to a read at offset 0.
+ * Readers replying straight from d->buf pass no @buf, see read_rendered().
+ */
+void copy_rendered(char *buf, const struct file_info *d, size_t len)
+{
+	if (buf)
+		memcpy(buf, d->buf, len);
+}
+
+/* Fall back to the host's file, read straight into the buffer of @d. */
+int read_file(const char *path, char *buf, size_t size, struct file_info *d)
+{
+	size_t total_len = 0;
+	ssize_t l;
+	int fd, rv = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	for (;;) {
+		/* Full before the end of the file, let the caller grow it */
+		if (total_len == d->buflen) {
+			d->truncated = true;
+			goto err;
+		}
+		l = read(fd, d->buf + total_len, d->buflen - total_len);
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error reading to cache");
+			goto err;
+		}
+		if (l == 0)
+			break;
+		total_len += l;
+	}
+
+	d->size = total_len;
+	if (total_len > size)
+		total_len = size;
+
+	/* read from off 0 */
+	copy_rendered(buf, d, total_len);
+	rv = total_len;
+  err:
+	close(fd);
+	return rv;
+}
+
+/*
+ * Snapshots of the host's /proc files the virtualized ones are rendered
+ * from.  Each file is read at most once per snapshot interval (-t, in
+ * milliseconds) however many containers read it meanwhile.  A snapshot is
+ * immutable once published: readers take a reference to the current one
+ * under a short lock and render from it at leisure, while one of them at a
+ * time reads the next one into the buffer the previous generation
+ * released.
+ */
+enum host_file_t {
+	HOST_PROC_CPUINFO,
+	HOST_PROC_DISKSTATS,
+	HOST_PROC_MEMINFO,
+	HOST_PROC_STAT,
+	HOST_FILE_MAX,
+};
+
+struct host_snapshot {
+	int refcount;   // atomic
+	uint64_t taken; // CLOCK_MONOTONIC, in ms
+	size_t size;    // of @buf
+	size_t len;     // of the contents
+	char *buf;
+};
+
+struct host_file {
+	const char *path;
+	pthread_mutex_t lock;         // protects @cur
+	pthread_mutex_t refresh_lock; // taken by the one reading the file
+	struct host_snapshot *cur;
+	struct host_snapshot *spare;  // atomic, a released buffer for reuse
+};
+
+static struct host_file host_files[HOST_FILE_MAX] = {
+	[HOST_PROC_CPUINFO]   = { "/proc/cpuinfo",   PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, NULL, NULL },
+	[HOST_PROC_DISKSTATS] = { "/proc/diskstats", PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, NULL, NULL },
+	[HOST_PROC_MEMINFO]   = { "/proc/meminfo",   PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, NULL, NULL },
+	[HOST_PROC_STAT]      = { "/proc/stat",      PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, NULL, NULL },
+};
+
+static uint64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int host_snapshot_interval(void)
+{
+	struct fuse_context *fc = lxcfs_get_context();
+	struct lxcfs_opts *opts = fc ? (struct lxcfs_opts *)fc->private_data : NULL;
+
+	return opts ? opts->snapshot_ms : HOST_SNAPSHOT_MS;
+}
+
+static void free_host_snapshot(struct host_snapshot *s)
+{
+	if (!s)
+		return;
+	free(s->buf);
+	free(s);
+}
+
+static void put_host_snapshot(struct host_file *hf, struct host_snapshot *s)
+{
+	struct host_snapshot *expected = NULL;
+
+	if (!s || __atomic_sub_fetch(&s->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	/* Keep the buffer around for the next generation. */
+	if (!__atomic_compare_exchange_n(&hf->spare, &expected, s, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		free_host_snapshot(s);
+}
+
+/* Read @hf into a new snapshot holding a single reference. */
+static struct host_snapshot *read_host_snapshot(struct host_file *hf)
+{
+	struct host_snapshot *s;
+	ssize_t ret;
+	int fd;
+
+	s = __atomic_exchange_n(&hf->spare, NULL, __ATOMIC_ACQ_REL);
+	if (!s) {
+		do {
+			s = calloc(1, sizeof(*s));
+		} while (!s);
+	}
+
+	fd = open(hf->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto err;
+
+	s->len = 0;
+	for (;;) {
+		if (s->len + 1 >= s->size) {
+			size_t newsize = s->size ? 2 * s->size : 4 * BUF_RESERVE_SIZE;
+			char *tmp;
+
+			tmp = realloc(s->buf, newsize);
+			if (!tmp)
+				goto err;
+			s->buf = tmp;
+			s->size = newsize;
 		}
-		eol = strchr(memstat, '\n');
-		if (!eol)
-			return;
-		memstat = eol+1;
+		ret = read(fd, s->buf + s->len, s->size - s->len - 1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			goto err;
+		}
+		if (ret == 0)
+			break;
+		s->len += ret;
 	}
+	close(fd);
+	fd = -1;
+
+	if (!s->len)
+		goto err;
+	s->buf[s->len] = '\0';
+	s->taken = monotonic_ms();
+	s->refcount = 1;
+	return s;
+
+err:
+	if (fd >= 0)
+		close(fd);
+	free_host_snapshot(s);
+	return NULL;
 }
 
-static void get_blkio_io_value(char *str, unsigned major, unsigned minor, char *iotype, unsigned long *v)
+static struct host_snapshot *get_current_snapshot(struct host_file *hf,
+						  uint64_t now,
+						  unsigned int interval)
 {
-	char *eol;
-	char key[32];
+	struct host_snapshot *s;
 
-	memset(key, 0, 32);
-	snprintf(key, 32, "%u:%u %s", major, minor, iotype);
+	lock_mutex(&hf->lock);
+	s = hf->cur;
+	if (s && now < s->taken + interval)
+		__atomic_add_fetch(&s->refcount, 1, __ATOMIC_ACQ_REL);
+	else
+		s = NULL;
+	unlock_mutex(&hf->lock);
 
-	size_t len = strlen(key);
-	*v = 0;
+	return s;
+}
 
-	while (*str) {
-		if (startswith(str, key)) {
-			sscanf(str + len, "%lu", v);
-			return;
+/*
+ * Return a reference to a snapshot of host file @type no older than the
+ * snapshot interval, reading the file if there is none.
+ */
+static struct host_snapshot *get_host_snapshot(enum host_file_t type)
+{
+	struct host_file *hf = &host_files[type];
+	unsigned int interval = host_snapshot_interval();
+	struct host_snapshot *s, *old;
+
+	if (!interval)
+		return read_host_snapshot(hf);
+
+	s = get_current_snapshot(hf, monotonic_ms(), interval);
+	if (s)
+		return s;
+
+	lock_mutex(&hf->refresh_lock);
+	/* Somebody else may have just done the work. */
+	s = get_current_snapshot(hf, monotonic_ms(), interval);
+	if (!s) {
+		s = read_host_snapshot(hf);
+		if (s) {
+			/* One reference for @hf->cur, one for the caller. */
+			s->refcount = 2;
+			lock_mutex(&hf->lock);
+			old = hf->cur;
+			hf->cur = s;
+			unlock_mutex(&hf->lock);
+			put_host_snapshot(hf, old);
 		}
-		eol = strchr(str, '\n');
-		if (!eol)
-			return;
-		str = eol+1;
 	}
+	unlock_mutex(&hf->refresh_lock);
+
+	return s;
 }
 
-int read_file(const char *path, char *buf, size_t size, struct file_info *d)
+/*
+ * Open a stream over a snapshot of host file @type, to be closed with
+ * close_host_file().
+ */
+static FILE *open_host_file(enum host_file_t type, struct host_snapshot **snap)
 {
-	size_t linelen = 0, total_len = 0, rv = 0;
-	char *line = NULL;
-	char *cache = d->buf;
-	size_t cache_size = d->buflen;
-	FILE *f = fopen(path, "r");
-	if (!f)
-		return 0;
+	FILE *f;
 
-	while (getline(&line, &linelen, f) != -1) {
-		ssize_t l = snprintf(cache, cache_size, "%s", line);
-		if (l < 0) {
-			perror("Error writing to cache");
-			rv = 0;
-			goto err;
-		}
-		if (l >= cache_size) {
-			lxcfs_error("%s\n", "Internal error: truncated write to cache.");
-			rv = 0;
-			goto err;
-		}
-		cache += l;
-		cache_size -= l;
-		total_len += l;
+	*snap = get_host_snapshot(type);
+	if (!*snap)
+		return NULL;
+
+	f = fmemopen((*snap)->buf, (*snap)->len, "r");
+	if (!f) {
+		put_host_snapshot(&host_files[type], *snap);
+		*snap = NULL;
 	}
+	return f;
+}
 
-	d->size = total_len;
-	if (total_len > size)
-		total_len = size;
+static void close_host_file(enum host_file_t type, FILE *f,
+			    struct host_snapshot *snap)
+{
+	if (f)
+		fclose(f);
+	put_host_snapshot(&host_files[type], snap);
+}
 
-	/* read from off 0 */
-	memcpy(buf, d->buf, total_len);
-	rv = total_len;
-  err:
-	fclose(f);
-	free(line);
-	return rv;
+static void free_host_snapshots(void)
+{
+	int i;
+
+	for (i = 0; i < HOST_FILE_MAX; i++) {
+		free_host_snapshot(host_files[i].cur);
+		free_host_snapshot(host_files[i].spare);
+		host_files[i].cur = NULL;
+		host_files[i].spare = NULL;
+	}
 }
 
 /*
@@ -3394,7 +5168,7 @@ static unsigned long get_memlimit(const char *cgroup, const char *file)
 	char *memlimit_str = NULL;
 	unsigned long memlimit = -1;
 
-	if (cgfs_get_value("memory", cgroup, file, &memlimit_str))
+	if (ctrl_get_value(LXC_CTRL_MEMORY, cgroup, file, &memlimit_str))
 		memlimit = strtoul(memlimit_str, NULL, 10);
 
 	free(memlimit_str);
@@ -3422,8 +5196,8 @@ static unsigned long get_min_memlimit(const char *cgroup, const char *file)
 static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
-	struct lxcfs_opts *opts = (struct lxcfs_opts *) fuse_get_context()->private_data;
+	struct fuse_context *fc = lxcfs_get_context();
+	struct lxcfs_opts *opts = (struct lxcfs_opts *) lxcfs_get_context()->private_data;
 	struct file_info *d = (struct file_info *)fi->fh;
 	char *cg;
 	char *memusage_str = NULL, *memstat_str = NULL,
@@ -3437,6 +5211,7 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 	char *cache = d->buf;
 	size_t cache_size = d->buflen;
 	FILE *f = NULL;
+	struct host_snapshot *snap = NULL;
 
 	if (offset){
 		if (offset > d->size)
@@ -3449,24 +5224,20 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 		return total_len;
 	}
 
-	pid_t initpid = lookup_initpid_in_store(fc->pid);
-	if (initpid <= 0)
-		initpid = fc->pid;
-	cg = get_pid_cgroup(initpid, "memory");
+	cg = get_container_cgroup(fc->pid, LXC_CTRL_MEMORY, NULL);
 	if (!cg)
 		return read_file("/proc/meminfo", buf, size, d);
-	prune_init_slice(cg);
 
 	memlimit = get_min_memlimit(cg, "memory.limit_in_bytes");
-	if (!cgfs_get_value("memory", cg, "memory.usage_in_bytes", &memusage_str))
+	if (!ctrl_get_value(LXC_CTRL_MEMORY, cg, "memory.usage_in_bytes", &memusage_str))
 		goto err;
-	if (!cgfs_get_value("memory", cg, "memory.stat", &memstat_str))
+	if (!ctrl_get_value(LXC_CTRL_MEMORY, cg, "memory.stat", &memstat_str))
 		goto err;
 
 	// Following values are allowed to fail, because swapaccount might be turned
 	// off for current kernel
-	if(cgfs_get_value("memory", cg, "memory.memsw.limit_in_bytes", &memswlimit_str) &&
-		cgfs_get_value("memory", cg, "memory.memsw.usage_in_bytes", &memswusage_str))
+	if(ctrl_get_value(LXC_CTRL_MEMORY, cg, "memory.memsw.limit_in_bytes", &memswlimit_str) &&
+		ctrl_get_value(LXC_CTRL_MEMORY, cg, "memory.memsw.usage_in_bytes", &memswusage_str))
 	{
 		memswlimit = get_min_memlimit(cg, "memory.memsw.limit_in_bytes");
 		memswusage = strtoul(memswusage_str, NULL, 10);
@@ -3483,7 +5254,7 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 			&inactive_anon, &active_file, &inactive_file,
 			&unevictable, &shmem);
 
-	f = fopen("/proc/meminfo", "r");
+	f = open_host_file(HOST_PROC_MEMINFO, &snap);
 	if (!f)
 		goto err;
 
@@ -3583,7 +5354,7 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 
 		}
 		if (l >= cache_size) {
-			lxcfs_error("%s\n", "Internal error: truncated write to cache.");
+			d->truncated = true;
 			rv = 0;
 			goto err;
 		}
@@ -3596,12 +5367,11 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 	d->cached = 1;
 	d->size = total_len;
 	if (total_len > size ) total_len = size;
-	memcpy(buf, d->buf, total_len);
+	copy_rendered(buf, d, total_len);
 
 	rv = total_len;
 err:
-	if (f)
-		fclose(f);
+	close_host_file(HOST_PROC_MEMINFO, f, snap);
 	free(line);
 	free(cg);
 	free(memusage_str);
@@ -3619,20 +5389,18 @@ char *get_cpuset(const char *cg)
 {
 	char *answer;
 
-	if (!cgfs_get_value("cpuset", cg, "cpuset.cpus", &answer))
+	if (!ctrl_get_value(LXC_CTRL_CPUSET, cg, "cpuset.cpus", &answer))
 		return NULL;
 	return answer;
 }
 
-bool cpu_in_cpuset(int cpu, const char *cpuset);
-
-static bool cpuline_in_cpuset(const char *line, const char *cpuset)
+static bool cpuline_in_cpuset(const char *line, const struct cpumask *cpus)
 {
 	int cpu;
 
 	if (sscanf(line, "processor       : %d", &cpu) != 1)
 		return false;
-	return cpu_in_cpuset(cpu, cpuset);
+	return cpumask_test(cpus, cpu);
 }
 
 /*
@@ -3647,7 +5415,7 @@ static bool read_cpu_cfs_param(const char *cg, const char *param, int64_t *value
 
 	sprintf(file, "cpu.cfs_%s_us", param);
 
-	if (!cgfs_get_value("cpu", cg, file, &str))
+	if (!ctrl_get_value(LXC_CTRL_CPU, cg, file, &str))
 		goto err;
 
 	if (sscanf(str, "%ld", value) != 1)
@@ -3729,18 +5497,8 @@ static double exact_cpu_count(const char *cg)
  */
 bool use_cpuview(const char *cg)
 {
-	int cfd;
-	char *tmpc;
-
-	tmpc = find_mounted_controller("cpu", &cfd);
-	if (!tmpc)
-		return false;
-
-	tmpc = find_mounted_controller("cpuacct", &cfd);
-	if (!tmpc)
-		return false;
-
-	return true;
+	return ctrl_table[LXC_CTRL_CPU].hier >= 0 &&
+	       ctrl_table[LXC_CTRL_CPUACCT].hier >= 0;
 }
 
 /*
@@ -3755,13 +5513,254 @@ static bool is_processor_line(const char *line)
 	return false;
 }
 
+/*
+ * The host's /proc/cpuinfo split into the block of each CPU, so that a
+ * container's view is put together by copying the blocks of its CPUs
+ * instead of going over the whole file.  The index is only rebuilt when
+ * the host's online CPUs change: /sys/devices/system/cpu/online is checked
+ * at most once per snapshot interval.  Like the host snapshots, an index is
+ * immutable once published and readers hold a reference to it.
+ *
+ * s390x lists the CPUs in a header rather than in blocks, it is not indexed.
+ */
+struct cpuinfo_block {
+	size_t start;    // of the block, after its processor line
+	size_t end;      // the next processor line, or the end of the file
+};
+
+struct cpuinfo_index {
+	int refcount;    // atomic
+	char *online;    // /sys/devices/system/cpu/online it was built for
+	struct host_snapshot *snap;
+	bool s390x;
+	int nr_cpus;     // one past the highest CPU listed
+	int *blocks;     // @cpu_blocks index of each CPU, or -1
+	struct cpuinfo_block *cpu_blocks;
+};
+
+static struct cpuinfo_cache {
+	pthread_mutex_t lock;         // protects @cur and @checked
+	pthread_mutex_t refresh_lock; // taken by the one checking @cur
+	struct cpuinfo_index *cur;
+	uint64_t checked;             // CLOCK_MONOTONIC, in ms
+} cpuinfo_cache = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, NULL, 0
+};
+
+static void put_cpuinfo_index(struct cpuinfo_index *idx)
+{
+	if (!idx || __atomic_sub_fetch(&idx->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	put_host_snapshot(&host_files[HOST_PROC_CPUINFO], idx->snap);
+	free(idx->online);
+	free(idx->blocks);
+	free(idx->cpu_blocks);
+	free(idx);
+}
+
+/* Return the host's online CPUs in a newly allocated string, or NULL. */
+static char *read_host_cpu_online(void)
+{
+	char buf[4096], *nl;
+	ssize_t ret;
+	int fd;
+
+	fd = open("/sys/devices/system/cpu/online", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	do {
+		ret = read(fd, buf, sizeof(buf) - 1);
+	} while (ret < 0 && errno == EINTR);
+	close(fd);
+	if (ret <= 0)
+		return NULL;
+	buf[ret] = '\0';
+	nl = strchr(buf, '\n');
+	if (nl)
+		*nl = '\0';
+	return strdup(buf);
+}
+
+/* Index a fresh read of the host's cpuinfo, built for online CPUs @online. */
+static struct cpuinfo_index *build_cpuinfo_index(char *online)
+{
+	struct cpuinfo_index *idx;
+	char *buf, *line, *next;
+	int cpu, i, nr = 0, size = 0;
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx)
+		return NULL;
+	idx->refcount = 1;
+	idx->online = online;
+
+	idx->snap = read_host_snapshot(&host_files[HOST_PROC_CPUINFO]);
+	if (!idx->snap)
+		goto err;
+	buf = idx->snap->buf;
+
+	if (memmem(buf, strchrnul(buf, '\n') - buf, "IBM/S390", 8)) {
+		idx->s390x = true;
+		return idx;
+	}
+
+	for (line = buf; *line; line = next) {
+		next = strchrnul(line, '\n');
+		if (*next)
+			next++;
+
+		if (strncmp(line, "processor", 9) != 0 ||
+		    sscanf(line, "processor       : %d", &cpu) != 1 ||
+		    cpu < 0 || cpu >= CPUMASK_MAX_CPUS)
+			continue;
+
+		if (nr == size) {
+			struct cpuinfo_block *tmp;
+
+			size = size ? 2 * size : 64;
+			tmp = realloc(idx->cpu_blocks, size * sizeof(*tmp));
+			if (!tmp)
+				goto err;
+			idx->cpu_blocks = tmp;
+		}
+		if (nr > 0)
+			idx->cpu_blocks[nr - 1].end = line - buf;
+		idx->cpu_blocks[nr].start = next - buf;
+		idx->cpu_blocks[nr].end = idx->snap->len;
+		nr++;
+
+		if (cpu >= idx->nr_cpus) {
+			int *tmp;
+
+			tmp = realloc(idx->blocks, (cpu + 1) * sizeof(*tmp));
+			if (!tmp)
+				goto err;
+			for (i = idx->nr_cpus; i <= cpu; i++)
+				tmp[i] = -1;
+			idx->blocks = tmp;
+			idx->nr_cpus = cpu + 1;
+		}
+		idx->blocks[cpu] = nr - 1;
+	}
+
+	return idx;
+
+err:
+	idx->online = NULL;
+	put_cpuinfo_index(idx);
+	return NULL;
+}
+
+/*
+ * Return a reference to the index of the host's cpuinfo, building it if
+ * there is none or the online CPUs changed since.  NULL if that failed.
+ */
+static struct cpuinfo_index *get_cpuinfo_index(void)
+{
+	struct cpuinfo_cache *c = &cpuinfo_cache;
+	unsigned int interval = host_snapshot_interval();
+	struct cpuinfo_index *idx, *old;
+	char *online;
+
+	lock_mutex(&c->lock);
+	idx = c->cur;
+	if (idx && monotonic_ms() < c->checked + interval)
+		__atomic_add_fetch(&idx->refcount, 1, __ATOMIC_ACQ_REL);
+	else
+		idx = NULL;
+	unlock_mutex(&c->lock);
+	if (idx)
+		return idx;
+
+	lock_mutex(&c->refresh_lock);
+	/* Nobody else replaces @c->cur while we hold the refresh lock. */
+	idx = c->cur;
+	if (idx && monotonic_ms() < c->checked + interval) {
+		__atomic_add_fetch(&idx->refcount, 1, __ATOMIC_ACQ_REL);
+		goto out;
+	}
+
+	online = read_host_cpu_online();
+	if (idx && online && idx->online && strcmp(online, idx->online) == 0) {
+		free(online);
+		__atomic_add_fetch(&idx->refcount, 1, __ATOMIC_ACQ_REL);
+		lock_mutex(&c->lock);
+		c->checked = monotonic_ms();
+		unlock_mutex(&c->lock);
+		goto out;
+	}
+
+	idx = build_cpuinfo_index(online);
+	if (!idx) {
+		free(online);
+		goto out;
+	}
+
+	/* One reference for @c->cur, one for the caller. */
+	idx->refcount = 2;
+	lock_mutex(&c->lock);
+	old = c->cur;
+	c->cur = idx;
+	c->checked = monotonic_ms();
+	unlock_mutex(&c->lock);
+	put_cpuinfo_index(old);
+
+out:
+	unlock_mutex(&c->refresh_lock);
+	return idx;
+}
+
+static void free_cpuinfo_index(void)
+{
+	put_cpuinfo_index(cpuinfo_cache.cur);
+	cpuinfo_cache.cur = NULL;
+}
+
+/*
+ * Render the blocks of the CPUs in @cpus, at most @max_cpus of them if it
+ * is positive, renumbered from 0, into @buf.  Returns the length or -1 if it
+ * does not fit.
+ */
+static ssize_t render_cpuinfo(const struct cpuinfo_index *idx,
+			      const struct cpumask *cpus, int max_cpus,
+			      char *buf, size_t size)
+{
+	const struct cpuinfo_block *b;
+	size_t total_len = 0, len;
+	int cpu, curcpu = 0, l;
+
+	for_each_cpu(cpu, cpus) {
+		if (cpu >= idx->nr_cpus)
+			break;
+		if (idx->blocks[cpu] < 0)
+			continue;
+		if (max_cpus > 0 && curcpu == max_cpus)
+			break;
+
+		l = snprintf(buf + total_len, size - total_len, "processor\t: %d\n", curcpu);
+		if (l < 0 || l >= size - total_len)
+			return -1;
+		total_len += l;
+
+		b = &idx->cpu_blocks[idx->blocks[cpu]];
+		len = b->end - b->start;
+		if (len >= size - total_len)
+			return -1;
+		memcpy(buf + total_len, idx->snap->buf + b->start, len);
+		total_len += len;
+		curcpu++;
+	}
+
+	return total_len;
+}
+
 static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	struct file_info *d = (struct file_info *)fi->fh;
 	char *cg;
-	char *cpuset = NULL;
+	struct cpumask *cpus = NULL;
 	char *line = NULL;
 	size_t linelen = 0, total_len = 0, rv = 0;
 	bool am_printing = false, firstline = true, is_s390x = false;
@@ -3770,6 +5769,9 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 	char *cache = d->buf;
 	size_t cache_size = d->buflen;
 	FILE *f = NULL;
+	struct host_snapshot *snap = NULL;
+	struct cpuinfo_index *idx = NULL;
+	ssize_t len;
 
 	if (offset){
 		if (offset > d->size)
@@ -3782,16 +5784,12 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 		return total_len;
 	}
 
-	pid_t initpid = lookup_initpid_in_store(fc->pid);
-	if (initpid <= 0)
-		initpid = fc->pid;
-	cg = get_pid_cgroup(initpid, "cpuset");
+	cg = get_container_cgroup(fc->pid, LXC_CTRL_CPUSET, NULL);
 	if (!cg)
 		return read_file("proc/cpuinfo", buf, size, d);
-	prune_init_slice(cg);
 
-	cpuset = get_cpuset(cg);
-	if (!cpuset)
+	cpus = get_container_cpumask(fc->pid, cg);
+	if (!cpus)
 		goto err;
 
 	use_view = use_cpuview(cg);
@@ -3799,7 +5797,18 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 	if (use_view)
 		max_cpus = max_cpu_count(cg);
 
-	f = fopen("/proc/cpuinfo", "r");
+	idx = get_cpuinfo_index();
+	if (idx && !idx->s390x) {
+		len = render_cpuinfo(idx, cpus, max_cpus, d->buf, d->buflen);
+		if (len < 0) {
+			d->truncated = true;
+			goto err;
+		}
+		total_len = len;
+		goto out;
+	}
+
+	f = open_host_file(HOST_PROC_CPUINFO, &snap);
 	if (!f)
 		goto err;
 
@@ -3818,7 +5827,7 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 		if (is_processor_line(line)) {
 			if (use_view && max_cpus > 0 && (curcpu+1) == max_cpus)
 				break;
-			am_printing = cpuline_in_cpuset(line, cpuset);
+			am_printing = cpuline_in_cpuset(line, cpus);
 			if (am_printing) {
 				curcpu ++;
 				l = snprintf(cache, cache_size, "processor	: %d\n", curcpu);
@@ -3828,7 +5837,7 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 					goto err;
 				}
 				if (l >= cache_size) {
-					lxcfs_error("%s\n", "Internal error: truncated write to cache.");
+					d->truncated = true;
 					rv = 0;
 					goto err;
 				}
@@ -3841,7 +5850,7 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 			char *p;
 			if (use_view && max_cpus > 0 && (curcpu+1) == max_cpus)
 				break;
-			if (!cpu_in_cpuset(cpu, cpuset))
+			if (!cpumask_test(cpus, cpu))
 				continue;
 			curcpu ++;
 			p = strchr(line, ':');
@@ -3855,7 +5864,7 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 				goto err;
 			}
 			if (l >= cache_size) {
-				lxcfs_error("%s\n", "Internal error: truncated write to cache.");
+				d->truncated = true;
 				rv = 0;
 				goto err;
 			}
@@ -3873,7 +5882,7 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 				goto err;
 			}
 			if (l >= cache_size) {
-				lxcfs_error("%s\n", "Internal error: truncated write to cache.");
+				d->truncated = true;
 				rv = 0;
 				goto err;
 			}
@@ -3887,14 +5896,15 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 		char *origcache = d->buf;
 		ssize_t l;
 		do {
-			d->buf = malloc(d->buflen);
+			d->buf = buf_pool_alloc(d->buflen, NULL);
 		} while (!d->buf);
 		cache = d->buf;
 		cache_size = d->buflen;
 		total_len = 0;
 		l = snprintf(cache, cache_size, "vendor_id       : IBM/S390\n");
 		if (l < 0 || l >= cache_size) {
-			free(origcache);
+			d->truncated = l >= cache_size;
+			buf_pool_free(origcache, d->buflen);
 			goto err;
 		}
 		cache_size -= l;
@@ -3902,31 +5912,35 @@ static int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 		total_len += l;
 		l = snprintf(cache, cache_size, "# processors    : %d\n", curcpu + 1);
 		if (l < 0 || l >= cache_size) {
-			free(origcache);
+			d->truncated = l >= cache_size;
+			buf_pool_free(origcache, d->buflen);
 			goto err;
 		}
 		cache_size -= l;
 		cache += l;
 		total_len += l;
 		l = snprintf(cache, cache_size, "%s", origcache);
-		free(origcache);
-		if (l < 0 || l >= cache_size)
+		buf_pool_free(origcache, d->buflen);
+		if (l < 0 || l >= cache_size) {
+			d->truncated = l >= cache_size;
 			goto err;
+		}
 		total_len += l;
 	}
 
+out:
 	d->cached = 1;
 	d->size = total_len;
 	if (total_len > size ) total_len = size;
 
 	/* read from off 0 */
-	memcpy(buf, d->buf, total_len);
+	copy_rendered(buf, d, total_len);
 	rv = total_len;
 err:
-	if (f)
-		fclose(f);
+	close_host_file(HOST_PROC_CPUINFO, f, snap);
+	put_cpuinfo_index(idx);
 	free(line);
-	free(cpuset);
+	cpumask_free(cpus);
 	free(cg);
 	return rv;
 }
@@ -4068,13 +6082,12 @@ static double get_reaper_age(pid_t pid)
 
 /*
  * Returns 0 on success.
- * It is the caller's responsibility to free `return_usage`, unless this
- * function returns an error.
+ * It is the caller's responsibility to free `cpu_usage` with cpu_usage_free(),
+ * unless this function returns an error.
  */
-static int read_cpuacct_usage_all(char *cg, char *cpuset, struct cpuacct_usage **return_usage, int *size)
+static int read_cpuacct_usage_all(char *cg, struct cpu_usage *cpu_usage, int *size)
 {
 	int cpucount = get_nprocs_conf();
-	struct cpuacct_usage *cpu_usage;
 	int rv = 0, i, j, ret;
 	int cg_cpu;
 	uint64_t cg_user, cg_system;
@@ -4091,15 +6104,13 @@ static int read_cpuacct_usage_all(char *cg, char *cpuset, struct cpuacct_usage *
 		return -1;
 	}
 
-	cpu_usage = malloc(sizeof(struct cpuacct_usage) * cpucount);
-	if (!cpu_usage)
+	if (cpu_usage_alloc(cpu_usage, cpucount) != 0)
 		return -ENOMEM;
 
-	memset(cpu_usage, 0, sizeof(struct cpuacct_usage) * cpucount);
-	if (!cgfs_get_value("cpuacct", cg, "cpuacct.usage_all", &usage_str)) {
+	if (!ctrl_get_value(LXC_CTRL_CPUACCT, cg, "cpuacct.usage_all", &usage_str)) {
 		// read cpuacct.usage_percpu instead
 		lxcfs_v("failed to read cpuacct.usage_all. reading cpuacct.usage_percpu instead\n%s", "");
-		if (!cgfs_get_value("cpuacct", cg, "cpuacct.usage_percpu", &usage_str)) {
+		if (!ctrl_get_value(LXC_CTRL_CPUACCT, cg, "cpuacct.usage_percpu", &usage_str)) {
 			rv = -1;
 			goto err;
 		}
@@ -4154,77 +6165,22 @@ static int read_cpuacct_usage_all(char *cg, char *cpuset, struct cpuacct_usage *
 		read_pos += read_cnt;
 
 		/* Convert the time from nanoseconds to USER_HZ */
-		cpu_usage[j].user = cg_user / 1000.0 / 1000 / 1000 * ticks_per_sec;
-		cpu_usage[j].system = cg_system / 1000.0 / 1000 / 1000 * ticks_per_sec;
+		cpu_usage->user[j] = cg_user / 1000.0 / 1000 / 1000 * ticks_per_sec;
+		cpu_usage->system[j] = cg_system / 1000.0 / 1000 / 1000 * ticks_per_sec;
 		j++;
 	}
 
 	rv = 0;
-	*return_usage = cpu_usage;
 	*size = cpucount;
 
-err:
-	if (usage_str)
-		free(usage_str);
-
-	if (rv != 0) {
-		free(cpu_usage);
-		*return_usage = NULL;
-	}
-
-	return rv;
-}
-
-static unsigned long diff_cpu_usage(struct cpuacct_usage *older, struct cpuacct_usage *newer, struct cpuacct_usage *diff, int cpu_count)
-{
-	int i;
-	unsigned long sum = 0;
-
-	for (i = 0; i < cpu_count; i++) {
-		if (!newer[i].online)
-			continue;
-
-		/* When cpuset is changed on the fly, the CPUs might get reordered.
-		 * We could either reset all counters, or check that the substractions
-		 * below will return expected results.
-		 */
-		if (newer[i].user > older[i].user)
-			diff[i].user = newer[i].user - older[i].user;
-		else
-			diff[i].user = 0;
-
-		if (newer[i].system > older[i].system)
-			diff[i].system = newer[i].system - older[i].system;
-		else
-			diff[i].system = 0;
-
-		if (newer[i].idle > older[i].idle)
-			diff[i].idle = newer[i].idle - older[i].idle;
-		else
-			diff[i].idle = 0;
-
-		sum += diff[i].user;
-		sum += diff[i].system;
-		sum += diff[i].idle;
-	}
-
-	return sum;
-}
-
-static void add_cpu_usage(unsigned long *surplus, struct cpuacct_usage *usage, unsigned long *counter, unsigned long threshold)
-{
-	unsigned long free_space, to_add;
-
-	free_space = threshold - usage->user - usage->system;
-
-	if (free_space > usage->idle)
-		free_space = usage->idle;
+err:
+	if (usage_str)
+		free(usage_str);
 
-	to_add = free_space > *surplus ? *surplus : free_space;
+	if (rv != 0)
+		cpu_usage_free(cpu_usage);
 
-	*counter += to_add;
-	usage->idle -= to_add;
-	*surplus -= to_add;
+	return rv;
 }
 
 static struct cg_proc_stat *prune_proc_stat_list(struct cg_proc_stat *node)
@@ -4232,7 +6188,7 @@ static struct cg_proc_stat *prune_proc_stat_list(struct cg_proc_stat *node)
 	struct cg_proc_stat *first = NULL, *prev, *tmp;
 
 	for (prev = NULL; node; ) {
-		if (!cgfs_param_exist("cpu", node->cg, "cpu.shares")) {
+		if (!ctrl_param_exist(LXC_CTRL_CPU, node->cg, "cpu.shares")) {
 			tmp = node;
 			lxcfs_debug("Removing stat node for %s\n", node->cg);
 
@@ -4303,18 +6259,17 @@ out:
 	return node;
 }
 
-static struct cg_proc_stat *new_proc_stat_node(struct cpuacct_usage *usage, int cpu_count, const char *cg)
+static struct cg_proc_stat *new_proc_stat_node(struct cpu_usage *usage, int cpu_count, const char *cg)
 {
 	struct cg_proc_stat *node;
-	int i;
 
 	node = malloc(sizeof(struct cg_proc_stat));
 	if (!node)
 		goto err;
 
 	node->cg = NULL;
-	node->usage = NULL;
-	node->view = NULL;
+	node->usage.user = NULL;
+	node->view.user = NULL;
 
 	node->cg = malloc(strlen(cg) + 1);
 	if (!node->cg)
@@ -4322,17 +6277,20 @@ static struct cg_proc_stat *new_proc_stat_node(struct cpuacct_usage *usage, int
 
 	strcpy(node->cg, cg);
 
-	node->usage = malloc(sizeof(struct cpuacct_usage) * cpu_count);
-	if (!node->usage)
+	if (cpu_usage_alloc(&node->usage, cpu_count) != 0)
 		goto err;
 
-	memcpy(node->usage, usage, sizeof(struct cpuacct_usage) * cpu_count);
+	cpu_usage_copy(&node->usage, usage, cpu_count);
 
-	node->view = malloc(sizeof(struct cpuacct_usage) * cpu_count);
-	if (!node->view)
+	if (cpu_usage_alloc(&node->view, cpu_count) != 0)
 		goto err;
 
 	node->cpu_count = cpu_count;
+	node->nprocs = 0;
+	node->max_cpus = 0;
+	node->user_sum = node->system_sum = node->idle_sum = 0;
+	node->updated = 0;
+	node->last_read = 0;
 	node->next = NULL;
 
 	if (pthread_mutex_init(&node->lock, NULL) != 0) {
@@ -4340,21 +6298,15 @@ static struct cg_proc_stat *new_proc_stat_node(struct cpuacct_usage *usage, int
 		goto err;
 	}
 
-	for (i = 0; i < cpu_count; i++) {
-		node->view[i].user = 0;
-		node->view[i].system = 0;
-		node->view[i].idle = 0;
-	}
-
 	return node;
 
 err:
 	if (node && node->cg)
 		free(node->cg);
-	if (node && node->usage)
-		free(node->usage);
-	if (node && node->view)
-		free(node->view);
+	if (node)
+		cpu_usage_free(&node->usage);
+	if (node)
+		cpu_usage_free(&node->view);
 	if (node)
 		free(node);
 
@@ -4400,52 +6352,19 @@ out:
 
 static bool expand_proc_stat_node(struct cg_proc_stat *node, int cpu_count)
 {
-	struct cpuacct_usage *new_usage, *new_view;
-	int i;
-
-	/* Allocate new memory */
-	new_usage = malloc(sizeof(struct cpuacct_usage) * cpu_count);
-	if (!new_usage)
+	/* Existing data is copied, new elements are zeroed */
+	if (cpu_usage_realloc(&node->usage, node->cpu_count, cpu_count) != 0)
 		return false;
 
-	new_view = malloc(sizeof(struct cpuacct_usage) * cpu_count);
-	if (!new_view) {
-		free(new_usage);
+	if (cpu_usage_realloc(&node->view, node->cpu_count, cpu_count) != 0)
 		return false;
-	}
-
-	/* Copy existing data & initialize new elements */
-	for (i = 0; i < cpu_count; i++) {
-		if (i < node->cpu_count) {
-			new_usage[i].user = node->usage[i].user;
-			new_usage[i].system = node->usage[i].system;
-			new_usage[i].idle = node->usage[i].idle;
-
-			new_view[i].user = node->view[i].user;
-			new_view[i].system = node->view[i].system;
-			new_view[i].idle = node->view[i].idle;
-		} else {
-			new_usage[i].user = 0;
-			new_usage[i].system = 0;
-			new_usage[i].idle = 0;
-
-			new_view[i].user = 0;
-			new_view[i].system = 0;
-			new_view[i].idle = 0;
-		}
-	}
 
-	free(node->usage);
-	free(node->view);
-
-	node->usage = new_usage;
-	node->view = new_view;
 	node->cpu_count = cpu_count;
 
 	return true;
 }
 
-static struct cg_proc_stat *find_or_create_proc_stat_node(struct cpuacct_usage *usage, int cpu_count, const char *cg)
+static struct cg_proc_stat *find_or_create_proc_stat_node(struct cpu_usage *usage, int cpu_count, const char *cg)
 {
 	int hash = calc_hash(cg) % CPUVIEW_HASH_SIZE;
 	struct cg_proc_stat_head *head = proc_stat_history[hash];
@@ -4481,49 +6400,39 @@ static struct cg_proc_stat *find_or_create_proc_stat_node(struct cpuacct_usage *
 	return node;
 }
 
-static void reset_proc_stat_node(struct cg_proc_stat *node, struct cpuacct_usage *usage, int cpu_count)
+static void reset_proc_stat_node(struct cg_proc_stat *node, struct cpu_usage *usage, int cpu_count)
 {
-	int i;
-
 	lxcfs_debug("Resetting stat node for %s\n", node->cg);
-	memcpy(node->usage, usage, sizeof(struct cpuacct_usage) * cpu_count);
-
-	for (i = 0; i < cpu_count; i++) {
-		node->view[i].user = 0;
-		node->view[i].system = 0;
-		node->view[i].idle = 0;
-	}
+	cpu_usage_copy(&node->usage, usage, cpu_count);
+	cpu_usage_zero(&node->view, cpu_count);
 
 	node->cpu_count = cpu_count;
 }
 
-static int cpuview_proc_stat(const char *cg, const char *cpuset, struct cpuacct_usage *cg_cpu_usage, int cg_cpu_usage_size, FILE *f, char *buf, size_t buf_size)
-{
-	char *line = NULL;
-	size_t linelen = 0, total_len = 0, rv = 0, l;
-	int curcpu = -1; /* cpu numbering starts at 0 */
-	int physcpu, i;
-	int max_cpus = max_cpu_count(cg), cpu_cnt = 0;
-	unsigned long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0, guest = 0, guest_nice = 0;
-	unsigned long user_sum = 0, system_sum = 0, idle_sum = 0;
-	unsigned long user_surplus = 0, system_surplus = 0;
-	unsigned long total_sum, threshold;
-	struct cg_proc_stat *stat_node;
-	struct cpuacct_usage *diff = NULL;
-	int nprocs = get_nprocs_conf();
+/* A cpuN line of the host's /proc/stat. */
+struct host_cpu_stat {
+	int physcpu;
+	bool valid; /* all ten counters could be read */
+	unsigned long user, nice, system, idle, iowait, irq, softirq, steal, guest, guest_nice;
+};
 
-	if (cg_cpu_usage_size < nprocs)
-		nprocs = cg_cpu_usage_size;
+/*
+ * Read the cpuN lines following the "cpu" one of the host's /proc/stat @f
+ * into @stats, grown as needed.  Stops at the first other line, which is
+ * left in @line.  Returns the number of cpuN lines or -1 on error.
+ */
+static int read_host_cpu_stats(FILE *f, struct host_cpu_stat **stats, int *size,
+			       char **line, size_t *linelen)
+{
+	struct host_cpu_stat *st;
+	int nr = 0, physcpu, ret;
 
-	/* Read all CPU stats and stop when we've encountered other lines */
-	while (getline(&line, &linelen, f) != -1) {
-		int ret;
+	while (getline(line, linelen, f) != -1) {
 		char cpu_char[10]; /* That's a lot of cores */
-		uint64_t all_used, cg_used;
 
-		if (strlen(line) == 0)
+		if (strlen(*line) == 0)
 			continue;
-		if (sscanf(line, "cpu%9[^ ]", cpu_char) != 1) {
+		if (sscanf(*line, "cpu%9[^ ]", cpu_char) != 1) {
 			/* not a ^cpuN line containing a number N */
 			break;
 		}
@@ -4531,15 +6440,59 @@ static int cpuview_proc_stat(const char *cg, const char *cpuset, struct cpuacct_
 		if (sscanf(cpu_char, "%d", &physcpu) != 1)
 			continue;
 
+		if (nr == *size) {
+			int newsize = *size ? 2 * *size : 64;
+
+			st = realloc(*stats, newsize * sizeof(*st));
+			if (!st)
+				return -1;
+			*stats = st;
+			*size = newsize;
+		}
+		st = &(*stats)[nr++];
+		st->physcpu = physcpu;
+		ret = sscanf(*line, "%*s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+			   &st->user,
+			   &st->nice,
+			   &st->system,
+			   &st->idle,
+			   &st->iowait,
+			   &st->irq,
+			   &st->softirq,
+			   &st->steal,
+			   &st->guest,
+			   &st->guest_nice);
+		st->valid = ret == 10;
+	}
+
+	return nr;
+}
+
+/*
+ * Mark the CPUs of @cg_cpu_usage online in @cpus and compute their idle
+ * time from the host's @stats.  Returns the number of host CPUs seen.
+ */
+static int cpuview_merge_host(const struct host_cpu_stat *stats, int nr,
+			      const char *cg, const struct cpumask *cpus,
+			      struct cpu_usage *cg_cpu_usage, int cg_cpu_usage_size)
+{
+	int curcpu = -1; /* cpu numbering starts at 0 */
+	int physcpu, i, n, cpu_cnt = 0;
+
+	for (n = 0; n < nr; n++) {
+		const struct host_cpu_stat *st = &stats[n];
+		uint64_t all_used, cg_used;
+
+		physcpu = st->physcpu;
 		if (physcpu >= cg_cpu_usage_size)
 			continue;
 
 		curcpu ++;
 		cpu_cnt ++;
 
-		if (!cpu_in_cpuset(physcpu, cpuset)) {
+		if (!cpumask_test(cpus, physcpu)) {
 			for (i = curcpu; i <= physcpu; i++) {
-				cg_cpu_usage[i].online = false;
+				cpu_usage_set_online(cg_cpu_usage, i, false);
 			}
 			continue;
 		}
@@ -4547,215 +6500,170 @@ static int cpuview_proc_stat(const char *cg, const char *cpuset, struct cpuacct_
 		if (curcpu < physcpu) {
 			/* Some CPUs may be disabled */
 			for (i = curcpu; i < physcpu; i++)
-				cg_cpu_usage[i].online = false;
+				cpu_usage_set_online(cg_cpu_usage, i, false);
 
 			curcpu = physcpu;
 		}
 
-		cg_cpu_usage[curcpu].online = true;
-
-		ret = sscanf(line, "%*s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-			   &user,
-			   &nice,
-			   &system,
-			   &idle,
-			   &iowait,
-			   &irq,
-			   &softirq,
-			   &steal,
-			   &guest,
-			   &guest_nice);
+		cpu_usage_set_online(cg_cpu_usage, curcpu, true);
 
-		if (ret != 10)
+		if (!st->valid)
 			continue;
 
-		all_used = user + nice + system + iowait + irq + softirq + steal + guest + guest_nice;
-		cg_used = cg_cpu_usage[curcpu].user + cg_cpu_usage[curcpu].system;
+		all_used = st->user + st->nice + st->system + st->iowait + st->irq +
+			   st->softirq + st->steal + st->guest + st->guest_nice;
+		cg_used = cg_cpu_usage->user[curcpu] + cg_cpu_usage->system[curcpu];
 
 		if (all_used >= cg_used) {
-			cg_cpu_usage[curcpu].idle = idle + (all_used - cg_used);
+			cg_cpu_usage->idle[curcpu] = st->idle + (all_used - cg_used);
 
 		} else {
 			lxcfs_error("cpu%d from %s has unexpected cpu time: %lu in /proc/stat, "
 					"%lu in cpuacct.usage_all; unable to determine idle time\n",
 					curcpu, cg, all_used, cg_used);
-			cg_cpu_usage[curcpu].idle = idle;
+			cg_cpu_usage->idle[curcpu] = st->idle;
 		}
 	}
 
+	return cpu_cnt;
+}
+
+/*
+ * Fold the new usage @cg_cpu_usage of @stat_node's cgroup @cg into its view,
+ * which must be locked.  @cpu_cnt is the number of host CPUs, @max_cpus and
+ * @exact_cpus what the cgroup's CPU quota allows.
+ */
+static bool cpuview_update(struct cg_proc_stat *stat_node, const char *cg,
+			   struct cpu_usage *cg_cpu_usage, int nprocs,
+			   int cpu_cnt, int max_cpus, double exact_cpus)
+{
+	uint64_t all[3], visible[3], sums[3], surplus[2];
+	unsigned long total_sum, threshold;
+	uint64_t *shown = stat_node->view.online;
+	struct cpu_usage diff;
+	int curcpu;
+
 	/* Cannot use more CPUs than is available due to cpuset */
 	if (max_cpus > cpu_cnt)
 		max_cpus = cpu_cnt;
 
-	stat_node = find_or_create_proc_stat_node(cg_cpu_usage, nprocs, cg);
-
-	if (!stat_node) {
-		lxcfs_error("unable to find/create stat node for %s\n", cg);
-		rv = 0;
-		goto err;
-	}
-
-	diff = malloc(sizeof(struct cpuacct_usage) * nprocs);
-	if (!diff) {
-		rv = 0;
-		goto err;
-	}
+	if (cpu_usage_alloc(&diff, nprocs) != 0)
+		return false;
 
 	/*
 	 * If the new values are LOWER than values stored in memory, it means
 	 * the cgroup has been reset/recreated and we should reset too.
 	 */
 	for (curcpu = 0; curcpu < nprocs; curcpu++) {
-		if (!cg_cpu_usage[curcpu].online)
+		if (!cpu_usage_online(cg_cpu_usage, curcpu))
 			continue;
 
-		if (cg_cpu_usage[curcpu].user < stat_node->usage[curcpu].user)
+		if (cg_cpu_usage->user[curcpu] < stat_node->usage.user[curcpu])
 			reset_proc_stat_node(stat_node, cg_cpu_usage, nprocs);
 
 		break;
 	}
 
-	total_sum = diff_cpu_usage(stat_node->usage, cg_cpu_usage, diff, nprocs);
-
-	for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
-		stat_node->usage[curcpu].online = cg_cpu_usage[curcpu].online;
+	cpu_usage_advance(&stat_node->usage, cg_cpu_usage, &diff, nprocs, all);
+	total_sum = all[0] + all[1] + all[2];
 
-		if (!stat_node->usage[curcpu].online)
-			continue;
-
-		i++;
-
-		stat_node->usage[curcpu].user += diff[curcpu].user;
-		stat_node->usage[curcpu].system += diff[curcpu].system;
-		stat_node->usage[curcpu].idle += diff[curcpu].idle;
-
-		if (max_cpus > 0 && i >= max_cpus) {
-			user_surplus += diff[curcpu].user;
-			system_surplus += diff[curcpu].system;
-		}
-	}
+	/* The container sees the first max_cpus online CPUs */
+	cpu_usage_first(&stat_node->usage, max_cpus, shown, nprocs);
 
 	/* Calculate usage counters of visible CPUs */
 	if (max_cpus > 0) {
+		/* The usage of the hidden CPUs goes to the visible ones */
+		cpu_usage_sum(&diff, shown, nprocs, visible);
+		surplus[0] = all[0] - visible[0];
+		surplus[1] = all[1] - visible[1];
+
 		/* threshold = maximum usage per cpu, including idle */
 		threshold = total_sum / cpu_cnt * max_cpus;
 
-		for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
-			if (!stat_node->usage[curcpu].online)
-				continue;
-
-			i++;
-
-			if (i == max_cpus)
-				break;
-
-			if (diff[curcpu].user + diff[curcpu].system >= threshold)
-				continue;
-
-			/* Add user */
-			add_cpu_usage(
-					&user_surplus,
-					&diff[curcpu],
-					&diff[curcpu].user,
-					threshold);
+		/* Add user, then if there is still room, system */
+		cpu_usage_spread(&diff, shown, threshold, surplus, nprocs);
 
-			if (diff[curcpu].user + diff[curcpu].system >= threshold)
-				continue;
-
-			/* If there is still room, add system */
-			add_cpu_usage(
-					&system_surplus,
-					&diff[curcpu],
-					&diff[curcpu].system,
-					threshold);
-		}
+		if (surplus[0] > 0)
+			lxcfs_debug("leftover user: %" PRIu64 " for %s\n", surplus[0], cg);
+		if (surplus[1] > 0)
+			lxcfs_debug("leftover system: %" PRIu64 " for %s\n", surplus[1], cg);
 
-		if (user_surplus > 0)
-			lxcfs_debug("leftover user: %lu for %s\n", user_surplus, cg);
-		if (system_surplus > 0)
-			lxcfs_debug("leftover system: %lu for %s\n", system_surplus, cg);
+		cpu_usage_add(&stat_node->view, &diff, shown, nprocs, sums);
+		cpu_usage_sum(&diff, shown, nprocs, visible);
 
-		unsigned long diff_user = 0;
-		unsigned long diff_system = 0;
-		unsigned long diff_idle = 0;
+		unsigned long diff_user = visible[0];
+		unsigned long diff_system = visible[1];
+		unsigned long diff_idle = visible[2];
 		unsigned long max_diff_idle = 0;
 		unsigned long max_diff_idle_index = 0;
-		for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
-			if (!stat_node->usage[curcpu].online)
+		for (curcpu = 0; curcpu < nprocs; curcpu++) {
+			if (!((shown[curcpu / 64] >> (curcpu % 64)) & 1))
 				continue;
 
-			i++;
-
-			if (i == max_cpus)
-				break;
-
-			stat_node->view[curcpu].user += diff[curcpu].user;
-			stat_node->view[curcpu].system += diff[curcpu].system;
-			stat_node->view[curcpu].idle += diff[curcpu].idle;
-
-			user_sum += stat_node->view[curcpu].user;
-			system_sum += stat_node->view[curcpu].system;
-			idle_sum += stat_node->view[curcpu].idle;
-
-			diff_user += diff[curcpu].user;
-			diff_system += diff[curcpu].system;
-			diff_idle += diff[curcpu].idle;
-			if (diff[curcpu].idle > max_diff_idle) {
-				max_diff_idle = diff[curcpu].idle;
+			if (diff.idle[curcpu] > max_diff_idle) {
+				max_diff_idle = diff.idle[curcpu];
 				max_diff_idle_index = curcpu;
 			}
 
-			lxcfs_v("curcpu: %d, diff_user: %lu, diff_system: %lu, diff_idle: %lu\n", curcpu, diff[curcpu].user, diff[curcpu].system, diff[curcpu].idle);
+			lxcfs_v("curcpu: %d, diff_user: %lu, diff_system: %lu, diff_idle: %lu\n", curcpu, diff.user[curcpu], diff.system[curcpu], diff.idle[curcpu]);
 		}
 		lxcfs_v("total. diff_user: %lu, diff_system: %lu, diff_idle: %lu\n", diff_user, diff_system, diff_idle);
 
 		// revise cpu usage view to support partial cpu case
-		double exact_cpus = exact_cpu_count(cg);
 		if (exact_cpus < (double)max_cpus){
 			lxcfs_v("revising cpu usage view to match the exact cpu count [%f]\n", exact_cpus);
 			unsigned long delta = (unsigned long)((double)(diff_user + diff_system + diff_idle) * (1 - exact_cpus / (double)max_cpus));
 			lxcfs_v("delta: %lu\n", delta);
-			lxcfs_v("idle_sum before: %lu\n", idle_sum);
-			idle_sum = idle_sum > delta ? idle_sum - delta : 0;
-			lxcfs_v("idle_sum after: %lu\n", idle_sum);
+			lxcfs_v("idle_sum before: %lu\n", sums[2]);
+			sums[2] = sums[2] > delta ? sums[2] - delta : 0;
+			lxcfs_v("idle_sum after: %lu\n", sums[2]);
 
 			curcpu = max_diff_idle_index;
-			lxcfs_v("curcpu: %d, idle before: %lu\n", curcpu, stat_node->view[curcpu].idle);
-			stat_node->view[curcpu].idle = stat_node->view[curcpu].idle > delta ? stat_node->view[curcpu].idle - delta : 0;
-			lxcfs_v("curcpu: %d, idle after: %lu\n", curcpu, stat_node->view[curcpu].idle);
+			lxcfs_v("curcpu: %d, idle before: %lu\n", curcpu, stat_node->view.idle[curcpu]);
+			stat_node->view.idle[curcpu] = stat_node->view.idle[curcpu] > delta ? stat_node->view.idle[curcpu] - delta : 0;
+			lxcfs_v("curcpu: %d, idle after: %lu\n", curcpu, stat_node->view.idle[curcpu]);
 		}
 	} else {
-		for (curcpu = 0; curcpu < nprocs; curcpu++) {
-			if (!stat_node->usage[curcpu].online)
-				continue;
+		cpu_usage_assign(&stat_node->view, &stat_node->usage, shown, nprocs, sums);
+	}
 
-			stat_node->view[curcpu].user = stat_node->usage[curcpu].user;
-			stat_node->view[curcpu].system = stat_node->usage[curcpu].system;
-			stat_node->view[curcpu].idle = stat_node->usage[curcpu].idle;
+	stat_node->nprocs = nprocs;
+	stat_node->max_cpus = max_cpus;
+	stat_node->user_sum = sums[0];
+	stat_node->system_sum = sums[1];
+	stat_node->idle_sum = sums[2];
+	stat_node->updated = monotonic_ms();
 
-			user_sum += stat_node->view[curcpu].user;
-			system_sum += stat_node->view[curcpu].system;
-			idle_sum += stat_node->view[curcpu].idle;
-		}
-	}
+	cpu_usage_free(&diff);
+	return true;
+}
+
+/*
+ * Render the cpu lines of @stat_node's view, which must be locked, into
+ * @buf.  Returns their length or 0 on error, setting @truncated if they did
+ * not fit.
+ */
+static size_t cpuview_render(struct cg_proc_stat *stat_node, char *buf, size_t buf_size,
+			     bool *truncated)
+{
+	size_t total_len = 0, l;
+	int curcpu, i;
 
 	/* Render the file */
 	/* cpu-all */
 	l = snprintf(buf, buf_size, "cpu  %lu 0 %lu %lu 0 0 0 0 0 0\n",
-			user_sum,
-			system_sum,
-			idle_sum);
+			stat_node->user_sum,
+			stat_node->system_sum,
+			stat_node->idle_sum);
 	lxcfs_v("cpu-all: %s\n", buf);
 
 	if (l < 0) {
 		perror("Error writing to cache");
-		rv = 0;
-		goto err;
+		return 0;
 	}
 	if (l >= buf_size) {
-		lxcfs_error("%s\n", "Internal error: truncated write to cache.");
-		rv = 0;
-		goto err;
+		*truncated = true;
+		return 0;
 	}
 
 	buf += l;
@@ -4763,96 +6671,359 @@ static int cpuview_proc_stat(const char *cg, const char *cpuset, struct cpuacct_
 	total_len += l;
 
 	/* Render visible CPUs */
-	for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
-		if (!stat_node->usage[curcpu].online)
+	for (curcpu = 0, i = -1; curcpu < stat_node->nprocs; curcpu++) {
+		if (!cpu_usage_online(&stat_node->view, curcpu))
 			continue;
 
 		i++;
 
-		if (max_cpus > 0 && i == max_cpus)
-			break;
-
 		l = snprintf(buf, buf_size, "cpu%d %lu 0 %lu %lu 0 0 0 0 0 0\n",
 				i,
-				stat_node->view[curcpu].user,
-				stat_node->view[curcpu].system,
-				stat_node->view[curcpu].idle);
+				stat_node->view.user[curcpu],
+				stat_node->view.system[curcpu],
+				stat_node->view.idle[curcpu]);
 		lxcfs_v("cpu: %s\n", buf);
 
 		if (l < 0) {
 			perror("Error writing to cache");
-			rv = 0;
-			goto err;
+			return 0;
 
 		}
 		if (l >= buf_size) {
-			lxcfs_error("%s\n", "Internal error: truncated write to cache.");
-			rv = 0;
-			goto err;
+			*truncated = true;
+			return 0;
+		}
+
+		buf += l;
+		buf_size -= l;
+		total_len += l;
+	}
+
+	return total_len;
+}
+
+/* Append @line and the rest of @f to @buf.  Returns 0 on error. */
+static size_t cpuview_copy_rest(FILE *f, char **line, size_t *linelen,
+				char *buf, size_t buf_size, bool *truncated)
+{
+	size_t total_len = 0, l;
+
+	/* Pass the rest of /proc/stat, start with the last line read */
+	do {
+		l = snprintf(buf, buf_size, "%s", *line);
+		if (l < 0) {
+			perror("Error writing to cache");
+			return 0;
+		}
+		if (l >= buf_size) {
+			*truncated = true;
+			return 0;
+		}
+		buf += l;
+		buf_size -= l;
+		total_len += l;
+	} while (getline(line, linelen, f) != -1);
+
+	return total_len;
+}
+
+static int cpuview_proc_stat(const char *cg, const struct cpumask *cpus, struct cpu_usage *cg_cpu_usage, int cg_cpu_usage_size, FILE *f, struct file_info *d)
+{
+	char *buf = d->buf;
+	size_t buf_size = d->buflen;
+	char *line = NULL;
+	size_t linelen = 0, total_len = 0, rv = 0, l;
+	int max_cpus = max_cpu_count(cg), cpu_cnt;
+	double exact_cpus = 0;
+	struct host_cpu_stat *stats = NULL;
+	int nr_stats, size_stats = 0;
+	struct cg_proc_stat *stat_node;
+	int nprocs = get_nprocs_conf();
+
+	if (cg_cpu_usage_size < nprocs)
+		nprocs = cg_cpu_usage_size;
+
+	/* Read all CPU stats and stop when we've encountered other lines */
+	nr_stats = read_host_cpu_stats(f, &stats, &size_stats, &line, &linelen);
+	if (nr_stats < 0)
+		goto out;
+	cpu_cnt = cpuview_merge_host(stats, nr_stats, cg, cpus,
+				     cg_cpu_usage, cg_cpu_usage_size);
+	if (max_cpus > 0)
+		exact_cpus = exact_cpu_count(cg);
+
+	stat_node = find_or_create_proc_stat_node(cg_cpu_usage, nprocs, cg);
+
+	if (!stat_node) {
+		lxcfs_error("unable to find/create stat node for %s\n", cg);
+		rv = 0;
+		goto out;
+	}
+
+	__atomic_store_n(&stat_node->last_read, monotonic_ms(), __ATOMIC_RELAXED);
+	if (cpuview_update(stat_node, cg, cg_cpu_usage, nprocs, cpu_cnt,
+			   max_cpus, exact_cpus))
+		total_len = cpuview_render(stat_node, buf, buf_size, &d->truncated);
+	pthread_mutex_unlock(&stat_node->lock);
+	if (total_len == 0)
+		goto out;
+
+	l = cpuview_copy_rest(f, &line, &linelen, buf + total_len, buf_size - total_len,
+			      &d->truncated);
+	if (l == 0)
+		goto out;
+
+	rv = total_len + l;
+
+out:
+	free(line);
+	free(stats);
+	return rv;
+}
+
+/*
+ * The cpuview daemon updates the views of all containers that read their
+ * /proc/stat lately, every CPUVIEW_TICK_MS.  It reads the host's per-CPU
+ * counters once and the usage of each of those cgroups, then folds them
+ * all into their nodes in one pass.  Reads of /proc/stat then only render
+ * the latest view, see cpuview_proc_stat_cached(), and fall back to
+ * computing it themselves when the daemon is not running or lags behind.
+ */
+#define CPUVIEW_TICK_MS 1000
+#define CPUVIEW_IDLE_MS 10000 /* views unread for so long are left alone */
+
+/* The usage of a cgroup, collected before the nodes are updated. */
+struct cpuview_sample {
+	char *cg;
+	struct cpu_usage usage;
+	int size;
+	int cpu_cnt;
+	int max_cpus;
+	double exact_cpus;
+};
+
+static volatile sig_atomic_t cpuview_stop = 0;
+static bool cpuview_running; /* atomic */
+
+/* Must be called with @head->lock held. */
+static struct cg_proc_stat *locate_proc_stat_node(struct cg_proc_stat_head *head,
+						  const char *cg)
+{
+	struct cg_proc_stat *node;
+
+	for (node = head->next; node; node = node->next)
+		if (strcmp(cg, node->cg) == 0)
+			return node;
+	return NULL;
+}
+
+/* Collect the cgroups whose view was read within CPUVIEW_IDLE_MS. */
+static int cpuview_collect(struct cpuview_sample **samples, int *size)
+{
+	struct cpuview_sample *tmp;
+	struct cg_proc_stat *node;
+	uint64_t now = monotonic_ms();
+	int i, nr = 0;
+
+	for (i = 0; i < CPUVIEW_HASH_SIZE; i++) {
+		pthread_rwlock_rdlock(&proc_stat_history[i]->lock);
+		for (node = proc_stat_history[i]->next; node; node = node->next) {
+			if (now - MIN(now, __atomic_load_n(&node->last_read, __ATOMIC_RELAXED)) > CPUVIEW_IDLE_MS)
+				continue;
+			if (nr == *size) {
+				int newsize = *size ? 2 * *size : 64;
+
+				do {
+					tmp = realloc(*samples, newsize * sizeof(*tmp));
+				} while (!tmp);
+				*samples = tmp;
+				*size = newsize;
+			}
+			memset(&(*samples)[nr], 0, sizeof(**samples));
+			(*samples)[nr++].cg = must_copy_string(node->cg);
+		}
+		pthread_rwlock_unlock(&proc_stat_history[i]->lock);
+	}
+
+	return nr;
+}
+
+static void cpuview_tick(struct cpuview_sample **samples, int *size_samples,
+			 struct host_cpu_stat **stats, int *size_stats)
+{
+	struct host_snapshot *snap = NULL;
+	struct cg_proc_stat_head *head;
+	struct cg_proc_stat *node;
+	struct cpuview_sample *sm;
+	struct cpumask *cpus;
+	char *line = NULL, *cpuset;
+	size_t linelen = 0;
+	int i, nr, nr_stats = -1, nprocs = get_nprocs_conf();
+	FILE *f;
+
+	nr = cpuview_collect(samples, size_samples);
+	if (nr == 0)
+		return;
+
+	f = open_host_file(HOST_PROC_STAT, &snap);
+	if (f && getline(&line, &linelen, f) != -1)
+		nr_stats = read_host_cpu_stats(f, stats, size_stats, &line, &linelen);
+	close_host_file(HOST_PROC_STAT, f, snap);
+	free(line);
+	if (nr_stats < 0)
+		goto out;
+
+	/* All the cgroup file reads first, ... */
+	for (i = 0; i < nr; i++) {
+		sm = &(*samples)[i];
+		cpuset = get_cpuset(sm->cg);
+		if (!cpuset)
+			continue;
+		cpus = cpumask_parse(cpuset);
+		free(cpuset);
+		if (!cpus)
+			continue;
+		if (read_cpuacct_usage_all(sm->cg, &sm->usage, &sm->size) == 0) {
+			sm->cpu_cnt = cpuview_merge_host(*stats, nr_stats, sm->cg, cpus,
+							 &sm->usage, sm->size);
+			sm->max_cpus = max_cpu_count(sm->cg);
+			if (sm->max_cpus > 0)
+				sm->exact_cpus = exact_cpu_count(sm->cg);
 		}
+		cpumask_free(cpus);
+	}
+
+	/* ... then a single pass over the nodes. */
+	for (i = 0; i < nr; i++) {
+		sm = &(*samples)[i];
+		if (!sm->usage.user)
+			continue;
+
+		head = proc_stat_history[calc_hash(sm->cg) % CPUVIEW_HASH_SIZE];
+		pthread_rwlock_rdlock(&head->lock);
+		node = locate_proc_stat_node(head, sm->cg);
+		if (node) {
+			int n = MIN(nprocs, sm->size);
+
+			pthread_mutex_lock(&node->lock);
+			if (node->cpu_count >= n || expand_proc_stat_node(node, n))
+				cpuview_update(node, sm->cg, &sm->usage, n, sm->cpu_cnt,
+					       sm->max_cpus, sm->exact_cpus);
+			pthread_mutex_unlock(&node->lock);
+		}
+		pthread_rwlock_unlock(&head->lock);
+	}
+
+out:
+	for (i = 0; i < nr; i++) {
+		free((*samples)[i].cg);
+		cpu_usage_free(&(*samples)[i].usage);
+	}
+}
+
+static void *cpuview_begin(void *arg)
+{
+	struct cpuview_sample *samples = NULL;
+	struct host_cpu_stat *stats = NULL;
+	int size_samples = 0, size_stats = 0;
+	struct timespec ts = {
+		.tv_sec = CPUVIEW_TICK_MS / 1000,
+		.tv_nsec = (CPUVIEW_TICK_MS % 1000) * 1000000,
+	};
 
-		buf += l;
-		buf_size -= l;
-		total_len += l;
+	while (!cpuview_stop) {
+		cpuview_tick(&samples, &size_samples, &stats, &size_stats);
+		nanosleep(&ts, NULL);
 	}
 
-	/* Pass the rest of /proc/stat, start with the last line read */
-	l = snprintf(buf, buf_size, "%s", line);
+	free(samples);
+	free(stats);
+	return NULL;
+}
 
-	if (l < 0) {
-		perror("Error writing to cache");
-		rv = 0;
-		goto err;
+/* Return a positive number on success, return 0 on failure.*/
+pthread_t cpuview_daemon(void)
+{
+	pthread_t pid;
 
+	if (pthread_create(&pid, NULL, cpuview_begin, NULL) != 0) {
+		lxcfs_error("%s\n", "Create pthread fails in cpuview_daemon!");
+		return 0;
 	}
-	if (l >= buf_size) {
-		lxcfs_error("%s\n", "Internal error: truncated write to cache.");
-		rv = 0;
-		goto err;
+	__atomic_store_n(&cpuview_running, true, __ATOMIC_RELAXED);
+	return pid;
+}
+
+/* Returns 0 on success. */
+int stop_cpuview_daemon(pthread_t pid)
+{
+	__atomic_store_n(&cpuview_running, false, __ATOMIC_RELAXED);
+	cpuview_stop = 1;
+	if (pthread_join(pid, NULL) != 0) {
+		lxcfs_error("%s\n", "stop_cpuview_daemon error: failed to join");
+		return -1;
 	}
+	cpuview_stop = 0;
+	return 0;
+}
 
-	buf += l;
-	buf_size -= l;
-	total_len += l;
+/*
+ * Render /proc/stat for @cg from the view the cpuview daemon keeps up to
+ * date.  Returns 0 if there is none recent enough.
+ */
+static size_t cpuview_proc_stat_cached(const char *cg, struct file_info *d)
+{
+	char *buf = d->buf;
+	size_t buf_size = d->buflen;
+	struct cg_proc_stat_head *head = proc_stat_history[calc_hash(cg) % CPUVIEW_HASH_SIZE];
+	struct cg_proc_stat *node;
+	struct host_snapshot *snap = NULL;
+	char *line = NULL;
+	size_t linelen = 0, total_len = 0, l = 0;
+	uint64_t now = monotonic_ms();
+	FILE *f;
 
-	/* Pass the rest of the host's /proc/stat */
-	while (getline(&line, &linelen, f) != -1) {
-		l = snprintf(buf, buf_size, "%s", line);
-		if (l < 0) {
-			perror("Error writing to cache");
-			rv = 0;
-			goto err;
-		}
-		if (l >= buf_size) {
-			lxcfs_error("%s\n", "Internal error: truncated write to cache.");
-			rv = 0;
-			goto err;
-		}
-		buf += l;
-		buf_size -= l;
-		total_len += l;
+	if (!__atomic_load_n(&cpuview_running, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_rwlock_rdlock(&head->lock);
+	node = locate_proc_stat_node(head, cg);
+	if (node) {
+		pthread_mutex_lock(&node->lock);
+		__atomic_store_n(&node->last_read, now, __ATOMIC_RELAXED);
+		if (node->updated && now - node->updated <= 2 * CPUVIEW_TICK_MS)
+			total_len = cpuview_render(node, buf, buf_size, &d->truncated);
+		pthread_mutex_unlock(&node->lock);
 	}
+	pthread_rwlock_unlock(&head->lock);
+	if (total_len == 0)
+		return 0;
 
-	rv = total_len;
+	/* The rest of the host's /proc/stat, past its cpu lines. */
+	f = open_host_file(HOST_PROC_STAT, &snap);
+	if (f) {
+		while (getline(&line, &linelen, f) != -1) {
+			if (strncmp(line, "cpu", 3) == 0)
+				continue;
+			l = cpuview_copy_rest(f, &line, &linelen, buf + total_len,
+					      buf_size - total_len, &d->truncated);
+			break;
+		}
+	}
+	close_host_file(HOST_PROC_STAT, f, snap);
+	free(line);
 
-err:
-	if (stat_node)
-		pthread_mutex_unlock(&stat_node->lock);
-	if (line)
-		free(line);
-	if (diff)
-		free(diff);
-	return rv;
+	return l ? total_len + l : 0;
 }
 
 #define CPUALL_MAX_SIZE (BUF_RESERVE_SIZE / 2)
 static int proc_stat_read(char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	struct file_info *d = (struct file_info *)fi->fh;
 	char *cg;
-	char *cpuset = NULL;
+	struct cpumask *cpus = NULL;
 	char *line = NULL;
 	size_t linelen = 0, total_len = 0, rv = 0;
 	int curcpu = -1; /* cpu numbering starts at 0 */
@@ -4865,7 +7036,8 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 	char *cache = d->buf + CPUALL_MAX_SIZE;
 	size_t cache_size = d->buflen - CPUALL_MAX_SIZE;
 	FILE *f = NULL;
-	struct cpuacct_usage *cg_cpu_usage = NULL;
+	struct host_snapshot *snap = NULL;
+	struct cpu_usage cg_cpu_usage = { NULL };
 	int cg_cpu_usage_size = 0;
 
 	if (offset){
@@ -4879,10 +7051,9 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 		return total_len;
 	}
 
-	pid_t initpid = lookup_initpid_in_store(fc->pid);
+	pid_t initpid;
+	cg = get_container_cgroup(fc->pid, LXC_CTRL_CPUSET, &initpid);
 	lxcfs_v("initpid: %d\n", initpid);
-	if (initpid <= 0)
-		initpid = fc->pid;
 
 	/*
 	 * when container run with host pid namespace initpid == 1, cgroup will "/"
@@ -4890,17 +7061,22 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 	 * in some case cpuacct_usage.all in "/" will larger then /proc/stat
 	 */
 	if (initpid == 1) {
+	    free(cg);
 	    return read_file("/proc/stat", buf, size, d);
 	}
 
-	cg = get_pid_cgroup(initpid, "cpuset");
 	lxcfs_v("cg: %s\n", cg);
 	if (!cg)
 		return read_file("/proc/stat", buf, size, d);
-	prune_init_slice(cg);
 
-	cpuset = get_cpuset(cg);
-	if (!cpuset)
+	if (use_cpuview(cg)) {
+		total_len = cpuview_proc_stat_cached(cg, d);
+		if (total_len > 0)
+			goto out;
+	}
+
+	cpus = get_container_cpumask(fc->pid, cg);
+	if (!cpus)
 		goto err;
 
 	/*
@@ -4908,12 +7084,12 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 	 * If the cpuacct cgroup is present, it is used to calculate the container's
 	 * CPU usage. If not, values from the host's /proc/stat are used.
 	 */
-	if (read_cpuacct_usage_all(cg, cpuset, &cg_cpu_usage, &cg_cpu_usage_size) != 0) {
+	if (read_cpuacct_usage_all(cg, &cg_cpu_usage, &cg_cpu_usage_size) != 0) {
 		lxcfs_v("%s\n", "proc_stat_read failed to read from cpuacct, "
 				"falling back to the host's /proc/stat");
 	}
 
-	f = fopen("/proc/stat", "r");
+	f = open_host_file(HOST_PROC_STAT, &snap);
 	if (!f)
 		goto err;
 
@@ -4923,9 +7099,9 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 		goto err;
 	}
 
-	if (use_cpuview(cg) && cg_cpu_usage) {
-		total_len = cpuview_proc_stat(cg, cpuset, cg_cpu_usage, cg_cpu_usage_size,
-				f, d->buf, d->buflen);
+	if (use_cpuview(cg) && cg_cpu_usage.user) {
+		total_len = cpuview_proc_stat(cg, cpus, &cg_cpu_usage, cg_cpu_usage_size,
+				f, d);
 		goto out;
 	}
 
@@ -4947,7 +7123,7 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 				goto err;
 			}
 			if (l >= cache_size) {
-				lxcfs_error("%s\n", "Internal error: truncated write to cache.");
+				d->truncated = true;
 				rv = 0;
 				goto err;
 			}
@@ -4959,7 +7135,7 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 
 		if (sscanf(cpu_char, "%d", &physcpu) != 1)
 			continue;
-		if (!cpu_in_cpuset(physcpu, cpuset))
+		if (!cpumask_test(cpus, physcpu))
 			continue;
 		curcpu ++;
 
@@ -4975,7 +7151,7 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 			   &guest,
 			   &guest_nice);
 
-		if (ret != 10 || !cg_cpu_usage) {
+		if (ret != 10 || !cg_cpu_usage.user) {
 			c = strchr(line, ' ');
 			if (!c)
 				continue;
@@ -4987,7 +7163,7 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 
 			}
 			if (l >= cache_size) {
-				lxcfs_error("%s\n", "Internal error: truncated write to cache.");
+				d->truncated = true;
 				rv = 0;
 				goto err;
 			}
@@ -5000,12 +7176,12 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 				continue;
 		}
 
-		if (cg_cpu_usage) {
+		if (cg_cpu_usage.user) {
 			if (physcpu >= cg_cpu_usage_size)
 				break;
 
 			all_used = user + nice + system + iowait + irq + softirq + steal + guest + guest_nice;
-			cg_used = cg_cpu_usage[physcpu].user + cg_cpu_usage[physcpu].system;
+			cg_used = cg_cpu_usage.user[physcpu] + cg_cpu_usage.system[physcpu];
 
 			if (all_used >= cg_used) {
 				new_idle = idle + (all_used - cg_used);
@@ -5018,7 +7194,7 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 			}
 
 			l = snprintf(cache, cache_size, "cpu%d %lu 0 %lu %lu 0 0 0 0 0 0\n",
-					curcpu, cg_cpu_usage[physcpu].user, cg_cpu_usage[physcpu].system,
+					curcpu, cg_cpu_usage.user[physcpu], cg_cpu_usage.system[physcpu],
 					new_idle);
 
 			if (l < 0) {
@@ -5028,7 +7204,7 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 
 			}
 			if (l >= cache_size) {
-				lxcfs_error("%s\n", "Internal error: truncated write to cache.");
+				d->truncated = true;
 				rv = 0;
 				goto err;
 			}
@@ -5037,8 +7213,8 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 			cache_size -= l;
 			total_len += l;
 
-			user_sum += cg_cpu_usage[physcpu].user;
-			system_sum += cg_cpu_usage[physcpu].system;
+			user_sum += cg_cpu_usage.user[physcpu];
+			system_sum += cg_cpu_usage.system[physcpu];
 			idle_sum += new_idle;
 
 		} else {
@@ -5086,16 +7262,14 @@ out:
 	if (total_len > size)
 		total_len = size;
 
-	memcpy(buf, d->buf, total_len);
+	copy_rendered(buf, d, total_len);
 	rv = total_len;
 
 err:
-	if (f)
-		fclose(f);
-	if (cg_cpu_usage)
-		free(cg_cpu_usage);
+	close_host_file(HOST_PROC_STAT, f, snap);
+	cpu_usage_free(&cg_cpu_usage);
 	free(line);
-	free(cpuset);
+	cpumask_free(cpus);
 	free(cg);
 	return rv;
 }
@@ -5109,19 +7283,14 @@ err:
  */
 static double get_reaper_busy(pid_t task)
 {
-	pid_t initpid = lookup_initpid_in_store(task);
 	char *cgroup = NULL, *usage_str = NULL;
 	unsigned long usage = 0;
 	double res = 0;
 
-	if (initpid <= 0)
-		return 0;
-
-	cgroup = get_pid_cgroup(initpid, "cpuacct");
+	cgroup = get_container_cgroup(task, LXC_CTRL_CPUACCT, NULL);
 	if (!cgroup)
 		goto out;
-	prune_init_slice(cgroup);
-	if (!cgfs_get_value("cpuacct", cgroup, "cpuacct.usage", &usage_str))
+	if (!ctrl_get_value(LXC_CTRL_CPUACCT, cgroup, "cpuacct.usage", &usage_str))
 		goto out;
 	usage = strtoul(usage_str, NULL, 10);
 	res = (double)usage / 1000000000;
@@ -5151,7 +7320,7 @@ void iwashere(void)
 static int proc_uptime_read(char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	struct file_info *d = (struct file_info *)fi->fh;
 	double busytime = get_reaper_busy(fc->pid);
 	char *cache = d->buf;
@@ -5192,7 +7361,7 @@ static int proc_uptime_read(char *buf, size_t size, off_t offset,
 
 	if (total_len > size) total_len = size;
 
-	memcpy(buf, d->buf, total_len);
+	copy_rendered(buf, d, total_len);
 	return total_len;
 }
 
@@ -5200,7 +7369,7 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
 	char dev_name[72];
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	struct file_info *d = (struct file_info *)fi->fh;
 	char *cg;
 	char *io_serviced_str = NULL, *io_merged_str = NULL, *io_service_bytes_str = NULL,
@@ -5218,6 +7387,7 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 	unsigned int major = 0, minor = 0;
 	int i = 0;
 	FILE *f = NULL;
+	struct host_snapshot *snap = NULL;
 
 	if (offset){
 		if (offset > d->size)
@@ -5230,27 +7400,23 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 		return total_len;
 	}
 
-	pid_t initpid = lookup_initpid_in_store(fc->pid);
-	if (initpid <= 0)
-		initpid = fc->pid;
-	cg = get_pid_cgroup(initpid, "blkio");
+	cg = get_container_cgroup(fc->pid, LXC_CTRL_BLKIO, NULL);
 	if (!cg)
 		return read_file("/proc/diskstats", buf, size, d);
-	prune_init_slice(cg);
 
-	if (!cgfs_get_value("blkio", cg, "blkio.io_serviced_recursive", &io_serviced_str))
+	if (!ctrl_get_value(LXC_CTRL_BLKIO, cg, "blkio.io_serviced_recursive", &io_serviced_str))
 		goto err;
-	if (!cgfs_get_value("blkio", cg, "blkio.io_merged_recursive", &io_merged_str))
+	if (!ctrl_get_value(LXC_CTRL_BLKIO, cg, "blkio.io_merged_recursive", &io_merged_str))
 		goto err;
-	if (!cgfs_get_value("blkio", cg, "blkio.io_service_bytes_recursive", &io_service_bytes_str))
+	if (!ctrl_get_value(LXC_CTRL_BLKIO, cg, "blkio.io_service_bytes_recursive", &io_service_bytes_str))
 		goto err;
-	if (!cgfs_get_value("blkio", cg, "blkio.io_wait_time_recursive", &io_wait_time_str))
+	if (!ctrl_get_value(LXC_CTRL_BLKIO, cg, "blkio.io_wait_time_recursive", &io_wait_time_str))
 		goto err;
-	if (!cgfs_get_value("blkio", cg, "blkio.io_service_time_recursive", &io_service_time_str))
+	if (!ctrl_get_value(LXC_CTRL_BLKIO, cg, "blkio.io_service_time_recursive", &io_service_time_str))
 		goto err;
 
 
-	f = fopen("/proc/diskstats", "r");
+	f = open_host_file(HOST_PROC_DISKSTATS, &snap);
 	if (!f)
 		goto err;
 
@@ -5301,7 +7467,7 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 			goto err;
 		}
 		if (l >= cache_size) {
-			lxcfs_error("%s\n", "Internal error: truncated write to cache.");
+			d->truncated = true;
 			rv = 0;
 			goto err;
 		}
@@ -5313,13 +7479,12 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 	d->cached = 1;
 	d->size = total_len;
 	if (total_len > size ) total_len = size;
-	memcpy(buf, d->buf, total_len);
+	copy_rendered(buf, d, total_len);
 
 	rv = total_len;
 err:
 	free(cg);
-	if (f)
-		fclose(f);
+	close_host_file(HOST_PROC_DISKSTATS, f, snap);
 	free(line);
 	free(io_serviced_str);
 	free(io_merged_str);
@@ -5332,7 +7497,7 @@ err:
 static int proc_swaps_read(char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	struct file_info *d = (struct file_info *)fi->fh;
 	char *cg = NULL;
 	char *memswlimit_str = NULL, *memlimit_str = NULL, *memusage_str = NULL, *memswusage_str = NULL;
@@ -5352,353 +7517,1172 @@ static int proc_swaps_read(char *buf, size_t size, off_t offset,
 		return total_len;
 	}
 
-	pid_t initpid = lookup_initpid_in_store(fc->pid);
-	if (initpid <= 0)
-		initpid = fc->pid;
-	cg = get_pid_cgroup(initpid, "memory");
+	cg = get_container_cgroup(fc->pid, LXC_CTRL_MEMORY, NULL);
 	if (!cg)
 		return read_file("/proc/swaps", buf, size, d);
-	prune_init_slice(cg);
 
-	memlimit = get_min_memlimit(cg, "memory.limit_in_bytes");
+	memlimit = get_min_memlimit(cg, "memory.limit_in_bytes");
+
+	if (!ctrl_get_value(LXC_CTRL_MEMORY, cg, "memory.usage_in_bytes", &memusage_str))
+		goto err;
+
+	memusage = strtoul(memusage_str, NULL, 10);
+
+	if (ctrl_get_value(LXC_CTRL_MEMORY, cg, "memory.memsw.usage_in_bytes", &memswusage_str) &&
+	    ctrl_get_value(LXC_CTRL_MEMORY, cg, "memory.memsw.limit_in_bytes", &memswlimit_str)) {
+
+		memswlimit = get_min_memlimit(cg, "memory.memsw.limit_in_bytes");
+		memswusage = strtoul(memswusage_str, NULL, 10);
+
+		swap_total = (memswlimit - memlimit) / 1024;
+		swap_free = (memswusage - memusage) / 1024;
+	}
+
+	total_len = snprintf(d->buf, d->buflen, "Filename\t\t\t\tType\t\tSize\tUsed\tPriority\n");
+
+	/* When no mem + swap limit is specified or swapaccount=0*/
+	if (!memswlimit) {
+		struct host_snapshot *snap;
+		char *line = NULL;
+		size_t linelen = 0;
+		FILE *f = open_host_file(HOST_PROC_MEMINFO, &snap);
+
+		if (!f)
+			goto err;
+
+		while (getline(&line, &linelen, f) != -1) {
+			if (startswith(line, "SwapTotal:")) {
+				sscanf(line, "SwapTotal:      %8lu kB", &swap_total);
+			} else if (startswith(line, "SwapFree:")) {
+				sscanf(line, "SwapFree:      %8lu kB", &swap_free);
+			}
+		}
+
+		free(line);
+		close_host_file(HOST_PROC_MEMINFO, f, snap);
+	}
+
+	if (swap_total > 0) {
+		l = snprintf(d->buf + total_len, d->buflen - total_len,
+				"none%*svirtual\t\t%lu\t%lu\t0\n", 36, " ",
+				swap_total, swap_free);
+		total_len += l;
+	}
+
+	if (total_len < 0 || l < 0) {
+		perror("Error writing to cache");
+		rv = 0;
+		goto err;
+	}
+
+	d->cached = 1;
+	d->size = (int)total_len;
+
+	if (total_len > size) total_len = size;
+	copy_rendered(buf, d, total_len);
+	rv = total_len;
+
+err:
+	free(cg);
+	free(memswlimit_str);
+	free(memlimit_str);
+	free(memusage_str);
+	free(memswusage_str);
+	return rv;
+}
+/*
+ * The loadavg sampler reads the thread ids of each tracked cgroup from its
+ * "tasks" file (cgroup.threads on cgroup2) and the state of each thread from
+ * /proc/<tid>/stat.  Every load_node keeps the threads it saw last time
+ * sorted by tid together with an open fd for their stat file, so a thread
+ * that stays around costs a single pread() per pass.  At most
+ * FD_SHARE_LOAD_STAT quarters of the fd budget, see fd_cache_max(), are
+ * spent on those fds; threads beyond that get their stat file opened for
+ * each pass.  The scratch buffers of a pass live in a
+ * load_sampler which is reused from one pass to the next.
+ */
+struct load_sampler {
+	char *buf;		/* contents of a tasks file */
+	size_t buf_size;
+	pid_t *tids;		/* threads found in this pass */
+	int nr_tids;
+	int size_tids;
+	struct load_tid *merged;	/* becomes the node's next thread list */
+	int size_merged;
+};
+
+static void free_load_tids(struct load_tid *tids, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (tids[i].fd >= 0) {
+			close(tids[i].fd);
+			__atomic_sub_fetch(&load_fds_open, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void free_load_sampler(struct load_sampler *s)
+{
+	free(s->buf);
+	free(s->tids);
+	free(s->merged);
+	memset(s, 0, sizeof(*s));
+}
+
+static void load_sampler_add_tid(struct load_sampler *s, pid_t tid)
+{
+	if (s->nr_tids == s->size_tids) {
+		int newsize = s->size_tids ? 2 * s->size_tids : 256;
+		pid_t *tmp;
+
+		do {
+			tmp = realloc(s->tids, newsize * sizeof(pid_t));
+		} while (!tmp);
+		s->tids = tmp;
+		s->size_tids = newsize;
+	}
+	s->tids[s->nr_tids++] = tid;
+}
+
+/* Append the thread ids listed in @file of directory @dfd to @s->tids. */
+static void load_read_tids(struct load_sampler *s, int dfd, const char *file)
+{
+	size_t len = 0;
+	ssize_t ret;
+	char *p, *end;
+	long tid;
+	int fd;
+
+	fd = openat(dfd, file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	for (;;) {
+		if (len + 1 >= s->buf_size) {
+			size_t newsize = s->buf_size ? 2 * s->buf_size : 4096;
+			char *tmp;
+
+			do {
+				tmp = realloc(s->buf, newsize);
+			} while (!tmp);
+			s->buf = tmp;
+			s->buf_size = newsize;
+		}
+		ret = read(fd, s->buf + len, s->buf_size - len - 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+	close(fd);
+	if (!len)
+		return;
+	s->buf[len] = '\0';
+
+	for (p = s->buf; ; p = end) {
+		tid = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		load_sampler_add_tid(s, tid);
+	}
+}
+
+/*
+ * Collect the threads of cgroup @name below directory @parentfd and of its
+ * descendants down to @depth levels.  Returns false if the cgroup is gone.
+ */
+static bool load_collect_tids(struct load_sampler *s, int parentfd,
+			      const char *name, int depth, bool unified)
+{
+	struct dirent *file;
+	DIR *dir;
+	int dfd;
+
+	dfd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+		return false;
+
+	load_read_tids(s, dfd, unified ? "cgroup.threads" : "tasks");
+
+	if (depth <= 0) {
+		close(dfd);
+		return true;
+	}
+
+	dir = fdopendir(dfd);
+	if (!dir) {
+		close(dfd);
+		return true;
+	}
+	while ((file = readdir(dir)) != NULL) {
+		if (file->d_type != DT_DIR || file->d_name[0] == '.')
+			continue;
+		load_collect_tids(s, dirfd(dir), file->d_name, depth - 1, unified);
+	}
+	closedir(dir);
+
+	return true;
+}
+
+/*
+ * Return the state of thread @tid, reading it through its cached stat fd
+ * @fd if there is one and caching the fd if there is room.  0 if the
+ * thread is gone.  Unless @reopen, a thread whose cached fd fails is gone
+ * even if @tid exists again.
+ */
+static char load_tid_state(pid_t tid, int *fd, bool reopen)
+{
+	char stat[128], path[LXCFS_NUMSTRLEN64 + 12], *p;
+	ssize_t ret = -1;
+	int newfd;
+
+	/* A cached fd keeps reading the thread it was opened for, which
+	 * fails once that one got reaped and @tid possibly reused. */
+	if (*fd >= 0) {
+		ret = pread(*fd, stat, sizeof(stat) - 1, 0);
+		if (ret <= 0) {
+			close(*fd);
+			*fd = -1;
+			__atomic_sub_fetch(&load_fds_open, 1, __ATOMIC_RELAXED);
+			if (!reopen)
+				return 0;
+		}
+	}
+
+	if (ret <= 0) {
+		snprintf(path, sizeof(path), "/proc/%d/stat", tid);
+		newfd = open(path, O_RDONLY | O_CLOEXEC);
+		if (newfd < 0)
+			return 0;
+		ret = pread(newfd, stat, sizeof(stat) - 1, 0);
+		if (ret > 0 && __atomic_add_fetch(&load_fds_open, 1, __ATOMIC_RELAXED) <= load_fds_max) {
+			*fd = newfd;
+		} else {
+			if (ret > 0)
+				__atomic_sub_fetch(&load_fds_open, 1, __ATOMIC_RELAXED);
+			close(newfd);
+		}
+		if (ret <= 0)
+			return 0;
+	}
+
+	/* "tid (comm) S ...": comm may contain anything, the state follows
+	 * the last ')'. */
+	stat[ret] = '\0';
+	p = strrchr(stat, ')');
+	if (!p || p[1] != ' ')
+		return 0;
+	return p[2];
+}
+
+static int cmp_pid(const void *a, const void *b)
+{
+	pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * calc_load calculates the load according to the following formula:
+ * load1 = load0 * exp + active * (1 - exp)
+ *
+ * @load1: the new loadavg.
+ * @load0: the former loadavg.
+ * @active: the number of active tasks at this moment, as fixed-point.
+ * @exp: the fixed-point defined in the beginning.
+ */
+static unsigned long
+calc_load(unsigned long load, unsigned long exp, unsigned long active)
+{
+	unsigned long newload;
+
+	newload = load * exp + active * (FIXED_1 - exp);
+	if (active >= load)
+		newload += FIXED_1 - 1;
+
+	return newload / FIXED_1;
+}
+
+/* x^n in fixed point with @frac_bits bits of precision. */
+static unsigned long
+fixed_power_int(unsigned long x, unsigned int frac_bits, unsigned int n)
+{
+	unsigned long result = 1UL << frac_bits;
+
+	while (n) {
+		if (n & 1) {
+			result *= x;
+			result += 1UL << (frac_bits - 1);
+			result >>= frac_bits;
+		}
+		n >>= 1;
+		if (!n)
+			break;
+		x *= x;
+		x += 1UL << (frac_bits - 1);
+		x >>= frac_bits;
+	}
+
+	return result;
+}
 
-	if (!cgfs_get_value("memory", cg, "memory.usage_in_bytes", &memusage_str))
-		goto err;
+/*
+ * calc_load_n applies @n periods of calc_load at once, as if @active had
+ * stayed the same all along:
+ * load_n = load0 * exp^n + active * (1 - exp^n)
+ */
+static unsigned long
+calc_load_n(unsigned long load, unsigned long exp, unsigned long active,
+	    unsigned int n)
+{
+	return calc_load(load, fixed_power_int(exp, FSHIFT, n), active);
+}
 
-	memusage = strtoul(memusage_str, NULL, 10);
+/*
+ * With LOAD_ENGINE_CONN, the threads of a cgroup are only read from its
+ * tasks files every LOAD_RESYNC_PASSES.  In between, the kernel's proc
+ * connector tells about every new thread: load_conn_listen() queues them
+ * with the thread they were forked from and load_conn_drain() sorts them
+ * by it before each pass.  A new thread starts in the cgroup of its
+ * parent, so refresh_load() adds those forked by a thread the node already
+ * tracks, without looking at /proc.  Threads that exit drop out when their
+ * stat file can no longer be read.  The connector doesn't report threads moving between
+ * cgroups, which the periodic resync picks up, as it does after events
+ * have been lost.
+ */
+struct load_fork {
+	pid_t parent;		/* the thread @tid was forked from */
+	pid_t tid;
+};
 
-	if (cgfs_get_value("memory", cg, "memory.memsw.usage_in_bytes", &memswusage_str) &&
-	    cgfs_get_value("memory", cg, "memory.memsw.limit_in_bytes", &memswlimit_str)) {
+static struct load_conn {
+	int fd;			/* netlink socket, -1 if not listening */
+	int evfd;		/* to stop load_conn_listen() */
+	pthread_t thread;
+	pthread_mutex_t lock;	/* for the fields below */
+	struct load_fork *forks; /* threads created since the last drain */
+	int nr_forks;
+	int size_forks;
+	bool lost;		/* events were lost since the last drain */
+	/* Only touched by load_conn_drain() and, during a pass, read. */
+	struct load_fork *drained; /* the previous forks, sorted by parent */
+	int nr_drained;
+	int size_drained;
+	unsigned int pass;	/* atomic, the number of the current pass */
+	unsigned int lost_pass;	/* nodes synced before this must resync */
+} load_conn = {
+	.fd = -1,
+	.evfd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-		memswlimit = get_min_memlimit(cg, "memory.memsw.limit_in_bytes");
-		memswusage = strtoul(memswusage_str, NULL, 10);
+static void load_conn_queue(pid_t parent, pid_t tid)
+{
+	struct load_fork *tmp;
 
-		swap_total = (memswlimit - memlimit) / 1024;
-		swap_free = (memswusage - memusage) / 1024;
+	lock_mutex(&load_conn.lock);
+	if (load_conn.nr_forks == load_conn.size_forks) {
+		int newsize = load_conn.size_forks ? 2 * load_conn.size_forks : 1024;
+
+		tmp = NULL;
+		if (newsize <= LOAD_CONN_MAX_FORKS)
+			tmp = realloc(load_conn.forks, newsize * sizeof(*tmp));
+		if (!tmp) {
+			/* Everybody will resync instead. */
+			load_conn.lost = true;
+			load_conn.nr_forks = 0;
+			unlock_mutex(&load_conn.lock);
+			return;
+		}
+		load_conn.forks = tmp;
+		load_conn.size_forks = newsize;
 	}
+	load_conn.forks[load_conn.nr_forks].parent = parent;
+	load_conn.forks[load_conn.nr_forks].tid = tid;
+	load_conn.nr_forks++;
+	unlock_mutex(&load_conn.lock);
+}
 
-	total_len = snprintf(d->buf, d->size, "Filename\t\t\t\tType\t\tSize\tUsed\tPriority\n");
+static void load_conn_set_lost(void)
+{
+	lock_mutex(&load_conn.lock);
+	load_conn.lost = true;
+	load_conn.nr_forks = 0;
+	unlock_mutex(&load_conn.lock);
+}
 
-	/* When no mem + swap limit is specified or swapaccount=0*/
-	if (!memswlimit) {
-		char *line = NULL;
-		size_t linelen = 0;
-		FILE *f = fopen("/proc/meminfo", "r");
+static void *load_conn_listen(void *arg)
+{
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct pollfd pfds[2] = {
+		{ .fd = load_conn.fd, .events = POLLIN },
+		{ .fd = load_conn.evfd, .events = POLLIN },
+	};
+	struct nlmsghdr *nlh;
+	struct cn_msg *cn;
+	struct proc_event *ev;
+	pid_t parent;
+	ssize_t len;
 
-		if (!f)
-			goto err;
+	for (;;) {
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfds[1].revents)
+			return NULL;
 
-		while (getline(&line, &linelen, f) != -1) {
-			if (startswith(line, "SwapTotal:")) {
-				sscanf(line, "SwapTotal:      %8lu kB", &swap_total);
-			} else if (startswith(line, "SwapFree:")) {
-				sscanf(line, "SwapFree:      %8lu kB", &swap_free);
+		len = recv(load_conn.fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			/* The socket's buffer overflowed. */
+			if (errno == ENOBUFS) {
+				load_conn_set_lost();
+				continue;
 			}
+			break;
+		}
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type != NLMSG_DONE)
+				continue;
+			cn = NLMSG_DATA(nlh);
+			if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+				continue;
+			ev = (struct proc_event *)cn->data;
+			if (ev->what != PROC_EVENT_FORK)
+				continue;
+			/*
+			 * The parent of a new thread of a process is that of
+			 * the process, the thread is rather where its group
+			 * leader is.
+			 */
+			parent = ev->event_data.fork.parent_pid;
+			if (ev->event_data.fork.child_pid != ev->event_data.fork.child_tgid)
+				parent = ev->event_data.fork.child_tgid;
+			load_conn_queue(parent, ev->event_data.fork.child_pid);
 		}
-
-		free(line);
-		fclose(f);
 	}
 
-	if (swap_total > 0) {
-		l = snprintf(d->buf + total_len, d->size - total_len,
-				"none%*svirtual\t\t%lu\t%lu\t0\n", 36, " ",
-				swap_total, swap_free);
-		total_len += l;
-	}
+	lxcfs_error("Stopped listening to the proc connector: %s.\n", strerror(errno));
+	/* Makes every node read its tasks files at each pass from now on. */
+	lock_mutex(&load_conn.lock);
+	load_conn.lost = true;
+	close(load_conn.fd);
+	load_conn.fd = -1;
+	unlock_mutex(&load_conn.lock);
+	return NULL;
+}
 
-	if (total_len < 0 || l < 0) {
-		perror("Error writing to cache");
-		rv = 0;
+static void load_conn_stop(void)
+{
+	uint64_t one = 1;
+
+	if (load_conn.evfd < 0)
+		return;
+
+	if (write(load_conn.evfd, &one, sizeof(one)) != sizeof(one))
+		lxcfs_error("%s\n", "Failed to stop the proc connector listener.");
+	pthread_join(load_conn.thread, NULL);
+	close(load_conn.evfd);
+	load_conn.evfd = -1;
+	if (load_conn.fd >= 0)
+		close(load_conn.fd);
+	load_conn.fd = -1;
+
+	free(load_conn.forks);
+	free(load_conn.drained);
+	load_conn.forks = load_conn.drained = NULL;
+	load_conn.nr_forks = load_conn.size_forks = 0;
+	load_conn.nr_drained = load_conn.size_drained = 0;
+	load_conn.lost = false;
+	load_conn.pass = load_conn.lost_pass = 0;
+}
+
+/* Subscribe to the proc connector, needs CAP_NET_ADMIN in the init netns. */
+static int load_conn_start(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = CN_IDX_PROC,
+	};
+	struct {
+		struct nlmsghdr nlh;
+		struct cn_msg cn;
+		enum proc_cn_mcast_op op;
+	} __attribute__((__packed__)) msg;
+	int rcvbuf = 4 * 1024 * 1024;
+
+	load_conn.fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (load_conn.fd < 0)
+		return -1;
+	if (bind(load_conn.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto err;
+	/* Not fatal, a burst of forks just gets more likely to overflow it. */
+	setsockopt(load_conn.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len = sizeof(msg);
+	msg.nlh.nlmsg_type = NLMSG_DONE;
+	msg.nlh.nlmsg_pid = getpid();
+	msg.cn.id.idx = CN_IDX_PROC;
+	msg.cn.id.val = CN_VAL_PROC;
+	msg.cn.len = sizeof(msg.op);
+	msg.op = PROC_CN_MCAST_LISTEN;
+	if (send(load_conn.fd, &msg, sizeof(msg), 0) != sizeof(msg))
+		goto err;
+
+	load_conn.evfd = eventfd(0, EFD_CLOEXEC);
+	if (load_conn.evfd < 0)
+		goto err;
+	if (pthread_create(&load_conn.thread, NULL, load_conn_listen, NULL) != 0) {
+		close(load_conn.evfd);
+		load_conn.evfd = -1;
 		goto err;
 	}
+	return 0;
 
-	d->cached = 1;
-	d->size = (int)total_len;
+err:
+	close(load_conn.fd);
+	load_conn.fd = -1;
+	return -1;
+}
 
-	if (total_len > size) total_len = size;
-	memcpy(buf, d->buf, total_len);
-	rv = total_len;
+static int cmp_fork_parent(const void *a, const void *b)
+{
+	pid_t x = ((const struct load_fork *)a)->parent;
+	pid_t y = ((const struct load_fork *)b)->parent;
 
-err:
-	free(cg);
-	free(memswlimit_str);
-	free(memlimit_str);
-	free(memusage_str);
-	free(memswusage_str);
-	return rv;
+	return (x > y) - (x < y);
 }
+
 /*
- * Find the process pid from cgroup path.
- * eg:from /sys/fs/cgroup/cpu/docker/containerid/cgroup.procs to find the process pid.
- * @pid_buf : put pid to pid_buf.
- * @dpath : the path of cgroup. eg: /docker/containerid or /docker/containerid/child-cgroup ...
- * @depth : the depth of cgroup in container.
- * @sum : return the number of pid.
- * @cfd : the file descriptor of the mounted cgroup. eg: /sys/fs/cgroup/cpu
+ * Start pass number @pass, handing out the threads forked since the last
+ * one.  Called by load_begin() between two passes.
  */
-static int calc_pid(char ***pid_buf, char *dpath, int depth, int sum, int cfd)
+static void load_conn_drain(unsigned int pass)
 {
-	DIR *dir;
+	struct load_fork *forks;
+	int nr, size;
+	bool lost;
+
+	__atomic_store_n(&load_conn.pass, pass, __ATOMIC_RELAXED);
+
+	lock_mutex(&load_conn.lock);
+	forks = load_conn.forks;
+	nr = load_conn.nr_forks;
+	size = load_conn.size_forks;
+	load_conn.forks = load_conn.drained;
+	load_conn.size_forks = load_conn.size_drained;
+	load_conn.nr_forks = 0;
+	/* Once not listening anymore, everybody keeps resyncing. */
+	lost = load_conn.lost || load_conn.fd < 0;
+	load_conn.lost = false;
+	unlock_mutex(&load_conn.lock);
+
+	if (lost) {
+		load_conn.lost_pass = pass;
+		nr = 0;
+	}
+	qsort(forks, nr, sizeof(*forks), cmp_fork_parent);
+
+	load_conn.drained = forks;
+	load_conn.nr_drained = nr;
+	load_conn.size_drained = size;
+}
+
+/* Append to @s->tids the threads forked by @parent since the last pass. */
+static void load_add_forked(struct load_sampler *s, pid_t parent)
+{
+	const struct load_fork *forks = load_conn.drained;
+	int lo = 0, hi = load_conn.nr_drained, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (forks[mid].parent < parent)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < load_conn.nr_drained && forks[lo].parent == parent; lo++)
+		load_sampler_add_tid(s, forks[lo].tid);
+}
+
+/* Whether @p's threads are known without reading its tasks files. */
+static bool load_tids_known(struct load_node *p)
+{
+	unsigned int pass = __atomic_load_n(&load_conn.pass, __ATOMIC_RELAXED);
+
+	return loadavg == LOAD_ENGINE_CONN && p->synced_pass != 0 &&
+	       p->synced_pass >= load_conn.lost_pass &&
+	       pass - p->synced_pass < LOAD_RESYNC_PASSES;
+}
+
+/*
+ * Return 0 means that container p->cg is closed.
+ * Positive num equals the total number of pid.
+ * @ticks is the number of FLUSH_TIME periods since the last refresh.
+ */
+static int refresh_load(struct load_sampler *s, struct load_node *p,
+			const char *path, unsigned int ticks)
+{
+	struct load_tid *old = p->tids, *tmp;
+	struct load_avg avg;
+	int i, j = 0, n = 0, run_pid = 0;
+	bool known = load_tids_known(p);
+	char state;
 	int fd;
-	struct dirent *file;
-	FILE *f = NULL;
-	size_t linelen = 0;
-	char *line = NULL;
-	int pd;
-	char *path_dir, *path;
-	char **pid;
 
-	/* path = dpath + "/cgroup.procs" + /0 */
-	do {
-		path = malloc(strlen(dpath) + 20);
-	} while (!path);
+	s->nr_tids = 0;
+	if (known) {
+		for (i = 0; i < p->nr_tids; i++)
+			load_sampler_add_tid(s, p->tids[i].tid);
+		/* This also picks up the threads forked by the new ones. */
+		for (i = 0; i < s->nr_tids && load_conn.nr_drained; i++)
+			load_add_forked(s, s->tids[i]);
+	} else {
+		if (!load_collect_tids(s, p->cfd, path, DEPTH_DIR,
+				       ctrl_table[LXC_CTRL_CPU].unified))
+			return 0;
+		p->synced_pass = __atomic_load_n(&load_conn.pass, __ATOMIC_RELAXED);
+	}
+	/*  normal exit  */
+	if (s->nr_tids == 0)
+		return 0;
 
-	strcpy(path, dpath);
-	fd = openat(cfd, path, O_RDONLY);
-	if (fd < 0)
-		goto out;
+	qsort(s->tids, s->nr_tids, sizeof(pid_t), cmp_pid);
 
-	dir = fdopendir(fd);
-	if (dir == NULL) {
-		close(fd);
-		goto out;
+	if (s->size_merged < s->nr_tids) {
+		do {
+			tmp = realloc(s->merged, s->nr_tids * sizeof(*tmp));
+		} while (!tmp);
+		s->merged = tmp;
+		s->size_merged = s->nr_tids;
 	}
 
-	while (((file = readdir(dir)) != NULL) && depth > 0) {
-		if (strncmp(file->d_name, ".", 1) == 0)
+	/* Walk the old and new sorted thread lists side by side. */
+	for (i = 0; i < s->nr_tids; i++) {
+		pid_t tid = s->tids[i];
+
+		if (i > 0 && tid == s->tids[i - 1])
 			continue;
-		if (strncmp(file->d_name, "..", 1) == 0)
+		while (j < p->nr_tids && old[j].tid < tid)
+			free_load_tids(&old[j++], 1);
+		fd = -1;
+		if (j < p->nr_tids && old[j].tid == tid)
+			fd = old[j++].fd;
+
+		state = load_tid_state(tid, &fd, !known || fd < 0);
+		/* Gone since we read the tasks file. */
+		if (!state && fd < 0)
+			continue;
+		/* Exited but not reaped yet, tasks files don't list those. */
+		if (state == 'Z' || state == 'X') {
+			struct load_tid dead = { tid, fd };
+
+			free_load_tids(&dead, 1);
 			continue;
-		if (file->d_type == DT_DIR) {
-			/* path + '/' + d_name +/0 */
-			do {
-				path_dir = malloc(strlen(path) + 2 + sizeof(file->d_name));
-			} while (!path_dir);
-			strcpy(path_dir, path);
-			strcat(path_dir, "/");
-			strcat(path_dir, file->d_name);
-			pd = depth - 1;
-			sum = calc_pid(pid_buf, path_dir, pd, sum, cfd);
-			free(path_dir);
 		}
-	}
-	closedir(dir);
+		if (state == 'R' || state == 'D')
+			run_pid++;
+		s->merged[n].tid = tid;
+		s->merged[n].fd = fd;
+		n++;
+	}
+	if (j < p->nr_tids)
+		free_load_tids(&old[j], p->nr_tids - j);
+
+	/* The node keeps the new list, its old one is next pass' scratch. */
+	p->tids = s->merged;
+	p->nr_tids = n;
+	j = p->size_tids;
+	p->size_tids = s->size_merged;
+	s->merged = old;
+	s->size_merged = j;
 
-	strcat(path, "/cgroup.procs");
-	fd = openat(cfd, path, O_RDONLY);
-	if (fd < 0)
-		goto out;
+	/*Calculate the loadavg.*/
+	avg = p->avg;
+	avg.avenrun[0] = calc_load_n(avg.avenrun[0], EXP_1, run_pid * FIXED_1, ticks);
+	avg.avenrun[1] = calc_load_n(avg.avenrun[1], EXP_5, run_pid * FIXED_1, ticks);
+	avg.avenrun[2] = calc_load_n(avg.avenrun[2], EXP_15, run_pid * FIXED_1, ticks);
+	avg.run_pid = run_pid;
+	avg.total_pid = n;
+	/* We make the biggest pid become last_pid.*/
+	if (n > 0)
+		avg.last_pid = p->tids[n - 1].tid;
+	load_avg_publish(p, &avg);
 
-	f = fdopen(fd, "r");
-	if (!f) {
-		close(fd);
-		goto out;
+	/* Only the tasks files tell whether the cgroup is still in use. */
+	return n || known ? n : s->nr_tids;
+}
+
+/*
+ * Find the first "@key <value>" or "@key=<value>" in @buf, as in cpu.stat
+ * and the pressure files, whose first line is the "some" one.
+ */
+static bool psi_get_field(const char *buf, const char *key, uint64_t *value)
+{
+	size_t len = strlen(key);
+	const char *p;
+
+	for (p = buf; (p = strstr(p, key)); p += len) {
+		if ((p == buf || p[-1] == ' ' || p[-1] == '\n') &&
+		    (p[len] == ' ' || p[len] == '='))
+			return sscanf(p + len + 1, "%" SCNu64, value) == 1;
 	}
+	return false;
+}
 
-	while (getline(&line, &linelen, f) != -1) {
-		do {
-			pid = realloc(*pid_buf, sizeof(char *) * (sum + 1));
-		} while (!pid);
-		*pid_buf = pid;
-		do {
-			*(*pid_buf + sum) = malloc(strlen(line) + 1);
-		} while (*(*pid_buf + sum) == NULL);
-		strcpy(*(*pid_buf + sum), line);
-		sum++;
+/*
+ * Read field @key of @file, or its whole content if @key is NULL.
+ * Return 1 on success, 0 if @cg is gone and -1 if it has no @file.
+ */
+static int psi_read_field(const char *cg, const char *file, const char *key,
+			  uint64_t *value)
+{
+	char *buf = NULL;
+	bool ret;
+
+	if (!ctrl_get_value(LXC_CTRL_CPU, cg, file, &buf)) {
+		if (errno == ENOENT && ctrl_param_exist(LXC_CTRL_CPU, cg, "cgroup.procs"))
+			return -1;
+		return 0;
 	}
-	fclose(f);
-out:
-	if (line)
-		free(line);
-	free(path);
-	return sum;
+	if (key)
+		ret = psi_get_field(buf, key, value);
+	else
+		ret = sscanf(buf, "%" SCNu64, value) == 1;
+	free(buf);
+	return ret ? 1 : -1;
 }
+
 /*
- * calc_load calculates the load according to the following formula:
- * load1 = load0 * exp + active * (1 - exp)
+ * The PSI engine, for cgroup2 hosts whose kernel has pressure stall
+ * information.  Rather than looking at every thread, it takes the time
+ * the cgroup's tasks spent on a CPU (cpu.stat), waiting for one
+ * (cpu.pressure) and blocked on I/O (io.pressure) since the last sample.
+ * Spread over the elapsed time this is the average number of active
+ * tasks, which is what the kernel's loadavg decays.  The "some" stall
+ * times count a period once however many tasks stall in it, so this
+ * stays a lower bound of the thread-scanning figure.
  *
- * @load1: the new loadavg.
- * @load0: the former loadavg.
- * @active: the total number of running pid at this moment.
- * @exp: the fixed-point defined in the beginning.
+ * Return like refresh_load(), or -1 if @p->cg has no PSI files, in which
+ * case refresh_load() should be used for it instead.
  */
-static unsigned long
-calc_load(unsigned long load, unsigned long exp, unsigned long active)
+static int refresh_load_psi(struct load_node *p, unsigned int ticks)
 {
-	unsigned long newload;
+	uint64_t now, usage, cpu_some, io_some, pids, busy, elapsed;
+	struct load_avg avg;
+	unsigned long active;
+	int ret;
 
-	active = active > 0 ? active * FIXED_1 : 0;
-	newload = load * exp + active * (FIXED_1 - exp);
-	if (active >= load)
-		newload += FIXED_1 - 1;
+	now = monotonic_ms() * 1000;
+	ret = psi_read_field(p->cg, "cpu.stat", "usage_usec", &usage);
+	if (ret <= 0)
+		return ret;
+	ret = psi_read_field(p->cg, "cpu.pressure", "total", &cpu_some);
+	if (ret > 0)
+		ret = psi_read_field(p->cg, "io.pressure", "total", &io_some);
+	if (ret <= 0)
+		return ret;
 
-	return newload / FIXED_1;
+	/* The first sample of a cgroup only sets the baseline. */
+	avg = p->avg;
+	if (p->psi_stamp && now > p->psi_stamp) {
+		elapsed = now - p->psi_stamp;
+		busy = (usage - p->psi_usage) + (cpu_some - p->psi_cpu_some) +
+		       (io_some - p->psi_io_some);
+		active = busy * FIXED_1 / elapsed;
+
+		avg.avenrun[0] = calc_load_n(avg.avenrun[0], EXP_1, active, ticks);
+		avg.avenrun[1] = calc_load_n(avg.avenrun[1], EXP_5, active, ticks);
+		avg.avenrun[2] = calc_load_n(avg.avenrun[2], EXP_15, active, ticks);
+		avg.run_pid = (active + FIXED_1 / 2) >> FSHIFT;
+	}
+	p->psi_stamp = now;
+	p->psi_usage = usage;
+	p->psi_cpu_some = cpu_some;
+	p->psi_io_some = io_some;
+
+	/* pids.current is only there with the pids controller enabled. */
+	if (psi_read_field(p->cg, "pids.current", NULL, &pids) > 0)
+		avg.total_pid = pids;
+	avg.total_pid = MAX(avg.total_pid, MAX(avg.run_pid, 1));
+	load_avg_publish(p, &avg);
+
+	return avg.total_pid;
+}
+/*
+ * Refresh all nodes of bucket @b, dropping those of vanished cgroups.
+ * Nodes inserted meanwhile go in front of the one we start from, and are
+ * left for the next pass.
+ */
+static void refresh_load_bucket(struct load_sampler *s, struct load_bucket *b,
+				unsigned int ticks)
+{
+	const char *path;
+	struct load_node *f;
+	uint64_t now = monotonic_ms(), unread;
+	unsigned int n;
+	int sum;
+
+	pthread_mutex_lock(&b->lock);
+	f = b->next;
+	pthread_mutex_unlock(&b->lock);
+	while (f) {
+		/*
+		 * Containers nobody reads the loadavg of only get refreshed
+		 * every LOAD_IDLE_TICKS, with the decay of the periods they
+		 * skipped, and are dropped after a while.
+		 */
+		n = f->pending_ticks + ticks;
+		unread = now - MIN(now, __atomic_load_n(&f->last_read, __ATOMIC_RELAXED));
+		if (load_idle_ms && unread >= load_idle_ms) {
+			if (unread >= load_idle_ms * LOAD_EVICT_FACTOR) {
+				f = del_node(b, f);
+				continue;
+			}
+			if (!f->idle) {
+				/* Don't keep fds open for it meanwhile. */
+				free_load_tids(f->tids, f->nr_tids);
+				f->nr_tids = 0;
+				f->synced_pass = 0;
+				f->idle = true;
+			}
+			if (n < LOAD_IDLE_TICKS) {
+				f->pending_ticks = n;
+				f = f->next;
+				continue;
+			}
+		} else {
+			f->idle = false;
+		}
+		f->pending_ticks = 0;
+
+		/* Make sure we pass a relative path to openat(). */
+		path = f->cg + strspn(f->cg, "/");
+		if (*path == '\0')
+			path = ".";
+		sum = -1;
+		if (loadavg == LOAD_ENGINE_PSI)
+			sum = refresh_load_psi(f, n);
+		if (sum < 0)
+			sum = refresh_load(s, f, path, n);
+		if (sum == 0)
+			f = del_node(b, f);
+		else
+			f = f->next;
+	}
 }
 
 /*
- * Return 0 means that container p->cg is closed.
- * Return -1 means that error occurred in refresh.
- * Positive num equals the total number of pid.
+ * The buckets are refreshed by a pool of threads: load_begin() starts a
+ * pass every FLUSH_TIME and takes part in it, and every thread keeps
+ * claiming the next bucket nobody has taken yet until none is left.  A
+ * thread stuck on a huge container thus never holds up the buckets behind
+ * it as long as the others are free.
  */
-static int refresh_load(struct load_node *p, char *path)
+static struct load_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int gen;	/* bumped to start a pass */
+	int busy;		/* workers yet to finish the pass */
+	size_t next_bucket;	/* atomic, the next bucket to claim */
+	unsigned int ticks;	/* periods the current pass accounts for */
+	bool stopping;
+	int nr_workers;		/* not counting load_begin() itself */
+	pthread_t *workers;
+} load_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* What the passes take, for operators to size the pool with -w. */
+static struct load_stats load_stats; // atomic members
+
+void load_get_stats(struct load_stats *stats)
 {
-	FILE *f = NULL;
-	char **idbuf;
-	char proc_path[256];
-	int i, ret, run_pid = 0, total_pid = 0, last_pid = 0;
-	char *line = NULL;
-	size_t linelen = 0;
-	int sum, length;
-	DIR *dp;
-	struct dirent *file;
+	stats->passes = __atomic_load_n(&load_stats.passes, __ATOMIC_RELAXED);
+	stats->last_ms = __atomic_load_n(&load_stats.last_ms, __ATOMIC_RELAXED);
+	stats->max_ms = __atomic_load_n(&load_stats.max_ms, __ATOMIC_RELAXED);
+	stats->threads = __atomic_load_n(&load_stats.threads, __ATOMIC_RELAXED);
+}
+
+static void refresh_load_buckets(struct load_sampler *s)
+{
+	unsigned int ticks = load_pool.ticks;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&load_pool.next_bucket, 1, __ATOMIC_RELAXED)) < load_table.size)
+		refresh_load_bucket(s, &load_table.buckets[i], ticks);
+}
+
+static void *load_worker(void *arg)
+{
+	struct load_sampler s = { 0 };
+	unsigned int gen;
+
+	pthread_mutex_lock(&load_pool.lock);
+	gen = load_pool.gen;
+	for (;;) {
+		while (load_pool.gen == gen && !load_pool.stopping)
+			pthread_cond_wait(&load_pool.cond, &load_pool.lock);
+		if (load_pool.stopping)
+			break;
+		gen = load_pool.gen;
+		pthread_mutex_unlock(&load_pool.lock);
+
+		refresh_load_buckets(&s);
+
+		pthread_mutex_lock(&load_pool.lock);
+		if (--load_pool.busy == 0)
+			pthread_cond_broadcast(&load_pool.cond);
+	}
+	pthread_mutex_unlock(&load_pool.lock);
+
+	free_load_sampler(&s);
+	return NULL;
+}
+
+static void stop_load_workers(void)
+{
+	int i;
+
+	pthread_mutex_lock(&load_pool.lock);
+	load_pool.stopping = true;
+	pthread_cond_broadcast(&load_pool.cond);
+	pthread_mutex_unlock(&load_pool.lock);
+
+	for (i = 0; i < load_pool.nr_workers; i++)
+		pthread_join(load_pool.workers[i], NULL);
+	free(load_pool.workers);
+	load_pool.workers = NULL;
+	load_pool.nr_workers = 0;
+	load_pool.stopping = false;
+}
+
+/* Start up to @nr threads helping load_begin(), returns how many did. */
+static int start_load_workers(int nr)
+{
+	int i;
+
+	if (nr <= 0)
+		return 0;
 
 	do {
-		idbuf = malloc(sizeof(char *));
-	} while (!idbuf);
-	sum = calc_pid(&idbuf, path, DEPTH_DIR, 0, p->cfd);
-	/*  normal exit  */
-	if (sum == 0)
-		goto out;
+		load_pool.workers = malloc(nr * sizeof(pthread_t));
+	} while (!load_pool.workers);
 
-	for (i = 0; i < sum; i++) {
-		/*clean up '\n' */
-		length = strlen(idbuf[i])-1;
-		idbuf[i][length] = '\0';
-		ret = snprintf(proc_path, 256, "/proc/%s/task", idbuf[i]);
-		if (ret < 0 || ret > 255) {
-			lxcfs_error("%s\n", "snprintf() failed in refresh_load.");
-			i = sum;
-			sum = -1;
-			goto err_out;
-		}
-
-		dp = opendir(proc_path);
-		if (!dp) {
-			lxcfs_error("%s\n", "Open proc_path failed in refresh_load.");
-			continue;
-		}
-		while ((file = readdir(dp)) != NULL) {
-			if (strncmp(file->d_name, ".", 1) == 0)
-				continue;
-			if (strncmp(file->d_name, "..", 1) == 0)
-				continue;
-			total_pid++;
-			/* We make the biggest pid become last_pid.*/
-			ret = atof(file->d_name);
-			last_pid = (ret > last_pid) ? ret : last_pid;
-
-			ret = snprintf(proc_path, 256, "/proc/%s/task/%s/status", idbuf[i], file->d_name);
-			if (ret < 0 || ret > 255) {
-				lxcfs_error("%s\n", "snprintf() failed in refresh_load.");
-				i = sum;
-				sum = -1;
-				closedir(dp);
-				goto err_out;
-			}
-			f = fopen(proc_path, "r");
-			if (f != NULL) {
-				while (getline(&line, &linelen, f) != -1) {
-					/* Find State */
-					if ((line[0] == 'S') && (line[1] == 't'))
-						break;
-				}
-			if ((line[7] == 'R') || (line[7] == 'D'))
-				run_pid++;
-			fclose(f);
-			}
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&load_pool.workers[i], NULL, load_worker, NULL) != 0) {
+			lxcfs_error("Failed to start loadavg worker %d of %d.\n", i + 1, nr);
+			break;
 		}
-		closedir(dp);
 	}
-	/*Calculate the loadavg.*/
-	p->avenrun[0] = calc_load(p->avenrun[0], EXP_1, run_pid);
-	p->avenrun[1] = calc_load(p->avenrun[1], EXP_5, run_pid);
-	p->avenrun[2] = calc_load(p->avenrun[2], EXP_15, run_pid);
-	p->run_pid = run_pid;
-	p->total_pid = total_pid;
-	p->last_pid = last_pid;
+	load_pool.nr_workers = i;
+
+	return i;
+}
+
+/*
+ * Wait for the next FLUSH_TIME tick of @tfd and return how many ticks
+ * passed since the last one, more than one if a pass ran over.
+ */
+static unsigned int load_wait_tick(int tfd)
+{
+	uint64_t expired;
+	ssize_t ret;
+
+	if (tfd < 0) {
+		sleep(FLUSH_TIME);
+		return 1;
+	}
 
-	free(line);
-err_out:
-	for (; i > 0; i--)
-		free(idbuf[i-1]);
-out:
-	free(idbuf);
-	return sum;
+	do {
+		ret = read(tfd, &expired, sizeof(expired));
+	} while (ret < 0 && errno == EINTR);
+	if (ret != sizeof(expired) || expired == 0)
+		return 1;
+
+	return expired > UINT_MAX ? UINT_MAX : (unsigned int)expired;
 }
+
 /*
  * Traverse the hash table and update it.
  */
 void *load_begin(void *arg)
 {
+	struct load_sampler s = { 0 };
+	struct itimerspec its = {
+		.it_interval = { .tv_sec = FLUSH_TIME },
+		.it_value = { .tv_sec = FLUSH_TIME },
+	};
+	unsigned int ticks = 1, pass = 0;
+	uint64_t start, took;
+	int tfd;
 
-	char *path = NULL;
-	int i, sum, length, ret;
-	struct load_node *f;
-	int first_node;
-	clock_t time1, time2;
+	/*
+	 * The EXP_* constants assume a sample every FLUSH_TIME: a monotonic
+	 * timer keeps that cadence, and the periods a slow pass missed are
+	 * folded into the decay of the next one.
+	 */
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd >= 0 && timerfd_settime(tfd, 0, &its, NULL) < 0) {
+		close(tfd);
+		tfd = -1;
+	}
+	if (tfd < 0)
+		lxcfs_error("Failed to set up the loadavg timer: %s.\n", strerror(errno));
 
 	while (1) {
 		if (loadavg_stop == 1)
-			return NULL;
+			break;
 
-		time1 = clock();
-		for (i = 0; i < LOAD_SIZE; i++) {
-			pthread_mutex_lock(&load_hash[i].lock);
-			if (load_hash[i].next == NULL) {
-				pthread_mutex_unlock(&load_hash[i].lock);
-				continue;
-			}
-			f = load_hash[i].next;
-			first_node = 1;
-			while (f) {
-				length = strlen(f->cg) + 2;
-				do {
-					/* strlen(f->cg) + '.' or '' + \0 */
-					path = malloc(length);
-				} while (!path);
-
-				ret = snprintf(path, length, "%s%s", *(f->cg) == '/' ? "." : "", f->cg);
-				if (ret < 0 || ret > length - 1) {
-					/* snprintf failed, ignore the node.*/
-					lxcfs_error("Refresh node %s failed for snprintf().\n", f->cg);
-					goto out;
-				}
-				sum = refresh_load(f, path);
-				if (sum == 0) {
-					f = del_node(f, i);
-				} else {
-out:					f = f->next;
-				}
-				free(path);
-				/* load_hash[i].lock locks only on the first node.*/
-				if (first_node == 1) {
-					first_node = 0;
-					pthread_mutex_unlock(&load_hash[i].lock);
-				}
-			}
-		}
+		start = monotonic_ms();
+		if (load_conn.evfd >= 0)
+			load_conn_drain(++pass);
+		pthread_mutex_lock(&load_pool.lock);
+		__atomic_store_n(&load_pool.next_bucket, 0, __ATOMIC_RELAXED);
+		load_pool.ticks = ticks;
+		load_pool.busy = load_pool.nr_workers;
+		load_pool.gen++;
+		pthread_cond_broadcast(&load_pool.cond);
+		pthread_mutex_unlock(&load_pool.lock);
+
+		refresh_load_buckets(&s);
+
+		pthread_mutex_lock(&load_pool.lock);
+		while (load_pool.busy > 0)
+			pthread_cond_wait(&load_pool.cond, &load_pool.lock);
+		pthread_mutex_unlock(&load_pool.lock);
+
+		took = monotonic_ms() - start;
+		__atomic_store_n(&load_stats.last_ms, took, __ATOMIC_RELAXED);
+		if (took > load_stats.max_ms)
+			__atomic_store_n(&load_stats.max_ms, took, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&load_stats.passes, 1, __ATOMIC_RELAXED);
+		lxcfs_debug("loadavg pass took %" PRIu64 " ms with %d threads.\n",
+			    took, load_pool.nr_workers + 1);
+		if (took >= FLUSH_TIME * 1000)
+			lxcfs_error("loadavg pass took %" PRIu64 " ms, longer than the %d s "
+				    "sampling period, consider more threads (-w).\n",
+				    took, FLUSH_TIME);
 
 		if (loadavg_stop == 1)
-			return NULL;
+			break;
+
+		load_table_resize();
+
+		ticks = load_wait_tick(tfd);
+	}
+
+	if (tfd >= 0)
+		close(tfd);
+	load_conn_stop();
+	stop_load_workers();
+	free_load_sampler(&s);
+	return NULL;
+}
+
+/*
+ * A container seen for the first time, or again after having been
+ * dropped, starts from a sample of its threads taken right away rather
+ * than from zero, as if its load had been steady so far.
+ */
+static struct load_node *new_load_node(const char *cg, uint64_t hash, pid_t initpid)
+{
+	struct load_sampler s = { 0 };
+	struct load_node *n;
+	struct load_avg avg;
+	const char *path;
+
+	do {
+		n = calloc(1, sizeof(struct load_node));
+	} while (!n);
+	n->cg = must_copy_string(cg);
+	n->hash = hash;
+	n->avg.total_pid = 1;
+	n->avg.last_pid = initpid;
+	n->cfd = ctrl_table[LXC_CTRL_CPU].fd;
+	n->last_read = monotonic_ms();
+
+	path = cg + strspn(cg, "/");
+	if (*path == '\0')
+		path = ".";
+	if (refresh_load(&s, n, path, 1) > 0) {
+		avg = n->avg;
+		avg.avenrun[0] = avg.avenrun[1] = avg.avenrun[2] = avg.run_pid * FIXED_1;
+		load_avg_publish(n, &avg);
+	}
+	free_load_sampler(&s);
+	/* Only takes the baseline of its counters. */
+	if (loadavg == LOAD_ENGINE_PSI)
+		refresh_load_psi(n, 1);
+
+	return n;
+}
+
+/*
+ * Copy the averages of @cg into @avg, starting to track it if it is new.
+ * Return false if the loadavg table is not set up.
+ */
+static bool load_get_avg(const char *cg, pid_t initpid, struct load_avg *avg)
+{
+	struct load_bucket *b;
+	struct load_node *n, *new = NULL;
+	uint64_t hash = load_hash_cg(cg);
+
+	for (;;) {
+		pthread_rwlock_rdlock(&load_table.lock);
+		if (!load_table.buckets) {
+			pthread_rwlock_unlock(&load_table.lock);
+			if (new)
+				free_load_node(new);
+			return false;
+		}
+		b = &load_table.buckets[hash & (load_table.size - 1)];
+
+		pthread_mutex_lock(&b->lock);
+		n = locate_node(b, cg, hash);
+		if (n || new)
+			break;
+		pthread_mutex_unlock(&b->lock);
+		pthread_rwlock_unlock(&load_table.lock);
 
-		time2 = clock();
-		usleep(FLUSH_TIME * 1000000 - (int)((time2 - time1) * 1000000 / CLOCKS_PER_SEC));
+		/* First time, sample it without holding up anybody. */
+		new = new_load_node(cg, hash, initpid);
+	}
+	if (n) {
+		__atomic_store_n(&n->last_read, monotonic_ms(), __ATOMIC_RELAXED);
+		if (new)
+			free_load_node(new);
+	} else {
+		n = new;
+		insert_node(b, n);
 	}
+	load_avg_read(n, avg);
+	pthread_mutex_unlock(&b->lock);
+
+	pthread_rwlock_unlock(&load_table.lock);
+	return true;
 }
 
 static int proc_loadavg_read(char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	struct file_info *d = (struct file_info *)fi->fh;
 	pid_t initpid;
 	char *cg;
 	size_t total_len = 0;
 	char *cache = d->buf;
-	struct load_node *n;
-	int hash;
-	int cfd, rv = 0;
+	struct load_avg avg;
+	int rv = 0;
 	unsigned long a, b, c;
 
 	if (offset) {
@@ -5714,54 +8698,27 @@ static int proc_loadavg_read(char *buf, size_t size, off_t offset,
 	if (!loadavg)
 		return read_file("/proc/loadavg", buf, size, d);
 
-	initpid = lookup_initpid_in_store(fc->pid);
-	if (initpid <= 0)
-		initpid = fc->pid;
-	cg = get_pid_cgroup(initpid, "cpu");
+	cg = get_container_cgroup(fc->pid, LXC_CTRL_CPU, &initpid);
 	if (!cg)
 		return read_file("/proc/loadavg", buf, size, d);
 
-	prune_init_slice(cg);
-	hash = calc_hash(cg) % LOAD_SIZE;
-	n = locate_node(cg, hash);
-
-	/* First time */
-	if (n == NULL) {
-		if (!find_mounted_controller("cpu", &cfd)) {
-			/*
-			 * In locate_node() above, pthread_rwlock_unlock() isn't used
-			 * because delete is not allowed before read has ended.
-			 */
-			pthread_rwlock_unlock(&load_hash[hash].rdlock);
-			rv = 0;
-			goto err;
-		}
-		do {
-			n = malloc(sizeof(struct load_node));
-		} while (!n);
+	if (ctrl_table[LXC_CTRL_CPU].fd < 0) {
+		rv = 0;
+		goto err;
+	}
+	if (!load_get_avg(cg, initpid, &avg)) {
+		free(cg);
+		return read_file("/proc/loadavg", buf, size, d);
+	}
 
-		do {
-			n->cg = malloc(strlen(cg)+1);
-		} while (!n->cg);
-		strcpy(n->cg, cg);
-		n->avenrun[0] = 0;
-		n->avenrun[1] = 0;
-		n->avenrun[2] = 0;
-		n->run_pid = 0;
-		n->total_pid = 1;
-		n->last_pid = initpid;
-		n->cfd = cfd;
-		insert_node(&n, hash);
-	}
-	a = n->avenrun[0] + (FIXED_1/200);
-	b = n->avenrun[1] + (FIXED_1/200);
-	c = n->avenrun[2] + (FIXED_1/200);
+	a = avg.avenrun[0] + (FIXED_1/200);
+	b = avg.avenrun[1] + (FIXED_1/200);
+	c = avg.avenrun[2] + (FIXED_1/200);
 	total_len = snprintf(d->buf, d->buflen, "%lu.%02lu %lu.%02lu %lu.%02lu %d/%d %d\n",
 		LOAD_INT(a), LOAD_FRAC(a),
 		LOAD_INT(b), LOAD_FRAC(b),
 		LOAD_INT(c), LOAD_FRAC(c),
-		n->run_pid, n->total_pid, n->last_pid);
-	pthread_rwlock_unlock(&load_hash[hash].rdlock);
+		avg.run_pid, avg.total_pid, avg.last_pid);
 	if (total_len < 0 || total_len >=  d->buflen) {
 		lxcfs_error("%s\n", "Failed to write to cache");
 		rv = 0;
@@ -5772,15 +8729,20 @@ static int proc_loadavg_read(char *buf, size_t size, off_t offset,
 
 	if (total_len > size)
 		total_len = size;
-	memcpy(buf, d->buf, total_len);
+	copy_rendered(buf, d, total_len);
 	rv = total_len;
 
 err:
 	free(cg);
 	return rv;
 }
-/* Return a positive number on success, return 0 on failure.*/
-pthread_t load_daemon(int load_use)
+/*
+ * Return a positive number on success, return 0 on failure.
+ * @nr_threads threads, at least one, share refreshing the loadavgs.
+ * Containers whose loadavg has not been read for @idle_secs seconds are
+ * refreshed less often, and dropped after LOAD_EVICT_FACTOR times that.
+ */
+pthread_t load_daemon_v2(int load_use, int nr_threads, int idle_secs)
 {
 	int ret;
 	pthread_t pid;
@@ -5790,17 +8752,40 @@ pthread_t load_daemon(int load_use)
 		lxcfs_error("%s\n", "Initialize hash_table fails in load_daemon!");
 		return 0;
 	}
+	if (load_use == LOAD_ENGINE_PSI &&
+	    (!ctrl_table[LXC_CTRL_CPU].unified || access("/proc/pressure/cpu", R_OK) < 0)) {
+		lxcfs_error("%s\n", "No cgroup2 pressure stall information, sampling tasks for loadavg instead.");
+		load_use = LOAD_ENGINE_TASKS;
+	}
+	if (load_use == LOAD_ENGINE_CONN && load_conn_start() < 0) {
+		lxcfs_error("Failed to listen to the proc connector: %s, sampling tasks for loadavg instead.\n",
+			    strerror(errno));
+		load_use = LOAD_ENGINE_TASKS;
+	}
+	nr_threads = MIN(MAX(nr_threads, 1), LOAD_MAX_THREADS);
+	load_idle_ms = MAX(idle_secs, 0) * 1000ULL;
+	memset(&load_stats, 0, sizeof(load_stats));
+	__atomic_store_n(&load_stats.threads, start_load_workers(nr_threads - 1) + 1,
+			 __ATOMIC_RELAXED);
 	ret = pthread_create(&pid, NULL, load_begin, NULL);
 	if (ret != 0) {
 		lxcfs_error("%s\n", "Create pthread fails in load_daemon!");
+		load_conn_stop();
+		stop_load_workers();
 		load_free();
 		return 0;
 	}
-	/* use loadavg, here loadavg = 1*/
+	/* use loadavg, with the engine selected by load_use */
 	loadavg = load_use;
 	return pid;
 }
 
+/* Return a positive number on success, return 0 on failure.*/
+pthread_t load_daemon(int load_use)
+{
+	return load_daemon_v2(load_use, 1, LOAD_IDLE_SECS);
+}
+
 /* Returns 0 on success. */
 int stop_load_daemon(pthread_t pid)
 {
@@ -5817,27 +8802,11 @@ int stop_load_daemon(pthread_t pid)
 
 	load_free();
 	loadavg_stop = 0;
+	__atomic_store_n(&load_stats.threads, 0, __ATOMIC_RELAXED);
 
 	return 0;
 }
 
-static off_t get_procfile_size(const char *which)
-{
-	FILE *f = fopen(which, "r");
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t sz, answer = 0;
-	if (!f)
-		return 0;
-
-	while ((sz = getline(&line, &len, f)) != -1)
-		answer += sz;
-	fclose (f);
-	free(line);
-
-	return answer;
-}
-
 int proc_getattr(const char *path, struct stat *sb)
 {
 	struct timespec now;
@@ -5906,20 +8875,14 @@ int proc_open(const char *path, struct fuse_file_info *fi)
 	if (type == -1)
 		return -ENOENT;
 
-	info = malloc(sizeof(*info));
+	info = buf_pool_alloc(sizeof(*info), NULL);
 	if (!info)
 		return -ENOMEM;
 
 	memset(info, 0, sizeof(*info));
 	info->type = type;
-
-	info->buflen = get_procfile_size(path) + BUF_RESERVE_SIZE;
-	do {
-		info->buf = malloc(info->buflen);
-	} while (!info->buf);
-	memset(info->buf, 0, info->buflen);
-	/* set actual size to buffer size */
-	info->size = info->buflen;
+	pthread_rwlock_init(&info->lock, NULL);
+	/* The buffer is only allocated by the first read, see render_sized() */
 
 	fi->fh = (unsigned long)info;
 	return 0;
@@ -5938,15 +8901,332 @@ int proc_access(const char *path, int mask)
 
 int proc_release(const char *path, struct fuse_file_info *fi)
 {
+	struct file_info *f = (struct file_info *)fi->fh;
+
+	if (f)
+		pthread_rwlock_destroy(&f->lock);
 	do_release_file_info(fi);
 	return 0;
 }
 
-int proc_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+/*
+ * The buffer of an open /proc or /sys file is sized from what that file
+ * took the last times it was rendered, rather than from the size of the
+ * host's file, which can be many times the container's view of it.  Reads
+ * at offset 0 go through render_sized(), which grows the buffer and renders
+ * again when the handler reports it did not fit.
+ */
+#define FILE_BUF_MAX (64 * 1024 * 1024)
+
+static int size_hints[LXC_TYPE_MAX]; // atomic, in bytes
+
+/*
+ * Reads at offset 0 render into the buffer of @fi, and may replace it,
+ * while later offsets are served from it: the former hold its lock
+ * exclusively and the latter shared.
+ */
+void lock_file_info(struct fuse_file_info *fi, off_t offset)
+{
+	struct file_info *d = (struct file_info *)fi->fh;
+	int ret;
+
+	if (offset == 0)
+		ret = pthread_rwlock_wrlock(&d->lock);
+	else
+		ret = pthread_rwlock_rdlock(&d->lock);
+	if (ret != 0) {
+		lxcfs_error("returned:%d %s\n", ret, strerror(ret));
+		exit(1);
+	}
+}
+
+void unlock_file_info(struct fuse_file_info *fi)
+{
+	struct file_info *d = (struct file_info *)fi->fh;
+	int ret;
+
+	if ((ret = pthread_rwlock_unlock(&d->lock)) != 0) {
+		lxcfs_error("returned:%d %s\n", ret, strerror(ret));
+		exit(1);
+	}
+}
+
+/* Grow the buffer of @d to hold at least @len bytes, dropping its contents. */
+static bool reserve_file_buf(struct file_info *d, size_t len)
+{
+	char *tmp;
+
+	if (len < BUF_RESERVE_SIZE)
+		len = BUF_RESERVE_SIZE;
+	if (d->buf && d->buflen >= len)
+		return true;
+
+	tmp = buf_pool_alloc(len, &len);
+	if (!tmp)
+		return false;
+	buf_pool_free(d->buf, d->buflen);
+	d->buf = tmp;
+	d->buflen = len;
+	return true;
+}
+
+/*
+ * Follow the size files of @type are rendered to: right away when they
+ * grow, and halfway back when they shrink, so that a smaller one in between
+ * does not undersize the next buffer.
+ */
+static void update_size_hint(int type, int len)
+{
+	int hint = __atomic_load_n(&size_hints[type], __ATOMIC_RELAXED);
+
+	len += BUF_RESERVE_SIZE;
+	if (len < hint)
+		len = hint - (hint - len) / 2;
+	if (len != hint)
+		__atomic_store_n(&size_hints[type], len, __ATOMIC_RELAXED);
+}
+
+int render_sized(char *buf, size_t size, struct fuse_file_info *fi,
+		 int (*render)(char *, size_t, off_t, struct fuse_file_info *))
+{
+	struct file_info *d = (struct file_info *)fi->fh;
+	size_t len = __atomic_load_n(&size_hints[d->type], __ATOMIC_RELAXED);
+	int rv;
+
+	for (;;) {
+		if (!reserve_file_buf(d, len))
+			return -ENOMEM;
+
+		d->truncated = false;
+		d->cached = 0;
+		rv = render(buf, size, 0, fi);
+		if (!d->truncated)
+			break;
+
+		len = 2 * d->buflen;
+		if (len > FILE_BUF_MAX) {
+			lxcfs_error("%s\n", "Internal error: truncated write to cache.");
+			return rv;
+		}
+	}
+
+	if (rv >= 0 && d->cached)
+		update_size_hint(d->type, d->size);
+	return rv;
+}
+
+/*
+ * Rendered /proc files are shared between all opens of the same file in the
+ * same container for the render cache TTL (-c, in milliseconds).  A
+ * container is identified like in the init-pid store, by its pid namespace
+ * and the creation time of its init.  While one thread renders a file the
+ * others wanting it wait for the result instead of rendering it again.
+ */
+struct render_cache {
+	ino_t ino;          // pid namespace of the container
+	long int ctime;     // creation time of its init
+	int type;           // LXC_TYPE_PROC_*
+	bool busy;          // being rendered, wait on the shard's cond
+	uint64_t rendered;  // CLOCK_MONOTONIC, in ms, 0 if never
+	char *buf;
+	size_t len;
+	struct render_cache *next;
+};
+
+#define RENDER_CACHE_HASH_SIZE 256
+#define RENDER_CACHE_SHARDS 16
+#define RENDER_CACHE_SHARD(h) ((h) % RENDER_CACHE_SHARDS)
+
+struct render_cache_shard {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t pruned;
+};
+
+static struct render_cache *render_cache_table[RENDER_CACHE_HASH_SIZE];
+static struct render_cache_shard render_cache_shards[RENDER_CACHE_SHARDS] = {
+	[0 ... RENDER_CACHE_SHARDS - 1] = {
+		PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0
+	}
+};
+
+static unsigned int render_cache_ttl(void)
+{
+	struct fuse_context *fc = lxcfs_get_context();
+	struct lxcfs_opts *opts = fc ? (struct lxcfs_opts *)fc->private_data : NULL;
+
+	return opts ? opts->render_cache_ms : RENDER_CACHE_MS;
+}
+
+static int render_cache_hash(ino_t ino, int type)
+{
+	return (ino * LXC_TYPE_MAX + type) % RENDER_CACHE_HASH_SIZE;
+}
+
+/* Drop the entries of containers nobody read from for PURGE_SECS. */
+static void prune_render_cache(int shard, uint64_t now)
+{
+	struct render_cache_shard *sh = &render_cache_shards[shard];
+	struct render_cache *e, **p;
+	int i;
+
+	if (now < sh->pruned + PURGE_SECS * 1000)
+		return;
+	sh->pruned = now;
+
+	for (i = shard; i < RENDER_CACHE_HASH_SIZE; i += RENDER_CACHE_SHARDS) {
+		for (p = &render_cache_table[i]; *p; ) {
+			e = *p;
+			if (e->busy || e->rendered + PURGE_SECS * 1000 > now) {
+				p = &e->next;
+				continue;
+			}
+			*p = e->next;
+			free(e->buf);
+			free(e);
+		}
+	}
+}
+
+/* Copy a rendered file into @d and answer the read at offset 0 from it. */
+static int render_cache_copy(struct render_cache *e, char *buf, size_t size,
+			     struct file_info *d)
+{
+	size_t total_len = e->len;
+
+	if (!reserve_file_buf(d, total_len + 1))
+		return -ENOMEM;
+	memcpy(d->buf, e->buf, total_len);
+	d->size = total_len;
+	d->cached = 1;
+
+	if (total_len > size)
+		total_len = size;
+	copy_rendered(buf, d, total_len);
+	return total_len;
+}
+
+/*
+ * Serve a read at offset 0 of @d from the render cache, or render it with
+ * @render and cache the result.
+ */
+static int render_cached(char *buf, size_t size, struct fuse_file_info *fi,
+			 int (*render)(char *, size_t, off_t, struct fuse_file_info *))
+{
+	struct fuse_context *fc = lxcfs_get_context();
+	struct file_info *d = (struct file_info *)fi->fh;
+	unsigned int ttl = render_cache_ttl();
+	struct render_cache_shard *sh;
+	struct render_cache *e;
+	struct stat sb;
+	long int ctime = 0;
+	uint64_t now;
+	char *copy;
+	int h, rv;
+
+	if (!ttl || lookup_initpid(fc->pid, &sb, &ctime) <= 0 || !ctime)
+		return render_sized(buf, size, fi, render);
+
+	h = render_cache_hash(sb.st_ino, d->type);
+	sh = &render_cache_shards[RENDER_CACHE_SHARD(h)];
+
+	lock_mutex(&sh->lock);
+	for (;;) {
+		for (e = render_cache_table[h]; e; e = e->next) {
+			if (e->ino == sb.st_ino && e->ctime == ctime &&
+			    e->type == d->type)
+				break;
+		}
+		if (!e || !e->busy)
+			break;
+		pthread_cond_wait(&sh->cond, &sh->lock);
+	}
+
+	now = monotonic_ms();
+	if (e && e->rendered && now < e->rendered + ttl) {
+		rv = render_cache_copy(e, buf, size, d);
+		unlock_mutex(&sh->lock);
+		return rv;
+	}
+
+	if (!e) {
+		prune_render_cache(RENDER_CACHE_SHARD(h), now);
+		do {
+			e = calloc(1, sizeof(*e));
+		} while (!e);
+		e->ino = sb.st_ino;
+		e->ctime = ctime;
+		e->type = d->type;
+		e->next = render_cache_table[h];
+		render_cache_table[h] = e;
+	}
+	e->busy = true;
+	unlock_mutex(&sh->lock);
+
+	rv = render_sized(buf, size, fi, render);
+
+	/* Fallbacks to the host's file do not mark @d cached, don't keep them. */
+	copy = NULL;
+	if (rv >= 0 && d->cached) {
+		copy = malloc(d->size);
+		if (copy)
+			memcpy(copy, d->buf, d->size);
+	}
+
+	lock_mutex(&sh->lock);
+	if (copy) {
+		free(e->buf);
+		e->buf = copy;
+		e->len = d->size;
+		e->rendered = monotonic_ms();
+	}
+	e->busy = false;
+	pthread_cond_broadcast(&sh->cond);
+	unlock_mutex(&sh->lock);
+
+	return rv;
+}
+
+static void free_render_cache(void)
+{
+	struct render_cache *e, *next;
+	int i;
+
+	for (i = 0; i < RENDER_CACHE_HASH_SIZE; i++) {
+		for (e = render_cache_table[i]; e; e = next) {
+			next = e->next;
+			free(e->buf);
+			free(e);
+		}
+		render_cache_table[i] = NULL;
+	}
+}
+
+/* Must be called with the lock of @fi held, see lock_file_info(). */
+static int proc_read_locked(const char *path, char *buf, size_t size,
+			    off_t offset, struct fuse_file_info *fi)
 {
 	struct file_info *f = (struct file_info *) fi->fh;
 
+	if (offset == 0) {
+		switch (f->type) {
+		case LXC_TYPE_PROC_MEMINFO:
+			return render_cached(buf, size, fi, proc_meminfo_read);
+		case LXC_TYPE_PROC_CPUINFO:
+			return render_cached(buf, size, fi, proc_cpuinfo_read);
+		case LXC_TYPE_PROC_UPTIME:
+			return render_cached(buf, size, fi, proc_uptime_read);
+		case LXC_TYPE_PROC_STAT:
+			return render_cached(buf, size, fi, proc_stat_read);
+		case LXC_TYPE_PROC_DISKSTATS:
+			return render_cached(buf, size, fi, proc_diskstats_read);
+		case LXC_TYPE_PROC_SWAPS:
+			return render_cached(buf, size, fi, proc_swaps_read);
+		case LXC_TYPE_PROC_LOADAVG:
+			return render_cached(buf, size, fi, proc_loadavg_read);
+		}
+	}
+
 	switch (f->type) {
 	case LXC_TYPE_PROC_MEMINFO:
 		return proc_meminfo_read(buf, size, offset, fi);
@@ -5967,6 +9247,67 @@ int proc_read(const char *path, char *buf, size_t size, off_t offset,
 	}
 }
 
+int proc_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	int rv;
+
+	lock_file_info(fi, offset);
+	rv = proc_read_locked(path, buf, size, offset, fi);
+	unlock_file_info(fi);
+	return rv;
+}
+
+/*
+ * Zero-copy reads, for front-ends which can reply with an iovec.  @read
+ * renders the file in the buffer of @fi at offset 0 as usual but does not
+ * copy it out, and later offsets are served from that buffer as they are
+ * by the handlers.  @iov then points into the buffer: unless an error is
+ * returned, @fi stays locked so that no other read replaces it until the
+ * caller is done with the reply and calls read_rendered_done().
+ */
+int read_rendered(const char *path, size_t size, off_t offset,
+		  struct fuse_file_info *fi, struct iovec *iov,
+		  int (*read)(const char *, char *, size_t, off_t, struct fuse_file_info *))
+{
+	struct file_info *d = (struct file_info *)fi->fh;
+	int rv, left;
+
+	iov->iov_base = NULL;
+	iov->iov_len = 0;
+
+	lock_file_info(fi, offset);
+	if (offset == 0) {
+		rv = read(path, NULL, size, 0, fi);
+	} else if (offset > d->size) {
+		rv = -EINVAL;
+	} else if (!d->cached) {
+		rv = 0;
+	} else {
+		left = d->size - offset;
+		rv = left > size ? size : left;
+	}
+
+	if (rv < 0)
+		unlock_file_info(fi);
+	else if (rv > 0) {
+		iov->iov_base = d->buf + offset;
+		iov->iov_len = rv;
+	}
+	return rv;
+}
+
+void read_rendered_done(struct fuse_file_info *fi)
+{
+	unlock_file_info(fi);
+}
+
+int proc_read_iov(const char *path, size_t size, off_t offset,
+		  struct fuse_file_info *fi, struct iovec *iov)
+{
+	return read_rendered(path, size, offset, fi, iov, proc_read_locked);
+}
+
 /*
  * Functions needed to setup cgroups in the __constructor__.
  */
@@ -6313,6 +9654,12 @@ static void __attribute__((constructor)) collect_and_mount_subsystems(void)
 	size_t len = 0;
 	int i, init_ns = -1;
 	bool found_unified = false;
+	struct stat sb;
+
+	if (stat("/proc/self/ns/pid", &sb) == 0)
+		host_pidns_ino = sb.st_ino;
+
+	cgroup_dirfds_max = fd_cache_max(FD_SHARE_CGROUP_DIRFDS);
 
 	if ((f = fopen("/proc/self/cgroup", "r")) == NULL) {
 		lxcfs_error("Error opening /proc/self/cgroup: %s\n", strerror(errno));
@@ -6382,6 +9729,8 @@ static void __attribute__((constructor)) collect_and_mount_subsystems(void)
 	if (!cret || chdir(cwd) < 0)
 		lxcfs_debug("Could not change back to original working directory: %s.\n", strerror(errno));
 
+	init_ctrl_table();
+
 	if (!init_cpuview()) {
 		lxcfs_error("%s\n", "failed to init CPU view");
 		goto out;
@@ -6402,6 +9751,20 @@ static void __attribute__((destructor)) free_subsystems(void)
 
 	lxcfs_debug("%s\n", "Running destructor for liblxcfs.");
 
+	pidns_watch_stop();
+	free_pidns_helpers();
+	free_initpid_store();
+	free_cgroup_dirfds();
+	free_cpuinfo_index();
+	free_host_snapshots();
+	free_render_cache();
+	buf_pool_drain();
+	/* Threads outliving us must not call back into an unloaded library. */
+	if (cgfs_buf_key_created)
+		pthread_key_delete(cgfs_buf_key);
+	if (context_key_created)
+		pthread_key_delete(context_key);
+
 	for (i = 0; i < num_hierarchies; i++) {
 		if (hierarchies[i])
 			free(hierarchies[i]);
@@ -1,6 +1,7 @@
 #ifndef __LXCFS_BINDINGS_H
 #define __LXCFS_BINDINGS_H
 
+#include "cpuset.h"
 #include "macro.h"
 #include "sysfs_fuse.h"
 
@@ -28,6 +29,18 @@ enum lxcfs_virt_t {
 	LXC_TYPE_SYS_DEVICES_SYSTEM,
 	LXC_TYPE_SYS_DEVICES_SYSTEM_CPU,
 	LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE,
+	LXC_TYPE_MAX,
+};
+
+/* Controllers lxcfs reads from itself, indexing the controller table. */
+enum lxcfs_ctrl_t {
+	LXC_CTRL_BLKIO,
+	LXC_CTRL_CPU,
+	LXC_CTRL_CPUACCT,
+	LXC_CTRL_CPUSET,
+	LXC_CTRL_MEMORY,
+	LXC_CTRL_UNIFIED,
+	LXC_CTRL_MAX,
 };
 
 struct file_info {
@@ -39,10 +52,27 @@ struct file_info {
 	int buflen;
 	int size; //actual data size
 	int cached;
+	bool truncated; // the last read did not fit in @buf
+	pthread_rwlock_t lock; // /proc and /sys files, see lock_file_info()
 };
 
+/* Default for how long a snapshot of a host /proc file is served, in ms. */
+#define HOST_SNAPSHOT_MS 100
+/* Default for how long a rendered /proc file is served to a container, in ms. */
+#define RENDER_CACHE_MS 100
+/* Default number of threads refreshing the loadavgs. */
+#define LOAD_THREADS 1
+/* Default for how long a container's loadavg is unread before it is refreshed less often, in s. */
+#define LOAD_IDLE_SECS 60
+/* How load_daemon() computes the loadavgs, passed as its @load_use. */
+#define LOAD_ENGINE_TASKS 1	/* sample the state of every task */
+#define LOAD_ENGINE_PSI 2	/* derive them from pressure stall information */
+#define LOAD_ENGINE_CONN 3	/* sample tasks, learning of new ones from the proc connector */
+
 struct lxcfs_opts {
 	bool swap_off;
+	unsigned int snapshot_ms; // 0 reads the host files on every request
+	unsigned int render_cache_ms; // 0 renders every open separately
 };
 
 extern int cg_write(const char *path, const char *buf, size_t size, off_t offset,
@@ -70,17 +100,43 @@ extern int proc_open(const char *path, struct fuse_file_info *fi);
 extern int proc_read(const char *path, char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi);
 extern int proc_access(const char *path, int mask);
+extern int proc_read_iov(const char *path, size_t size, off_t offset,
+			 struct fuse_file_info *fi, struct iovec *iov);
+struct load_stats {
+	uint64_t passes;   // loadavg refreshes done since the daemon started
+	uint64_t last_ms;  // wall time of the last one
+	uint64_t max_ms;   // and of the longest one
+	int threads;       // sharing each pass, 0 if the daemon is stopped
+};
+
 extern pthread_t load_daemon(int load_use);
+extern pthread_t load_daemon_v2(int load_use, int nr_threads, int idle_secs);
 extern int stop_load_daemon(pthread_t pid);
+extern void load_get_stats(struct load_stats *stats);
+extern pthread_t cpuview_daemon(void);
+extern int stop_cpuview_daemon(pthread_t pid);
 
 extern pid_t lookup_initpid_in_store(pid_t qpid);
 extern char *get_pid_cgroup(pid_t pid, const char *contrl);
+extern char *get_container_cgroup(pid_t qpid, enum lxcfs_ctrl_t ctrl, pid_t *initpid);
+extern struct cpumask *get_container_cpumask(pid_t qpid, const char *cg);
 extern int read_file(const char *path, char *buf, size_t size,
 		     struct file_info *d);
+extern void copy_rendered(char *buf, const struct file_info *d, size_t len);
+extern void lock_file_info(struct fuse_file_info *fi, off_t offset);
+extern void unlock_file_info(struct fuse_file_info *fi);
+extern int read_rendered(const char *path, size_t size, off_t offset,
+			 struct fuse_file_info *fi, struct iovec *iov,
+			 int (*read)(const char *, char *, size_t, off_t, struct fuse_file_info *));
+extern void read_rendered_done(struct fuse_file_info *fi);
+extern int render_sized(char *buf, size_t size, struct fuse_file_info *fi,
+			int (*render)(char *, size_t, off_t, struct fuse_file_info *));
 extern void prune_init_slice(char *cg);
 extern char *get_cpuset(const char *cg);
 extern bool use_cpuview(const char *cg);
 extern int max_cpu_count(const char *cg);
 extern void do_release_file_info(struct fuse_file_info *fi);
+extern void lxcfs_set_context(struct fuse_context *ctx);
+extern struct fuse_context *lxcfs_get_context(void);
 
 #endif /* __LXCFS_BINDINGS_H */
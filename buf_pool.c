@@ -0,0 +1,338 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buf_pool.h"
+
+#define NR_CLASSES (BUF_POOL_MAX_SHIFT - BUF_POOL_MIN_SHIFT + 1)
+#define MAG_SIZE 16
+
+struct magazine {
+	int n;
+	void *bufs[MAG_SIZE];
+	struct magazine *next;
+};
+
+/* The magazines of a thread, one per size class. */
+struct pool_cache {
+	struct magazine *mags[NR_CLASSES];
+	struct pool_cache *next;
+	struct pool_cache **pprev;
+};
+
+/*
+ * Magazines not loaded in any thread: @loaded hold buffers, left over by
+ * threads which filled or exited, @empty are kept for threads to fill.
+ */
+struct depot {
+	pthread_mutex_t lock;
+	struct magazine *loaded;
+	struct magazine *empty;
+};
+
+static struct depot depots[NR_CLASSES] = {
+	[0 ... NR_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL }
+};
+
+/* All thread caches, so that buf_pool_drain() can empty them. */
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_cache *caches;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static bool cache_key_created;
+
+static size_t pool_limit = BUF_POOL_LIMIT; // atomic
+static size_t pool_retained;               // atomic
+static uint64_t pool_hits, pool_misses, pool_dropped; // atomic
+
+static inline size_t class_size(int c)
+{
+	return (size_t)1 << (c + BUF_POOL_MIN_SHIFT);
+}
+
+/* The size class @size is rounded up to, or -1 if it is not pooled. */
+static int size_class(size_t size)
+{
+	int shift;
+
+	if (size > class_size(NR_CLASSES - 1))
+		return -1;
+	if (size <= class_size(0))
+		return 0;
+	shift = 64 - __builtin_clzll(size - 1);
+	return shift - BUF_POOL_MIN_SHIFT;
+}
+
+static void free_magazine(struct magazine *m)
+{
+	int i;
+
+	for (i = 0; i < m->n; i++)
+		free(m->bufs[i]);
+	free(m);
+}
+
+/* Hand the magazines of @cache over to the depot and forget about it. */
+static void flush_cache(void *arg)
+{
+	struct pool_cache *cache = arg;
+	struct magazine *m;
+	struct depot *d;
+	int c;
+
+	pthread_mutex_lock(&caches_lock);
+	*cache->pprev = cache->next;
+	if (cache->next)
+		cache->next->pprev = cache->pprev;
+	pthread_mutex_unlock(&caches_lock);
+
+	for (c = 0; c < NR_CLASSES; c++) {
+		m = cache->mags[c];
+		if (!m)
+			continue;
+		d = &depots[c];
+		pthread_mutex_lock(&d->lock);
+		if (m->n) {
+			m->next = d->loaded;
+			d->loaded = m;
+		} else {
+			m->next = d->empty;
+			d->empty = m;
+		}
+		pthread_mutex_unlock(&d->lock);
+	}
+	free(cache);
+}
+
+static void create_cache_key(void)
+{
+	cache_key_created = pthread_key_create(&cache_key, flush_cache) == 0;
+}
+
+/* The calling thread's magazines, or NULL if it cannot have any. */
+static struct pool_cache *get_cache(void)
+{
+	struct pool_cache *cache;
+
+	pthread_once(&cache_key_once, create_cache_key);
+	if (!cache_key_created)
+		return NULL;
+
+	cache = pthread_getspecific(cache_key);
+	if (cache)
+		return cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	if (pthread_setspecific(cache_key, cache) != 0) {
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&caches_lock);
+	cache->next = caches;
+	if (caches)
+		caches->pprev = &cache->next;
+	cache->pprev = &caches;
+	caches = cache;
+	pthread_mutex_unlock(&caches_lock);
+
+	return cache;
+}
+
+/* Trade @m, if any, for a magazine with buffers in class @c. */
+static struct magazine *depot_get_loaded(int c, struct magazine *m)
+{
+	struct depot *d = &depots[c];
+	struct magazine *loaded;
+
+	pthread_mutex_lock(&d->lock);
+	loaded = d->loaded;
+	if (loaded) {
+		d->loaded = loaded->next;
+		if (m) {
+			m->next = d->empty;
+			d->empty = m;
+		}
+		m = loaded;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return m;
+}
+
+/* Trade the full @m, if any, for an empty magazine in class @c. */
+static struct magazine *depot_get_empty(int c, struct magazine *m)
+{
+	struct depot *d = &depots[c];
+	struct magazine *empty;
+
+	pthread_mutex_lock(&d->lock);
+	empty = d->empty;
+	if (empty)
+		d->empty = empty->next;
+	if (m) {
+		m->next = d->loaded;
+		d->loaded = m;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	if (!empty)
+		empty = calloc(1, sizeof(*empty));
+	return empty;
+}
+
+void *buf_pool_alloc(size_t size, size_t *got)
+{
+	struct pool_cache *cache;
+	struct magazine *m;
+	int c = size_class(size);
+
+	if (c < 0) {
+		__atomic_add_fetch(&pool_misses, 1, __ATOMIC_RELAXED);
+		if (got)
+			*got = size;
+		return malloc(size);
+	}
+
+	if (got)
+		*got = class_size(c);
+
+	cache = get_cache();
+	if (cache) {
+		m = cache->mags[c];
+		if (!m || !m->n)
+			m = cache->mags[c] = depot_get_loaded(c, m);
+		if (m && m->n) {
+			__atomic_sub_fetch(&pool_retained, class_size(c), __ATOMIC_RELAXED);
+			__atomic_add_fetch(&pool_hits, 1, __ATOMIC_RELAXED);
+			return m->bufs[--m->n];
+		}
+	}
+
+	__atomic_add_fetch(&pool_misses, 1, __ATOMIC_RELAXED);
+	return malloc(class_size(c));
+}
+
+void buf_pool_free(void *buf, size_t size)
+{
+	struct pool_cache *cache;
+	struct magazine *m;
+	size_t limit = __atomic_load_n(&pool_limit, __ATOMIC_RELAXED);
+	int c = size_class(size);
+
+	if (!buf)
+		return;
+	if (c < 0)
+		goto out_free;
+
+	if (__atomic_add_fetch(&pool_retained, class_size(c), __ATOMIC_RELAXED) > limit)
+		goto out_drop;
+
+	cache = get_cache();
+	if (!cache)
+		goto out_drop;
+
+	m = cache->mags[c];
+	if (!m || m->n == MAG_SIZE)
+		m = cache->mags[c] = depot_get_empty(c, m);
+	if (!m)
+		goto out_drop;
+
+	m->bufs[m->n++] = buf;
+	return;
+
+out_drop:
+	__atomic_sub_fetch(&pool_retained, class_size(c), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool_dropped, 1, __ATOMIC_RELAXED);
+out_free:
+	free(buf);
+}
+
+/* Free the loaded magazines of the depot until the pool is within @limit. */
+static void trim_depot(size_t limit)
+{
+	struct magazine *m;
+	struct depot *d;
+	size_t freed;
+	int c;
+
+	for (c = NR_CLASSES - 1; c >= 0; c--) {
+		d = &depots[c];
+		for (;;) {
+			if (__atomic_load_n(&pool_retained, __ATOMIC_RELAXED) <= limit)
+				return;
+			pthread_mutex_lock(&d->lock);
+			m = d->loaded;
+			if (m)
+				d->loaded = m->next;
+			pthread_mutex_unlock(&d->lock);
+			if (!m)
+				break;
+			freed = m->n * class_size(c);
+			free_magazine(m);
+			__atomic_sub_fetch(&pool_retained, freed, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void buf_pool_set_limit(size_t bytes)
+{
+	__atomic_store_n(&pool_limit, bytes, __ATOMIC_RELAXED);
+	trim_depot(bytes);
+}
+
+void buf_pool_get_stats(struct buf_pool_stats *stats)
+{
+	stats->hits = __atomic_load_n(&pool_hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&pool_misses, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&pool_dropped, __ATOMIC_RELAXED);
+	stats->retained = __atomic_load_n(&pool_retained, __ATOMIC_RELAXED);
+	stats->limit = __atomic_load_n(&pool_limit, __ATOMIC_RELAXED);
+}
+
+/*
+ * Only to be called when no other thread uses the pool, like when the
+ * library is unloaded: the caches of live threads are freed under them.
+ */
+void buf_pool_drain(void)
+{
+	struct pool_cache *cache, *next;
+	struct magazine *m, *tmp;
+	int c;
+
+	for (cache = caches; cache; cache = next) {
+		next = cache->next;
+		for (c = 0; c < NR_CLASSES; c++) {
+			if (cache->mags[c])
+				free_magazine(cache->mags[c]);
+		}
+		free(cache);
+	}
+	caches = NULL;
+
+	for (c = 0; c < NR_CLASSES; c++) {
+		for (m = depots[c].loaded; m; m = tmp) {
+			tmp = m->next;
+			free_magazine(m);
+		}
+		for (m = depots[c].empty; m; m = tmp) {
+			tmp = m->next;
+			free(m);
+		}
+		depots[c].loaded = NULL;
+		depots[c].empty = NULL;
+	}
+	pool_retained = 0;
+
+	/* Threads outliving us must not call back into an unloaded library. */
+	if (cache_key_created)
+		pthread_key_delete(cache_key);
+	cache_key_created = false;
+}
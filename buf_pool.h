@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#ifndef __LXCFS_BUF_POOL_H
+#define __LXCFS_BUF_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Freed file_info structs and the buffers files are rendered into are kept
+ * for reuse instead of going back to malloc.  Sizes are rounded up to a
+ * power of two between 2^BUF_POOL_MIN_SHIFT and 2^BUF_POOL_MAX_SHIFT bytes,
+ * larger ones are not pooled.  Each thread keeps a magazine of buffers per
+ * size and only goes to the shared depot, under a lock, to swap a whole
+ * magazine.  At most BUF_POOL_LIMIT bytes are kept by default.
+ */
+#define BUF_POOL_MIN_SHIFT 6
+#define BUF_POOL_MAX_SHIFT 16
+#define BUF_POOL_LIMIT (4 * 1024 * 1024)
+
+struct buf_pool_stats {
+	uint64_t hits;     // allocations served from the pool
+	uint64_t misses;   // allocations passed on to malloc
+	uint64_t dropped;  // frees passed on to free for going over the limit
+	size_t retained;   // bytes kept in the pool
+	size_t limit;
+};
+
+/*
+ * Return a buffer of at least @size bytes and set @got, if not NULL, to its
+ * actual size.  It must be given back with buf_pool_free() and either size.
+ */
+extern void *buf_pool_alloc(size_t size, size_t *got);
+extern void buf_pool_free(void *buf, size_t size);
+extern void buf_pool_set_limit(size_t bytes);
+extern void buf_pool_get_stats(struct buf_pool_stats *stats);
+/* Free everything the pool keeps, of all threads. */
+extern void buf_pool_drain(void);
+
+#endif /* __LXCFS_BUF_POOL_H */
@@ -0,0 +1,854 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu_usage.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_USAGE_X86
+#include <immintrin.h>
+#endif
+
+/* Bits of word @w of @mask below @cpu_count. */
+static inline uint64_t mask_word(const uint64_t *mask, int w, int cpu_count)
+{
+	int rest = cpu_count - w * 64;
+
+	if (rest >= 64)
+		return mask[w];
+	return mask[w] & ((UINT64_C(1) << rest) - 1);
+}
+
+/* The end of the CPUs of word @w, below @cpu_count. */
+static inline int word_end(int w, int cpu_count)
+{
+	return cpu_count - w * 64 < 64 ? cpu_count : w * 64 + 64;
+}
+
+/*
+ * The arrays are allocated in one block, a cache line apart more than
+ * their size: on hosts with a power of two CPUs, the same CPU's counters
+ * would otherwise be a multiple of 4k apart, and stores to one array would
+ * falsely stall loads from the others.
+ */
+#define CPU_USAGE_SKEW 8
+
+int cpu_usage_alloc(struct cpu_usage *u, int cpu_count)
+{
+	size_t pad = CPU_USAGE_PAD(cpu_count) + CPU_USAGE_SKEW;
+	size_t len = (3 * pad + CPU_USAGE_WORDS(pad)) * sizeof(uint64_t);
+	void *p;
+
+	if (posix_memalign(&p, 64, len) != 0)
+		return -1;
+	memset(p, 0, len);
+
+	u->user = p;
+	u->system = u->user + pad;
+	u->idle = u->system + pad;
+	u->online = u->idle + pad;
+	return 0;
+}
+
+void cpu_usage_free(struct cpu_usage *u)
+{
+	free(u->user);
+	u->user = u->system = u->idle = u->online = NULL;
+}
+
+void cpu_usage_copy(struct cpu_usage *dst, const struct cpu_usage *src, int cpu_count)
+{
+	memcpy(dst->user, src->user, cpu_count * sizeof(uint64_t));
+	memcpy(dst->system, src->system, cpu_count * sizeof(uint64_t));
+	memcpy(dst->idle, src->idle, cpu_count * sizeof(uint64_t));
+	cpu_usage_copy_online(dst->online, src->online, cpu_count);
+}
+
+int cpu_usage_realloc(struct cpu_usage *u, int old_count, int new_count)
+{
+	struct cpu_usage new;
+
+	if (cpu_usage_alloc(&new, new_count) != 0)
+		return -1;
+
+	cpu_usage_copy(&new, u, old_count < new_count ? old_count : new_count);
+	cpu_usage_free(u);
+	*u = new;
+	return 0;
+}
+
+void cpu_usage_zero(struct cpu_usage *u, int cpu_count)
+{
+	memset(u->user, 0, cpu_count * sizeof(uint64_t));
+	memset(u->system, 0, cpu_count * sizeof(uint64_t));
+	memset(u->idle, 0, cpu_count * sizeof(uint64_t));
+}
+
+void cpu_usage_copy_online(uint64_t *dst, const uint64_t *src, int cpu_count)
+{
+	int full = cpu_count / 64;
+	uint64_t m;
+
+	memcpy(dst, src, full * sizeof(uint64_t));
+	if (cpu_count % 64) {
+		m = (UINT64_C(1) << (cpu_count % 64)) - 1;
+		dst[full] = (dst[full] & ~m) | (src[full] & m);
+	}
+}
+
+int cpu_usage_first(const struct cpu_usage *u, int n, uint64_t *mask, int cpu_count)
+{
+	int i, set = 0, words = CPU_USAGE_WORDS(cpu_count);
+	uint64_t bits;
+
+	memset(mask, 0, words * sizeof(uint64_t));
+	for (i = 0; i < words; i++) {
+		bits = mask_word(u->online, i, cpu_count);
+		if (n > 0 && set + __builtin_popcountll(bits) > n) {
+			/* Keep only the lowest n - set bits */
+			while (set < n) {
+				mask[i] |= bits & -bits;
+				bits &= bits - 1;
+				set++;
+			}
+			break;
+		}
+		mask[i] = bits;
+		set += __builtin_popcountll(bits);
+	}
+
+	return set;
+}
+
+/*
+ * Each implementation provides the kernels below.  room() computes, for
+ * the CPUs of word @w of @mask, how many idle ticks each could give away
+ * and returns their sum, take() has them all given to @counter, see
+ * cpu_usage_spread().  Only the vector kernels have those two.
+ */
+struct cpu_usage_ops {
+	const char *name;
+	void (*advance)(struct cpu_usage *usage, const struct cpu_usage *newer,
+			struct cpu_usage *diff, int cpu_count, uint64_t sums[3]);
+	void (*add)(struct cpu_usage *dst, const struct cpu_usage *src,
+		    const uint64_t *mask, int cpu_count, uint64_t sums[3]);
+	void (*assign)(struct cpu_usage *dst, const struct cpu_usage *src,
+		       const uint64_t *mask, int cpu_count, uint64_t sums[3]);
+	void (*sum)(const struct cpu_usage *u, const uint64_t *mask,
+		    int cpu_count, uint64_t sums[3]);
+	uint64_t (*room)(const struct cpu_usage *u, const uint64_t *mask, uint64_t threshold,
+			 uint64_t room[64], int w, int cpu_count);
+	void (*take)(struct cpu_usage *u, uint64_t *counter, const uint64_t room[64],
+		     int w, int cpu_count);
+};
+
+static inline uint64_t sub_clamp(uint64_t a, uint64_t b)
+{
+	return a > b ? a - b : 0;
+}
+
+/*
+ * The scalar kernels are the loops of the old array of structs code, one
+ * CPU after the other.  Those taking @mask stop after its last CPU, as the
+ * old code stopped after the last CPU shown.
+ */
+static inline bool mask_test(const uint64_t *mask, unsigned int cpu)
+{
+	return (mask[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+/* One past the last CPU of @mask below @cpu_count, 0 if there is none. */
+static inline int mask_end(const uint64_t *mask, int cpu_count)
+{
+	uint64_t bits;
+	int w;
+
+	for (w = CPU_USAGE_WORDS(cpu_count) - 1; w >= 0; w--) {
+		bits = mask_word(mask, w, cpu_count);
+		if (bits)
+			return w * 64 + 64 - __builtin_clzll(bits);
+	}
+
+	return 0;
+}
+
+static void scalar_advance(struct cpu_usage *usage, const struct cpu_usage *newer,
+			   struct cpu_usage *diff, int cpu_count, uint64_t sums[3])
+{
+	uint64_t *uu = usage->user, *us = usage->system, *ui = usage->idle;
+	const uint64_t *nu = newer->user, *ns = newer->system, *ni = newer->idle;
+	uint64_t *du = diff->user, *ds = diff->system, *di = diff->idle;
+	uint64_t su = 0, ss = 0, si = 0, user, system, idle;
+	int i;
+
+	for (i = 0; i < cpu_count; i++) {
+		if (!mask_test(newer->online, i)) {
+			du[i] = ds[i] = di[i] = 0;
+			continue;
+		}
+
+		/* Through locals, as the stores may alias the loads */
+		user = sub_clamp(nu[i], uu[i]);
+		system = sub_clamp(ns[i], us[i]);
+		idle = sub_clamp(ni[i], ui[i]);
+		du[i] = user;
+		ds[i] = system;
+		di[i] = idle;
+		uu[i] += user;
+		us[i] += system;
+		ui[i] += idle;
+		su += user;
+		ss += system;
+		si += idle;
+	}
+
+	sums[0] = su;
+	sums[1] = ss;
+	sums[2] = si;
+}
+
+static void scalar_add(struct cpu_usage *dst, const struct cpu_usage *src,
+		       const uint64_t *mask, int cpu_count, uint64_t sums[3])
+{
+	uint64_t *du = dst->user, *ds = dst->system, *di = dst->idle;
+	const uint64_t *su = src->user, *ss = src->system, *si = src->idle;
+	uint64_t au = 0, as = 0, ai = 0;
+	int i, end = mask_end(mask, cpu_count);
+
+	for (i = 0; i < end; i++) {
+		if (!mask_test(mask, i))
+			continue;
+
+		au += du[i] += su[i];
+		as += ds[i] += ss[i];
+		ai += di[i] += si[i];
+	}
+
+	sums[0] = au;
+	sums[1] = as;
+	sums[2] = ai;
+}
+
+static void scalar_assign(struct cpu_usage *dst, const struct cpu_usage *src,
+			  const uint64_t *mask, int cpu_count, uint64_t sums[3])
+{
+	uint64_t *du = dst->user, *ds = dst->system, *di = dst->idle;
+	const uint64_t *su = src->user, *ss = src->system, *si = src->idle;
+	uint64_t au = 0, as = 0, ai = 0;
+	int i, end = mask_end(mask, cpu_count);
+
+	for (i = 0; i < end; i++) {
+		if (!mask_test(mask, i))
+			continue;
+
+		au += du[i] = su[i];
+		as += ds[i] = ss[i];
+		ai += di[i] = si[i];
+	}
+
+	sums[0] = au;
+	sums[1] = as;
+	sums[2] = ai;
+}
+
+static void scalar_sum(const struct cpu_usage *u, const uint64_t *mask,
+		       int cpu_count, uint64_t sums[3])
+{
+	uint64_t su = 0, ss = 0, si = 0;
+	int i, end = mask_end(mask, cpu_count);
+
+	for (i = 0; i < end; i++) {
+		if (!mask_test(mask, i))
+			continue;
+
+		su += u->user[i];
+		ss += u->system[i];
+		si += u->idle[i];
+	}
+
+	sums[0] = su;
+	sums[1] = ss;
+	sums[2] = si;
+}
+
+/* See cpu_usage_spread(), the scalar kernels have no room() and take(). */
+static void scalar_spread(struct cpu_usage *u, const uint64_t *mask, uint64_t threshold,
+			  uint64_t surplus[2], int cpu_count)
+{
+	uint64_t *user = u->user, *system = u->system, *idle = u->idle;
+	uint64_t su = surplus[0], ss = surplus[1], free_space, to_user, to_system;
+	int i, end = mask_end(mask, cpu_count);
+
+	for (i = 0; i < end && (su > 0 || ss > 0); i++) {
+		if (!mask_test(mask, i))
+			continue;
+
+		free_space = sub_clamp(threshold, user[i] + system[i]);
+		if (free_space > idle[i])
+			free_space = idle[i];
+
+		/* User first, then if there is still room, system */
+		to_user = free_space < su ? free_space : su;
+		free_space -= to_user;
+		to_system = free_space < ss ? free_space : ss;
+		user[i] += to_user;
+		system[i] += to_system;
+		idle[i] -= to_user + to_system;
+		su -= to_user;
+		ss -= to_system;
+	}
+
+	surplus[0] = su;
+	surplus[1] = ss;
+}
+
+static const struct cpu_usage_ops scalar_ops = {
+	.name = "scalar",
+	.advance = scalar_advance,
+	.add = scalar_add,
+	.assign = scalar_assign,
+	.sum = scalar_sum,
+};
+
+#ifdef CPU_USAGE_X86
+/*
+ * The vector kernels work on CPU_USAGE_STRIDE CPUs at a time, through the
+ * padding of the arrays, and mask off the CPUs out of @mask with a lane
+ * mask looked up from their bits.  The SSE2 ones take two such masks from
+ * the first half of the table.
+ */
+static const uint64_t lane_masks[16][4] __attribute__((aligned(32))) = {
+#define L(b) ((b) ? UINT64_MAX : 0)
+#define LANES(n) { L(n & 1), L(n & 2), L(n & 4), L(n & 8) }
+	LANES(0), LANES(1), LANES(2), LANES(3),
+	LANES(4), LANES(5), LANES(6), LANES(7),
+	LANES(8), LANES(9), LANES(10), LANES(11),
+	LANES(12), LANES(13), LANES(14), LANES(15),
+#undef LANES
+#undef L
+};
+
+#define LOAD128(p, i) _mm_loadu_si128((const __m128i *)((p) + (i)))
+#define STORE128(p, i, v) _mm_storeu_si128((__m128i *)((p) + (i)), (v))
+#define LOAD256(p, i) _mm256_loadu_si256((const __m256i *)((p) + (i)))
+#define STORE256(p, i, v) _mm256_storeu_si256((__m256i *)((p) + (i)), (v))
+
+/*
+ * SSE2 cannot compare 64-bit integers, so a - b is clamped at 0 by
+ * recomputing its borrow.  min(a, b) = a - clamp(a - b).
+ */
+__attribute__((target("sse2")))
+static inline __m128i sse2_sub_clamp(__m128i a, __m128i b)
+{
+	__m128i d = _mm_sub_epi64(a, b);
+	__m128i borrow = _mm_srli_epi64(_mm_or_si128(_mm_andnot_si128(a, b),
+						     _mm_andnot_si128(_mm_xor_si128(a, b), d)), 63);
+
+	return _mm_andnot_si128(_mm_sub_epi64(_mm_setzero_si128(), borrow), d);
+}
+
+__attribute__((target("sse2")))
+static inline void sse2_sums(__m128i au, __m128i as, __m128i ai, uint64_t sums[3])
+{
+	uint64_t t[2];
+
+	_mm_storeu_si128((__m128i *)t, au);
+	sums[0] = t[0] + t[1];
+	_mm_storeu_si128((__m128i *)t, as);
+	sums[1] = t[0] + t[1];
+	_mm_storeu_si128((__m128i *)t, ai);
+	sums[2] = t[0] + t[1];
+}
+
+/* @d = @m & clamp(@n - @u), @u += @d, returns @acc + @d */
+__attribute__((target("sse2")))
+static inline __m128i sse2_advance1(uint64_t *u, const uint64_t *n, uint64_t *d,
+				    int i, __m128i m, __m128i acc)
+{
+	__m128i old = LOAD128(u, i);
+	__m128i v = _mm_and_si128(m, sse2_sub_clamp(LOAD128(n, i), old));
+
+	STORE128(d, i, v);
+	STORE128(u, i, _mm_add_epi64(old, v));
+	return _mm_add_epi64(acc, v);
+}
+
+__attribute__((target("sse2")))
+static void sse2_advance(struct cpu_usage *usage, const struct cpu_usage *newer,
+			 struct cpu_usage *diff, int cpu_count, uint64_t sums[3])
+{
+	uint64_t *uu = usage->user, *us = usage->system, *ui = usage->idle;
+	const uint64_t *nu = newer->user, *ns = newer->system, *ni = newer->idle;
+	uint64_t *du = diff->user, *ds = diff->system, *di = diff->idle, bits;
+	__m128i au = _mm_setzero_si128(), as = au, ai = au, m;
+	int w, i, end;
+
+	for (w = 0; w < CPU_USAGE_WORDS(cpu_count); w++) {
+		bits = mask_word(newer->online, w, cpu_count);
+		end = word_end(w, cpu_count);
+		for (i = w * 64; i < end; i += 2, bits >>= 2) {
+			m = LOAD128(lane_masks[bits & 3], 0);
+			au = sse2_advance1(uu, nu, du, i, m, au);
+			as = sse2_advance1(us, ns, ds, i, m, as);
+			ai = sse2_advance1(ui, ni, di, i, m, ai);
+		}
+	}
+
+	sse2_sums(au, as, ai, sums);
+}
+
+__attribute__((target("sse2")))
+static void sse2_add(struct cpu_usage *dst, const struct cpu_usage *src,
+		     const uint64_t *mask, int cpu_count, uint64_t sums[3])
+{
+	uint64_t *du = dst->user, *ds = dst->system, *di = dst->idle, bits;
+	const uint64_t *su = src->user, *ss = src->system, *si = src->idle;
+	__m128i au = _mm_setzero_si128(), as = au, ai = au, m, v;
+	int w, i, end;
+
+	for (w = 0; w < CPU_USAGE_WORDS(cpu_count); w++) {
+		bits = mask_word(mask, w, cpu_count);
+		if (!bits)
+			continue;
+		end = word_end(w, cpu_count);
+		for (i = w * 64; i < end; i += 2, bits >>= 2) {
+			m = LOAD128(lane_masks[bits & 3], 0);
+			v = _mm_add_epi64(LOAD128(du, i), _mm_and_si128(m, LOAD128(su, i)));
+			STORE128(du, i, v);
+			au = _mm_add_epi64(au, _mm_and_si128(m, v));
+			v = _mm_add_epi64(LOAD128(ds, i), _mm_and_si128(m, LOAD128(ss, i)));
+			STORE128(ds, i, v);
+			as = _mm_add_epi64(as, _mm_and_si128(m, v));
+			v = _mm_add_epi64(LOAD128(di, i), _mm_and_si128(m, LOAD128(si, i)));
+			STORE128(di, i, v);
+			ai = _mm_add_epi64(ai, _mm_and_si128(m, v));
+		}
+	}
+
+	sse2_sums(au, as, ai, sums);
+}
+
+__attribute__((target("sse2")))
+static void sse2_assign(struct cpu_usage *dst, const struct cpu_usage *src,
+			const uint64_t *mask, int cpu_count, uint64_t sums[3])
+{
+	uint64_t *du = dst->user, *ds = dst->system, *di = dst->idle, bits;
+	const uint64_t *su = src->user, *ss = src->system, *si = src->idle;
+	__m128i au = _mm_setzero_si128(), as = au, ai = au, m, v;
+	int w, i, end;
+
+	for (w = 0; w < CPU_USAGE_WORDS(cpu_count); w++) {
+		bits = mask_word(mask, w, cpu_count);
+		if (!bits)
+			continue;
+		end = word_end(w, cpu_count);
+		for (i = w * 64; i < end; i += 2, bits >>= 2) {
+			m = LOAD128(lane_masks[bits & 3], 0);
+			v = _mm_and_si128(m, LOAD128(su, i));
+			STORE128(du, i, _mm_or_si128(v, _mm_andnot_si128(m, LOAD128(du, i))));
+			au = _mm_add_epi64(au, v);
+			v = _mm_and_si128(m, LOAD128(ss, i));
+			STORE128(ds, i, _mm_or_si128(v, _mm_andnot_si128(m, LOAD128(ds, i))));
+			as = _mm_add_epi64(as, v);
+			v = _mm_and_si128(m, LOAD128(si, i));
+			STORE128(di, i, _mm_or_si128(v, _mm_andnot_si128(m, LOAD128(di, i))));
+			ai = _mm_add_epi64(ai, v);
+		}
+	}
+
+	sse2_sums(au, as, ai, sums);
+}
+
+__attribute__((target("sse2")))
+static void sse2_sum(const struct cpu_usage *u, const uint64_t *mask,
+		     int cpu_count, uint64_t sums[3])
+{
+	const uint64_t *uu = u->user, *us = u->system, *ui = u->idle;
+	__m128i au = _mm_setzero_si128(), as = au, ai = au, m;
+	uint64_t bits;
+	int w, i, end;
+
+	for (w = 0; w < CPU_USAGE_WORDS(cpu_count); w++) {
+		bits = mask_word(mask, w, cpu_count);
+		if (!bits)
+			continue;
+		end = word_end(w, cpu_count);
+		for (i = w * 64; i < end; i += 2, bits >>= 2) {
+			m = LOAD128(lane_masks[bits & 3], 0);
+			au = _mm_add_epi64(au, _mm_and_si128(m, LOAD128(uu, i)));
+			as = _mm_add_epi64(as, _mm_and_si128(m, LOAD128(us, i)));
+			ai = _mm_add_epi64(ai, _mm_and_si128(m, LOAD128(ui, i)));
+		}
+	}
+
+	sse2_sums(au, as, ai, sums);
+}
+
+__attribute__((target("sse2")))
+static uint64_t sse2_room(const struct cpu_usage *u, const uint64_t *mask, uint64_t threshold,
+			  uint64_t room[64], int w, int cpu_count)
+{
+	const uint64_t *uu = u->user, *us = u->system, *ui = u->idle;
+	__m128i t = _mm_set1_epi64x(threshold), acc = _mm_setzero_si128(), m, f;
+	uint64_t bits = mask_word(mask, w, cpu_count), sums[3];
+	int i, end = word_end(w, cpu_count);
+
+	for (i = w * 64; i < end; i += 2, bits >>= 2) {
+		m = LOAD128(lane_masks[bits & 3], 0);
+		f = sse2_sub_clamp(t, _mm_add_epi64(LOAD128(uu, i), LOAD128(us, i)));
+		f = _mm_and_si128(m, _mm_sub_epi64(f, sse2_sub_clamp(f, LOAD128(ui, i))));
+		STORE128(room, i - w * 64, f);
+		acc = _mm_add_epi64(acc, f);
+	}
+
+	sse2_sums(acc, acc, acc, sums);
+	return sums[0];
+}
+
+__attribute__((target("sse2")))
+static void sse2_take(struct cpu_usage *u, uint64_t *counter, const uint64_t room[64],
+		      int w, int cpu_count)
+{
+	uint64_t *idle = u->idle;
+	__m128i r;
+	int i, end = word_end(w, cpu_count);
+
+	for (i = w * 64; i < end; i += 2) {
+		r = LOAD128(room, i - w * 64);
+		STORE128(counter, i, _mm_add_epi64(LOAD128(counter, i), r));
+		STORE128(idle, i, _mm_sub_epi64(LOAD128(idle, i), r));
+	}
+}
+
+static const struct cpu_usage_ops sse2_ops = {
+	.name = "sse2",
+	.advance = sse2_advance,
+	.add = sse2_add,
+	.assign = sse2_assign,
+	.sum = sse2_sum,
+	.room = sse2_room,
+	.take = sse2_take,
+};
+
+/* AVX2 compares signed integers, flipping their sign bit makes it unsigned. */
+__attribute__((target("avx2")))
+static inline __m256i avx2_sub_clamp(__m256i a, __m256i b)
+{
+	__m256i sign = _mm256_set1_epi64x(INT64_MIN);
+	__m256i lt = _mm256_cmpgt_epi64(_mm256_xor_si256(b, sign), _mm256_xor_si256(a, sign));
+
+	return _mm256_andnot_si256(lt, _mm256_sub_epi64(a, b));
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_sums(__m256i au, __m256i as, __m256i ai, uint64_t sums[3])
+{
+	uint64_t t[4];
+
+	_mm256_storeu_si256((__m256i *)t, au);
+	sums[0] = t[0] + t[1] + t[2] + t[3];
+	_mm256_storeu_si256((__m256i *)t, as);
+	sums[1] = t[0] + t[1] + t[2] + t[3];
+	_mm256_storeu_si256((__m256i *)t, ai);
+	sums[2] = t[0] + t[1] + t[2] + t[3];
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_advance1(uint64_t *u, const uint64_t *n, uint64_t *d,
+				    int i, __m256i m, __m256i acc)
+{
+	__m256i old = LOAD256(u, i);
+	__m256i v = _mm256_and_si256(m, avx2_sub_clamp(LOAD256(n, i), old));
+
+	STORE256(d, i, v);
+	STORE256(u, i, _mm256_add_epi64(old, v));
+	return _mm256_add_epi64(acc, v);
+}
+
+__attribute__((target("avx2")))
+static void avx2_advance(struct cpu_usage *usage, const struct cpu_usage *newer,
+			 struct cpu_usage *diff, int cpu_count, uint64_t sums[3])
+{
+	uint64_t *uu = usage->user, *us = usage->system, *ui = usage->idle;
+	const uint64_t *nu = newer->user, *ns = newer->system, *ni = newer->idle;
+	uint64_t *du = diff->user, *ds = diff->system, *di = diff->idle, bits;
+	__m256i au = _mm256_setzero_si256(), as = au, ai = au, m;
+	int w, i, end;
+
+	for (w = 0; w < CPU_USAGE_WORDS(cpu_count); w++) {
+		bits = mask_word(newer->online, w, cpu_count);
+		end = word_end(w, cpu_count);
+		for (i = w * 64; i < end; i += 4, bits >>= 4) {
+			m = LOAD256(lane_masks[bits & 15], 0);
+			au = avx2_advance1(uu, nu, du, i, m, au);
+			as = avx2_advance1(us, ns, ds, i, m, as);
+			ai = avx2_advance1(ui, ni, di, i, m, ai);
+		}
+	}
+
+	avx2_sums(au, as, ai, sums);
+}
+
+__attribute__((target("avx2")))
+static void avx2_add(struct cpu_usage *dst, const struct cpu_usage *src,
+		     const uint64_t *mask, int cpu_count, uint64_t sums[3])
+{
+	uint64_t *du = dst->user, *ds = dst->system, *di = dst->idle, bits;
+	const uint64_t *su = src->user, *ss = src->system, *si = src->idle;
+	__m256i au = _mm256_setzero_si256(), as = au, ai = au, m, v;
+	int w, i, end;
+
+	for (w = 0; w < CPU_USAGE_WORDS(cpu_count); w++) {
+		bits = mask_word(mask, w, cpu_count);
+		if (!bits)
+			continue;
+		end = word_end(w, cpu_count);
+		for (i = w * 64; i < end; i += 4, bits >>= 4) {
+			m = LOAD256(lane_masks[bits & 15], 0);
+			v = _mm256_add_epi64(LOAD256(du, i), _mm256_and_si256(m, LOAD256(su, i)));
+			STORE256(du, i, v);
+			au = _mm256_add_epi64(au, _mm256_and_si256(m, v));
+			v = _mm256_add_epi64(LOAD256(ds, i), _mm256_and_si256(m, LOAD256(ss, i)));
+			STORE256(ds, i, v);
+			as = _mm256_add_epi64(as, _mm256_and_si256(m, v));
+			v = _mm256_add_epi64(LOAD256(di, i), _mm256_and_si256(m, LOAD256(si, i)));
+			STORE256(di, i, v);
+			ai = _mm256_add_epi64(ai, _mm256_and_si256(m, v));
+		}
+	}
+
+	avx2_sums(au, as, ai, sums);
+}
+
+__attribute__((target("avx2")))
+static void avx2_assign(struct cpu_usage *dst, const struct cpu_usage *src,
+			const uint64_t *mask, int cpu_count, uint64_t sums[3])
+{
+	uint64_t *du = dst->user, *ds = dst->system, *di = dst->idle, bits;
+	const uint64_t *su = src->user, *ss = src->system, *si = src->idle;
+	__m256i au = _mm256_setzero_si256(), as = au, ai = au, m, v;
+	int w, i, end;
+
+	for (w = 0; w < CPU_USAGE_WORDS(cpu_count); w++) {
+		bits = mask_word(mask, w, cpu_count);
+		if (!bits)
+			continue;
+		end = word_end(w, cpu_count);
+		for (i = w * 64; i < end; i += 4, bits >>= 4) {
+			m = LOAD256(lane_masks[bits & 15], 0);
+			v = LOAD256(su, i);
+			STORE256(du, i, _mm256_blendv_epi8(LOAD256(du, i), v, m));
+			au = _mm256_add_epi64(au, _mm256_and_si256(m, v));
+			v = LOAD256(ss, i);
+			STORE256(ds, i, _mm256_blendv_epi8(LOAD256(ds, i), v, m));
+			as = _mm256_add_epi64(as, _mm256_and_si256(m, v));
+			v = LOAD256(si, i);
+			STORE256(di, i, _mm256_blendv_epi8(LOAD256(di, i), v, m));
+			ai = _mm256_add_epi64(ai, _mm256_and_si256(m, v));
+		}
+	}
+
+	avx2_sums(au, as, ai, sums);
+}
+
+__attribute__((target("avx2")))
+static void avx2_sum(const struct cpu_usage *u, const uint64_t *mask,
+		     int cpu_count, uint64_t sums[3])
+{
+	const uint64_t *uu = u->user, *us = u->system, *ui = u->idle;
+	__m256i au = _mm256_setzero_si256(), as = au, ai = au, m;
+	uint64_t bits;
+	int w, i, end;
+
+	for (w = 0; w < CPU_USAGE_WORDS(cpu_count); w++) {
+		bits = mask_word(mask, w, cpu_count);
+		if (!bits)
+			continue;
+		end = word_end(w, cpu_count);
+		for (i = w * 64; i < end; i += 4, bits >>= 4) {
+			m = LOAD256(lane_masks[bits & 15], 0);
+			au = _mm256_add_epi64(au, _mm256_and_si256(m, LOAD256(uu, i)));
+			as = _mm256_add_epi64(as, _mm256_and_si256(m, LOAD256(us, i)));
+			ai = _mm256_add_epi64(ai, _mm256_and_si256(m, LOAD256(ui, i)));
+		}
+	}
+
+	avx2_sums(au, as, ai, sums);
+}
+
+__attribute__((target("avx2")))
+static uint64_t avx2_room(const struct cpu_usage *u, const uint64_t *mask, uint64_t threshold,
+			  uint64_t room[64], int w, int cpu_count)
+{
+	const uint64_t *uu = u->user, *us = u->system, *ui = u->idle;
+	__m256i t = _mm256_set1_epi64x(threshold), acc = _mm256_setzero_si256(), m, f;
+	uint64_t bits = mask_word(mask, w, cpu_count), sums[3];
+	int i, end = word_end(w, cpu_count);
+
+	for (i = w * 64; i < end; i += 4, bits >>= 4) {
+		m = LOAD256(lane_masks[bits & 15], 0);
+		f = avx2_sub_clamp(t, _mm256_add_epi64(LOAD256(uu, i), LOAD256(us, i)));
+		f = _mm256_and_si256(m, _mm256_sub_epi64(f, avx2_sub_clamp(f, LOAD256(ui, i))));
+		STORE256(room, i - w * 64, f);
+		acc = _mm256_add_epi64(acc, f);
+	}
+
+	avx2_sums(acc, acc, acc, sums);
+	return sums[0];
+}
+
+__attribute__((target("avx2")))
+static void avx2_take(struct cpu_usage *u, uint64_t *counter, const uint64_t room[64],
+		      int w, int cpu_count)
+{
+	uint64_t *idle = u->idle;
+	__m256i r;
+	int i, end = word_end(w, cpu_count);
+
+	for (i = w * 64; i < end; i += 4) {
+		r = LOAD256(room, i - w * 64);
+		STORE256(counter, i, _mm256_add_epi64(LOAD256(counter, i), r));
+		STORE256(idle, i, _mm256_sub_epi64(LOAD256(idle, i), r));
+	}
+}
+
+static const struct cpu_usage_ops avx2_ops = {
+	.name = "avx2",
+	.advance = avx2_advance,
+	.add = avx2_add,
+	.assign = avx2_assign,
+	.sum = avx2_sum,
+	.room = avx2_room,
+	.take = avx2_take,
+};
+#endif /* CPU_USAGE_X86 */
+
+static const struct cpu_usage_ops *ops = &scalar_ops;
+static pthread_once_t ops_once = PTHREAD_ONCE_INIT;
+
+static void cpu_usage_pick_ops(void)
+{
+#ifdef CPU_USAGE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		ops = &avx2_ops;
+	else if (__builtin_cpu_supports("sse2"))
+		ops = &sse2_ops;
+#endif
+}
+
+static inline const struct cpu_usage_ops *cpu_usage_ops(void)
+{
+	pthread_once(&ops_once, cpu_usage_pick_ops);
+	return ops;
+}
+
+const char *cpu_usage_impl(void)
+{
+	return cpu_usage_ops()->name;
+}
+
+void cpu_usage_advance(struct cpu_usage *usage, const struct cpu_usage *newer,
+		       struct cpu_usage *diff, int cpu_count, uint64_t sums[3])
+{
+	cpu_usage_ops()->advance(usage, newer, diff, cpu_count, sums);
+	cpu_usage_copy_online(usage->online, newer->online, cpu_count);
+	cpu_usage_copy_online(diff->online, newer->online, cpu_count);
+}
+
+void cpu_usage_add(struct cpu_usage *dst, const struct cpu_usage *src,
+		   const uint64_t *mask, int cpu_count, uint64_t sums[3])
+{
+	cpu_usage_ops()->add(dst, src, mask, cpu_count, sums);
+}
+
+void cpu_usage_assign(struct cpu_usage *dst, const struct cpu_usage *src,
+		      const uint64_t *mask, int cpu_count, uint64_t sums[3])
+{
+	cpu_usage_ops()->assign(dst, src, mask, cpu_count, sums);
+}
+
+void cpu_usage_sum(const struct cpu_usage *u, const uint64_t *mask,
+		   int cpu_count, uint64_t sums[3])
+{
+	cpu_usage_ops()->sum(u, mask, cpu_count, sums);
+}
+
+void cpu_usage_spread(struct cpu_usage *u, const uint64_t *mask, uint64_t threshold,
+		      uint64_t surplus[2], int cpu_count)
+{
+	const struct cpu_usage_ops *o = cpu_usage_ops();
+	uint64_t room[64] __attribute__((aligned(32))), total, to_add;
+	uint64_t *counters[2] = { u->user, u->system };
+	int w, c, i, end;
+
+	if (!o->room) {
+		scalar_spread(u, mask, threshold, surplus, cpu_count);
+		return;
+	}
+
+	/*
+	 * What each CPU takes depends on what the ones before it took.  But as
+	 * long as the surplus covers the room of all the CPUs of a word, they
+	 * all take it whole.  Only the word where it runs out is handed out
+	 * one CPU at a time.  Handing out user time to a word, then system
+	 * time, leaves each CPU with what it gets one CPU after the other.
+	 */
+	for (w = 0; w < CPU_USAGE_WORDS(cpu_count) && (surplus[0] > 0 || surplus[1] > 0); w++) {
+		if (!mask_word(mask, w, cpu_count))
+			continue;
+
+		for (c = 0; c < 2; c++) {
+			if (surplus[c] == 0)
+				continue;
+
+			total = o->room(u, mask, threshold, room, w, cpu_count);
+			if (total <= surplus[c]) {
+				o->take(u, counters[c], room, w, cpu_count);
+				surplus[c] -= total;
+				continue;
+			}
+
+			end = word_end(w, cpu_count);
+			for (i = w * 64; i < end && surplus[c] > 0; i++) {
+				to_add = room[i - w * 64] < surplus[c] ? room[i - w * 64] : surplus[c];
+				counters[c][i] += to_add;
+				u->idle[i] -= to_add;
+				surplus[c] -= to_add;
+			}
+		}
+	}
+}
+
+/* For benchmarks: use the kernels named @name.  Returns 0 on success. */
+int cpu_usage_set_impl(const char *name)
+{
+	const struct cpu_usage_ops *candidates[] = {
+#ifdef CPU_USAGE_X86
+		&avx2_ops,
+		&sse2_ops,
+#endif
+		&scalar_ops,
+	};
+	size_t i;
+
+	cpu_usage_ops();
+	for (i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+		if (strcmp(candidates[i]->name, name) != 0)
+			continue;
+#ifdef CPU_USAGE_X86
+		if (candidates[i] == &avx2_ops && !__builtin_cpu_supports("avx2"))
+			return -1;
+		if (candidates[i] == &sse2_ops && !__builtin_cpu_supports("sse2"))
+			return -1;
+#endif
+		ops = candidates[i];
+		return 0;
+	}
+
+	return -1;
+}
@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#ifndef __LXCFS_CPU_USAGE_H
+#define __LXCFS_CPU_USAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Per-CPU usage in clock ticks, kept as one array per counter so that the
+ * cpuview math can work on several CPUs at once.  The arrays are padded to
+ * a multiple of CPU_USAGE_STRIDE entries and the CPUs of the cgroup's
+ * cpuset are set in the @online bitmap.
+ */
+#define CPU_USAGE_STRIDE 4
+#define CPU_USAGE_PAD(n) (((n) + CPU_USAGE_STRIDE - 1) & ~(CPU_USAGE_STRIDE - 1))
+#define CPU_USAGE_WORDS(n) (((n) + 63) / 64)
+
+struct cpu_usage {
+	uint64_t *user;
+	uint64_t *system;
+	uint64_t *idle;
+	uint64_t *online;
+};
+
+static inline bool cpu_usage_online(const struct cpu_usage *u, int cpu)
+{
+	return (u->online[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+static inline void cpu_usage_set_online(struct cpu_usage *u, int cpu, bool online)
+{
+	if (online)
+		u->online[cpu / 64] |= UINT64_C(1) << (cpu % 64);
+	else
+		u->online[cpu / 64] &= ~(UINT64_C(1) << (cpu % 64));
+}
+
+/* Allocation, all counters zeroed and all CPUs offline. Return 0 on success. */
+extern int cpu_usage_alloc(struct cpu_usage *u, int cpu_count);
+extern int cpu_usage_realloc(struct cpu_usage *u, int old_count, int new_count);
+extern void cpu_usage_free(struct cpu_usage *u);
+extern void cpu_usage_copy(struct cpu_usage *dst, const struct cpu_usage *src, int cpu_count);
+extern void cpu_usage_zero(struct cpu_usage *u, int cpu_count);
+extern void cpu_usage_copy_online(uint64_t *dst, const uint64_t *src, int cpu_count);
+
+/*
+ * Set @mask to the first @n CPUs online in @u, or to all of them if @n is
+ * not positive.  Returns the number of CPUs set.
+ */
+extern int cpu_usage_first(const struct cpu_usage *u, int n, uint64_t *mask, int cpu_count);
+
+/*
+ * The kernels below only look at the first @cpu_count CPUs, and those in
+ * @mask where they take one.  Those given @sums set them to the sums of
+ * the user, system and idle counters they produce.
+ */
+
+/*
+ * Move @usage forward to @newer: @diff = @newer - @usage for the CPUs online
+ * in @newer, counters that went backwards count as 0, and 0 for the other
+ * CPUs.  @usage += @diff, and takes the online CPUs of @newer.
+ */
+extern void cpu_usage_advance(struct cpu_usage *usage, const struct cpu_usage *newer,
+			      struct cpu_usage *diff, int cpu_count, uint64_t sums[3]);
+
+/* @dst += @src */
+extern void cpu_usage_add(struct cpu_usage *dst, const struct cpu_usage *src,
+			  const uint64_t *mask, int cpu_count, uint64_t sums[3]);
+
+/* @dst = @src */
+extern void cpu_usage_assign(struct cpu_usage *dst, const struct cpu_usage *src,
+			     const uint64_t *mask, int cpu_count, uint64_t sums[3]);
+
+extern void cpu_usage_sum(const struct cpu_usage *u, const uint64_t *mask,
+			  int cpu_count, uint64_t sums[3]);
+
+/*
+ * Hand out up to @surplus[0] ticks of user time and @surplus[1] of system
+ * time to the CPUs in @mask in order.  A CPU takes them out of its idle
+ * time, user time first, as long as its user and system time stay below
+ * @threshold.  @surplus is left with what could not be handed out.
+ */
+extern void cpu_usage_spread(struct cpu_usage *u, const uint64_t *mask, uint64_t threshold,
+			     uint64_t surplus[2], int cpu_count);
+
+/* The name of the kernels in use: "avx2", "sse2" or "scalar". */
+extern const char *cpu_usage_impl(void);
+extern int cpu_usage_set_impl(const char *name);
+
+#endif /* __LXCFS_CPU_USAGE_H */
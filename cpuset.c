@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "cpuset.h"
+
 /*
  * Helper functions for cpuset_in-set
  */
@@ -22,10 +25,6 @@ static int cpuset_getrange(const char *c, int *a, int *b)
 	return ret;
 }
 
-/*
- * cpusets are in format "1,2-3,4"
- * iow, comma-delimited ranges
- */
 bool cpu_in_cpuset(int cpu, const char *cpuset)
 {
 	const char *c;
@@ -43,3 +42,123 @@ bool cpu_in_cpuset(int cpu, const char *cpuset)
 	return false;
 }
 
+
+/*
+ * Read the range at @c into [@a, @b], clamped to CPUMASK_MAX_CPUS.  Returns
+ * false for what cpu_in_cpuset() would never match.
+ */
+static bool cpuset_range(const char *c, int *a, int *b)
+{
+	int ret;
+
+	ret = cpuset_getrange(c, a, b);
+	if (ret == 1)
+		*b = *a;
+	else if (ret != 2)
+		return false;
+	if (*a < 0 || *a >= CPUMASK_MAX_CPUS || *b < *a)
+		return false;
+	if (*b >= CPUMASK_MAX_CPUS)
+		*b = CPUMASK_MAX_CPUS - 1;
+	return true;
+}
+
+static struct cpumask *cpumask_alloc(int nr_bits)
+{
+	struct cpumask *mask;
+
+	mask = calloc(1, sizeof(*mask) + (nr_bits + 63) / 64 * sizeof(uint64_t));
+	if (mask)
+		mask->nr_bits = nr_bits;
+	return mask;
+}
+
+struct cpumask *cpumask_parse(const char *cpuset)
+{
+	struct cpumask *mask;
+	const char *c;
+	int a, b, nr_bits = 0, cpu;
+
+	/* Size the mask first ... */
+	for (c = cpuset; c && *c; c = cpuset_nexttok(c)) {
+		if (cpuset_range(c, &a, &b) && b >= nr_bits)
+			nr_bits = b + 1;
+	}
+
+	mask = cpumask_alloc(nr_bits);
+	if (!mask)
+		return NULL;
+
+	/* ... then fill it in. */
+	for (c = cpuset; c && *c; c = cpuset_nexttok(c)) {
+		if (!cpuset_range(c, &a, &b))
+			continue;
+		for (cpu = a; cpu <= b; cpu++)
+			mask->bits[cpu / 64] |= UINT64_C(1) << (cpu % 64);
+	}
+
+	for (a = 0; a < (nr_bits + 63) / 64; a++)
+		mask->weight += __builtin_popcountll(mask->bits[a]);
+
+	return mask;
+}
+
+struct cpumask *cpumask_dup(const struct cpumask *mask)
+{
+	struct cpumask *copy;
+
+	copy = cpumask_alloc(mask->nr_bits);
+	if (!copy)
+		return NULL;
+	memcpy(copy->bits, mask->bits, (mask->nr_bits + 63) / 64 * sizeof(uint64_t));
+	copy->weight = mask->weight;
+	return copy;
+}
+
+void cpumask_free(struct cpumask *mask)
+{
+	free(mask);
+}
+
+int cpumask_next(const struct cpumask *mask, int cpu)
+{
+	uint64_t word;
+	int i;
+
+	if (cpu < 0)
+		cpu = 0;
+	if (cpu >= mask->nr_bits)
+		return -1;
+
+	i = cpu / 64;
+	word = mask->bits[i] & (~UINT64_C(0) << (cpu % 64));
+	for (;;) {
+		if (word)
+			return i * 64 + __builtin_ctzll(word);
+		if (++i >= (mask->nr_bits + 63) / 64)
+			return -1;
+		word = mask->bits[i];
+	}
+}
+
+int cpumask_nth(const struct cpumask *mask, int n)
+{
+	uint64_t word;
+	int i, cnt;
+
+	if (n < 0 || n >= mask->weight)
+		return -1;
+
+	for (i = 0; ; i++) {
+		word = mask->bits[i];
+		cnt = __builtin_popcountll(word);
+		if (n < cnt)
+			break;
+		n -= cnt;
+	}
+
+	/* Drop the @n lowest CPUs of the word */
+	while (n--)
+		word &= word - 1;
+	return i * 64 + __builtin_ctzll(word);
+}
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#ifndef __LXCFS_CPUSET_H
+#define __LXCFS_CPUSET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * cpusets are in format "1,2-3,4"
+ * iow, comma-delimited ranges
+ */
+extern bool cpu_in_cpuset(int cpu, const char *cpuset);
+
+/*
+ * A cpuset compiled into a bitmap once, so that testing a CPU is a bit
+ * lookup instead of a parse of the string.  Only the CPUs below @nr_bits
+ * can be set, @weight is the number of those which are.
+ */
+#define CPUMASK_MAX_CPUS 65536
+
+struct cpumask {
+	int nr_bits;
+	int weight;
+	uint64_t bits[];
+};
+
+/* Return a new mask for @cpuset, which is NULL if out of memory. */
+extern struct cpumask *cpumask_parse(const char *cpuset);
+extern struct cpumask *cpumask_dup(const struct cpumask *mask);
+extern void cpumask_free(struct cpumask *mask);
+
+static inline bool cpumask_test(const struct cpumask *mask, int cpu)
+{
+	if (cpu < 0 || cpu >= mask->nr_bits)
+		return false;
+	return (mask->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+static inline int cpumask_weight(const struct cpumask *mask)
+{
+	return mask->weight;
+}
+
+/* The first CPU in @mask from @cpu on, or -1 if none. */
+extern int cpumask_next(const struct cpumask *mask, int cpu);
+
+/* The @n-th CPU in @mask, counting from 0, or -1 if it has fewer. */
+extern int cpumask_nth(const struct cpumask *mask, int n);
+
+#define for_each_cpu(cpu, mask)                                  \
+	for ((cpu) = cpumask_next((mask), 0); (cpu) >= 0;        \
+	     (cpu) = cpumask_next((mask), (cpu) + 1))
+
+#endif /* __LXCFS_CPUSET_H */
@@ -14,10 +14,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +35,7 @@
 #include <linux/limits.h>
 
 #include "bindings.h"
+#include "buf_pool.h"
 #include "config.h" // for VERSION
 
 void *dlopen_handle;
@@ -70,21 +75,33 @@ static void users_unlock(void)
 }
 
 static pthread_t loadavg_pid = 0;
+static int load_threads = LOAD_THREADS;
+static int load_engine = LOAD_ENGINE_TASKS;
+static int load_idle_secs = LOAD_IDLE_SECS;
 
 /* Returns zero on success */
 static int start_loadavg(void) {
 	char *error;
 	pthread_t (*load_daemon)(int);
+	pthread_t (*load_daemon_v2)(int, int, int);
 
 	dlerror();    /* Clear any existing error */
 
+	/* Libraries predating the worker pool only have load_daemon(). */
+	load_daemon_v2 = (pthread_t (*)(int, int, int)) dlsym(dlopen_handle, "load_daemon_v2");
+	if (load_daemon_v2) {
+		loadavg_pid = load_daemon_v2(load_engine, load_threads, load_idle_secs);
+		return loadavg_pid == 0 ? -1 : 0;
+	}
+	dlerror();
+
 	load_daemon = (pthread_t (*)(int)) dlsym(dlopen_handle, "load_daemon");
 	error = dlerror();
 	if (error != NULL) {
 		lxcfs_error("load_daemon fails:%s\n", error);
 		return -1;
 	}
-	loadavg_pid = load_daemon(1);
+	loadavg_pid = load_daemon(load_engine);
 	if (loadavg_pid == 0)
 		return -1;
 
@@ -109,16 +126,104 @@ static int stop_loadavg(void) {
 	return 0;
 }
 
+static pthread_t cpuview_pid = 0;
+
+/* Libraries predating the cpuview daemon just lack it, that is fine. */
+static void start_cpuview(void) {
+	pthread_t (*cpuview_daemon)(void);
+
+	dlerror();    /* Clear any existing error */
+	cpuview_daemon = (pthread_t (*)(void)) dlsym(dlopen_handle, "cpuview_daemon");
+	if (!cpuview_daemon) {
+		lxcfs_debug("cpuview_daemon not found: %s\n", dlerror());
+		return;
+	}
+	cpuview_pid = cpuview_daemon();
+}
+
+static void stop_cpuview(void) {
+	int (*stop_cpuview_daemon)(pthread_t);
+
+	if (cpuview_pid == 0)
+		return;
+
+	stop_cpuview_daemon = (int (*)(pthread_t)) dlsym(dlopen_handle, "stop_cpuview_daemon");
+	if (!stop_cpuview_daemon) {
+		lxcfs_error("stop_cpuview_daemon error: %s\n", dlerror());
+		return;
+	}
+	stop_cpuview_daemon(cpuview_pid);
+	cpuview_pid = 0;
+}
+
+/* In bytes, -1 leaves the library's default. */
+static long long buf_pool_limit = -1;
+
+/* Libraries predating the buffer pool just lack it, that is fine. */
+static void set_buf_pool_limit(void)
+{
+	void (*set_limit)(size_t);
+
+	if (buf_pool_limit < 0)
+		return;
+
+	set_limit = (void (*)(size_t)) dlsym(dlopen_handle, "buf_pool_set_limit");
+	if (!set_limit) {
+		lxcfs_debug("buf_pool_set_limit not found: %s\n", dlerror());
+		return;
+	}
+	set_limit(buf_pool_limit);
+}
+
+static void report_buf_pool(void)
+{
+	void (*get_stats)(struct buf_pool_stats *);
+	struct buf_pool_stats st;
+
+	get_stats = (void (*)(struct buf_pool_stats *)) dlsym(dlopen_handle, "buf_pool_get_stats");
+	if (!get_stats) {
+		lxcfs_error("buf_pool_get_stats not found: %s\n", dlerror());
+		return;
+	}
+	get_stats(&st);
+	lxcfs_error("buffer pool: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+		    " dropped, %zu of %zu bytes retained\n",
+		    st.hits, st.misses, st.dropped, st.retained, st.limit);
+}
+
+/* Libraries predating the pass statistics just lack them. */
+static void report_loadavg(void)
+{
+	void (*get_stats)(struct load_stats *);
+	struct load_stats st;
+
+	if (loadavg_pid == 0)
+		return;
+
+	get_stats = (void (*)(struct load_stats *)) dlsym(dlopen_handle, "load_get_stats");
+	if (!get_stats) {
+		lxcfs_debug("load_get_stats not found: %s\n", dlerror());
+		return;
+	}
+	get_stats(&st);
+	lxcfs_error("loadavg: %" PRIu64 " passes with %d threads, the last took %" PRIu64
+		    " ms, the longest %" PRIu64 " ms\n",
+		    st.passes, st.threads, st.last_ms, st.max_ms);
+}
+
 static volatile sig_atomic_t need_reload;
+static volatile sig_atomic_t need_report;
 
 /* do_reload - reload the dynamic library.  Done under
  * lock and when we know the user_count was 0 */
 static void do_reload(void)
 {
 	char lxcfs_lib_path[PATH_MAX];
+	bool cpuview_restart = cpuview_pid > 0;
 
 	if (loadavg_pid > 0)
 		stop_loadavg();
+	stop_cpuview();
 
 	if (dlopen_handle) {
 		lxcfs_debug("%s\n", "Closing liblxcfs.so handle.");
@@ -145,8 +250,11 @@ static void do_reload(void)
 	}
 
 good:
+	set_buf_pool_limit();
 	if (loadavg_pid > 0)
 		start_loadavg();
+	if (cpuview_restart)
+		start_cpuview();
 
 	if (need_reload)
 		lxcfs_error("%s\n", "lxcfs: reloaded");
@@ -158,6 +266,11 @@ static void up_users(void)
 	users_lock();
 	if (users_count == 0 && need_reload)
 		do_reload();
+	if (need_report) {
+		need_report = 0;
+		report_buf_pool();
+		report_loadavg();
+	}
 	users_count++;
 	users_unlock();
 }
@@ -174,6 +287,11 @@ static void reload_handler(int sig)
 	need_reload = 1;
 }
 
+static void report_handler(int sig)
+{
+	need_report = 1;
+}
+
 /* Functions to run the library methods */
 static int do_cg_getattr(const char *path, struct stat *sb)
 {
@@ -190,36 +308,6 @@ static int do_cg_getattr(const char *path, struct stat *sb)
 	return cg_getattr(path, sb);
 }
 
-static int do_proc_getattr(const char *path, struct stat *sb)
-{
-	int (*proc_getattr)(const char *path, struct stat *sb);
-	char *error;
-	dlerror();    /* Clear any existing error */
-	proc_getattr = (int (*)(const char *, struct stat *)) dlsym(dlopen_handle, "proc_getattr");
-	error = dlerror();
-	if (error != NULL) {
-		lxcfs_error("%s\n", error);
-		return -1;
-	}
-
-	return proc_getattr(path, sb);
-}
-
-static int do_sys_getattr(const char *path, struct stat *sb)
-{
-	int (*sys_getattr)(const char *path, struct stat *sb);
-	char *error;
-	dlerror();    /* Clear any existing error */
-	sys_getattr = (int (*)(const char *, struct stat *)) dlsym(dlopen_handle, "sys_getattr");
-	error = dlerror();
-	if (error != NULL) {
-		lxcfs_error("%s\n", error);
-		return -1;
-	}
-
-	return sys_getattr(path, sb);
-}
-
 static int do_cg_read(const char *path, char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
@@ -238,40 +326,40 @@ static int do_cg_read(const char *path, char *buf, size_t size, off_t offset,
 	return cg_read(path, buf, size, offset, fi);
 }
 
-static int do_proc_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+static int do_proc_read_iov(const char *path, size_t size, off_t offset,
+		struct fuse_file_info *fi, struct iovec *iov)
 {
-	int (*proc_read)(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi);
+	int (*proc_read_iov)(const char *path, size_t size, off_t offset,
+		struct fuse_file_info *fi, struct iovec *iov);
 	char *error;
 
 	dlerror();    /* Clear any existing error */
-	proc_read = (int (*)(const char *, char *, size_t, off_t, struct fuse_file_info *)) dlsym(dlopen_handle, "proc_read");
+	proc_read_iov = (int (*)(const char *, size_t, off_t, struct fuse_file_info *, struct iovec *)) dlsym(dlopen_handle, "proc_read_iov");
 	error = dlerror();
 	if (error != NULL) {
 		lxcfs_error("%s\n", error);
 		return -1;
 	}
 
-	return proc_read(path, buf, size, offset, fi);
+	return proc_read_iov(path, size, offset, fi, iov);
 }
 
-static int do_sys_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+static int do_sys_read_iov(const char *path, size_t size, off_t offset,
+		struct fuse_file_info *fi, struct iovec *iov)
 {
-	int (*sys_read)(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi);
+	int (*sys_read_iov)(const char *path, size_t size, off_t offset,
+		struct fuse_file_info *fi, struct iovec *iov);
 	char *error;
 
 	dlerror();    /* Clear any existing error */
-	sys_read = (int (*)(const char *, char *, size_t, off_t, struct fuse_file_info *)) dlsym(dlopen_handle, "sys_read");
+	sys_read_iov = (int (*)(const char *, size_t, off_t, struct fuse_file_info *, struct iovec *)) dlsym(dlopen_handle, "sys_read_iov");
 	error = dlerror();
 	if (error != NULL) {
 		lxcfs_error("%s\n", error);
 		return -1;
 	}
 
-	return sys_read(path, buf, size, offset, fi);
+	return sys_read_iov(path, size, offset, fi, iov);
 }
 
 static int do_cg_write(const char *path, const char *buf, size_t size, off_t offset,
@@ -369,42 +457,6 @@ static int do_cg_readdir(const char *path, void *buf, fuse_fill_dir_t filler, of
 	return cg_readdir(path, buf, filler, offset, fi);
 }
 
-static int do_proc_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-		struct fuse_file_info *fi)
-{
-	int (*proc_readdir)(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-		struct fuse_file_info *fi);
-	char *error;
-
-	dlerror();    /* Clear any existing error */
-	proc_readdir = (int (*)(const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *)) dlsym(dlopen_handle, "proc_readdir");
-	error = dlerror();
-	if (error != NULL) {
-		lxcfs_error("%s\n", error);
-		return -1;
-	}
-
-	return proc_readdir(path, buf, filler, offset, fi);
-}
-
-static int do_sys_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-		struct fuse_file_info *fi)
-{
-	int (*sys_readdir)(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-		struct fuse_file_info *fi);
-	char *error;
-
-	dlerror();    /* Clear any existing error */
-	sys_readdir = (int (*)(const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *)) dlsym(dlopen_handle, "sys_readdir");
-	error = dlerror();
-	if (error != NULL) {
-		lxcfs_error("%s\n", error);
-		return -1;
-	}
-
-	return sys_readdir(path, buf, filler, offset, fi);
-}
-
 
 static int do_cg_open(const char *path, struct fuse_file_info *fi)
 {
@@ -572,401 +624,1002 @@ static int do_cg_releasedir(const char *path, struct fuse_file_info *fi)
 	return cg_releasedir(path, fi);
 }
 
-static int do_sys_releasedir(const char *path, struct fuse_file_info *fi)
+static void do_set_context(struct fuse_context *ctx)
 {
-	int (*sys_releasedir)(const char *path, struct fuse_file_info *fi);
+	void (*set_context)(struct fuse_context *ctx);
 	char *error;
 	dlerror();    /* Clear any existing error */
-	sys_releasedir = (int (*)(const char *path, struct fuse_file_info *)) dlsym(dlopen_handle, "sys_releasedir");
+	set_context = (void (*)(struct fuse_context *)) dlsym(dlopen_handle, "lxcfs_set_context");
 	error = dlerror();
 	if (error != NULL) {
 		lxcfs_error("%s\n", error);
-		return -1;
+		return;
 	}
 
-	return sys_releasedir(path, fi);
+	set_context(ctx);
 }
 
 /*
- * FUSE ops for /
- * these just delegate to the /proc and /cgroup ops as
- * needed
+ * Brackets every call into the library on behalf of @req: the library is
+ * not reloaded under it and gets to know the caller through @fc, which
+ * has to live until leave_library().
  */
+static void enter_library(fuse_req_t req, struct fuse_context *fc)
+{
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
-static int lxcfs_getattr(const char *path, struct stat *sb)
+	memset(fc, 0, sizeof(*fc));
+	fc->uid = ctx->uid;
+	fc->gid = ctx->gid;
+	fc->pid = ctx->pid;
+	fc->private_data = fuse_req_userdata(req);
+
+	up_users();
+	do_set_context(fc);
+}
+
+static void leave_library(void)
 {
-	int ret;
-	struct timespec now;
+	do_set_context(NULL);
+	down_users();
+}
 
-	if (strcmp(path, "/") == 0) {
-		if (clock_gettime(CLOCK_REALTIME, &now) < 0)
-			return -EINVAL;
-		sb->st_uid = sb->st_gid = 0;
-		sb->st_atim = sb->st_mtim = sb->st_ctim = now;
-		sb->st_size = 0;
-		sb->st_mode = S_IFDIR | 00755;
-		sb->st_nlink = 2;
-		return 0;
-	}
+/*
+ * Inodes
+ *
+ * Everything but what is below /cgroup is known in advance: those nodes
+ * have fixed inodes, their index in static_nodes[].  Inodes below /cgroup
+ * are handed out on lookup and kept in a hash of their paths until the
+ * kernel forgets them.  They are never reused.
+ */
+#define ENTRY_TIMEOUT 0.5
+#define ATTR_TIMEOUT 0.5
+/* What the high-level library reports for inodes it does not know either. */
+#define UNKNOWN_INO 0xffffffff
+
+enum lxcfs_area {
+	LXCFS_AREA_ROOT,
+	LXCFS_AREA_CGROUP,
+	LXCFS_AREA_PROC,
+	LXCFS_AREA_SYS,
+};
 
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_getattr(path, sb);
-		down_users();
-		return ret;
-	}
-	if (strncmp(path, "/proc", 5) == 0) {
-		up_users();
-		ret = do_proc_getattr(path, sb);
-		down_users();
-		return ret;
-	}
-	if (strncmp(path, "/sys", 4) == 0) {
-		up_users();
-		ret = do_sys_getattr(path, sb);
-		down_users();
-		return ret;
-	}
-	return -ENOENT;
+enum {
+	LXCFS_INO_ROOT = FUSE_ROOT_ID,
+	LXCFS_INO_CGROUP,
+	LXCFS_INO_PROC,
+	LXCFS_INO_PROC_CPUINFO,
+	LXCFS_INO_PROC_MEMINFO,
+	LXCFS_INO_PROC_STAT,
+	LXCFS_INO_PROC_UPTIME,
+	LXCFS_INO_PROC_DISKSTATS,
+	LXCFS_INO_PROC_SWAPS,
+	LXCFS_INO_PROC_LOADAVG,
+	LXCFS_INO_SYS,
+	LXCFS_INO_SYS_DEVICES,
+	LXCFS_INO_SYS_SYSTEM,
+	LXCFS_INO_SYS_CPU,
+	LXCFS_INO_SYS_CPU_ONLINE,
+	LXCFS_INO_STATIC_MAX,
+};
+
+struct static_node {
+	const char *name;
+	const char *path;
+	fuse_ino_t parent;
+	enum lxcfs_area area;
+	mode_t mode;
+};
+
+#define PROC_FILE(ino, name) \
+	[ino] = { name, "/proc/" name, LXCFS_INO_PROC, LXCFS_AREA_PROC, S_IFREG | 00444 }
+
+static const struct static_node static_nodes[LXCFS_INO_STATIC_MAX] = {
+	[LXCFS_INO_ROOT]	= { "", "/", LXCFS_INO_ROOT, LXCFS_AREA_ROOT, S_IFDIR | 00755 },
+	/* only listed: its attributes come from the library, like those below it */
+	[LXCFS_INO_CGROUP]	= { "cgroup", "/cgroup", LXCFS_INO_ROOT, LXCFS_AREA_CGROUP, S_IFDIR | 00755 },
+	[LXCFS_INO_PROC]	= { "proc", "/proc", LXCFS_INO_ROOT, LXCFS_AREA_PROC, S_IFDIR | 00555 },
+	PROC_FILE(LXCFS_INO_PROC_CPUINFO, "cpuinfo"),
+	PROC_FILE(LXCFS_INO_PROC_MEMINFO, "meminfo"),
+	PROC_FILE(LXCFS_INO_PROC_STAT, "stat"),
+	PROC_FILE(LXCFS_INO_PROC_UPTIME, "uptime"),
+	PROC_FILE(LXCFS_INO_PROC_DISKSTATS, "diskstats"),
+	PROC_FILE(LXCFS_INO_PROC_SWAPS, "swaps"),
+	PROC_FILE(LXCFS_INO_PROC_LOADAVG, "loadavg"),
+	[LXCFS_INO_SYS]		= { "sys", "/sys", LXCFS_INO_ROOT, LXCFS_AREA_SYS, S_IFDIR | 00555 },
+	[LXCFS_INO_SYS_DEVICES]	= { "devices", "/sys/devices", LXCFS_INO_SYS, LXCFS_AREA_SYS, S_IFDIR | 00555 },
+	[LXCFS_INO_SYS_SYSTEM]	= { "system", "/sys/devices/system", LXCFS_INO_SYS_DEVICES, LXCFS_AREA_SYS, S_IFDIR | 00555 },
+	[LXCFS_INO_SYS_CPU]	= { "cpu", "/sys/devices/system/cpu", LXCFS_INO_SYS_SYSTEM, LXCFS_AREA_SYS, S_IFDIR | 00555 },
+	[LXCFS_INO_SYS_CPU_ONLINE] = { "online", "/sys/devices/system/cpu/online", LXCFS_INO_SYS_CPU, LXCFS_AREA_SYS, S_IFREG | 00444 },
+};
+
+static inline bool is_static_ino(fuse_ino_t ino)
+{
+	return ino >= FUSE_ROOT_ID && ino < LXCFS_INO_STATIC_MAX;
 }
 
-static int lxcfs_opendir(const char *path, struct fuse_file_info *fi)
+/* The static node named @name in @parent, 0 if none. */
+static fuse_ino_t static_child(fuse_ino_t parent, const char *name)
 {
-	int ret;
-	if (strcmp(path, "/") == 0)
-		return 0;
+	fuse_ino_t ino;
 
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_opendir(path, fi);
-		down_users();
-		return ret;
+	for (ino = FUSE_ROOT_ID + 1; ino < LXCFS_INO_STATIC_MAX; ino++) {
+		if (static_nodes[ino].parent == parent &&
+		    strcmp(static_nodes[ino].name, name) == 0)
+			return ino;
 	}
-	if (strcmp(path, "/proc") == 0)
-		return 0;
-	if (strncmp(path, "/sys", 4) == 0)
-		return 0;
+	return 0;
+}
+
+struct cg_inode {
+	fuse_ino_t ino;
+	unsigned long nlookup;	/* atomic under the read lock, see cg_inode_get() */
+	size_t hash;
+	struct cg_inode *ino_next;
+	struct cg_inode *path_next;
+	char path[];
+};
+
+/* The same inodes, hashed both by number and by path. */
+static struct {
+	pthread_rwlock_t lock;
+	struct cg_inode **by_ino;
+	struct cg_inode **by_path;
+	size_t nr_buckets;
+	size_t nr;
+	fuse_ino_t next_ino;
+} cg_inodes = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+	.next_ino = LXCFS_INO_STATIC_MAX,
+};
+
+static size_t path_hash(const char *path)
+{
+	size_t h = 5381;
 
-	return -ENOENT;
+	while (*path)
+		h = h * 33 + (unsigned char)*path++;
+	return h;
 }
 
-static int lxcfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-		struct fuse_file_info *fi)
+/* Called with the lock held for writing. */
+static int cg_inodes_grow(void)
 {
-	int ret;
-	if (strcmp(path, "/") == 0) {
-		if (filler(buf, ".", NULL, 0) != 0 ||
-		    filler(buf, "..", NULL, 0) != 0 ||
-		    filler(buf, "proc", NULL, 0) != 0 ||
-		    filler(buf, "sys", NULL, 0) != 0 ||
-		    filler(buf, "cgroup", NULL, 0) != 0)
-			return -ENOMEM;
-		return 0;
-	}
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_readdir(path, buf, filler, offset, fi);
-		down_users();
-		return ret;
+	size_t i, n = cg_inodes.nr_buckets ? cg_inodes.nr_buckets * 2 : 256;
+	struct cg_inode **by_ino, **by_path, *node, *next;
+
+	by_ino = calloc(n, sizeof(*by_ino));
+	by_path = calloc(n, sizeof(*by_path));
+	if (!by_ino || !by_path) {
+		free(by_ino);
+		free(by_path);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < cg_inodes.nr_buckets; i++) {
+		for (node = cg_inodes.by_ino[i]; node; node = next) {
+			next = node->ino_next;
+			node->ino_next = by_ino[node->ino % n];
+			by_ino[node->ino % n] = node;
+		}
+		for (node = cg_inodes.by_path[i]; node; node = next) {
+			next = node->path_next;
+			node->path_next = by_path[node->hash % n];
+			by_path[node->hash % n] = node;
+		}
 	}
-	if (strcmp(path, "/proc") == 0) {
-		up_users();
-		ret = do_proc_readdir(path, buf, filler, offset, fi);
-		down_users();
-		return ret;
+
+	free(cg_inodes.by_ino);
+	free(cg_inodes.by_path);
+	cg_inodes.by_ino = by_ino;
+	cg_inodes.by_path = by_path;
+	cg_inodes.nr_buckets = n;
+	return 0;
+}
+
+/* Must be called with cg_inodes.lock held. */
+static struct cg_inode *cg_inode_find(const char *path, size_t hash)
+{
+	struct cg_inode *node;
+
+	if (!cg_inodes.nr_buckets)
+		return NULL;
+
+	node = cg_inodes.by_path[hash % cg_inodes.nr_buckets];
+	for (; node; node = node->path_next) {
+		if (node->hash == hash && strcmp(node->path, path) == 0)
+			return node;
 	}
+	return NULL;
+}
+
+/*
+ * Look @path up, which the kernel now holds one more time, 0 if out of
+ * memory.  Known paths only take the lock shared and bump nlookup
+ * atomically, forgets take it exclusively before dropping a node.
+ */
+static fuse_ino_t cg_inode_get(const char *path)
+{
+	struct cg_inode *node;
+	size_t hash = path_hash(path), len = strlen(path);
+	fuse_ino_t ino = 0;
+
+	pthread_rwlock_rdlock(&cg_inodes.lock);
+	node = cg_inode_find(path, hash);
+	if (node) {
+		__atomic_add_fetch(&node->nlookup, 1, __ATOMIC_RELAXED);
+		ino = node->ino;
+	}
+	pthread_rwlock_unlock(&cg_inodes.lock);
+	if (ino)
+		return ino;
+
+	pthread_rwlock_wrlock(&cg_inodes.lock);
+	/* Somebody may have added it in between. */
+	node = cg_inode_find(path, hash);
+	if (node)
+		goto found;
+
+	if (cg_inodes.nr >= cg_inodes.nr_buckets && cg_inodes_grow() < 0)
+		goto out;
+
+	node = malloc(sizeof(*node) + len + 1);
+	if (!node)
+		goto out;
+	memcpy(node->path, path, len + 1);
+	node->hash = hash;
+	node->nlookup = 0;
+	node->ino = cg_inodes.next_ino++;
+	node->ino_next = cg_inodes.by_ino[node->ino % cg_inodes.nr_buckets];
+	cg_inodes.by_ino[node->ino % cg_inodes.nr_buckets] = node;
+	node->path_next = cg_inodes.by_path[hash % cg_inodes.nr_buckets];
+	cg_inodes.by_path[hash % cg_inodes.nr_buckets] = node;
+	cg_inodes.nr++;
+
+found:
+	node->nlookup++;
+	ino = node->ino;
+out:
+	pthread_rwlock_unlock(&cg_inodes.lock);
+	return ino;
+}
+
+/*
+ * The path of @ino, or NULL if unknown.  It stays valid as long as the
+ * kernel holds on to @ino, which it does for any request on it.
+ */
+static const char *cg_inode_path(fuse_ino_t ino)
+{
+	struct cg_inode *node = NULL;
 
-	if (strncmp(path, "/sys", 4) == 0) {
-		up_users();
-		ret = do_sys_readdir(path, buf, filler, offset, fi);
-		down_users();
-		return ret;
+	pthread_rwlock_rdlock(&cg_inodes.lock);
+	if (cg_inodes.nr_buckets)
+		node = cg_inodes.by_ino[ino % cg_inodes.nr_buckets];
+	for (; node; node = node->ino_next) {
+		if (node->ino == ino)
+			break;
 	}
+	pthread_rwlock_unlock(&cg_inodes.lock);
 
-	return -ENOENT;
+	return node ? node->path : NULL;
 }
 
-static int lxcfs_access(const char *path, int mode)
+static void cg_inode_forget(fuse_ino_t ino, unsigned long nlookup)
 {
-	int ret;
+	struct cg_inode **pnode, *node;
 
-	if (strcmp(path, "/") == 0 && (mode & W_OK) == 0)
-		return 0;
+	pthread_rwlock_wrlock(&cg_inodes.lock);
+	if (!cg_inodes.nr_buckets)
+		goto out;
 
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_access(path, mode);
-		down_users();
-		return ret;
+	for (pnode = &cg_inodes.by_ino[ino % cg_inodes.nr_buckets]; *pnode; pnode = &(*pnode)->ino_next) {
+		if ((*pnode)->ino == ino)
+			break;
 	}
-	if (strncmp(path, "/proc", 5) == 0) {
-		up_users();
-		ret = do_proc_access(path, mode);
-		down_users();
-		return ret;
+	node = *pnode;
+	if (!node)
+		goto out;
+	if (node->nlookup > nlookup) {
+		node->nlookup -= nlookup;
+		goto out;
 	}
-	if (strncmp(path, "/sys", 4) == 0) {
-		up_users();
-		ret = do_sys_access(path, mode);
-		down_users();
-		return ret;
+	*pnode = node->ino_next;
+
+	for (pnode = &cg_inodes.by_path[node->hash % cg_inodes.nr_buckets]; *pnode != node; pnode = &(*pnode)->path_next)
+		;
+	*pnode = node->path_next;
+	cg_inodes.nr--;
+	free(node);
+
+out:
+	pthread_rwlock_unlock(&cg_inodes.lock);
+}
+
+/* The path of @ino and the part of the tree it is in, NULL if unknown. */
+static const char *ino_path(fuse_ino_t ino, enum lxcfs_area *area)
+{
+	if (is_static_ino(ino)) {
+		*area = static_nodes[ino].area;
+		return static_nodes[ino].path;
 	}
 
+	*area = LXCFS_AREA_CGROUP;
+	return cg_inode_path(ino);
+}
+
+static char *child_path(const char *parent, const char *name)
+{
+	size_t len = strlen(parent) + strlen(name) + 2;
+	char *path;
 
-	return -EACCES;
+	path = malloc(len);
+	if (path)
+		snprintf(path, len, "%s/%s", parent, name);
+	return path;
 }
 
-static int lxcfs_releasedir(const char *path, struct fuse_file_info *fi)
+/*
+ * FUSE ops
+ *
+ * Nodes outside of /cgroup are answered from static_nodes[] where possible,
+ * the rest is passed on to the library by the path of the inode.
+ */
+
+static int static_getattr(fuse_ino_t ino, struct stat *sb)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+		return -EINVAL;
+	memset(sb, 0, sizeof(*sb));
+	sb->st_ino = ino;
+	sb->st_uid = sb->st_gid = 0;
+	sb->st_atim = sb->st_mtim = sb->st_ctim = now;
+	sb->st_size = 0;
+	sb->st_mode = static_nodes[ino].mode;
+	sb->st_nlink = S_ISDIR(sb->st_mode) ? 2 : 1;
+	return 0;
+}
+
+static int cgroup_getattr(fuse_req_t req, const char *path, struct stat *sb)
 {
+	struct fuse_context fc;
 	int ret;
-	if (strcmp(path, "/") == 0)
-		return 0;
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_releasedir(path, fi);
-		down_users();
-		return ret;
-	}
-	if (strcmp(path, "/proc") == 0)
-		return 0;
-	if (strncmp(path, "/sys", 4) == 0){
-		up_users();
-		ret = do_sys_releasedir(path, fi);
-		down_users();
-		return ret;
-	}
 
-	return -EINVAL;
+	enter_library(req, &fc);
+	ret = do_cg_getattr(path, sb);
+	leave_library();
+	return ret;
+}
+
+/* Reply to a lookup of @path, which exists below /cgroup with attributes @sb. */
+static void reply_cgroup_entry(fuse_req_t req, const char *path, struct stat *sb)
+{
+	struct fuse_entry_param e;
+
+	memset(&e, 0, sizeof(e));
+	e.ino = cg_inode_get(path);
+	if (!e.ino) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	e.attr = *sb;
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = ATTR_TIMEOUT;
+	e.entry_timeout = ENTRY_TIMEOUT;
+	if (fuse_reply_entry(req, &e) != 0)
+		cg_inode_forget(e.ino, 1);
 }
 
-static int lxcfs_open(const char *path, struct fuse_file_info *fi)
+static void lxcfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+	struct fuse_entry_param e;
+	enum lxcfs_area area;
+	const char *ppath;
+	char *path;
+	struct stat sb;
 	int ret;
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_open(path, fi);
-		down_users();
-		return ret;
-	}
-	if (strncmp(path, "/proc", 5) == 0) {
-		up_users();
-		ret = do_proc_open(path, fi);
-		down_users();
-		return ret;
+
+	ppath = ino_path(parent, &area);
+	if (!ppath) {
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
-	if (strncmp(path, "/sys", 4) == 0) {
-		up_users();
-		ret = do_sys_open(path, fi);
-		down_users();
-		return ret;
+
+	if (area != LXCFS_AREA_CGROUP) {
+		memset(&e, 0, sizeof(e));
+		e.ino = static_child(parent, name);
+		if (!e.ino) {
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+		if (e.ino == LXCFS_INO_CGROUP)
+			ret = cgroup_getattr(req, static_nodes[e.ino].path, &e.attr);
+		else
+			ret = static_getattr(e.ino, &e.attr);
+		if (ret < 0) {
+			fuse_reply_err(req, -ret);
+			return;
+		}
+		e.attr.st_ino = e.ino;
+		e.attr_timeout = ATTR_TIMEOUT;
+		e.entry_timeout = ENTRY_TIMEOUT;
+		fuse_reply_entry(req, &e);
+		return;
 	}
 
+	path = child_path(ppath, name);
+	if (!path) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	ret = cgroup_getattr(req, path, &sb);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		reply_cgroup_entry(req, path, &sb);
+	free(path);
+}
 
-	return -EACCES;
+static void lxcfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	if (!is_static_ino(ino))
+		cg_inode_forget(ino, nlookup);
+	fuse_reply_none(req);
 }
 
-static int lxcfs_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+static void lxcfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+	enum lxcfs_area area;
+	const char *path;
+	struct stat sb;
 	int ret;
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_read(path, buf, size, offset, fi);
-		down_users();
-		return ret;
-	}
-	if (strncmp(path, "/proc", 5) == 0) {
-		up_users();
-		ret = do_proc_read(path, buf, size, offset, fi);
-		down_users();
-		return ret;
-	}
-	if (strncmp(path, "/sys", 4) == 0) {
-		up_users();
-		ret = do_sys_read(path, buf, size, offset, fi);
-		down_users();
-		return ret;
+
+	path = ino_path(ino, &area);
+	if (!path)
+		ret = -ENOENT;
+	else if (area != LXCFS_AREA_CGROUP)
+		ret = static_getattr(ino, &sb);
+	else
+		ret = cgroup_getattr(req, path, &sb);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
 	}
 
+	sb.st_ino = ino;
+	fuse_reply_attr(req, &sb, ATTR_TIMEOUT);
+}
 
-	return -EINVAL;
+/*
+ * Only cgroups can have their mode and owner changed.
+ *
+ * cat first does a truncate before doing ops->write.  This doesn't
+ * really make sense for cgroups.  So just return 0 always but do
+ * nothing.
+ */
+static void lxcfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		int to_set, struct fuse_file_info *fi)
+{
+	struct fuse_context fc;
+	enum lxcfs_area area;
+	const char *path;
+	struct stat sb;
+	int ret = 0;
+
+	path = ino_path(ino, &area);
+	if (!path) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (area != LXCFS_AREA_CGROUP) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	/* Like the high-level library, which only sets both times at once */
+	if ((to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) ==
+	    (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	enter_library(req, &fc);
+	if (to_set & FUSE_SET_ATTR_MODE)
+		ret = do_cg_chmod(path, attr->st_mode);
+	if (ret == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+		ret = do_cg_chown(path,
+				  (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1,
+				  (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1);
+	if (ret == 0)
+		ret = do_cg_getattr(path, &sb);
+	leave_library();
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	sb.st_ino = ino;
+	fuse_reply_attr(req, &sb, ATTR_TIMEOUT);
 }
 
-int lxcfs_write(const char *path, const char *buf, size_t size, off_t offset,
-	     struct fuse_file_info *fi)
+static void lxcfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
+	struct fuse_context fc;
+	enum lxcfs_area area;
+	const char *ppath;
+	char *path;
+	struct stat sb;
 	int ret;
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_write(path, buf, size, offset, fi);
-		down_users();
-		return ret;
+
+	ppath = ino_path(parent, &area);
+	if (!ppath || area != LXCFS_AREA_CGROUP) {
+		fuse_reply_err(req, ppath ? EPERM : ENOENT);
+		return;
+	}
+	path = child_path(ppath, name);
+	if (!path) {
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
 
-	return -EINVAL;
+	enter_library(req, &fc);
+	ret = do_cg_mkdir(path, mode);
+	if (ret == 0)
+		ret = do_cg_getattr(path, &sb);
+	leave_library();
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		reply_cgroup_entry(req, path, &sb);
+	free(path);
 }
 
-static int lxcfs_flush(const char *path, struct fuse_file_info *fi)
+static void lxcfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	return 0;
+	struct fuse_context fc;
+	enum lxcfs_area area;
+	const char *ppath;
+	char *path;
+	int ret;
+
+	ppath = ino_path(parent, &area);
+	if (!ppath || area != LXCFS_AREA_CGROUP) {
+		fuse_reply_err(req, ppath ? EPERM : ENOENT);
+		return;
+	}
+	path = child_path(ppath, name);
+	if (!path) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	enter_library(req, &fc);
+	ret = do_cg_rmdir(path);
+	leave_library();
+	fuse_reply_err(req, -ret);
+	free(path);
 }
 
-static int lxcfs_release(const char *path, struct fuse_file_info *fi)
+static int release_file(fuse_req_t req, enum lxcfs_area area, const char *path,
+		struct fuse_file_info *fi)
 {
+	struct fuse_context fc;
 	int ret;
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
+
+	enter_library(req, &fc);
+	switch (area) {
+	case LXCFS_AREA_CGROUP:
 		ret = do_cg_release(path, fi);
-		down_users();
-		return ret;
-	}
-	if (strncmp(path, "/proc", 5) == 0) {
-		up_users();
+		break;
+	case LXCFS_AREA_PROC:
 		ret = do_proc_release(path, fi);
-		down_users();
-		return ret;
-	}
-	if (strncmp(path, "/sys", 4) == 0) {
-		up_users();
+		break;
+	case LXCFS_AREA_SYS:
 		ret = do_sys_release(path, fi);
-		down_users();
-		return ret;
+		break;
+	default:
+		ret = -EINVAL;
 	}
-
-
-	return -EINVAL;
+	leave_library();
+	return ret;
 }
 
-static int lxcfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+static void lxcfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	return 0;
+	struct fuse_context fc;
+	enum lxcfs_area area;
+	const char *path;
+	int ret;
+
+	path = ino_path(ino, &area);
+	if (!path) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	enter_library(req, &fc);
+	switch (area) {
+	case LXCFS_AREA_CGROUP:
+		ret = do_cg_open(path, fi);
+		break;
+	case LXCFS_AREA_PROC:
+		ret = do_proc_open(path, fi);
+		break;
+	case LXCFS_AREA_SYS:
+		ret = do_sys_open(path, fi);
+		break;
+	default:
+		ret = -EACCES;
+	}
+	leave_library();
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fi->direct_io = 1;
+	/* The opener was interrupted, nobody is going to release it. */
+	if (fuse_reply_open(req, fi) == -ENOENT)
+		release_file(req, area, path, fi);
 }
 
-int lxcfs_mkdir(const char *path, mode_t mode)
+/*
+ * /proc and /sys files are replied to straight from the buffer the library
+ * rendered them in, which has to stay around until the reply is out.
+ * cgroup files are read into a buffer of ours.
+ */
+static void lxcfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi)
 {
+	void (*read_rendered_done)(struct fuse_file_info *fi);
+	struct fuse_context fc;
+	enum lxcfs_area area;
+	struct iovec iov;
+	const char *path;
+	char *buf;
 	int ret;
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_mkdir(path, mode);
-		down_users();
-		return ret;
+
+	path = ino_path(ino, &area);
+	if (!path) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (area == LXCFS_AREA_PROC || area == LXCFS_AREA_SYS) {
+		enter_library(req, &fc);
+		/*
+		 * A successful read leaves @fi locked until this is called:
+		 * look it up first, failing after the read would leave the
+		 * lock held for good.
+		 */
+		dlerror();    /* Clear any existing error */
+		read_rendered_done = (void (*)(struct fuse_file_info *)) dlsym(dlopen_handle, "read_rendered_done");
+		if (!read_rendered_done) {
+			lxcfs_error("%s\n", dlerror());
+			leave_library();
+			fuse_reply_err(req, EPERM);
+			return;
+		}
+		if (area == LXCFS_AREA_PROC)
+			ret = do_proc_read_iov(path, size, off, fi, &iov);
+		else
+			ret = do_sys_read_iov(path, size, off, fi, &iov);
+		if (ret < 0) {
+			fuse_reply_err(req, -ret);
+		} else {
+			fuse_reply_iov(req, &iov, 1);
+			read_rendered_done(fi);
+		}
+		leave_library();
+		return;
+	}
+	if (area != LXCFS_AREA_CGROUP) {
+		fuse_reply_err(req, EINVAL);
+		return;
 	}
 
-	return -EPERM;
+	buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	enter_library(req, &fc);
+	ret = do_cg_read(path, buf, size, off, fi);
+	leave_library();
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+	free(buf);
 }
 
-int lxcfs_chown(const char *path, uid_t uid, gid_t gid)
+static void lxcfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		size_t size, off_t off, struct fuse_file_info *fi)
 {
+	struct fuse_context fc;
+	enum lxcfs_area area;
+	const char *path;
 	int ret;
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_chown(path, uid, gid);
-		down_users();
-		return ret;
+
+	path = ino_path(ino, &area);
+	if (!path || area != LXCFS_AREA_CGROUP) {
+		fuse_reply_err(req, path ? EINVAL : ENOENT);
+		return;
 	}
 
-	if (strncmp(path, "/proc", 5) == 0)
-		return -EPERM;
+	enter_library(req, &fc);
+	ret = do_cg_write(path, buf, size, off, fi);
+	leave_library();
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
 
-	if (strncmp(path, "/sys", 4) == 0) 
-		return -EPERM;
-	return -ENOENT;
+static void lxcfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, 0);
+}
+
+static void lxcfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	enum lxcfs_area area;
+	const char *path;
+
+	path = ino_path(ino, &area);
+	if (!path) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	fuse_reply_err(req, -release_file(req, area, path, fi));
+}
+
+static void lxcfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, 0);
 }
 
 /*
- * cat first does a truncate before doing ops->write.  This doesn't
- * really make sense for cgroups.  So just return 0 always but do
- * nothing.
+ * An open directory.  Its entries are gathered in @buf by the readdir at
+ * offset 0, later ones reply with the rest of them.
  */
-int lxcfs_truncate(const char *path, off_t newsize)
+struct lxcfs_dir {
+	uint64_t fh; // the library's, for directories below /cgroup
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t alloc;
+};
+
+static int dir_fill(void *buf, const char *name, const struct stat *stbuf, off_t off)
 {
-	if (strncmp(path, "/cgroup", 7) == 0)
-		return 0;
-	return -EPERM;
+	struct lxcfs_dir *d = buf;
+	struct stat st;
+	size_t len, alloc;
+	char *p;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = UNKNOWN_INO;
+	if (stbuf) {
+		st.st_mode = stbuf->st_mode;
+		if (stbuf->st_ino)
+			st.st_ino = stbuf->st_ino;
+	}
+
+	len = fuse_add_direntry(d->req, NULL, 0, name, NULL, 0);
+	if (d->size + len > d->alloc) {
+		alloc = d->alloc ? d->alloc * 2 : 1024;
+		while (alloc < d->size + len)
+			alloc *= 2;
+		p = realloc(d->buf, alloc);
+		if (!p)
+			return 1;
+		d->buf = p;
+		d->alloc = alloc;
+	}
+	fuse_add_direntry(d->req, d->buf + d->size, d->alloc - d->size, name, &st,
+			  d->size + len);
+	d->size += len;
+	return 0;
 }
 
-int lxcfs_rmdir(const char *path)
+static int static_readdir(struct lxcfs_dir *d, fuse_ino_t ino)
 {
-	int ret;
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_rmdir(path);
-		down_users();
-		return ret;
+	struct stat st;
+	fuse_ino_t child;
+
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFDIR;
+	st.st_ino = ino;
+	if (dir_fill(d, ".", &st, 0) != 0)
+		return -ENOMEM;
+	st.st_ino = static_nodes[ino].parent;
+	if (dir_fill(d, "..", &st, 0) != 0)
+		return -ENOMEM;
+
+	for (child = FUSE_ROOT_ID + 1; child < LXCFS_INO_STATIC_MAX; child++) {
+		if (static_nodes[child].parent != ino)
+			continue;
+		st.st_ino = child;
+		st.st_mode = static_nodes[child].mode;
+		if (dir_fill(d, static_nodes[child].name, &st, 0) != 0)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static void lxcfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct fuse_file_info lfi = *fi;
+	struct fuse_context fc;
+	struct lxcfs_dir *d;
+	enum lxcfs_area area;
+	const char *path;
+	int ret = 0;
+
+	path = ino_path(ino, &area);
+	if (!path) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	d = calloc(1, sizeof(*d));
+	if (!d) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (area == LXCFS_AREA_CGROUP) {
+		enter_library(req, &fc);
+		ret = do_cg_opendir(path, &lfi);
+		leave_library();
+		if (ret < 0) {
+			free(d);
+			fuse_reply_err(req, -ret);
+			return;
+		}
+		d->fh = lfi.fh;
+	}
+
+	fi->fh = (uintptr_t)d;
+	/* The opener was interrupted, nobody is going to release it. */
+	if (fuse_reply_open(req, fi) == -ENOENT) {
+		if (area == LXCFS_AREA_CGROUP) {
+			enter_library(req, &fc);
+			do_cg_releasedir(path, &lfi);
+			leave_library();
+		}
+		free(d);
 	}
-	return -EPERM;
 }
 
-int lxcfs_chmod(const char *path, mode_t mode)
+static void lxcfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi)
 {
+	struct lxcfs_dir *d = (struct lxcfs_dir *)(uintptr_t)fi->fh;
+	struct fuse_file_info lfi = *fi;
+	struct fuse_context fc;
+	enum lxcfs_area area;
+	const char *path;
 	int ret;
-	if (strncmp(path, "/cgroup", 7) == 0) {
-		up_users();
-		ret = do_cg_chmod(path, mode);
-		down_users();
-		return ret;
+
+	if (off == 0) {
+		path = ino_path(ino, &area);
+		if (!path) {
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+
+		d->req = req;
+		d->size = 0;
+		if (area != LXCFS_AREA_CGROUP) {
+			ret = static_readdir(d, ino);
+		} else {
+			lfi.fh = d->fh;
+			enter_library(req, &fc);
+			ret = do_cg_readdir(path, d, dir_fill, 0, &lfi);
+			leave_library();
+		}
+		if (ret < 0) {
+			fuse_reply_err(req, -ret);
+			return;
+		}
 	}
 
-	if (strncmp(path, "/proc", 5) == 0)
-		return -EPERM;
+	if ((size_t)off < d->size)
+		fuse_reply_buf(req, d->buf + off, d->size - off < size ? d->size - off : size);
+	else
+		fuse_reply_buf(req, NULL, 0);
+}
+
+static void lxcfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct lxcfs_dir *d = (struct lxcfs_dir *)(uintptr_t)fi->fh;
+	struct fuse_file_info lfi = *fi;
+	struct fuse_context fc;
+	enum lxcfs_area area;
+	const char *path;
+
+	path = ino_path(ino, &area);
+	if (path && area == LXCFS_AREA_CGROUP) {
+		lfi.fh = d->fh;
+		enter_library(req, &fc);
+		do_cg_releasedir(path, &lfi);
+		leave_library();
+	}
+	free(d->buf);
+	free(d);
+	fuse_reply_err(req, 0);
+}
 
-	if (strncmp(path, "/sys", 4) == 0)
-		return -EPERM;
+static void lxcfs_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	struct fuse_context fc;
+	enum lxcfs_area area;
+	const char *path;
+	int ret;
 
-	return -ENOENT;
+	path = ino_path(ino, &area);
+	if (!path) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if (area == LXCFS_AREA_ROOT) {
+		fuse_reply_err(req, (mask & W_OK) ? EACCES : 0);
+		return;
+	}
+
+	enter_library(req, &fc);
+	switch (area) {
+	case LXCFS_AREA_CGROUP:
+		ret = do_cg_access(path, mask);
+		break;
+	case LXCFS_AREA_PROC:
+		ret = do_proc_access(path, mask);
+		break;
+	default:
+		ret = do_sys_access(path, mask);
+	}
+	leave_library();
+	fuse_reply_err(req, -ret);
 }
 
-const struct fuse_operations lxcfs_ops = {
+static const struct fuse_lowlevel_ops lxcfs_ops = {
+	.lookup = lxcfs_lookup,
+	.forget = lxcfs_forget,
 	.getattr = lxcfs_getattr,
-	.readlink = NULL,
-	.getdir = NULL,
-	.mknod = NULL,
+	.setattr = lxcfs_setattr,
 	.mkdir = lxcfs_mkdir,
-	.unlink = NULL,
 	.rmdir = lxcfs_rmdir,
-	.symlink = NULL,
-	.rename = NULL,
-	.link = NULL,
-	.chmod = lxcfs_chmod,
-	.chown = lxcfs_chown,
-	.truncate = lxcfs_truncate,
-	.utime = NULL,
 
 	.open = lxcfs_open,
 	.read = lxcfs_read,
-	.release = lxcfs_release,
 	.write = lxcfs_write,
-
-	.statfs = NULL,
 	.flush = lxcfs_flush,
+	.release = lxcfs_release,
 	.fsync = lxcfs_fsync,
 
-	.setxattr = NULL,
-	.getxattr = NULL,
-	.listxattr = NULL,
-	.removexattr = NULL,
-
 	.opendir = lxcfs_opendir,
 	.readdir = lxcfs_readdir,
 	.releasedir = lxcfs_releasedir,
 
-	.fsyncdir = NULL,
-	.init = NULL,
-	.destroy = NULL,
 	.access = lxcfs_access,
-	.create = NULL,
-	.ftruncate = NULL,
-	.fgetattr = NULL,
 };
-
 static void usage()
 {
 	fprintf(stderr, "Usage:\n");
 	fprintf(stderr, "\n");
-	fprintf(stderr, "lxcfs [-f|-d] -u -l -n [-p pidfile] mountpoint\n");
+	fprintf(stderr, "lxcfs [-f|-d] -u -l -P -N -n [-p pidfile] [-t ms] [-c ms] [-b kb] [-w threads] [-I secs] mountpoint\n");
 	fprintf(stderr, "  -f running foreground by default; -d enable debug output \n");
 	fprintf(stderr, "  -l use loadavg \n");
+	fprintf(stderr, "  -P use loadavg, computed from cgroup2 pressure stall information \n");
+	fprintf(stderr, "  -N use loadavg, learning of new tasks from the proc connector \n");
+	fprintf(stderr, "  -w number of threads refreshing the loadavgs (default %d, at most 100)\n", LOAD_THREADS);
+	fprintf(stderr, "  -I refresh loadavgs unread for secs seconds less often (default %d, 0 to disable)\n", LOAD_IDLE_SECS);
 	fprintf(stderr, "  -u no swap \n");
+	fprintf(stderr, "  -t reuse host /proc files for ms milliseconds (default %d, 0 to disable)\n", HOST_SNAPSHOT_MS);
+	fprintf(stderr, "  -c reuse rendered files within a container for ms milliseconds (default %d, 0 to disable)\n", RENDER_CACHE_MS);
+	fprintf(stderr, "  -b keep at most kb kilobytes of freed file buffers for reuse (default %d, 0 to disable)\n", BUF_POOL_LIMIT / 1024);
 	fprintf(stderr, "  Default pidfile is %s/lxcfs.pid\n", RUNTIME_PATH);
 	fprintf(stderr, "lxcfs -h\n");
 	exit(1);
@@ -1019,6 +1672,20 @@ bool swallow_option(int *argcp, char *argv[], char *opt, char **v)
 	return false;
 }
 
+static unsigned int parse_ms(const char *what, const char *v)
+{
+	char *end;
+	unsigned long ms;
+
+	errno = 0;
+	ms = strtoul(v, &end, 10);
+	if (errno || end == v || *end || ms > UINT_MAX) {
+		fprintf(stderr, "Invalid %s %s\n", what, v);
+		exit(EXIT_FAILURE);
+	}
+	return ms;
+}
+
 static int set_pidfile(char *pidfile)
 {
 	int fd;
@@ -1070,11 +1737,15 @@ int main(int argc, char *argv[])
 	bool debug = false, nonempty = false;
 	bool load_use = false;
 	/*
-	 * what we pass to fuse_main is:
-	 * argv[0] -s [-f|-d] -o allow_other,directio argv[1] NULL
+	 * what we pass to fuse_parse_cmdline is:
+	 * argv[0] [-f|-d] -o allow_other argv[1] NULL
 	 */
 	int nargs = 5, cnt = 0;
 	char *newargv[6];
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint = NULL;
 
 	struct lxcfs_opts *opts;
 	opts = malloc(sizeof(struct lxcfs_opts));
@@ -1083,6 +1754,8 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 	opts->swap_off = false;
+	opts->snapshot_ms = HOST_SNAPSHOT_MS;
+	opts->render_cache_ms = RENDER_CACHE_MS;
 
 	/* accomodate older init scripts */
 	swallow_arg(&argc, argv, "-s");
@@ -1091,6 +1764,14 @@ int main(int argc, char *argv[])
 	if (swallow_arg(&argc, argv, "-l")) {
 		load_use = true;
 	}
+	if (swallow_arg(&argc, argv, "-P")) {
+		load_use = true;
+		load_engine = LOAD_ENGINE_PSI;
+	}
+	if (swallow_arg(&argc, argv, "-N")) {
+		load_use = true;
+		load_engine = LOAD_ENGINE_CONN;
+	}
 	if (swallow_arg(&argc, argv, "-u")) {
 		opts->swap_off = true;
 	}
@@ -1112,6 +1793,55 @@ int main(int argc, char *argv[])
 	}
 	if (swallow_option(&argc, argv, "-p", &v))
 		pidfile = v;
+	if (swallow_option(&argc, argv, "-t", &v)) {
+		opts->snapshot_ms = parse_ms("snapshot interval", v);
+		free(v);
+		v = NULL;
+	}
+	if (swallow_option(&argc, argv, "-c", &v)) {
+		opts->render_cache_ms = parse_ms("render cache TTL", v);
+		free(v);
+		v = NULL;
+	}
+	if (swallow_option(&argc, argv, "-I", &v)) {
+		char *end;
+
+		errno = 0;
+		load_idle_secs = strtol(v, &end, 10);
+		if (errno || end == v || *end || load_idle_secs < 0 ||
+		    load_idle_secs > INT_MAX / 1000 / 10) {
+			fprintf(stderr, "Invalid loadavg idle time %s\n", v);
+			exit(EXIT_FAILURE);
+		}
+		free(v);
+		v = NULL;
+	}
+	if (swallow_option(&argc, argv, "-b", &v)) {
+		char *end;
+
+		errno = 0;
+		buf_pool_limit = strtoll(v, &end, 10);
+		if (errno || end == v || *end || buf_pool_limit < 0 ||
+		    buf_pool_limit > LLONG_MAX / 1024) {
+			fprintf(stderr, "Invalid buffer pool size %s\n", v);
+			exit(EXIT_FAILURE);
+		}
+		buf_pool_limit *= 1024;
+		free(v);
+		v = NULL;
+	}
+	if (swallow_option(&argc, argv, "-w", &v)) {
+		char *end;
+
+		errno = 0;
+		load_threads = strtol(v, &end, 10);
+		if (errno || end == v || *end || load_threads < 1 || load_threads > 100) {
+			fprintf(stderr, "Invalid number of loadavg threads %s\n", v);
+			exit(EXIT_FAILURE);
+		}
+		free(v);
+		v = NULL;
+	}
 
 	if (argc == 2  && strcmp(argv[1], "--version") == 0) {
 		fprintf(stderr, "%s\n", VERSION);
@@ -1125,6 +1855,10 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Error setting USR1 signal handler: %m\n");
 		goto out;
 	}
+	if (signal(SIGUSR2, report_handler) == SIG_ERR) {
+		fprintf(stderr, "Error setting USR2 signal handler: %m\n");
+		goto out;
+	}
 
 	newargv[cnt++] = argv[0];
 	if (debug)
@@ -1132,10 +1866,11 @@ int main(int argc, char *argv[])
 	else
 		newargv[cnt++] = "-f";
 	newargv[cnt++] = "-o";
+	/* direct_io and the timeouts are up to us on the low-level API */
 	if (nonempty)
-		newargv[cnt++] = "allow_other,direct_io,entry_timeout=0.5,attr_timeout=0.5,nonempty";
+		newargv[cnt++] = "allow_other,nonempty";
 	else
-		newargv[cnt++] = "allow_other,direct_io,entry_timeout=0.5,attr_timeout=0.5";
+		newargv[cnt++] = "allow_other";
 	newargv[cnt++] = argv[1];
 	newargv[cnt++] = NULL;
 
@@ -1149,9 +1884,32 @@ int main(int argc, char *argv[])
 
 	if (load_use && start_loadavg() != 0)
 		goto out;
+	start_cpuview();
+
+	args.argc = nargs;
+	args.argv = newargv;
+	if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) == -1)
+		goto out_stop;
+	ch = fuse_mount(mountpoint, &args);
+	if (!ch)
+		goto out_stop;
+	se = fuse_lowlevel_new(&args, &lxcfs_ops, sizeof(lxcfs_ops), opts);
+	if (se) {
+		if (fuse_set_signal_handlers(se) != -1) {
+			fuse_session_add_chan(se, ch);
+			if (fuse_session_loop_mt(se) == 0)
+				ret = EXIT_SUCCESS;
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, ch);
 
-	if (!fuse_main(nargs, newargv, &lxcfs_ops, opts))
-		ret = EXIT_SUCCESS;
+out_stop:
+	fuse_opt_free_args(&args);
+	free(mountpoint);
+	stop_cpuview();
 	if (load_use)
 		stop_loadavg();
 
@@ -28,9 +28,11 @@
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/sysinfo.h>
+#include <sys/uio.h>
 #include <sys/vfs.h>
 
 #include "bindings.h"
+#include "buf_pool.h"
 #include "config.h" // for VERSION
 #include "sysfs_fuse.h"
 
@@ -38,15 +40,14 @@ static int sys_devices_system_cpu_online_read(char *buf, size_t size,
 					      off_t offset,
 					      struct fuse_file_info *fi)
 {
-	struct fuse_context *fc = fuse_get_context();
+	struct fuse_context *fc = lxcfs_get_context();
 	struct file_info *d = (struct file_info *)fi->fh;
 	char *cache = d->buf;
 	char *cg;
-	char *cpuset = NULL;
+	struct cpumask *cpus = NULL;
 	bool use_view;
 
 	int max_cpus = 0;
-	pid_t initpid;
 	ssize_t total_len = 0;
 
 	if (offset) {
@@ -60,16 +61,12 @@ static int sys_devices_system_cpu_online_read(char *buf, size_t size,
 		return total_len;
 	}
 
-	initpid = lookup_initpid_in_store(fc->pid);
-	if (initpid <= 0)
-		initpid = fc->pid;
-	cg = get_pid_cgroup(initpid, "cpuset");
+	cg = get_container_cgroup(fc->pid, LXC_CTRL_CPUSET, NULL);
 	if (!cg)
 		return read_file("/sys/devices/system/cpu/online", buf, size, d);
-	prune_init_slice(cg);
 
-	cpuset = get_cpuset(cg);
-	if (!cpuset)
+	cpus = get_container_cpumask(fc->pid, cg);
+	if (!cpus)
 		goto err;
 
 	use_view = use_cpuview(cg);
@@ -77,15 +74,27 @@ static int sys_devices_system_cpu_online_read(char *buf, size_t size,
 	if (use_view)
 		max_cpus = max_cpu_count(cg);
 
-	if (max_cpus == 0)
+	if (max_cpus == 0) {
+		cpumask_free(cpus);
+		free(cg);
 		return read_file("/sys/devices/system/cpu/online", buf, size, d);
+	}
+	/* Cannot use more CPUs than is available due to cpuset */
+	if (max_cpus > cpumask_weight(cpus) && cpumask_weight(cpus) > 0)
+		max_cpus = cpumask_weight(cpus);
 	if (max_cpus > 1)
 		total_len = snprintf(d->buf, d->buflen, "0-%d\n", max_cpus - 1);
 	else
 		total_len = snprintf(d->buf, d->buflen, "0\n");
-	if (total_len < 0 || total_len >= d->buflen) {
+	if (total_len < 0) {
 		lxcfs_error("%s\n", "failed to write to cache");
-		return 0;
+		total_len = 0;
+		goto err;
+	}
+	if (total_len >= d->buflen) {
+		d->truncated = true;
+		total_len = 0;
+		goto err;
 	}
 
 	d->size = (int)total_len;
@@ -94,32 +103,13 @@ static int sys_devices_system_cpu_online_read(char *buf, size_t size,
 	if (total_len > size)
 		total_len = size;
 
-	memcpy(buf, d->buf, total_len);
+	copy_rendered(buf, d, total_len);
 err:
-	free(cpuset);
+	cpumask_free(cpus);
 	free(cg);
 	return total_len;
 }
 
-static off_t get_sysfile_size(const char *which)
-{
-	FILE *f;
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t sz, answer = 0;
-
-	f = fopen(which, "r");
-	if (!f)
-		return 0;
-
-	while ((sz = getline(&line, &len, f)) != -1)
-		answer += sz;
-	fclose(f);
-	free(line);
-
-	return answer;
-}
-
 int sys_getattr(const char *path, struct stat *sb)
 {
 	struct timespec now;
@@ -210,20 +200,13 @@ int sys_open(const char *path, struct fuse_file_info *fi)
 	if (type == -1)
 		return -ENOENT;
 
-	info = malloc(sizeof(*info));
+	info = buf_pool_alloc(sizeof(*info), NULL);
 	if (!info)
 		return -ENOMEM;
 
 	memset(info, 0, sizeof(*info));
 	info->type = type;
-
-	info->buflen = get_sysfile_size(path) + BUF_RESERVE_SIZE;
-	do {
-		info->buf = malloc(info->buflen);
-	} while (!info->buf);
-	memset(info->buf, 0, info->buflen);
-	/* set actual size to buffer size */
-	info->size = info->buflen;
+	pthread_rwlock_init(&info->lock, NULL);
 
 	fi->fh = (unsigned long)info;
 	return 0;
@@ -248,6 +231,10 @@ int sys_access(const char *path, int mask)
 
 int sys_release(const char *path, struct fuse_file_info *fi)
 {
+	struct file_info *f = (struct file_info *)fi->fh;
+
+	if (f)
+		pthread_rwlock_destroy(&f->lock);
 	do_release_file_info(fi);
 	return 0;
 }
@@ -258,13 +245,17 @@ int sys_releasedir(const char *path, struct fuse_file_info *fi)
 	return 0;
 }
 
-int sys_read(const char *path, char *buf, size_t size, off_t offset,
-	     struct fuse_file_info *fi)
+/* Must be called with the lock of @fi held, see lock_file_info(). */
+static int sys_read_locked(const char *path, char *buf, size_t size,
+			   off_t offset, struct fuse_file_info *fi)
 {
 	struct file_info *f = (struct file_info *)fi->fh;
 
 	switch (f->type) {
 	case LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE:
+		if (offset == 0)
+			return render_sized(buf, size, fi,
+					    sys_devices_system_cpu_online_read);
 		return sys_devices_system_cpu_online_read(buf, size, offset, fi);
 	case LXC_TYPE_SYS_DEVICES:
 	case LXC_TYPE_SYS_DEVICES_SYSTEM:
@@ -273,3 +264,20 @@ int sys_read(const char *path, char *buf, size_t size, off_t offset,
 		return -EINVAL;
 	}
 }
+
+int sys_read(const char *path, char *buf, size_t size, off_t offset,
+	     struct fuse_file_info *fi)
+{
+	int rv;
+
+	lock_file_info(fi, offset);
+	rv = sys_read_locked(path, buf, size, offset, fi);
+	unlock_file_info(fi);
+	return rv;
+}
+
+int sys_read_iov(const char *path, size_t size, off_t offset,
+		 struct fuse_file_info *fi, struct iovec *iov)
+{
+	return read_rendered(path, size, offset, fi, iov, sys_read_locked);
+}
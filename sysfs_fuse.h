@@ -11,6 +11,8 @@ extern int sys_releasedir(const char *path, struct fuse_file_info *fi);
 extern int sys_open(const char *path, struct fuse_file_info *fi);
 extern int sys_read(const char *path, char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi);
+extern int sys_read_iov(const char *path, size_t size, off_t offset,
+			struct fuse_file_info *fi, struct iovec *iov);
 extern int sys_access(const char *path, int mask);
 
 #endif /* __LXCFS_SYSFS_FUSE_H */
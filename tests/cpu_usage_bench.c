@@ -0,0 +1,275 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+/*
+ * Micro-benchmark of the cpuview math: one update of a view, as done by
+ * cpuview_update(), with the old array of structs code and with each
+ * implementation of the cpu_usage kernels.  Each is then checked to leave
+ * the same usage and view, CPU by CPU, as the old code.
+ *
+ *   cpu_usage_bench [cpus] [iterations]
+ *
+ * Each is timed a few times over, the best run is reported.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../cpu_usage.h"
+
+struct cpuacct_usage {
+	uint64_t user;
+	uint64_t system;
+	uint64_t idle;
+	bool online;
+};
+
+/* The old code, from before the struct of arrays layout. */
+static unsigned long diff_cpu_usage(struct cpuacct_usage *older, struct cpuacct_usage *newer,
+				    struct cpuacct_usage *diff, int cpu_count)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < cpu_count; i++) {
+		if (!newer[i].online)
+			continue;
+		diff[i].user = newer[i].user > older[i].user ? newer[i].user - older[i].user : 0;
+		diff[i].system = newer[i].system > older[i].system ? newer[i].system - older[i].system : 0;
+		diff[i].idle = newer[i].idle > older[i].idle ? newer[i].idle - older[i].idle : 0;
+		sum += diff[i].user + diff[i].system + diff[i].idle;
+	}
+
+	return sum;
+}
+
+static void add_cpu_usage(unsigned long *surplus, struct cpuacct_usage *usage,
+			  uint64_t *counter, unsigned long threshold)
+{
+	unsigned long free_space, to_add;
+
+	free_space = threshold - usage->user - usage->system;
+	if (free_space > usage->idle)
+		free_space = usage->idle;
+	to_add = free_space > *surplus ? *surplus : free_space;
+	*counter += to_add;
+	usage->idle -= to_add;
+	*surplus -= to_add;
+}
+
+static void old_update(struct cpuacct_usage *usage, struct cpuacct_usage *view,
+		       struct cpuacct_usage *newer, struct cpuacct_usage *diff,
+		       int nprocs, int max_cpus, int cpu_cnt)
+{
+	unsigned long user_surplus = 0, system_surplus = 0, total_sum, threshold;
+	int curcpu, i;
+
+	total_sum = diff_cpu_usage(usage, newer, diff, nprocs);
+	for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
+		usage[curcpu].online = newer[curcpu].online;
+		if (!usage[curcpu].online)
+			continue;
+		i++;
+		usage[curcpu].user += diff[curcpu].user;
+		usage[curcpu].system += diff[curcpu].system;
+		usage[curcpu].idle += diff[curcpu].idle;
+		if (i >= max_cpus) {
+			user_surplus += diff[curcpu].user;
+			system_surplus += diff[curcpu].system;
+		}
+	}
+
+	threshold = total_sum / cpu_cnt * max_cpus;
+	for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
+		if (!usage[curcpu].online)
+			continue;
+		if (++i == max_cpus)
+			break;
+		if (diff[curcpu].user + diff[curcpu].system >= threshold)
+			continue;
+		add_cpu_usage(&user_surplus, &diff[curcpu], &diff[curcpu].user, threshold);
+		if (diff[curcpu].user + diff[curcpu].system >= threshold)
+			continue;
+		add_cpu_usage(&system_surplus, &diff[curcpu], &diff[curcpu].system, threshold);
+	}
+
+	for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
+		if (!usage[curcpu].online)
+			continue;
+		if (++i == max_cpus)
+			break;
+		view[curcpu].user += diff[curcpu].user;
+		view[curcpu].system += diff[curcpu].system;
+		view[curcpu].idle += diff[curcpu].idle;
+	}
+}
+
+/* The same with the kernels, as cpuview_update() does it. */
+static void new_update(struct cpu_usage *usage, struct cpu_usage *view,
+		       struct cpu_usage *newer, struct cpu_usage *diff,
+		       uint64_t *visible, int nprocs, int max_cpus, int cpu_cnt)
+{
+	uint64_t total_sum, threshold, all[3], vis[3], sums[3], surplus[2];
+
+	cpu_usage_advance(usage, newer, diff, nprocs, all);
+	total_sum = all[0] + all[1] + all[2];
+
+	cpu_usage_first(usage, max_cpus, visible, nprocs);
+	cpu_usage_sum(diff, visible, nprocs, vis);
+
+	threshold = total_sum / cpu_cnt * max_cpus;
+	surplus[0] = all[0] - vis[0];
+	surplus[1] = all[1] - vis[1];
+	cpu_usage_spread(diff, visible, threshold, surplus, nprocs);
+
+	cpu_usage_add(view, diff, visible, nprocs, sums);
+}
+
+/* Whether @o and @n hold the same counters, reporting the first that differs. */
+static bool same_usage(const char *what, const struct cpuacct_usage *o,
+		       const struct cpu_usage *n, int cpus)
+{
+	int i;
+
+	for (i = 0; i < cpus; i++) {
+		if (o[i].user == n->user[i] && o[i].system == n->system[i] &&
+		    o[i].idle == n->idle[i])
+			continue;
+
+		fprintf(stderr, "%s of cpu %d: %llu %llu %llu instead of %llu %llu %llu\n",
+			what, i, (unsigned long long)n->user[i],
+			(unsigned long long)n->system[i], (unsigned long long)n->idle[i],
+			(unsigned long long)o[i].user, (unsigned long long)o[i].system,
+			(unsigned long long)o[i].idle);
+		return false;
+	}
+
+	return true;
+}
+
+#define RUNS 5
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *impls[] = { "scalar", "sse2", "avx2" };
+	int cpus = argc > 1 ? atoi(argv[1]) : 384;
+	int iters = argc > 2 ? atoi(argv[2]) : 20000;
+	int max_cpus = cpus / 3, i, j, k, r;
+	struct cpuacct_usage *o_usage, *o_view, *o_diff, **o_samples;
+	struct cpu_usage usage, view, diff, *samples;
+	uint64_t *visible;
+	double t, o_ns, best;
+	bool same;
+
+	if (cpus < 3 || iters < 1) {
+		fprintf(stderr, "usage: %s [cpus] [iterations]\n", argv[0]);
+		exit(1);
+	}
+
+	/* A few samples of steadily growing usage, some CPUs offline */
+	o_usage = calloc(cpus, sizeof(*o_usage));
+	o_view = calloc(cpus, sizeof(*o_view));
+	o_diff = calloc(cpus, sizeof(*o_diff));
+	o_samples = calloc(8, sizeof(*o_samples));
+	samples = calloc(8, sizeof(*samples));
+	visible = calloc(CPU_USAGE_WORDS(cpus), sizeof(uint64_t));
+	if (!o_usage || !o_view || !o_diff || !o_samples || !samples || !visible)
+		exit(1);
+
+	srand(42);
+	for (k = 0; k < 8; k++) {
+		o_samples[k] = calloc(cpus, sizeof(**o_samples));
+		if (!o_samples[k] || cpu_usage_alloc(&samples[k], cpus) != 0)
+			exit(1);
+		for (j = 0; j < cpus; j++) {
+			struct cpuacct_usage *s = &o_samples[k][j];
+
+			s->online = j % 7 != 3;
+			s->user = (k + 1) * 1000 + rand() % 500;
+			s->system = (k + 1) * 300 + rand() % 200;
+			s->idle = (k + 1) * 2000 + rand() % 1000;
+			samples[k].user[j] = s->user;
+			samples[k].system[j] = s->system;
+			samples[k].idle[j] = s->idle;
+			cpu_usage_set_online(&samples[k], j, s->online);
+		}
+	}
+
+	for (r = 0, o_ns = 0; r < RUNS; r++) {
+		t = now_ns();
+		for (i = 0; i < iters; i++) {
+			if (i % 8 == 0) {
+				memset(o_usage, 0, cpus * sizeof(*o_usage));
+				memset(o_view, 0, cpus * sizeof(*o_view));
+			}
+			old_update(o_usage, o_view, o_samples[i % 8], o_diff,
+				   cpus, max_cpus, cpus);
+		}
+		t = (now_ns() - t) / iters;
+		if (r == 0 || t < o_ns)
+			o_ns = t;
+	}
+	printf("%d cpus, %d visible\n", cpus, max_cpus);
+	printf("%-8s %8.0f ns/update\n", "old", o_ns);
+
+	for (k = 0; k < 3; k++) {
+		if (cpu_usage_set_impl(impls[k]) != 0) {
+			printf("%-8s unsupported\n", impls[k]);
+			continue;
+		}
+
+		if (cpu_usage_alloc(&usage, cpus) != 0 ||
+		    cpu_usage_alloc(&view, cpus) != 0 ||
+		    cpu_usage_alloc(&diff, cpus) != 0)
+			exit(1);
+
+		for (r = 0, best = 0; r < RUNS; r++) {
+			t = now_ns();
+			for (i = 0; i < iters; i++) {
+				if (i % 8 == 0) {
+					cpu_usage_zero(&usage, cpus);
+					cpu_usage_zero(&view, cpus);
+				}
+				new_update(&usage, &view, &samples[i % 8], &diff, visible,
+					   cpus, max_cpus, cpus);
+			}
+			t = (now_ns() - t) / iters;
+			if (r == 0 || t < best)
+				best = t;
+		}
+
+		/* Both from scratch through all the samples, compared after each update */
+		memset(o_usage, 0, cpus * sizeof(*o_usage));
+		memset(o_view, 0, cpus * sizeof(*o_view));
+		cpu_usage_zero(&usage, cpus);
+		cpu_usage_zero(&view, cpus);
+		for (i = 0, same = true; i < 8 && same; i++) {
+			old_update(o_usage, o_view, o_samples[i], o_diff, cpus, max_cpus, cpus);
+			new_update(&usage, &view, &samples[i], &diff, visible, cpus, max_cpus, cpus);
+			same = same_usage("usage", o_usage, &usage, cpus) &&
+			       same_usage("view", o_view, &view, cpus);
+		}
+
+		printf("%-8s %8.0f ns/update, %.2fx%s\n", impls[k], best, o_ns / best,
+		       same ? "" : "  MISMATCH");
+		if (!same)
+			exit(1);
+
+		cpu_usage_free(&usage);
+		cpu_usage_free(&view);
+		cpu_usage_free(&diff);
+	}
+
+	return 0;
+}
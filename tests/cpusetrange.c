@@ -3,11 +3,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
-/*
- * cpusets are in format "1,2-3,4"
- * iow, comma-delimited ranges
- */
-extern bool cpu_in_cpuset(int cpu, const char *cpuset);
+#include "../cpuset.h"
 
 void verify(bool condition) {
 	if (condition) {
@@ -18,6 +14,24 @@ void verify(bool condition) {
 	}
 }
 
+/* The compiled cpumask agrees with cpu_in_cpuset() */
+void verify_cpumask(const char *cpuset) {
+	struct cpumask *m = cpumask_parse(cpuset);
+	int cpu, n = 0;
+
+	printf("cpumask of \"%s\" matches", cpuset);
+	if (!m)
+		verify(false);
+	for (cpu = 0; cpu < 256; cpu++) {
+		if (cpumask_test(m, cpu) != cpu_in_cpuset(cpu, cpuset))
+			verify(false);
+		if (cpumask_test(m, cpu) && cpumask_nth(m, n++) != cpu)
+			verify(false);
+	}
+	verify(n == cpumask_weight(m));
+	cpumask_free(m);
+}
+
 int main() {
 	char *a = "1,2";
 	char *b = "1-3,5";
@@ -47,4 +61,34 @@ int main() {
 	verify(!cpu_in_cpuset(6, d));
 	printf("NOT 6 in empty set(2)");
 	verify(!cpu_in_cpuset(6, e));
+
+	verify_cpumask(a);
+	verify_cpumask(b);
+	verify_cpumask(c);
+	verify_cpumask(d);
+	verify_cpumask(e);
+	verify_cpumask("0-3,8-11\n");
+	verify_cpumask("63-65,127,128");
+	verify_cpumask("5-2,7");
+
+	struct cpumask *m = cpumask_parse("0,2-4,70");
+	int cpu, n = 0;
+
+	printf("weight of 0,2-4,70 is 5");
+	verify(m && cpumask_weight(m) == 5);
+	printf("4th cpu of 0,2-4,70 is 70");
+	verify(cpumask_nth(m, 4) == 70);
+	printf("no 5th cpu in 0,2-4,70");
+	verify(cpumask_nth(m, 5) == -1);
+	printf("next cpu of 0,2-4,70 from 5 is 70");
+	verify(cpumask_next(m, 5) == 70);
+	printf("no next cpu of 0,2-4,70 from 71");
+	verify(cpumask_next(m, 71) == -1);
+	for_each_cpu(cpu, m)
+		n += cpu;
+	printf("cpus of 0,2-4,70 add up to 79");
+	verify(n == 79);
+	cpumask_free(m);
+
+	return 0;
 }